@@ -0,0 +1,54 @@
+#include <stdio.h>
+
+#include "sys/runtime.hpp"
+#include "sys/shm.hpp"
+
+/*
+ * 共有メモリのキュー（sys/shm.hpp）でshmproducerからデータを受け取り、スループットを表示するアプリ。
+ * 時間は最初のデータが来てから、送る側がキューを閉じて全部読み終わるまでを測る。
+ */
+
+namespace {
+    const unsigned long kBlock = 4096;
+
+    unsigned long NowNanoseconds()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+    }
+}
+
+extern "C" int main() {
+    ShmQueue *queue = static_cast<ShmQueue *>(ShmMap("shmbench", sizeof(ShmQueue)));
+    if (queue == nullptr) {
+        fprintf(stderr, "shmconsumer: ShmMap failed\n");
+        return 1;
+    }
+
+    unsigned long received = 0;
+    unsigned long errors = 0;
+    unsigned long start = 0;
+    unsigned long len;
+    while (const char *p = queue->ReadBuffer(len)) {
+        if (received == 0) {
+            start = NowNanoseconds();
+        }
+        // 読めた範囲の最初と最後のバイトだけ確かめる
+        unsigned long last = received + len - 1;
+        if (p[0] != static_cast<char>(received / kBlock) || p[len - 1] != static_cast<char>(last / kBlock)) {
+            errors++;
+        }
+        queue->Consume(len);
+        received += len;
+    }
+    unsigned long ns = NowNanoseconds() - start;
+    if (ns == 0) {
+        ns = 1;
+    }
+
+    unsigned long centi_mbps = received * 100000 / ns;
+    printf("shmconsumer: received %lu bytes in %lu us, %lu.%02lu MB/s, slept %lu times waiting for data, %lu bad blocks\n",
+           received, ns / 1000, centi_mbps / 100, centi_mbps % 100, queue->ReaderWaits(), errors);
+    return errors ? 1 : 0;
+}
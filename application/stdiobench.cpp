@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sys/runtime.hpp"
+
+/*
+ * newlibのstdioとmalloc()を使うアプリ（sys/runtime.hpp）。
+ * 同じ出力をバッファなし・行バッファ・完全バッファで書いて、Writeシステムコールの回数と時間を比べる。
+ * １行は数個の文字列から組み立てるので、バッファなしでは文字列ごとに、行バッファでは行ごとに、
+ * 完全バッファでは4096バイトごとに１回のシステムコールになる。
+ * 最後にいろいろな大きさのmalloc()/free()の速さを測る。
+ */
+
+namespace {
+    const int kLines = 200;
+    const int kAllocs = 10000;
+    const size_t kStdioBufferSize = 4096;
+
+    char stdout_buffer[kStdioBufferSize];
+
+    unsigned long NowNanoseconds()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+    }
+
+    struct Result {
+        const char *name;
+        unsigned long writes;
+        unsigned long ns;
+    };
+
+    Result WriteLines(const char *name, int mode)
+    {
+        fflush(stdout);
+        setvbuf(stdout, mode == _IONBF ? nullptr : stdout_buffer, mode, kStdioBufferSize);
+        unsigned long writes = num_write_syscalls;
+        unsigned long start = NowNanoseconds();
+        for (int i = 0; i < kLines; i++) {
+            fputs("stdiobench ", stdout);
+            fputs(name, stdout);
+            fputs(": line ", stdout);
+            printf("%d", i);
+            fputs(" of the same text\n", stdout);
+        }
+        fflush(stdout);
+        return {name, num_write_syscalls - writes, NowNanoseconds() - start};
+    }
+
+    // 1〜2048バイトのブロックをkAllocs個確保して、半分ずつ２回に分けて解放する
+    unsigned long MallocFree()
+    {
+        static void *blocks[kAllocs];
+        unsigned long start = NowNanoseconds();
+        for (int i = 0; i < kAllocs; i++) {
+            blocks[i] = malloc(1 + i * 7919 % 2048);
+            if (blocks[i] == nullptr) {
+                fprintf(stderr, "stdiobench: malloc failed\n");
+                exit(1);
+            }
+            memset(blocks[i], i, 1);
+        }
+        for (int i = 0; i < kAllocs; i += 2) {
+            free(blocks[i]);
+        }
+        for (int i = 1; i < kAllocs; i += 2) {
+            free(blocks[i]);
+        }
+        return NowNanoseconds() - start;
+    }
+}
+
+extern "C" int main() {
+    Result results[] = {
+        WriteLines("unbuffered", _IONBF),
+        WriteLines("line-buffered", _IOLBF),
+        WriteLines("fully-buffered", _IOFBF),
+    };
+    unsigned long malloc_ns = MallocFree();
+
+    setvbuf(stdout, stdout_buffer, _IOLBF, kStdioBufferSize);
+    for (const Result &r : results) {
+        printf("%s: %d lines, %lu write syscalls, %lu us\n", r.name, kLines, r.writes, r.ns / 1000);
+    }
+    printf("malloc+free: %d blocks, %lu ns per block\n", kAllocs, malloc_ns / kAllocs);
+    return 0;
+}
@@ -0,0 +1,35 @@
+bits 64
+section .text
+
+extern main
+extern exit
+extern atexit
+extern __libc_init_array
+extern __libc_fini_array
+
+; newlibを使うアプリの入口（Makefileの--entry _start）。
+; グローバル変数のコンストラクタ（.init_array）を__libc_init_array()で呼んでからmain()を呼ぶ。
+; デストラクタ（.fini_array）はatexit()に登録した__libc_fini_array()がexit()の中で呼ぶ。
+; main()から戻ったらexit()を呼び、stdioのバッファを書き出してからSyscallExitで終わる。
+; カーネルはrspを16バイト境界に揃えたまま飛んでくるので、
+; 関数の入口で「call直後（16の倍数＋８）」になるよう揃え直してから呼ぶ。
+global _start
+_start:
+    and rsp, -16
+    mov rdi, __libc_fini_array
+    call atexit
+    call __libc_init_array
+    xor edi, edi  ; argc
+    xor esi, esi  ; argv
+    call main
+    mov edi, eax
+    call exit
+
+; __libc_init_array()と__libc_fini_array()が呼ぶ。.init・.finiセクションは使わないので何もしない。
+global _init
+_init:
+    ret
+
+global _fini
+_fini:
+    ret
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "syscall.hpp"
+
+/*
+ * futexを使ったミューテックス
+ * 取り合いにならなければアプリの中のアトミック命令だけで済み、取り合いになった時だけカーネルで眠る。
+ * stateは０：空き、１：ロック中（待っているタスクなし）、２：ロック中（待っているタスクがいるかもしれない）。
+ */
+class Mutex
+{
+public:
+    void Lock()
+    {
+        unsigned int c = 0;
+        if (__atomic_compare_exchange_n(&state_, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return; // 空いていた
+        }
+        // 取り合いになったので、待っているタスクがいる印（２）を付けてから眠る
+        if (c != 2) {
+            c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+        }
+        while (c != 0) {
+            SyscallFutexWait(&state_, 2, 0);
+            c = __atomic_exchange_n(&state_, 2, __ATOMIC_ACQUIRE);
+        }
+    }
+
+    bool TryLock()
+    {
+        unsigned int c = 0;
+        return __atomic_compare_exchange_n(&state_, &c, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void Unlock()
+    {
+        if (__atomic_fetch_sub(&state_, 1, __ATOMIC_RELEASE) != 1) {
+            // 待っているタスクがいるかもしれないので、空けてから１つ起こす
+            __atomic_store_n(&state_, 0, __ATOMIC_RELEASE);
+            SyscallFutexWake(&state_, 1);
+        }
+    }
+
+private:
+    volatile unsigned int state_{0};
+};
@@ -0,0 +1,176 @@
+#include <errno.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "mutex.hpp"
+#include "runtime.hpp"
+#include "syscall.hpp"
+#include "time.hpp"
+
+/*
+ * newlibが呼ぶOSの関数をシステムコールで実装する（使い方はsys/runtime.hpp）。
+ * ファイルはないので、使えるのはfd ０〜２（端末）だけ。
+ */
+
+namespace {
+    const blksize_t kStdioBufferSize = 4096; // Writeシステムコールが１回に書ける大きさ
+
+    // mallocのロック。newlibはrealloc()の中からmalloc()を呼ぶなど同じスレッドで入れ子に取るので、再帰的に取れるようにする。
+    // スレッドは%fs:0（FSベースの先頭に置かれた自分のアドレス）で見分ける。
+    // カーネルはtlsを渡さなかったスレッドと最初のタスクにもこのブロックを用意する（sys/thread.hpp）。
+    Mutex malloc_mutex;
+    unsigned long malloc_owner; // ロックを持っているスレッド（０なら誰も持っていない）
+    int malloc_depth;
+
+    unsigned long CurrentThread()
+    {
+        unsigned long self;
+        __asm__("mov %%fs:0, %0" : "=r"(self));
+        return self;
+    }
+}
+
+extern "C" {
+
+unsigned long num_write_syscalls;
+
+void _exit(int status)
+{
+    SyscallExit(status);
+    __builtin_unreachable();
+}
+
+void *sbrk(ptrdiff_t increment)
+{
+    long prev = SyscallSbrk(increment);
+    if (prev == -1) {
+        errno = ENOMEM;
+        return reinterpret_cast<void *>(-1);
+    }
+    return reinterpret_cast<void *>(prev);
+}
+
+// カーネルは１回に4096バイトまでしか書かないので、全部書けるまで繰り返す
+long write(int fd, const void *buf, size_t count)
+{
+    if (fd != 1 && fd != 2) {
+        errno = EBADF;
+        return -1;
+    }
+    const char *p = static_cast<const char *>(buf);
+    size_t written = 0;
+    while (written < count) {
+        long res = SyscallWrite(fd, p + written, count - written);
+        __atomic_fetch_add(&num_write_syscalls, 1, __ATOMIC_RELAXED);
+        if (res <= 0) {
+            if (written == 0) {
+                errno = EIO;
+                return -1;
+            }
+            break;
+        }
+        written += res;
+    }
+    return written;
+}
+
+long read(int fd, void *buf, size_t count)
+{
+    if (fd != 0) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0; // 入力は読めないので、いつもファイルの終わり
+}
+
+int open(const char *path, int flags, ...)
+{
+    errno = ENOENT;
+    return -1;
+}
+
+int close(int fd)
+{
+    if (fd < 0 || fd > 2) {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+// stdioは端末（S_IFCHR）なら行バッファにし、st_blksizeの大きさのバッファを使う
+int fstat(int fd, struct stat *buf)
+{
+    if (fd < 0 || fd > 2) {
+        errno = EBADF;
+        return -1;
+    }
+    *buf = {};
+    buf->st_mode = S_IFCHR;
+    buf->st_blksize = kStdioBufferSize;
+    return 0;
+}
+
+int isatty(int fd)
+{
+    if (fd < 0 || fd > 2) {
+        errno = EBADF;
+        return 0;
+    }
+    return 1;
+}
+
+off_t lseek(int fd, off_t offset, int whence)
+{
+    errno = ESPIPE;
+    return -1;
+}
+
+int getpid(void)
+{
+    return 1;
+}
+
+// abort()などが自分に送るシグナルは、128＋シグナル番号で終わらせる
+int kill(int pid, int sig)
+{
+    if (pid == getpid()) {
+        _exit(128 + sig);
+    }
+    errno = ESRCH;
+    return -1;
+}
+
+// 壁時計はないので、どの時計でも起動してからの時刻を返す
+int clock_gettime(clockid_t clock_id, struct timespec *tp)
+{
+    unsigned long ns = ClockMonotonicNanoseconds();
+    tp->tv_sec = ns / 1000000000;
+    tp->tv_nsec = ns % 1000000000;
+    return 0;
+}
+
+void __malloc_lock(struct _reent *ptr)
+{
+    unsigned long self = CurrentThread();
+    if (__atomic_load_n(&malloc_owner, __ATOMIC_RELAXED) == self) {
+        malloc_depth++;
+        return;
+    }
+    malloc_mutex.Lock();
+    __atomic_store_n(&malloc_owner, self, __ATOMIC_RELAXED);
+    malloc_depth = 1;
+}
+
+void __malloc_unlock(struct _reent *ptr)
+{
+    if (--malloc_depth > 0) {
+        return;
+    }
+    __atomic_store_n(&malloc_owner, 0, __ATOMIC_RELAXED);
+    malloc_mutex.Unlock();
+}
+
+} // extern "C"
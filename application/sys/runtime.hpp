@@ -0,0 +1,26 @@
+#pragma once
+
+#include <time.h>
+
+/*
+ * newlibを使うアプリの実行時環境（Makefileで$(RUNTIME_OBJS)と-lcをリンクしたアプリ）
+ *
+ * 入口はsys/crt0.asmの_startで、グローバル変数のコンストラクタを呼んでからmain()を呼ぶ。
+ * main()から戻るとexit()がデストラクタを呼び、stdioのバッファを書き出してから終わる。
+ * newlibが呼ぶsbrk()、write()、_exit()、clock_gettime()などはsys/newlib_support.cppにある。
+ *
+ *   - malloc()のヒープはSbrkシステムコールで伸ばす。ページは触った時にカーネルがマップする。
+ *   - stdout（fd １）は端末なので行バッファ、stderr（fd ２）はバッファなし（newlibの既定）。
+ *     バッファは4096バイトで、書き出す時は１回のwrite()システムコールで済む（カーネルが１回に書ける大きさ）。
+ *     まとめて出力したい時は setvbuf(stdout, nullptr, _IOFBF, 4096) で完全バッファにする。
+ *   - clock_gettime()はどの時計でも起動してからの時刻を返す（時刻のページから読むのでシステムコールは使わない）。
+ *   - malloc()はスレッドから呼んでもよいが、stdioの関数は同時に１つのスレッドからだけ呼ぶこと。
+ */
+
+// write()が呼んだWriteシステムコールの回数（stdioのバッファリングの効き目を見るのに使う）
+extern "C" unsigned long num_write_syscalls;
+
+// newlibは_POSIX_MONOTONIC_CLOCKがないとCLOCK_MONOTONICを定義しない（clock_gettime()はどの時計でも同じ値を返す）
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC ((clockid_t)4)
+#endif
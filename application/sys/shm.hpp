@@ -0,0 +1,154 @@
+#pragma once
+
+#include "syscall.hpp"
+
+/*
+ * プロセス間の共有メモリ
+ *
+ *   ShmQueue *queue = static_cast<ShmQueue *>(ShmMap("name", sizeof(ShmQueue)));
+ *   // 送る側
+ *   unsigned long len;
+ *   char *p = queue->WriteBuffer(len);  // 空きができるまで待ち、書ける連続した領域を返す
+ *   ...pに最大lenバイト書く...
+ *   queue->Commit(n);                   // 書いたnバイトを受け取る側に見せる
+ *   queue->Close();                     // もう送らない
+ *   // 受け取る側
+ *   const char *q = queue->ReadBuffer(len);  // データが来るまで待つ。Close()された後で空ならnullptr
+ *   ...qからlenバイトまで読む...
+ *   queue->Consume(n);
+ *
+ * 共有メモリは作られた時に０で埋まっているので、ShmQueueもShmEventも０の状態から使い始められる。
+ * データは共有ページに直接書いて直接読むので、カーネルはコピーしない。
+ * 待つ時は共有ページの上のfutexで眠り、相手が眠っている時だけ起こすシステムコールを呼ぶ。
+ */
+
+// 名前nameの共有メモリ（なければbytesバイトで作る）をマップする。失敗したらnullptr。
+inline void *ShmMap(const char *name, unsigned long bytes)
+{
+    long addr = SyscallShmMap(name, bytes);
+    return addr == -1 ? nullptr : reinterpret_cast<void *>(addr);
+}
+
+// 共有メモリに置くイベント。待つ側は条件を確かめてから眠り、条件を変えた側がNotify()で起こす。
+//
+//   unsigned int seq = event.Prepare();
+//   if (!条件) event.Wait(seq);         // Prepare()の後で条件を確かめ直すので、Notify()を取りこぼさない
+class ShmEvent
+{
+public:
+    unsigned int Prepare()
+    {
+        unsigned int seq = __atomic_load_n(&seq_, __ATOMIC_ACQUIRE);
+        __atomic_store_n(&waiting_, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // waiting_を書いてから条件を読む
+        return seq;
+    }
+
+    // Prepare()からseqが変わっていなければ、Notify()されるまで眠る
+    void Wait(unsigned int seq)
+    {
+        SyscallFutexWait(&seq_, seq, 0);
+        __atomic_store_n(&waiting_, 0, __ATOMIC_RELAXED);
+    }
+
+    // 条件を変えた後で呼ぶ。待っている側がいる時だけシステムコールで起こし、起こしたらtrueを返す。
+    bool Notify()
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // 条件を書いてからwaiting_を読む
+        if (__atomic_load_n(&waiting_, __ATOMIC_RELAXED) == 0) {
+            return false;
+        }
+        __atomic_fetch_add(&seq_, 1, __ATOMIC_RELEASE);
+        SyscallFutexWake(&seq_, ~0u);
+        return true;
+    }
+
+private:
+    volatile unsigned int seq_; // Notify()するたびに増える（futexの値）
+    volatile unsigned int waiting_; // 眠ろうとしている側がいる
+};
+
+// 送る側と受け取る側が１つずつのバイト列のキュー
+class ShmQueue
+{
+public:
+    static const unsigned int kCapacity = 256 * 1024; // ２のべき乗
+
+    char *WriteBuffer(unsigned long &len)
+    {
+        while (true) {
+            unsigned int tail = tail_;
+            unsigned int used = tail - __atomic_load_n(&head_, __ATOMIC_ACQUIRE);
+            if (used < kCapacity) {
+                unsigned int offset = tail & (kCapacity - 1);
+                len = Min(kCapacity - used, kCapacity - offset);
+                return data_ + offset;
+            }
+            unsigned int seq = writable_.Prepare();
+            if (tail - __atomic_load_n(&head_, __ATOMIC_ACQUIRE) == kCapacity) {
+                writer_waits_++;
+                writable_.Wait(seq);
+            }
+        }
+    }
+
+    void Commit(unsigned long len)
+    {
+        __atomic_store_n(&tail_, tail_ + static_cast<unsigned int>(len), __ATOMIC_RELEASE);
+        readable_.Notify();
+    }
+
+    void Close()
+    {
+        __atomic_store_n(&closed_, 1, __ATOMIC_RELEASE);
+        readable_.Notify();
+    }
+
+    const char *ReadBuffer(unsigned long &len)
+    {
+        while (true) {
+            unsigned int head = head_;
+            unsigned int ready = __atomic_load_n(&tail_, __ATOMIC_ACQUIRE) - head;
+            if (ready > 0) {
+                unsigned int offset = head & (kCapacity - 1);
+                len = Min(ready, kCapacity - offset);
+                return data_ + offset;
+            }
+            if (__atomic_load_n(&closed_, __ATOMIC_ACQUIRE)) {
+                // Close()の前にCommit()された分を読み逃さないよう、もう一度見てから終わる
+                if (__atomic_load_n(&tail_, __ATOMIC_ACQUIRE) == head) {
+                    return nullptr;
+                }
+                continue;
+            }
+            unsigned int seq = readable_.Prepare();
+            if (__atomic_load_n(&tail_, __ATOMIC_ACQUIRE) == head && !__atomic_load_n(&closed_, __ATOMIC_ACQUIRE)) {
+                reader_waits_++;
+                readable_.Wait(seq);
+            }
+        }
+    }
+
+    void Consume(unsigned long len)
+    {
+        __atomic_store_n(&head_, head_ + static_cast<unsigned int>(len), __ATOMIC_RELEASE);
+        writable_.Notify();
+    }
+
+    // 空きやデータがなくて眠った回数
+    unsigned long WriterWaits() const { return writer_waits_; }
+    unsigned long ReaderWaits() const { return reader_waits_; }
+
+private:
+    static unsigned int Min(unsigned int a, unsigned int b) { return a < b ? a : b; }
+
+    // 送る側と受け取る側が書く所は別々のキャッシュラインに置く
+    alignas(64) volatile unsigned int tail_; // 送る側が書く
+    volatile unsigned int closed_;
+    unsigned long writer_waits_;
+    ShmEvent writable_; // 受け取る側が読み進めた
+    alignas(64) volatile unsigned int head_; // 受け取る側が書く
+    unsigned long reader_waits_;
+    ShmEvent readable_; // 送る側が書き進めた
+    alignas(64) char data_[kCapacity];
+};
@@ -1,16 +1,18 @@
 bits 64
 section .text
 
-global SyscallExit
-SyscallExit:
-    mov rax, 0
-    mov r10, rcx
-    syscall
-    ret ; ここには帰ってこない、、ハズ、、、
-
-global SyscallLogString
-SyscallLogString:
-    mov rax, 1
+; システムコールを呼ぶ関数。kernel/syscall_list.incの各行から、
+;   Syscall<名前>: raxに番号を入れてsyscallする
+; という関数を作る（SyscallExitからは帰ってこない）。
+; 第４引数はrcxではなくr10で渡す（syscallがrcxに戻りアドレスを入れるため）。
+%macro SYSCALL_STUB 2  ; 番号, 名前
+global Syscall%2
+Syscall%2:
+    mov rax, %1
     mov r10, rcx
     syscall
     ret
+%endmacro
+
+%define SYSCALL_ENTRY(number, name, num_args, args, params) SYSCALL_STUB number, name
+%include "syscall_list.inc"
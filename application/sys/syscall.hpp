@@ -1,6 +1,73 @@
 #pragma once
 
-extern "C" int SyscallExit(long status);
+// タスクのCPU使用量
+struct TaskUsage {
+    unsigned long run_ns; // 実行していた時間の合計
+    unsigned long wait_ns; // 実行可能になってから実行されるまで待たされた時間の合計
+    unsigned long wakeups; // スリープから起こされた回数
+    unsigned long voluntary_switches; // スリープしてCPUを手放した回数
+    unsigned long involuntary_switches; // タイムスライスの終わりなどでCPUを取り上げられた回数
+};
 
-extern "C" int SyscallLogString(char *s);
+// SyscallFutexWaitの返り値（kernel/futex.hppと同じ）
+const long kFutexErrorInvalid = -1; // アドレスが不正
+const long kFutexErrorAgain = -2; // 値がexpectedと違ったので眠らなかった
+const long kFutexErrorTimedOut = -3; // タイムアウトした
 
+/*
+ * システムコールを呼ぶ関数Syscall<名前>の宣言は、カーネルと共有している一覧
+ * （kernel/syscall_list.inc）から作る。引数の型はそこに書き、返り値はどれもlongになる。
+ * それぞれの働きは次のとおり。
+ *
+ * SyscallExit(status)
+ *   呼び出したタスクを終わらせる。プロセス全体は終わらせない（スレッドから呼べばSyscallThreadExitと同じ）。
+ *   最初のタスクが終わっても他のスレッドは動き続け、その時点でJoinされていないスレッドは終わった時に自動で回収される。
+ * SyscallLogString(s)
+ *   sをカーネルのログに書く。
+ * SyscallNanosleep(ns)
+ *   nsナノ秒だけスリープする。
+ * SyscallClockNanosleep(deadline_ns)
+ *   起動してからの時刻deadline_ns（ナノ秒）までスリープする。
+ * SyscallGetTaskUsage(usage)
+ *   自分のタスクのCPU使用量をusageに書き込む。成功したら０を返す。
+ * SyscallCreateGroup(name)
+ *   CPUのクォータを設定できるタスクのグループを作り、そのidを返す（作れなければ−１）。
+ * SyscallSetGroupQuota(id, quota_ms, period_ms)
+ *   グループidのクォータをperiod_ms（1〜1000）ごとにquota_msにする。quota_msが０なら制限を外す。成功したら０を返す。
+ * SyscallMoveToGroup(task_id, id)
+ *   タスクtask_id（０なら自分）をグループidに移す（０ならどのグループにも属さない）。成功したら０を返す。
+ *   移せるのは自分と同じアプリのタスク（自分とそのスレッド）だけ。
+ *   移したタスクがこれから作るタスクも同じグループに入る。
+ * SyscallWrite(fd, buf, len)
+ *   fd（１か２：ターミナル）にbufからlenバイト書き込み、書き込んだバイト数を返す（失敗したら−１）。
+ *   １回に書き込めるのは4096バイトまでで、それより長い時は書き込めた分だけを返す。
+ * SyscallRingSetup(flags)
+ *   投入・完了リングを作って自分のアドレス空間にマップし、その先頭アドレスを返す（失敗したら−１）。
+ *   使い方はsys/uring.hppを参照。
+ * SyscallRingEnter(to_submit, min_complete, flags)
+ *   to_submit個まで投入された操作を処理し、min_complete個の完了が溜まるまで待つ。処理した数を返す。
+ * SyscallFutexWait(addr, expected, timeout_ns)
+ *   *addrがexpectedと等しければ、SyscallFutexWakeで起こされるかtimeout_nsナノ秒経つまで眠る（０なら無期限）。
+ *   起こされたら０を返す（失敗はkFutexError*）。addrは４バイト境界に揃えること。
+ * SyscallFutexWake(addr, n)
+ *   addrで眠っているタスクを最大n個起こし、起こした数を返す。
+ * SyscallThreadCreate(start, arg0, arg1, tls)
+ *   アドレス空間を共有するスレッドを作り、start(arg0, arg1)を実行させる。スレッドのタスクのidを返す（失敗したら−１）。
+ *   tlsはスレッドのFSベース（０かアプリの領域のアドレス）で、x86-64の慣例どおり先頭に自分のアドレスを置くこと。
+ *   ０ならカーネルがスタックの底に自分のアドレスだけを持つブロックを用意する（最初のタスクも同じ）。
+ *   startからは戻らず、SyscallThreadExitで終わること。使い方はsys/thread.hppを参照。
+ * SyscallThreadExit(status)
+ *   呼び出したスレッドだけを終わらせる。statusはSyscallThreadJoinで待っているスレッドに渡る。
+ * SyscallThreadJoin(id, status)
+ *   同じアプリのスレッドidが終わるまで待ち、返り値をstatusに書き込む（nullptrでもよい）。成功したら０を返す。
+ *   作ったスレッドは、最初のタスクが終わるまでにどれか１つのスレッドがJoinすること（しないと回収されない）。
+ * SyscallSbrk(increment)
+ *   ヒープの終わりをincrementバイト動かし、動かす前の終わりのアドレスを返す（ヒープの範囲を外れるなら−１）。
+ *   newlibのmalloc()が使う（sys/newlib_support.cpp）。
+ * SyscallShmMap(name, bytes)
+ *   名前name（31文字まで）の共有メモリ（なければbytesバイトで作る）を自分のアドレス空間にマップし、
+ *   その先頭アドレスを返す（失敗したら−１）。同じ名前を開いたアプリ同士は同じページを共有する。使い方はsys/shm.hppを参照。
+ */
+#define SYSCALL_ENTRY(number, name, num_args, args, params) extern "C" long Syscall##name params;
+#include "../../kernel/syscall_list.inc"
+#undef SYSCALL_ENTRY
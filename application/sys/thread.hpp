@@ -0,0 +1,34 @@
+#pragma once
+
+#include "syscall.hpp"
+
+/*
+ * スレッド
+ *
+ *   long Worker(void *arg) { ...; return 0; }
+ *   long id = ThreadCreate(Worker, &data);   // 失敗したら−１
+ *   long status;
+ *   ThreadJoin(id, &status);                  // Workerの返り値を受け取る
+ *
+ * スレッドはカーネルのタスクとして別々にスケジューリングされるので、他のCPUで同時に動く。
+ * スタックはカーネルがスレッドごとに用意する。tlsを渡すとスレッドのFSベースになり、%fs:0などで読める。
+ * tlsの先頭には自分のアドレスを置くこと（渡さなければカーネルが用意する）。%fs:0はスレッドの識別に使われる。
+ */
+
+using ThreadFunc = long (void *arg);
+
+// カーネルがrdi, rsiにfnとargを入れて呼ぶ入口。fnの返り値でスレッドを終える。
+inline void ThreadStart(ThreadFunc *fn, void *arg)
+{
+    SyscallThreadExit(fn(arg));
+}
+
+inline long ThreadCreate(ThreadFunc *fn, void *arg, void *tls = nullptr)
+{
+    return SyscallThreadCreate(reinterpret_cast<void *>(ThreadStart), reinterpret_cast<void *>(fn), arg, tls);
+}
+
+inline long ThreadJoin(long id, long *status)
+{
+    return SyscallThreadJoin(id, status);
+}
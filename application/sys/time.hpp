@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+ * システムコールを使わずに時刻を読むための関数。
+ * カーネルは時刻のページ（kernel/timer.hppのTimePage）を全てのアプリのkTimePageAddressに
+ * 読み取り専用でマップしているので、それとTSCから時刻を求める。
+ */
+
+// kernel/timer.hppのTimePageと同じ並び
+struct TimePage {
+    volatile unsigned long seq; // カーネルが書き換えている間は奇数
+    volatile unsigned long tick;
+    volatile unsigned long tick_tsc;
+    volatile unsigned long ns_per_tick;
+    volatile unsigned long tsc_per_tick; // ０ならTSCは較正前
+    volatile unsigned long tsc_mult;
+    volatile unsigned int tsc_shift;
+    unsigned int reserved;
+};
+
+// kernel/run_application.hppのkTimePageAddressと同じ値
+const unsigned long kTimePageAddress = 0xfffffffffffff000ul;
+
+inline unsigned long ReadTSC()
+{
+    unsigned int lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return (static_cast<unsigned long>(hi) << 32) | lo;
+}
+
+// 起動してからの時刻（ナノ秒）。カーネルのMonotonicNanoseconds()と同じ値になる。
+inline unsigned long ClockMonotonicNanoseconds()
+{
+    const TimePage *page = reinterpret_cast<const TimePage *>(kTimePageAddress);
+    unsigned long seq, tick, tick_tsc, ns_per_tick, tsc_per_tick, tsc_mult, tsc;
+    unsigned int tsc_shift;
+    do { // 読んでいる間にカーネルが書き換えたらやり直す
+        seq = page->seq;
+        __asm__ volatile("" : : : "memory");
+        tick = page->tick;
+        tick_tsc = page->tick_tsc;
+        ns_per_tick = page->ns_per_tick;
+        tsc_per_tick = page->tsc_per_tick;
+        tsc_mult = page->tsc_mult;
+        tsc_shift = page->tsc_shift;
+        tsc = ReadTSC();
+        __asm__ volatile("" : : : "memory");
+    } while ((seq & 1) || seq != page->seq);
+
+    if (tsc_per_tick == 0) {
+        return tick * ns_per_tick;
+    }
+    // １tick未満の部分。タイマー割り込みが遅れていても次のtickの時刻は越えないようにする。
+    unsigned long elapsed = tsc - tick_tsc;
+    if (elapsed >= tsc_per_tick) {
+        elapsed = tsc_per_tick - 1;
+    }
+    return tick * ns_per_tick + ((elapsed * tsc_mult) >> tsc_shift);
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include "syscall.hpp"
+
+/*
+ * カーネルとの投入・完了リング（kernel/uring.hppと同じ定義）
+ *
+ *   Ring ring;
+ *   RingInit(ring, 0);
+ *   Submission *sqe = RingGetSubmission(ring); // 空きがなければnullptr
+ *   sqe->opcode = kRingWrite; sqe->fd = 1; sqe->addr = ...; sqe->len = ...; sqe->user_data = 1;
+ *   RingSubmit(ring, 1);                        // 投入した分をまとめて１回のシステムコールで処理させる
+ *   Completion cqe;
+ *   while (RingPopCompletion(ring, cqe)) { ... }
+ */
+
+enum RingOpcode : unsigned char {
+    kRingNop = 0,
+    kRingWrite = 1, // fdにaddrからlenバイト書き込む
+    kRingTimeout = 2, // lenナノ秒後に完了する
+    kRingSend = 3, // 未実装（−１で完了する）
+    kRingRecv = 4, // 未実装（−１で完了する）
+};
+
+struct Submission {
+    unsigned char opcode;
+    unsigned char flags;
+    unsigned short reserved;
+    int fd;
+    unsigned long addr;
+    unsigned long len;
+    unsigned long user_data;
+};
+
+struct Completion {
+    unsigned long user_data;
+    long result;
+};
+
+struct RingHeader {
+    volatile unsigned int sq_head;
+    volatile unsigned int sq_tail;
+    volatile unsigned int cq_head;
+    volatile unsigned int cq_tail;
+    unsigned int sq_entries;
+    unsigned int cq_entries;
+    volatile unsigned int flags;
+    volatile unsigned int cq_overflow;
+    unsigned long sq_offset;
+    unsigned long cq_offset;
+};
+
+const unsigned int kRingNeedWakeup = 1;
+const unsigned int kRingSetupSqPoll = 1; // カーネルのポーリングタスクにSQを見張らせる
+const unsigned int kRingEnterSqWakeup = 1;
+
+struct Ring {
+    RingHeader *header;
+    Submission *sq;
+    Completion *cq;
+    unsigned int sq_tail; // まだカーネルに見せていない投入の末尾
+    bool sq_poll;
+};
+
+// リングを作る。成功したらtrueを返す。
+inline bool RingInit(Ring &ring, unsigned int flags)
+{
+    long addr = SyscallRingSetup(flags);
+    if (addr == -1) {
+        return false;
+    }
+    char *base = reinterpret_cast<char *>(addr);
+    ring.header = reinterpret_cast<RingHeader *>(base);
+    ring.sq = reinterpret_cast<Submission *>(base + ring.header->sq_offset);
+    ring.cq = reinterpret_cast<Completion *>(base + ring.header->cq_offset);
+    ring.sq_tail = ring.header->sq_tail;
+    ring.sq_poll = flags & kRingSetupSqPoll;
+    return true;
+}
+
+// 次に投入する操作を書く場所を返す。SQがいっぱいならnullptr。
+inline Submission *RingGetSubmission(Ring &ring)
+{
+    if (ring.sq_tail - ring.header->sq_head >= ring.header->sq_entries) {
+        return nullptr;
+    }
+    Submission *sqe = &ring.sq[ring.sq_tail & (ring.header->sq_entries - 1)];
+    ring.sq_tail++;
+    *sqe = Submission{};
+    return sqe;
+}
+
+// RingGetSubmission()で書いた操作をカーネルに渡し、min_complete個の完了を待つ。
+// ポーリングタスクがいれば、眠っている時だけシステムコールで起こす。
+inline long RingSubmit(Ring &ring, unsigned int min_complete = 0)
+{
+    unsigned int to_submit = ring.sq_tail - ring.header->sq_tail;
+    __asm__ volatile("" : : : "memory"); // 中身を書いてからtailを進める
+    ring.header->sq_tail = ring.sq_tail;
+    if (ring.sq_poll) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST); // tailを書いてからflagsを読む
+        bool wakeup = ring.header->flags & kRingNeedWakeup;
+        if (!wakeup && min_complete == 0) {
+            return to_submit;
+        }
+        return SyscallRingEnter(0, min_complete, wakeup ? kRingEnterSqWakeup : 0);
+    }
+    return SyscallRingEnter(to_submit, min_complete, 0);
+}
+
+// 完了を１つ取り出す。なければfalseを返す。
+inline bool RingPopCompletion(Ring &ring, Completion &cqe)
+{
+    unsigned int head = ring.header->cq_head;
+    if (head == ring.header->cq_tail) {
+        return false;
+    }
+    __asm__ volatile("" : : : "memory"); // tailを読んでから中身を読む
+    cqe = ring.cq[head & (ring.header->cq_entries - 1)];
+    __asm__ volatile("" : : : "memory");
+    ring.header->cq_head = head + 1;
+    return true;
+}
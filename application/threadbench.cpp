@@ -0,0 +1,104 @@
+#include "sys/syscall.hpp"
+#include "sys/thread.hpp"
+#include "sys/time.hpp"
+
+/*
+ * スレッドでCPUを使う計算を分けた時の速さを測るアプリ。
+ * 同じ量の計算を１スレッド、２スレッド、４スレッドで分けて実行し、かかった時間を表示する。
+ * 各スレッドはFSベースに自分用の領域を渡され、%fs:0がその領域を指していることも確かめる。
+ */
+
+namespace {
+    const unsigned long kTotalIterations = 400 * 1000 * 1000;
+    const int kMaxThreads = 4;
+
+    struct Work {
+        Work *self; // %fs:0で読む（x86-64のTLSの慣例と同じく、FSベースの先頭に自分のアドレスを置く）
+        unsigned long begin, end;
+        unsigned long result;
+    };
+    Work works[kMaxThreads];
+
+    unsigned long Length(const char *s)
+    {
+        unsigned long len = 0;
+        while (s[len]) len++;
+        return len;
+    }
+
+    void Puts(const char *s)
+    {
+        SyscallWrite(1, s, Length(s));
+    }
+
+    // 符号なし整数を10進数でbufに書き、書いた文字数を返す
+    int FormatNumber(char *buf, unsigned long value)
+    {
+        char tmp[24];
+        int n = 0;
+        do {
+            tmp[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        for (int i = 0; i < n; i++) {
+            buf[i] = tmp[n - 1 - i];
+        }
+        return n;
+    }
+
+    long Worker(void *arg)
+    {
+        Work *work;
+        __asm__ volatile("mov %%fs:0, %0" : "=r"(work));
+        if (work != arg) {
+            return -1;
+        }
+        unsigned long x = work->begin;
+        for (unsigned long i = work->begin; i < work->end; i++) {
+            x = x * 6364136223846793005ul + i; // 最適化で消されない適当な計算
+        }
+        work->result = x;
+        return 0;
+    }
+
+    // num_threads個のスレッドで計算し、かかった時間（ナノ秒）を返す。失敗したら０。
+    unsigned long Run(int num_threads)
+    {
+        long ids[kMaxThreads];
+        unsigned long start = ClockMonotonicNanoseconds();
+        for (int i = 0; i < num_threads; i++) {
+            works[i].self = &works[i];
+            works[i].begin = kTotalIterations / num_threads * i;
+            works[i].end = kTotalIterations / num_threads * (i + 1);
+            ids[i] = ThreadCreate(Worker, &works[i], &works[i]);
+            if (ids[i] < 0) {
+                return 0;
+            }
+        }
+        bool ok = true;
+        for (int i = 0; i < num_threads; i++) {
+            long status;
+            if (ThreadJoin(ids[i], &status) < 0 || status != 0) {
+                ok = false;
+            }
+        }
+        return ok ? ClockMonotonicNanoseconds() - start : 0;
+    }
+}
+
+extern "C" int main() {
+    for (int num_threads = 1; num_threads <= kMaxThreads; num_threads *= 2) {
+        unsigned long ns = Run(num_threads);
+        if (ns == 0) {
+            Puts("threadbench: thread failed\n");
+            SyscallExit(1);
+        }
+        char line[64];
+        int n = FormatNumber(line, num_threads);
+        for (const char *p = " threads: "; *p; p++) line[n++] = *p;
+        n += FormatNumber(line + n, ns / 1000);
+        for (const char *p = " us\n"; *p; p++) line[n++] = *p;
+        SyscallWrite(1, line, n);
+    }
+    SyscallExit(0);
+}
@@ -0,0 +1,9 @@
+#include "sys/syscall.hpp"
+
+/*
+ * 何もせずに終わるアプリ。起動の速さを測るのに使う（ターミナルのbench launch）。
+ */
+
+extern "C" int main() {
+    SyscallExit(0);
+}
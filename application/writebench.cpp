@@ -0,0 +1,128 @@
+#include "sys/syscall.hpp"
+#include "sys/time.hpp"
+#include "sys/uring.hpp"
+
+/*
+ * write()システムコールのスループットを測るアプリ。
+ * 4096バイトずつまとめて書いた場合と、1バイトずつ書いた場合の MB/s を表示する。
+ * 投入リングが使えれば、4096バイトの書き込みをkBatch個ずつ１回のシステムコールで処理させた場合も測る。
+ * 時間は時刻のページから読む経過時間（ClockMonotonicNanoseconds）で測る。
+ */
+
+namespace {
+    const unsigned long kChunk = 4096;
+    const unsigned long kBulkBytes = 1024 * 1024; // まとめて書く時の合計
+    const unsigned long kByteBytes = 16 * 1024; // 1バイトずつ書く時の合計（遅いので少なめ）
+    const unsigned int kBatch = 32; // リングで１回に投入する書き込みの数
+
+    char text[kChunk];
+
+    unsigned long Length(const char *s)
+    {
+        unsigned long len = 0;
+        while (s[len]) len++;
+        return len;
+    }
+
+    void Puts(const char *s)
+    {
+        SyscallWrite(1, s, Length(s));
+    }
+
+    // 符号なし整数を10進数でbufに書き、書いた文字数を返す
+    int FormatNumber(char *buf, unsigned long value)
+    {
+        char tmp[24];
+        int n = 0;
+        do {
+            tmp[n++] = '0' + value % 10;
+            value /= 10;
+        } while (value);
+        for (int i = 0; i < n; i++) {
+            buf[i] = tmp[n - 1 - i];
+        }
+        return n;
+    }
+
+    // 「name: bytes bytes in us us, X.YY MB/s」を出力する
+    void Report(const char *name, unsigned long bytes, unsigned long ns)
+    {
+        if (ns == 0) ns = 1;
+        // MB/s（10^6バイト毎秒）を小数点以下２桁まで
+        unsigned long centi_mbps = bytes * 100000 / ns;
+        char line[128];
+        int n = 0;
+        for (const char *p = name; *p; p++) line[n++] = *p;
+        line[n++] = ':';
+        line[n++] = ' ';
+        n += FormatNumber(line + n, bytes);
+        for (const char *p = " bytes in "; *p; p++) line[n++] = *p;
+        n += FormatNumber(line + n, ns / 1000);
+        for (const char *p = " us, "; *p; p++) line[n++] = *p;
+        n += FormatNumber(line + n, centi_mbps / 100);
+        line[n++] = '.';
+        line[n++] = '0' + centi_mbps / 10 % 10;
+        line[n++] = '0' + centi_mbps % 10;
+        for (const char *p = " MB/s\n"; *p; p++) line[n++] = *p;
+        SyscallWrite(1, line, n);
+    }
+}
+
+extern "C" int main() {
+    // 64文字ごとに改行の入った表示できる文字列
+    for (unsigned long i = 0; i < kChunk; i++) {
+        text[i] = (i % 64 == 63) ? '\n' : static_cast<char>('!' + i % 64 % 94);
+    }
+
+    unsigned long start = ClockMonotonicNanoseconds();
+    for (unsigned long written = 0; written < kBulkBytes; ) {
+        long res = SyscallWrite(1, text, kChunk);
+        if (res <= 0) {
+            Puts("writebench: write failed\n");
+            SyscallExit(1);
+        }
+        written += res;
+    }
+    unsigned long bulk_ns = ClockMonotonicNanoseconds() - start;
+
+    start = ClockMonotonicNanoseconds();
+    for (unsigned long i = 0; i < kByteBytes; i++) {
+        SyscallWrite(1, &text[i % kChunk], 1);
+    }
+    unsigned long byte_ns = ClockMonotonicNanoseconds() - start;
+
+    Ring ring;
+    unsigned long ring_ns = 0;
+    bool has_ring = RingInit(ring, 0);
+    if (has_ring) {
+        start = ClockMonotonicNanoseconds();
+        for (unsigned long written = 0; written < kBulkBytes; ) {
+            unsigned int n = 0;
+            for (; n < kBatch && written + n * kChunk < kBulkBytes; n++) {
+                Submission *sqe = RingGetSubmission(ring);
+                sqe->opcode = kRingWrite;
+                sqe->fd = 1;
+                sqe->addr = reinterpret_cast<unsigned long>(text);
+                sqe->len = kChunk;
+            }
+            RingSubmit(ring, n);
+            Completion cqe;
+            while (RingPopCompletion(ring, cqe)) {
+                if (cqe.result <= 0) {
+                    Puts("writebench: ring write failed\n");
+                    SyscallExit(1);
+                }
+                written += cqe.result;
+            }
+        }
+        ring_ns = ClockMonotonicNanoseconds() - start;
+    }
+
+    Report("write 4096B", kBulkBytes, bulk_ns);
+    Report("write 1B", kByteBytes, byte_ns);
+    if (has_ring) {
+        Report("ring 4096B x32", kBulkBytes, ring_ns);
+    }
+
+    SyscallExit(0);
+}
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+#
+# カーネルのtraceコマンド（trace dump）がシリアルポートへ書き出したトレースをタイムラインに直す。
+# 形式はkernel/trace.hppを参照。
+#
+# QEMUのシリアル出力をファイルに取っておく：
+#   QEMU_OPTS="-serial file:serial.bin" ./run.sh
+# ターミナルで trace on → （計測したい操作）→ trace dump を実行した後：
+#   devenv/trace_timeline.py serial.bin                 # テキストのタイムライン
+#   devenv/trace_timeline.py serial.bin --chrome out.json  # chrome://tracing（Perfetto）で開けるJSON
+#
+# ファイルに複数回分のダンプが含まれている場合は最後のものを使う（--indexで選べる）。
+#
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"JNXTRACE"
+HEADER = struct.Struct("<8sIIQII")
+CPU_HEADER = struct.Struct("<II")
+RECORD = struct.Struct("<QQQBBBBI")
+
+EVENT_SWITCH = 1
+EVENT_WAKEUP = 2
+EVENT_SLEEP = 3
+EVENT_INTERRUPT = 4
+EVENT_EXIT = 5
+FLAG_SLEEP = 1
+
+VECTORS = {
+    0x40: "xHCI",
+    0x41: "LAPIC timer",
+    0x42: "legacy",
+    0x43: "reschedule IPI",
+    0x44: "stop IPI",
+}
+
+
+def parse_dump(data, offset):
+    """offsetから始まるダンプを読み、(tsc_per_ms, レコードのリスト)を返す。"""
+    magic, version, record_size, tsc_per_ms, num_cpus, _ = HEADER.unpack_from(data, offset)
+    if version != 1 or record_size != RECORD.size:
+        raise ValueError(f"unsupported dump (version {version}, record size {record_size})")
+    offset += HEADER.size
+    records = []
+    for _ in range(num_cpus):
+        cpu, num_records = CPU_HEADER.unpack_from(data, offset)
+        offset += CPU_HEADER.size
+        for _ in range(num_records):
+            tsc, task, arg, event, rec_cpu, vector, flags, _ = RECORD.unpack_from(data, offset)
+            offset += RECORD.size
+            records.append({
+                "tsc": tsc, "task": task, "arg": arg, "event": event,
+                "cpu": rec_cpu, "vector": vector, "flags": flags,
+            })
+    records.sort(key=lambda r: r["tsc"])
+    return tsc_per_ms, records
+
+
+def find_dumps(data):
+    offsets = []
+    pos = data.find(MAGIC)
+    while pos >= 0:
+        offsets.append(pos)
+        pos = data.find(MAGIC, pos + 1)
+    return offsets
+
+
+def describe(r):
+    ev = r["event"]
+    if ev == EVENT_SWITCH:
+        how = "sleeps" if r["flags"] & FLAG_SLEEP else "preempted"
+        return f"switch  task {r['task']} -> task {r['arg']} ({how})"
+    if ev == EVENT_WAKEUP:
+        return f"wakeup  task {r['task']} on cpu {r['arg']}"
+    if ev == EVENT_SLEEP:
+        return f"sleep   task {r['task']}"
+    if ev == EVENT_INTERRUPT:
+        name = VECTORS.get(r["vector"], "?")
+        return f"irq     0x{r['vector']:02x} ({name}) in task {r['task']}"
+    if ev == EVENT_EXIT:
+        status = r["arg"] - (1 << 64) if r["arg"] >= (1 << 63) else r["arg"]
+        return f"exit    task {r['task']} (status {status})"
+    return f"unknown event {ev}"
+
+
+def print_timeline(tsc_per_ms, records, out):
+    if not records:
+        print("no records", file=out)
+        return
+    base = records[0]["tsc"]
+    prev = base
+    print(f"{'time(us)':>12} {'delta':>9}  cpu  event", file=out)
+    for r in records:
+        t = (r["tsc"] - base) * 1000.0 / tsc_per_ms
+        dt = (r["tsc"] - prev) * 1000.0 / tsc_per_ms
+        prev = r["tsc"]
+        print(f"{t:12.3f} {dt:9.3f}  {r['cpu']:3d}  {describe(r)}", file=out)
+
+
+def write_chrome(tsc_per_ms, records, path):
+    """CPUごとの実行中タスクを区間（X）、それ以外を瞬間イベント（i）にしたChromeのトレース形式で書き出す。"""
+    if not records:
+        events = []
+    else:
+        base = records[0]["tsc"]
+        to_us = lambda tsc: (tsc - base) * 1000.0 / tsc_per_ms
+        events = []
+        running = {}  # cpu -> (task, 開始時刻)
+        for r in records:
+            cpu = r["cpu"]
+            ts = to_us(r["tsc"])
+            if r["event"] == EVENT_SWITCH:
+                start = running.get(cpu, (r["task"], 0.0))[1]
+                events.append({"name": f"task {r['task']}", "ph": "X", "pid": 0, "tid": cpu,
+                               "ts": start, "dur": ts - start})
+                running[cpu] = (r["arg"], ts)
+            else:
+                events.append({"name": describe(r), "ph": "i", "s": "t", "pid": 0, "tid": cpu, "ts": ts})
+        end = to_us(records[-1]["tsc"])
+        for cpu, (task, start) in running.items():
+            events.append({"name": f"task {task}", "ph": "X", "pid": 0, "tid": cpu,
+                           "ts": start, "dur": end - start})
+        for cpu in sorted({r["cpu"] for r in records}):
+            events.append({"name": "thread_name", "ph": "M", "pid": 0, "tid": cpu, "args": {"name": f"cpu {cpu}"}})
+    with open(path, "w") as f:
+        json.dump({"traceEvents": events, "displayTimeUnit": "ns"}, f)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert a Jinux scheduler trace dump into a timeline")
+    parser.add_argument("file", help="serial output containing one or more trace dumps")
+    parser.add_argument("--index", type=int, default=-1, help="which dump to use (default: last)")
+    parser.add_argument("--chrome", metavar="JSON", help="write Chrome trace event JSON instead of text")
+    args = parser.parse_args()
+
+    with open(args.file, "rb") as f:
+        data = f.read()
+    offsets = find_dumps(data)
+    if not offsets:
+        sys.exit("no trace dump found")
+    tsc_per_ms, records = parse_dump(data, offsets[args.index])
+    if tsc_per_ms == 0:
+        sys.exit("TSC frequency is unknown in this dump")
+
+    if args.chrome:
+        write_chrome(tsc_per_ms, records, args.chrome)
+    else:
+        print_timeline(tsc_per_ms, records, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -75,7 +75,17 @@ namespace acpi
             logger->debug("[%d]\n", cnt);
             logger->debug("    Entry Type: %d\n", record->type);
             logger->debug("    Record Len: %d\n", record->len);
-            if (record->type == MADTRecordType::IOAPIC) {
+            if (record->type == MADTRecordType::ProcessorLocalAPIC) {
+                uint8_t apic_id = record->data[1];
+                uint32_t flags = *reinterpret_cast<uint32_t *>(&record->data[2]);
+                logger->debug("    Processor ID: %d\n", record->data[0]);
+                logger->debug("    APIC ID: %d\n", apic_id);
+                logger->debug("    Flags: 0x%08x\n", flags);
+                if (flags & 1) { // Enabled（０のものは起動できない）
+                    lapic_ids_.push_back(apic_id);
+                }
+
+            } else if (record->type == MADTRecordType::IOAPIC) {
                 logger->debug("    IOAPIC ID: %d\n", record->data[0]);
                 logger->debug("    IOAPIC Address: 0x%08x\n", *reinterpret_cast<uint32_t *>(&record->data[2]));
                 logger->debug("    Global System Interrupt Base: %d\n", *reinterpret_cast<uint32_t *>(&record->data[6]));
@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <cstring>
+#include <vector>
 
 #include "logging.hpp"
 #include "asmfunc.h"
@@ -86,9 +87,12 @@ namespace acpi
         // 中身のデータを解析する
         void Analyze();
 
+        // 有効なプロセッサのLocal APIC IDの一覧（BSPを含む）
+        const std::vector<uint8_t> &LocalAPICIDs() const { return lapic_ids_; }
 
     private:
         MADT *madt_;
+        std::vector<uint8_t> lapic_ids_;
     };
     
 
@@ -97,7 +101,8 @@ namespace acpi
     extern FADT* fadt;
     extern APICReader *apic_reader;
 
-    // PMタイマーを用いてmsecミリ秒を測る
+    // PMタイマーを用いてmsecミリ秒を測る（ビジーウェイト）
+    // LAPICタイマーの較正に使う。タスクが動き始めた後は、Task::SleepFor()を使うこと。
     void WaitMilliseconds(unsigned long msec);
 
     void Initialize(const RSDP *rsdp);
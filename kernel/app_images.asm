@@ -0,0 +1,22 @@
+; アプリの実行ファイル（application/でビルドしたELFファイル）をカーネルに埋め込む。
+; run_application.cppのkAppImagesから名前で探して実行する。
+
+bits 64
+section .rodata
+
+%macro APP_IMAGE 2  ; 名前, ファイル
+global app_image_%1_start
+global app_image_%1_end
+align 16
+app_image_%1_start:
+    incbin %2
+app_image_%1_end:
+%endmacro
+
+APP_IMAGE app, "../application/app"
+APP_IMAGE writebench, "../application/writebench"
+APP_IMAGE true, "../application/true"
+APP_IMAGE threadbench, "../application/threadbench"
+APP_IMAGE stdiobench, "../application/stdiobench"
+APP_IMAGE shmproducer, "../application/shmproducer"
+APP_IMAGE shmconsumer, "../application/shmconsumer"
@@ -4,6 +4,31 @@ section .text
 
 extern kernel_main_stack
 extern KernelMainNewStack
+extern fpu_save_kind      ; ０：fxsave、１：xsave、２：xsaveopt
+extern fpu_lazy           ; ０以外なら遅延切り替え（CR0.TSと#NM）
+extern fpu_nm_count       ; #NMで状態を入れ替えた回数
+extern smp_stop_request   ; ０以外の間、StopOtherCPUs()で止められたCPUは待ち続ける
+extern smp_stopped_count  ; 止まったCPUの数
+
+; CPUごとのデータ（smp.hppのPerCPU）のgs:からのオフセット
+%define PERCPU_SELF 0x00
+%define PERCPU_FPU_CURRENT 0x08   ; 実行中（これから実行する）タスクのFPU状態の保存領域
+%define PERCPU_FPU_OWNER 0x10     ; 遅延切り替えで、いまFPUレジスタに載っている状態の持ち主の保存領域
+%define PERCPU_FS_BASE 0x28        ; 実行中（これから実行する）タスクのFSベース
+%define PERCPU_FS_BASE_LOADED 0x30 ; IA32_FS_BASEに書き込んである値
+%define PERCPU_SYSCALL_STACK 0x38  ; 実行中のタスクがシステムコールで使うカーネルスタックの底
+%define PERCPU_USER_RSP 0x40       ; SyscallEntryがアプリのRSPを一時的に置く場所
+%define PERCPU_SWITCH_STACK_END 0x90
+
+%define LAPIC_EOI 0xfee000b0
+
+; システムコールの番号（SYSCALL_NR_Exitなど）をsyscall_list.incから定義する
+%macro SYSCALL_NUMBER 2  ; 番号, 名前
+%define SYSCALL_NR_%2 %1
+%endmacro
+%define SYSCALL_ENTRY(number, name, num_args, args, params) SYSCALL_NUMBER number, name
+%include "syscall_list.inc"
+%undef SYSCALL_ENTRY
 
 global KernelMain
 ; ここがカーネルのエントリポイントになる。
@@ -28,6 +53,20 @@ ReadIOAddressSpace32:
     in eax, dx
     ret
 
+global WriteIOAddressSpace8 ; void WriteIOAddressSpace8(uint16_t address, uint8_t value);
+WriteIOAddressSpace8:
+    mov dx, di
+    mov al, sil
+    out dx, al
+    ret
+
+global ReadIOAddressSpace8 ; uint8_t ReadIOAddressSpace8(uint16_t address);
+ReadIOAddressSpace8:
+    mov dx, di
+    xor eax, eax
+    in al, dx
+    ret
+
 global GetCS  ; uint16_t GetCS(void);
 GetCS:
     xor eax, eax  ; also clears upper 32 bits of rax
@@ -91,6 +130,11 @@ SetCR3:
     mov cr3, rdi
     ret
 
+global InvalidatePage   ; void InvalidatePage(uint64_t addr);
+InvalidatePage:
+    invlpg [rdi]
+    ret
+
 ;
 ; GetCRn
 ;
@@ -114,6 +158,176 @@ GetCR4:
     mov rax, cr4
     ret
 
+global SetCR0   ; void SetCR0(uint64_t value);
+SetCR0:
+    mov cr0, rdi
+    ret
+
+global SetCR4   ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global CPUID   ; void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t *regs);
+CPUID:
+    push rbx
+    mov r8, rdx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8], eax
+    mov [r8 + 4], ebx
+    mov [r8 + 8], ecx
+    mov [r8 + 12], edx
+    pop rbx
+    ret
+
+global XSetBV   ; void XSetBV(uint32_t xcr, uint64_t value);
+XSetBV:
+    mov ecx, edi
+    mov eax, esi
+    mov rdx, rsi
+    shr rdx, 32
+    xsetbv
+    ret
+
+; %1のレジスタが指す領域にFPUの状態をfpu_save_kindの命令で保存する。rax, rdxを破壊する。
+%macro SaveFPUState 1
+    mov eax, 0xffffffff  ; XCR0で有効にした全ての状態を対象にする
+    mov edx, 0xffffffff
+    cmp qword [fpu_save_kind], 1
+    jb %%fxsave
+    je %%xsave
+    xsaveopt [%1]
+    jmp %%end
+%%xsave:
+    xsave [%1]
+    jmp %%end
+%%fxsave:
+    fxsave [%1]
+%%end:
+%endmacro
+
+; %1のレジスタが指す領域からFPUの状態を復帰する。rax, rdxを破壊する。
+%macro LoadFPUState 1
+    mov eax, 0xffffffff
+    mov edx, 0xffffffff
+    cmp qword [fpu_save_kind], 0
+    je %%fxrstor
+    xrstor [%1]
+    jmp %%end
+%%fxrstor:
+    fxrstor [%1]
+%%end:
+%endmacro
+
+; 次のタスク（fpu_current_area）のFPUの状態を復帰する。rax, rcx, rdxを破壊する。
+; 遅延切り替えの時は復帰せず、レジスタの持ち主が別のタスクならCR0.TSを立てて最初の使用時に#NMを起こさせる。
+%macro SwitchInFPUState 0
+    mov rcx, [gs:PERCPU_FPU_CURRENT]
+    cmp qword [fpu_lazy], 0
+    je %%eager
+    mov rax, cr0
+    or rax, 8       ; CR0.TS
+    cmp rcx, [gs:PERCPU_FPU_OWNER]
+    jne %%set_cr0
+    and rax, ~8
+%%set_cr0:
+    mov cr0, rax
+    jmp %%end
+%%eager:
+    LoadFPUState rcx
+%%end:
+%endmacro
+
+; アプリは mov gs, セレクタ でGSベース（CPUごとのデータ）を書き換えられるので、CPL3から入ってきた時は
+; IA32_KERNEL_GS_BASEの写し（smp.cppで同じ値を書いておく。swapgsは使わないので変わらない）から書き戻す。
+; rax, rcx, rdxを破壊する。
+%macro RestoreGSBase 0
+    mov ecx, 0xc0000102  ; IA32_KERNEL_GS_BASE
+    rdmsr
+    mov ecx, 0xc0000101  ; IA32_GS_BASE
+    wrmsr
+%endmacro
+
+; 次のタスクのFSのセレクタ（コンテキストの0x30）とFSベース（gs:PERCPU_FS_BASE）を設定する。rax, rcx, rdxを破壊する。
+; セレクタを読み込むとFSベースが変わる（Intelでは０になる）ので、その時はFSベースを必ず書き直す。
+; wrmsrは遅いので、どちらも変わらなければ何もしない。
+%macro SwitchInFS 1  ; 次のタスクのコンテキスト
+    mov rax, [%1 + 0x30]
+    mov cx, fs
+    cmp ax, cx
+    je %%same_selector
+    mov fs, ax
+    mov qword [gs:PERCPU_FS_BASE_LOADED], -1  ; 正規でないアドレスなので、どのFSベースとも一致しない
+%%same_selector:
+    mov rax, [gs:PERCPU_FS_BASE]
+    cmp rax, [gs:PERCPU_FS_BASE_LOADED]
+    je %%end
+    mov [gs:PERCPU_FS_BASE_LOADED], rax
+    mov rdx, rax
+    shr rdx, 32
+    mov ecx, 0xc0000100  ; IA32_FS_BASE
+    wrmsr
+%%end:
+%endmacro
+
+; CR0.TSを下ろし、FPUレジスタの持ち主を実行中のタスクにする。rax, rcx, rdxを破壊する。
+%macro TakeFPUOwnership 0
+    clts
+    mov rcx, [gs:PERCPU_FPU_OWNER]
+    cmp rcx, [gs:PERCPU_FPU_CURRENT]
+    je %%end
+    test rcx, rcx
+    jz %%load          ; 持ち主がいなければ保存は要らない
+    SaveFPUState rcx
+%%load:
+    mov rcx, [gs:PERCPU_FPU_CURRENT]
+    LoadFPUState rcx
+    mov [gs:PERCPU_FPU_OWNER], rcx
+%%end:
+%endmacro
+
+global SaveFPU   ; void SaveFPU(void *area);
+SaveFPU:
+    SaveFPUState rdi
+    ret
+
+global LoadFPU   ; void LoadFPU(const void *area);
+LoadFPU:
+    LoadFPUState rdi
+    ret
+
+global ClaimFPU   ; void ClaimFPU();
+ClaimFPU:
+    TakeFPUOwnership
+    ret
+
+; #NM（デバイス使用不可例外）。CR0.TSが立っている時にFPU・SIMD命令を使うと発生する。
+; ここでFPUの状態を実行中のタスクのものに入れ替える。
+global IntHandlerNM
+IntHandlerNM:  ; void IntHandlerNM();
+    push rax
+    push rcx
+    push rdx
+    test byte [rsp + 0x20], 3  ; CS
+    jz .kernel_gs
+    RestoreGSBase
+.kernel_gs:
+    TakeFPUOwnership
+    lock inc qword [fpu_nm_count]
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
+global ReadTSC   ; uint64_t ReadTSC();
+ReadTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 global ReadFromLinearAddress    ; uint64_t ReadFromLinearAddress(void *lin_addr);
 ReadFromLinearAddress:
     mov rax, [rdi]
@@ -127,7 +341,7 @@ ReadFromLinearAddress:
 ; rsp ->|            |
 ;       |            |
 global SwitchContext
-SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
+SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx, volatile bool *saving);
     mov [rsi + 0x40], rax
     mov [rsi + 0x48], rbx
     mov [rsi + 0x50], rcx
@@ -164,7 +378,14 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     mov dx, gs
     mov [rsi + 0x38], rdx
 
-    fxsave [rsi + 0xc0] ; 浮動小数点数用のレジスタの保存（XMM0など）
+    ; 浮動小数点数用のレジスタ（XMM0など）は呼び出し元のTaskManagerがSaveFPU()で保存している
+
+    ; 保存が終わったので、このタスクのスタックを手放してCPUごとの領域に移り、*savingを下ろす。
+    ; これ以降は他のCPUがこのタスクをすぐに再開してもよい。
+    mov rsp, [gs:PERCPU_SELF]
+    add rsp, PERCPU_SWITCH_STACK_END
+    mov rax, [rsi + 0x58]  ; 第３引数（RDX）
+    mov byte [rax], 0
 
     ; iret 用のスタックフレーム
     push qword [rdi + 0x28] ; SS
@@ -174,14 +395,17 @@ SwitchContext:  ; void SwitchContext(void* next_ctx, void* current_ctx);
     push qword [rdi + 0x08] ; RIP
 
     ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
+    SwitchInFPUState
 
+    ; CR3が同じ（同じプロセスのタスクかカーネルのタスク同士）なら書き換えない。書き換えるとTLBが消える。
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    cmp rax, rcx
+    je .same_cr3
     mov cr3, rax
-    mov rax, [rdi + 0x30]
-    mov fs, ax
-    mov rax, [rdi + 0x38]
-    mov gs, ax
+.same_cr3:
+    SwitchInFS rdi
+    ; GSはセレクタをロードするとGSベース（CPUごとのデータ）が消えるので復帰しない
 
     mov rax, [rdi + 0x40]
     mov rbx, [rdi + 0x48]
@@ -212,14 +436,15 @@ RestoreContext:  ; void RestoreContext(void* task_context);
     push qword [rdi + 0x08] ; RIP
 
     ; コンテキストの復帰
-    fxrstor [rdi + 0xc0]
+    SwitchInFPUState
 
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    cmp rax, rcx
+    je .same_cr3
     mov cr3, rax
-    mov rax, [rdi + 0x30]
-    mov fs, ax
-    mov rax, [rdi + 0x38]
-    mov gs, ax
+.same_cr3:
+    SwitchInFS rdi
 
     mov rax, [rdi + 0x40]
     mov rbx, [rdi + 0x48]
@@ -240,16 +465,16 @@ RestoreContext:  ; void RestoreContext(void* task_context);
 
     o64 iret
 
-extern LAPICTimerOnInterrupt
-; void LAPICTimerOnInterrupt(const TaskContext *ctx_stack);
-
-global IntHandlerLAPICTimer
-IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
+; 割り込み時のレジスタをTaskContextと同じ並びでスタックに積み、そのアドレスを引数に%2を呼ぶ。
+; ハンドラの中でタスクを切り替える（RestoreContextで戻らない）ことができる。
+%macro InterruptEntryWithContext 2  ; 割り込みハンドラ名, 呼び出すC++の関数名
+extern %2
+global %1
+%1:
     push rbp
     mov rbp, rsp
 
-    sub rsp, 512
-    fxsave [rsp]
+    sub rsp, 512             ; FXSAVEイメージ（レジスタを積んでから保存する）
     push r15
     push r14
     push r13
@@ -267,6 +492,33 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     push rbx
     push rax
 
+    test byte [rbp + 0x10], 3  ; CS
+    jz %%kernel_gs
+    RestoreGSBase
+%%kernel_gs:
+
+    ; 遅延切り替えでCR0.TSが立っている時は、FPUレジスタの中身は割り込まれたタスクではなく持ち主の状態なので、
+    ; fxsaveすると#NMが起きて割り込まれたタスクの状態を読み込んでしまう（割り込みのたびに遅延が無駄になる）。
+    ; 代わりに持ち主の状態を保存領域へ追い出して持ち主をなしにし、TSを下ろしてハンドラがSSEを使えるようにする。
+    ; 出口ではTSを立て直すので、割り込まれたタスクの状態は実際にFPUを使うまで読み込まない。
+    ; r12（呼び出し先が保存するレジスタ）にTSが立っていたかを覚えておく。
+    xor r12, r12
+    cmp qword [fpu_lazy], 0
+    je %%save_image
+    mov r12, cr0
+    and r12, 8               ; CR0.TS
+    jz %%save_image
+    clts
+    mov rcx, [gs:PERCPU_FPU_OWNER]
+    test rcx, rcx
+    jz %%image_saved
+    SaveFPUState rcx
+    mov qword [gs:PERCPU_FPU_OWNER], 0
+    jmp %%image_saved
+%%save_image:
+    fxsave [rsp + 8*16]
+%%image_saved:
+
     mov ax, fs
     mov bx, gs
     mov rcx, cr3
@@ -281,7 +533,26 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     push rcx                 ; CR3
 
     mov rdi, rsp
-    call LAPICTimerOnInterrupt
+    call %2
+
+    test r12, r12
+    jnz %%restore_ts
+    fxrstor [rsp + 8*8 + 8*16]
+    jmp %%restored
+%%restore_ts:
+    ; 入口で持ち主をなしにしたので、普通は持ち主ではない。TSを立て直して、使う時に#NMで読み込ませる。
+    ; ハンドラの中でタスクを切り替えて戻ってきた後に#NMで持ち主になっていたら、保存領域から読み直す
+    ; （ハンドラがSSEのレジスタを壊しているかもしれないので）。
+    mov rcx, [gs:PERCPU_FPU_OWNER]
+    cmp rcx, [gs:PERCPU_FPU_CURRENT]
+    je %%reload
+    mov rax, cr0
+    or rax, 8
+    mov cr0, rax
+    jmp %%restored
+%%reload:
+    LoadFPUState rcx
+%%restored:
 
     add rsp, 8*8  ; CR3 から GS までを無視
     pop rax
@@ -299,11 +570,48 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
+%endmacro
+
+; void LAPICTimerOnInterrupt(const TaskContext *ctx_stack);
+InterruptEntryWithContext IntHandlerLAPICTimer, LAPICTimerOnInterrupt  ; void IntHandlerLAPICTimer();
+; void XHCIOnInterrupt(const TaskContext *ctx_stack);
+InterruptEntryWithContext IntHandlerXHCI, XHCIOnInterrupt  ; void IntHandlerXHCI();
+; void RescheduleOnInterrupt(const TaskContext *ctx_stack);
+InterruptEntryWithContext IntHandlerReschedule, RescheduleOnInterrupt  ; void IntHandlerReschedule();
+
+; 他のCPUのStopOtherCPUs()から送られる割り込み。smp_stop_requestが下りるまでここで待つ。
+; 止めている間にFPUのモードが変わってもよいよう、FPUレジスタを実行中のタスクの状態にしておく。
+; C++のコードはSSEのレジスタを壊すので、ここでは呼ばない。
+global IntHandlerStopCPU
+IntHandlerStopCPU:  ; void IntHandlerStopCPU();
+    push rax
+    push rcx
+    push rdx
+    test byte [rsp + 0x20], 3  ; CS
+    jz .kernel_gs
+    RestoreGSBase
+.kernel_gs:
+    cmp qword [fpu_lazy], 0
+    je .claimed
+    TakeFPUOwnership
+.claimed:
+    mov rax, [gs:PERCPU_FPU_CURRENT]
+    mov [gs:PERCPU_FPU_OWNER], rax
+    mov rax, LAPIC_EOI
+    mov dword [rax], 0
+    lock inc qword [smp_stopped_count]
+.wait:
+    pause
+    cmp qword [smp_stop_request], 0
+    jne .wait
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
 
 global WriteMSR
 WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
@@ -315,8 +623,32 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
     ret
 
 extern syscall_table
+extern num_syscalls
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
+    ; IA32_FMASKで割り込みを禁止して入ってくる。アプリのスタックは同じプロセスの他のスレッドが書き換えられるし、
+    ; RSPがカーネルの領域を指しているかもしれないので一切使わず、タスクのカーネルスタックに移る。
+    ; GSベースもアプリに書き換えられているかもしれず、退避に使えるレジスタもないので、
+    ; swapgsでIA32_KERNEL_GS_BASEの写しをGSベースにしてから（RestoreGSBaseと同じ値になる）CPUごとのデータを使う。
+    swapgs
+    mov [gs:PERCPU_USER_RSP], rsp
+    mov rsp, [gs:PERCPU_SYSCALL_STACK]
+    push qword [gs:PERCPU_USER_RSP]  ; アプリのRSP（sysretの直前に戻す）
+
+    ; swapgsでIA32_KERNEL_GS_BASEにアプリのGSベースが入ったので、写しを書き戻してから割り込みを許可する
+    push rax
+    push rcx
+    push rdx
+    mov rax, [gs:PERCPU_SELF]
+    mov rdx, rax
+    shr rdx, 32
+    mov ecx, 0xc0000102  ; IA32_KERNEL_GS_BASE
+    wrmsr
+    pop rdx
+    pop rcx
+    pop rax
+    sti
+
     push rbp
     push rcx  ; syscallの戻りアドレス
     push r11  ; syscall前のRFALGSの値（後で復帰）
@@ -327,19 +659,30 @@ SyscallEntry:  ; void SyscallEntry(void);
     mov rbp, rsp ; RSPの退避
     and rsp, 0xfffffffffffffff0 ; RSPの16bytesアラインメント
 
+    cmp rax, [num_syscalls]  ; 存在しない番号なら−１を返す
+    jae .invalid
     call [syscall_table + 8 * rax]
 
+.return:
     mov rsp, rbp
 
     pop rsi  ; syscall numberの復帰
-    cmp rsi, 0  ; syscallがExitだった場合
+    cmp rsi, SYSCALL_NR_Exit  ; syscallがExitだった場合
+    je  .exit
+    cmp rsi, SYSCALL_NR_ThreadExit  ; スレッドの終了も、CallAppの呼び出し元に戻るのは同じ
     je  .exit
 
     pop r11
     pop rcx
     pop rbp
+    cli      ; アプリのスタックに戻ってからsysretまでの間に割り込まれないようにする（sysretがr11からIFを戻す）
+    pop rsp  ; アプリのRSP
     o64 sysret
 
+.invalid:
+    mov rax, -1
+    jmp .return
+
 ; SyscallEntryから呼ばれる
 ; raxにはExitシステムコールの返り値
 extern GetOSStackInExitSyscall
@@ -348,7 +691,7 @@ extern GetOSStackInExitSyscall
     call GetOSStackInExitSyscall
     mov rsi, rax  ; 返り値を一旦退避
     pop rax  ; Exitステータスを復帰
-    mov rsp, rsi  ; rsp値を呼び出し時のOSの値に戻す。（ここから元のOSをのスタックの状態になる。）
+    mov rsp, rsi  ; rsp値を呼び出し時のOSの値に戻す。（システムコールはこの下で動いていたので、その上は壊れていない。）
 
     pop r15
     pop r14
@@ -361,7 +704,7 @@ extern GetOSStackInExitSyscall
 
 
 global CallApp
-CallApp: ; int64_t CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t *os_stack_pointer);
+CallApp: ; int64_t CallApp(uint64_t arg0, uint64_t arg1, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t *os_stack_pointer);
     push rbx
     push rbp
     push r12
@@ -369,6 +712,8 @@ CallApp: ; int64_t CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uin
     push r14
     push r15
     mov [r9], rsp
+    ; システムコールはここから下をカーネルスタックとして使う（切り替わった時はOnSwitchIn()が書き直す）
+    mov [gs:PERCPU_SYSCALL_STACK], rsp
 
     push rdx  ; SS
     push r8   ; RSP
@@ -378,3 +723,76 @@ CallApp: ; int64_t CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uin
     o64 retf
 
 
+
+
+; APの起動用コード。smp::kTrampolineAddress（0x8000）にコピーしてから、SIPIでAPに実行させる。
+; リアルモードで始まり、プロテクトモードを経てロングモードに入り、APTrampolineParamsのentryを呼ぶ。
+; コピー先で動くので、ラベルのアドレスはTRAMPOLINE()で変換して使う。
+%define TRAMPOLINE_BASE 0x8000
+%define TRAMPOLINE(label) (TRAMPOLINE_BASE + (label) - APTrampoline)
+
+bits 16
+global APTrampoline
+APTrampoline:
+    cli
+    cld
+    xor ax, ax
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    lgdt [TRAMPOLINE(ap_gdt_pointer)]
+    mov eax, cr0
+    or eax, 1              ; CR0.PE
+    mov cr0, eax
+    jmp dword 0x08:TRAMPOLINE(.protected_mode)
+
+bits 32
+.protected_mode:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov eax, cr4
+    or eax, (1 << 5) | (1 << 9) | (1 << 10)  ; CR4.PAE、OSFXSR、OSXMMEXCPT（C++のコードがSSEを使うので）
+    mov cr4, eax
+    mov eax, [TRAMPOLINE(APTrampolineParams)]  ; cr3（BSPと同じページテーブル。4GiB未満にある）
+    mov cr3, eax
+    mov ecx, 0xc0000080    ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8         ; LME
+    wrmsr
+    mov eax, cr0
+    and eax, ~(1 << 2)     ; CR0.EM
+    or eax, (1 << 31) | (1 << 16) | (1 << 1)  ; CR0.PG、WP、MP
+    mov cr0, eax
+    jmp 0x18:TRAMPOLINE(.long_mode)
+
+bits 64
+.long_mode:
+    mov rsp, [TRAMPOLINE(APTrampolineParams) + 8]  ; １６バイト境界（callで戻りアドレスを積んでABIどおりになる）
+    mov rdi, [TRAMPOLINE(APTrampolineParams) + 24]
+    mov rax, [TRAMPOLINE(APTrampolineParams) + 16]
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 8
+ap_gdt:
+    dq 0
+    dq 0x00cf9a000000ffff  ; 0x08：32bitコード
+    dq 0x00cf92000000ffff  ; 0x10：データ
+    dq 0x00af9a000000ffff  ; 0x18：64bitコード
+ap_gdt_pointer:
+    dw ap_gdt_pointer - ap_gdt - 1
+    dd TRAMPOLINE(ap_gdt)
+
+align 8
+global APTrampolineParams
+APTrampolineParams:  ; smp.cppのTrampolineParams
+    dq 0  ; cr3
+    dq 0  ; stack
+    dq 0  ; entry
+    dq 0  ; arg
+global APTrampolineEnd
+APTrampolineEnd:
@@ -7,6 +7,9 @@ extern "C" {
     void WriteIOAddressSpace32(uint16_t address, uint32_t value);
     // 指定したIOアドレス空間のアドレスから４bytes分読み出す
     uint32_t ReadIOAddressSpace32(uint16_t address);
+    // １byte版（シリアルポートなど）
+    void WriteIOAddressSpace8(uint16_t address, uint8_t value);
+    uint8_t ReadIOAddressSpace8(uint16_t address);
 
     uint16_t GetCS(void);
     void LoadIDT(uint16_t limit, uint64_t offset);
@@ -14,28 +17,59 @@ extern "C" {
     void SetCSSS(uint16_t cs, uint16_t ss);
     void SetDSAll(uint16_t value);
     void SetCR3(uint64_t value);
+    // addrを含むページの変換をこのCPUのTLBから消す
+    void InvalidatePage(uint64_t addr);
     void LoadTR(uint16_t sel);
     uint64_t GetCR0();
     uint64_t GetCR2();
     uint64_t GetCR3();
     uint64_t GetCR4();
+    // タイムスタンプカウンタの値を返す
+    uint64_t ReadTSC();
+    void SetCR0(uint64_t value);
+    void SetCR4(uint64_t value);
+    // leaf（EAX）とsubleaf（ECX）を指定してCPUIDを実行し、EAX, EBX, ECX, EDXをregs[0]〜regs[3]に格納する
+    void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t *regs);
+    // 拡張制御レジスタ（XCR0など）に書き込む
+    void XSetBV(uint32_t xcr, uint64_t value);
 
-    void SwitchContext(void* next_ctx, void* current_ctx);
+    // FPU・SIMDの状態を現在のモード（fpu.hpp）の命令で保存・復帰する。領域は６４バイト境界に置くこと。
+    void SaveFPU(void *area);
+    void LoadFPU(const void *area);
+    // CR0.TSを下ろし、遅延切り替えで他のタスクの状態が載っていれば入れ替える
+    void ClaimFPU();
+    // #NM（CR0.TSが立っている時のFPUの使用）のハンドラ
+    void IntHandlerNM();
+
+    // current_ctxに現在のコンテキストを保存してnext_ctxに切り替える。
+    // 保存が終わり現在のタスクのスタックを使わなくなった所で*savingをfalseにする（他のCPUが再開してよい合図）。
+    void SwitchContext(void* next_ctx, void* current_ctx, volatile bool *saving);
     // 現在のコンテキストは保存せずに、指定したタスクのコンテキストの復帰のみ行う関数。
     void RestoreContext(void* task_context);
     // LAPICタイマーの割り込み時に呼ばれる関数
     void IntHandlerLAPICTimer();
+    // xHCIの割り込み時に呼ばれる関数
+    void IntHandlerXHCI();
+    // 他のCPUからタスクの切り替えを求められた時の割り込み（IPI）
+    void IntHandlerReschedule();
+    // 他のCPUのsmp::StopOtherCPUs()で止められた時の割り込み（IPI）
+    void IntHandlerStopCPU();
+
+    // APの起動用コード（smp::kTrampolineAddressにコピーして使う）と、その中の引数の領域
+    extern uint8_t APTrampoline[];
+    extern uint8_t APTrampolineParams[];
+    extern uint8_t APTrampolineEnd[];
 
     // msrで指定した番号にvalueを格納する命令
     void WriteMSR(uint32_t msr, uint64_t value);
     // syscallを実行された時に呼び出されるOS側の関数
     void SyscallEntry(void);
 
-    // argc, argvはアプリへの引数
+    // arg0, arg1はアプリへの引数（rdi, rsiでそのまま渡す。mainならargc, argv）
     // csはアプリを実行するときのcsとssの値を格納
     // ripはアプリのエントリポイント、rspはアプリのスタックポインタ
     // os_stack_pointerは、OSのrsp値を格納しておくための変数へのポインタ。ここに格納した値は、アプリから帰って来る時にOSへ制御を戻す時に使う
-    int64_t CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t *os_stack_pointer);
+    int64_t CallApp(uint64_t arg0, uint64_t arg1, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t *os_stack_pointer);
     
     // リニアアドレスから8bytesのデータを読み出し返り値にする。
     // ページングの検証のために作成。
@@ -46,7 +46,8 @@ void Console::PutString(const char *s)
     if (!IsActive()) {
         return;
     }
-    __asm__("cli");
+    // 割り込みハンドラや他のCPUから出力されても行が混ざらないように
+    IRQSaveLockGuard<SpinLock> guard{lock_};
     while (*s) {
         if (*s == '\n') {
             NewLine();
@@ -57,7 +58,6 @@ void Console::PutString(const char *s)
         }
         s++; 
     }
-    __asm__("sti");
 }
 
 void Console::NewLine()
@@ -2,6 +2,7 @@
 
 #include "graphics.hpp"
 #include "font.hpp"
+#include "spinlock.hpp"
 
 // 画面をコンソール表示にする。
 // PutString(string)で文字を出力する。
@@ -45,6 +46,8 @@ private:
     // コンソールはデバッグなどに用いるが、ターミナルなどを起動した後は画面出力をしてほしくないので、
     // active == 0の時は処理を特にしないようにする。
     bool active{0};
+
+    SpinLock lock_; // buffer_とカーソル位置を守る
 };
 
 void InitializeConsole();
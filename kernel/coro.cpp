@@ -0,0 +1,150 @@
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "coro.hpp"
+#include "logging.hpp"
+#include "message.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+extern TaskManager* task_manager;
+extern TimerManager *timer_manager;
+extern logging::Logger *logger;
+
+namespace coro
+{
+    namespace {
+        const int kTimerValue = 0xc0; // エグゼキュータを起こすタイマーのvalue（中身は見ない）
+
+        struct Timer {
+            uint64_t deadline_tick;
+            Handle handle;
+            bool operator>(const Timer &rhs) const { return deadline_tick > rhs.deadline_tick; }
+        };
+
+        SpinLock lock; // 以下を守る
+        std::deque<Handle> ready; // 実行キュー
+        std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+
+        ::Task *executor = nullptr;
+        uint64_t armed_tick = 0; // TimerManagerに仕掛けてあるタイマーの満了時刻（エグゼキュータだけが触る）
+
+        bool PopReady(Handle &handle)
+        {
+            IRQSaveLockGuard<SpinLock> guard{lock};
+            if (ready.empty()) {
+                return false;
+            }
+            handle = ready.front();
+            ready.pop_front();
+            return true;
+        }
+
+        // 満了したタイマーのコルーチンを実行キューへ移す。
+        // 実行キューが空でなければtrueを返す。next_tickには次に満了するタイマーの時刻（なければ０）を入れる。
+        bool ExpireTimers(uint64_t &next_tick)
+        {
+            uint64_t now = timer_manager->CurrentTick();
+            IRQSaveLockGuard<SpinLock> guard{lock};
+            while (!timers.empty() && timers.top().deadline_tick <= now) {
+                ready.push_back(timers.top().handle);
+                timers.pop();
+            }
+            next_tick = timers.empty() ? 0 : timers.top().deadline_tick;
+            return !ready.empty();
+        }
+
+        // 実行キューが空になるまでコルーチンを再開し、空になったら眠る。
+        // Schedule()は実行キューに入れてからこのタスクを起こすので、眠る直前に入ったものも取りこぼさない
+        // （眠る前に起こされていればSleep()はすぐに戻る）。
+        void ExecutorTask(uint64_t id, int64_t data)
+        {
+            while (1) {
+                while (executor->ReceiveMessage().type != Message::Type::kNullMessage) {
+                    // タイマーの通知は起こしてもらうためだけのものなので読み捨てる
+                }
+
+                Handle handle;
+                while (PopReady(handle)) {
+                    handle.resume();
+                }
+
+                uint64_t next_tick;
+                if (ExpireTimers(next_tick)) {
+                    continue;
+                }
+                if (next_tick != 0 && (armed_tick == 0 || next_tick < armed_tick ||
+                                       armed_tick <= timer_manager->CurrentTick())) {
+                    timer_manager->AddTimer(next_tick, kTimerValue, executor->ID());
+                    armed_tick = next_tick;
+                }
+                executor->Sleep();
+            }
+        }
+    }
+
+    void Initialize()
+    {
+        // xHCIのドライバなどはBSPで動くサービスタスクと状態を共有しているので、エグゼキュータもBSPに固定する。
+        // アプリなどの負荷があってもデバイスの初期化が遅れないよう、10msごとに2msの実行時間をEDFで予約する。
+        // 予約が受け入れられなければレベル３で実行する。
+        executor = task_manager
+            ->NewTask()
+            ->InitContext(ExecutorTask, 0)
+            ->SetAffinity(0);
+        if (!task_manager->SetDeadline(executor, 2, 10, 10)) {
+            logger->warning("[coro] failed to reserve a deadline for the executor\n");
+        }
+        executor->Wakeup(3);
+    }
+
+    void Schedule(Handle handle)
+    {
+        {
+            IRQSaveLockGuard<SpinLock> guard{lock};
+            ready.push_back(handle);
+        }
+        executor->Wakeup();
+    }
+
+    void ScheduleAt(uint64_t deadline_tick, Handle handle)
+    {
+        {
+            IRQSaveLockGuard<SpinLock> guard{lock};
+            timers.push(Timer{deadline_tick, handle});
+        }
+        executor->Wakeup(); // タイマーを仕掛け直してもらう
+    }
+
+    void SleepFor::await_suspend(Handle handle) const
+    {
+        ScheduleAt(timer_manager->CurrentTick() + ms_, handle);
+    }
+
+    bool Mutex::Enqueue(Handle handle)
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        if (!locked_) {
+            locked_ = true;
+            return false;
+        }
+        waiters_.push_back(handle);
+        return true;
+    }
+
+    void Mutex::Unlock()
+    {
+        Handle next;
+        {
+            IRQSaveLockGuard<SpinLock> guard{lock_};
+            if (waiters_.empty()) {
+                locked_ = false;
+                return;
+            }
+            next = waiters_.front(); // locked_は立てたまま次のコルーチンに渡す
+            waiters_.pop_front();
+        }
+        Schedule(next);
+    }
+}
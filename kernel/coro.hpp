@@ -0,0 +1,310 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <type_traits>
+#include <utility>
+
+#include "spinlock.hpp"
+
+#if __has_include(<coroutine>)
+#include <coroutine>
+#else
+/*
+ * 同梱のlibc++（v8）には<coroutine>がない（<experimental/coroutine>だけ）ので、
+ * コンパイラがco_awaitなどを展開する時に探すものだけを用意する。
+ * 中身はclangとgccが共通に持つ__builtin_coro_*の薄いラッパ。
+ */
+namespace std
+{
+    template <class R, class... Args>
+    struct coroutine_traits {
+        using promise_type = typename R::promise_type;
+    };
+
+    template <class Promise = void>
+    struct coroutine_handle;
+
+    template <>
+    struct coroutine_handle<void> {
+        constexpr coroutine_handle() noexcept = default;
+        constexpr coroutine_handle(std::nullptr_t) noexcept {}
+
+        static coroutine_handle from_address(void *addr) noexcept
+        {
+            coroutine_handle handle;
+            handle.ptr_ = addr;
+            return handle;
+        }
+        void *address() const noexcept { return ptr_; }
+
+        explicit operator bool() const noexcept { return ptr_ != nullptr; }
+        void operator()() const { resume(); }
+        void resume() const { __builtin_coro_resume(ptr_); }
+        void destroy() const { __builtin_coro_destroy(ptr_); }
+        bool done() const { return __builtin_coro_done(ptr_); }
+
+    protected:
+        void *ptr_ = nullptr;
+    };
+
+    template <class Promise>
+    struct coroutine_handle : coroutine_handle<> {
+        using coroutine_handle<>::coroutine_handle;
+
+        static coroutine_handle from_address(void *addr) noexcept
+        {
+            coroutine_handle handle;
+            handle.ptr_ = addr;
+            return handle;
+        }
+        static coroutine_handle from_promise(Promise &promise) noexcept
+        {
+            coroutine_handle handle;
+            handle.ptr_ = __builtin_coro_promise(&promise, alignof(Promise), true);
+            return handle;
+        }
+        Promise &promise() const
+        {
+            return *static_cast<Promise *>(__builtin_coro_promise(ptr_, alignof(Promise), false));
+        }
+    };
+
+    struct suspend_always {
+        constexpr bool await_ready() const noexcept { return false; }
+        constexpr void await_suspend(coroutine_handle<>) const noexcept {}
+        constexpr void await_resume() const noexcept {}
+    };
+
+    struct suspend_never {
+        constexpr bool await_ready() const noexcept { return true; }
+        constexpr void await_suspend(coroutine_handle<>) const noexcept {}
+        constexpr void await_resume() const noexcept {}
+    };
+
+#if defined(__clang__) && __clang_major__ < 14
+    // 古いclangはstd::experimentalの方を探す
+    namespace experimental
+    {
+        using std::coroutine_traits;
+        using std::coroutine_handle;
+    }
+#endif
+}
+#endif
+
+/*
+ * ドライバの状態遷移を書くためのコルーチン
+ *
+ * デバイスの初期化のように「コマンドを出す→完了イベントを待つ→次のコマンドを出す…」と進む処理を、
+ * co_awaitを使って普通の関数のように書けるようにする。待っている間はコルーチンのフレーム（ヒープ）だけが残り、
+ * タスクのスタックは使わないので、待ち合わせが多くてもタスクを増やさずに済む。
+ *
+ * コルーチンは全て１つのカーネルタスク（エグゼキュータ）で実行する。
+ * 待っていたものが揃うとSchedule()で実行キューに入り、エグゼキュータが順に再開する。
+ * エグゼキュータはBSPに固定しているので、コルーチン同士が並列に動くことはない。
+ *
+ * ＜使い方＞
+ *   coro::Task<bool> Foo();          // co_return true; などで値を返すコルーチン
+ *   bool ok = co_await Foo();        // 呼び出し元のコルーチンからは完了を待って値を受け取る
+ *   coro::Spawn(Bar());              // 呼び出し元から切り離して実行する（終わるとフレームは解放される）
+ *   co_await coro::SleepFor(10);     // 10ms待つ
+ *   coro::Completion<int> done;      // 割り込みの下半分などからdone.Complete(x)されるまで待つ
+ *   int x = co_await done;
+ */
+namespace coro
+{
+    using Handle = std::coroutine_handle<>;
+
+    // エグゼキュータのタスクを作る。タスク管理の初期化の後、コルーチンを使うドライバより前に呼ぶ。
+    void Initialize();
+
+    // handleのコルーチンを実行キューに入れる。割り込みハンドラや他のCPUからも呼べる。
+    void Schedule(Handle handle);
+
+    // deadline_tickになったらhandleのコルーチンを実行キューに入れる
+    void ScheduleAt(uint64_t deadline_tick, Handle handle);
+
+    template <class T = void>
+    class Task;
+
+    namespace detail
+    {
+        struct PromiseBase {
+            Handle continuation{}; // co_awaitでこのコルーチンの完了を待っているコルーチン
+            bool detached{false}; // Spawn()されたもの。終わったら自分でフレームを解放する
+
+            // 終わった時、待っているコルーチンを実行キューに入れる（その場で再開するとスタックが積み重なるため）
+            struct FinalAwaiter {
+                bool await_ready() const noexcept { return false; }
+                template <class Promise>
+                void await_suspend(std::coroutine_handle<Promise> handle) noexcept
+                {
+                    PromiseBase &promise = handle.promise();
+                    if (promise.detached) {
+                        handle.destroy();
+                    } else if (promise.continuation) {
+                        Schedule(promise.continuation);
+                    }
+                }
+                void await_resume() const noexcept {}
+            };
+
+            // 呼ばれただけでは実行せず、co_awaitかSpawn()された時に始める
+            std::suspend_always initial_suspend() const noexcept { return {}; }
+            FinalAwaiter final_suspend() const noexcept { return {}; }
+            void unhandled_exception() {} // 例外は使わない
+        };
+
+        template <class T>
+        struct Promise : PromiseBase {
+            T value{};
+            void return_value(T v) { value = std::move(v); }
+        };
+
+        template <>
+        struct Promise<void> : PromiseBase {
+            void return_void() {}
+        };
+    }
+
+    // 値を返すコルーチン。co_awaitで完了を待つか、Spawn()で切り離して実行する。
+    template <class T>
+    class Task
+    {
+    public:
+        struct promise_type : detail::Promise<T> {
+            Task get_return_object()
+            {
+                return Task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+        };
+
+        Task(Task &&other) noexcept : handle_{std::exchange(other.handle_, nullptr)} {}
+        Task(const Task &) = delete;
+        Task &operator=(const Task &) = delete;
+        ~Task()
+        {
+            if (handle_) {
+                handle_.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept { return false; }
+        // 待つ側を覚えておき、そのままこのコルーチンの実行に移る
+        Handle await_suspend(Handle caller) noexcept
+        {
+            handle_.promise().continuation = caller;
+            return handle_;
+        }
+        T await_resume()
+        {
+            if constexpr (!std::is_void_v<T>) {
+                return std::move(handle_.promise().value);
+            }
+        }
+
+        // フレームの持ち主でなくなる（Spawn()で使う）
+        std::coroutine_handle<promise_type> Release() { return std::exchange(handle_, nullptr); }
+
+    private:
+        explicit Task(std::coroutine_handle<promise_type> handle) : handle_{handle} {}
+
+        std::coroutine_handle<promise_type> handle_;
+    };
+
+    // taskを呼び出し元から切り離して実行キューに入れる
+    inline void Spawn(Task<> task)
+    {
+        auto handle = task.Release();
+        handle.promise().detached = true;
+        Schedule(handle);
+    }
+
+    // co_await Yield()：実行キューの後ろに並び直し、他のコルーチンに順番を譲る
+    struct Yield {
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(Handle handle) const { Schedule(handle); }
+        void await_resume() const noexcept {}
+    };
+
+    // co_await SleepFor(ms)：msミリ秒の間、実行を止める
+    class SleepFor
+    {
+    public:
+        explicit SleepFor(uint64_t ms) : ms_{ms} {}
+        bool await_ready() const noexcept { return ms_ == 0; }
+        void await_suspend(Handle handle) const;
+        void await_resume() const noexcept {}
+
+    private:
+        uint64_t ms_;
+    };
+
+    /*
+     * １回だけ完了する待ち合わせ。待つ側がco_awaitし、割り込みの下半分などがComplete()で値を渡す。
+     * Complete()が先に呼ばれていれば、co_awaitは止まらずにすぐ値を返す。
+     * 待つ側のフレームに置き、そのアドレスを完了させる側に渡して使うので、コピーも移動もできない。
+     */
+    template <class T>
+    class Completion
+    {
+    public:
+        Completion() = default;
+        Completion(const Completion &) = delete;
+        Completion &operator=(const Completion &) = delete;
+
+        bool await_ready() const noexcept { return __atomic_load_n(&state_, __ATOMIC_ACQUIRE) == kDone; }
+        bool await_suspend(Handle handle) noexcept
+        {
+            waiter_ = handle;
+            int expected = kEmpty;
+            // 先に完了していた場合は止まらずに続ける
+            return __atomic_compare_exchange_n(&state_, &expected, kWaiting, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        }
+        T await_resume() { return value_; }
+
+        // 割り込みハンドラや他のタスクから呼べる。呼んだ後はこのオブジェクトに触れないこと（待つ側が解放する）。
+        void Complete(T value)
+        {
+            value_ = value;
+            // kWaitingだった場合、待つ側は止まっているのでwaiter_を読んでから再開させても大丈夫
+            if (__atomic_exchange_n(&state_, kDone, __ATOMIC_ACQ_REL) == kWaiting) {
+                Schedule(waiter_);
+            }
+        }
+
+    private:
+        enum State { kEmpty, kWaiting, kDone };
+
+        int state_{kEmpty};
+        Handle waiter_{};
+        T value_{};
+    };
+
+    /*
+     * コルーチン用の排他制御。ロックを取れるまでの間、コルーチンは実行キューから外れて待つ。
+     * 解放する時は待っている先頭のコルーチンにそのままロックを渡す。
+     */
+    class Mutex
+    {
+    public:
+        struct LockAwaiter {
+            Mutex *mutex;
+            bool await_ready() const noexcept { return false; }
+            bool await_suspend(Handle handle) { return mutex->Enqueue(handle); }
+            void await_resume() const noexcept {}
+        };
+
+        LockAwaiter Lock() { return LockAwaiter{this}; } // co_await mutex.Lock();
+        void Unlock();
+
+    private:
+        SpinLock lock_; // 以下を守る
+        bool locked_{false};
+        std::deque<Handle> waiters_;
+
+        bool Enqueue(Handle handle); // ロックを取れたらfalse（止まらない）、待つならtrueを返す
+    };
+}
@@ -0,0 +1,226 @@
+#include <string.h>
+
+#include "fpu.hpp"
+#include "asmfunc.h"
+#include "task.hpp"
+#include "logging.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+
+extern TaskManager *task_manager;
+extern logging::Logger *logger;
+
+// asmfunc.asmのSwitchContext/RestoreContextと#NMのハンドラが参照する
+// 実行中のタスクとレジスタの持ち主の保存領域はCPUごとのデータ（smp::PerCPU）に置く。
+extern "C" {
+    uint64_t fpu_save_kind = 0; // ０：fxsave、１：xsave、２：xsaveopt
+    uint64_t fpu_lazy = 0;
+    uint64_t fpu_nm_count = 0;
+}
+
+namespace {
+    const size_t kLegacyAreaSize = 512; // FXSAVEの領域。XSAVEの領域も先頭はこれと同じ形式。
+    const size_t kXstateBVOffset = 512; // XSAVEのヘッダにある、保存されている状態のビットマップ
+    const uint64_t kXCR0X87 = 1;
+    const uint64_t kXCR0SSE = 1 << 1;
+    const uint64_t kXCR0AVX = 1 << 2;
+
+    size_t area_size = kLegacyAreaSize;
+    uint64_t xcr0 = 0; // XCR0に設定する値（APにも同じ値を設定する）
+    bool xsave_supported = false;
+    bool xsaveopt_supported = false;
+    FPUMode current_mode = FPUMode::kFxsave;
+
+    uint64_t &XstateBV(uint8_t *area)
+    {
+        return *reinterpret_cast<uint64_t *>(&area[kXstateBVOffset]);
+    }
+
+    // x87とSSEの部分を初期値にする
+    void InitLegacyArea(uint8_t *area, bool x87, bool sse)
+    {
+        if (x87) {
+            memset(&area[0], 0, 24);
+            memset(&area[32], 0, 128); // ST0〜ST7
+            *reinterpret_cast<uint16_t *>(&area[0]) = 0x37f; // FCW
+        }
+        if (sse) {
+            memset(&area[160], 0, 256); // XMM0〜XMM15
+            *reinterpret_cast<uint32_t *>(&area[24]) = 0x1f80; // MXCSR（全ての例外をマスク）
+        }
+    }
+
+    // XSAVEOPTは初期状態のx87やSSEを書き込まずにXSTATE_BVのビットを落とすことがある。
+    // FXRSTORやイメージの上書きでも正しく扱えるよう、その部分を初期値で埋めてビットを立てておく。
+    void NormalizeFPUArea(uint8_t *area)
+    {
+        if (!xsave_supported) {
+            return;
+        }
+        uint64_t &xstate_bv = XstateBV(area);
+        InitLegacyArea(area, !(xstate_bv & kXCR0X87), !(xstate_bv & kXCR0SSE));
+        xstate_bv |= kXCR0X87 | kXCR0SSE;
+    }
+}
+
+void InitializeFPU()
+{
+    uint32_t regs[4]; // eax, ebx, ecx, edx
+    CPUID(1, 0, regs);
+    xsave_supported = regs[2] & (1u << 26);
+    bool avx_supported = regs[2] & (1u << 28);
+
+    if (xsave_supported) {
+        SetCR4(GetCR4() | (1ul << 18)); // CR4.OSXSAVE
+        xcr0 = kXCR0X87 | kXCR0SSE | (avx_supported ? kXCR0AVX : 0);
+        XSetBV(0, xcr0);
+        CPUID(0xd, 0, regs);
+        area_size = regs[1]; // EBX: 現在のXCR0で必要な保存領域の大きさ
+        CPUID(0xd, 1, regs);
+        xsaveopt_supported = regs[0] & 1;
+    }
+    logger->info("[+] FPU: xsave %d, xsaveopt %d, avx %d, area %lu bytes\n", 
+        xsave_supported, xsaveopt_supported, avx_supported, area_size);
+
+    SetFPUMode(xsaveopt_supported ? FPUMode::kXsaveopt : 
+               xsave_supported ? FPUMode::kXsave : FPUMode::kFxsave);
+}
+
+void InitializeFPUOnAP()
+{
+    if (xsave_supported) {
+        SetCR4(GetCR4() | (1ul << 18)); // CR4.OSXSAVE
+        XSetBV(0, xcr0);
+    }
+}
+
+size_t FPUAreaSize()
+{
+    return area_size;
+}
+
+void InitFPUArea(uint8_t *area)
+{
+    memset(area, 0, area_size);
+    InitLegacyArea(area, true, true);
+    if (xsave_supported) {
+        XstateBV(area) = kXCR0X87 | kXCR0SSE;
+    }
+}
+
+void SetInitialFPUArea(uint8_t *area)
+{
+    smp::PerCPU *cpu = smp::CurrentCPU();
+    cpu->fpu_current_area = area;
+    cpu->fpu_owner_area = area; // 今レジスタに載っているのはこのタスクの状態
+}
+
+void DropFPUArea(uint8_t *area)
+{
+    // 他のCPUでは、このタスクから切り替えた時に保存して持ち主を外しているので、見るのはこのCPUだけでよい
+    smp::PerCPU *cpu = smp::CurrentCPU();
+    if (cpu->fpu_owner_area == area) {
+        cpu->fpu_owner_area = nullptr;
+    }
+}
+
+bool FPUModeSupported(FPUMode mode)
+{
+    switch (mode) {
+        case FPUMode::kXsave:
+            return xsave_supported;
+        case FPUMode::kXsaveopt:
+            return xsaveopt_supported;
+        default:
+            return true;
+    }
+}
+
+bool SetFPUMode(FPUMode mode)
+{
+    if (!FPUModeSupported(mode)) {
+        return false;
+    }
+
+    // 他のCPUも止めて、同じようにレジスタを実行中のタスクの状態にしてもらう（IntHandlerStopCPU）
+    bool interrupts_enabled = smp::StopOtherCPUs();
+    // 遅延切り替え中なら、他のタスクの状態をレジスタから保存領域へ追い出し、実行中のタスクの状態を載せる
+    if (fpu_lazy) {
+        ClaimFPU();
+    }
+    smp::PerCPU *cpu = smp::CurrentCPU();
+    cpu->fpu_owner_area = cpu->fpu_current_area;
+
+    switch (mode) {
+        case FPUMode::kFxsave:
+            fpu_save_kind = 0;
+            break;
+        case FPUMode::kXsave:
+            fpu_save_kind = 1;
+            break;
+        case FPUMode::kXsaveopt:
+            fpu_save_kind = 2;
+            break;
+        case FPUMode::kLazy:
+            fpu_save_kind = xsaveopt_supported ? 2 : xsave_supported ? 1 : 0;
+            break;
+    }
+    fpu_lazy = mode == FPUMode::kLazy;
+    current_mode = mode;
+
+    // 眠っているタスクの保存領域を、どの命令で復帰しても同じ状態になる形に揃える
+    if (task_manager) {
+        task_manager->ForEachTask([](Task *task) {
+            NormalizeFPUArea(task->FPUArea());
+        });
+    }
+    smp::ResumeOtherCPUs(interrupts_enabled);
+    return true;
+}
+
+FPUMode GetFPUMode()
+{
+    return current_mode;
+}
+
+const char *FPUModeName(FPUMode mode)
+{
+    switch (mode) {
+        case FPUMode::kFxsave:
+            return "fxsave";
+        case FPUMode::kXsave:
+            return "xsave";
+        case FPUMode::kXsaveopt:
+            return "xsaveopt";
+        case FPUMode::kLazy:
+            return "lazy";
+    }
+    return "";
+}
+
+uint64_t FPUTrapCount()
+{
+    return fpu_nm_count;
+}
+
+void SwitchFPUState(uint8_t *prev_area, uint8_t *next_area, const uint8_t *interrupted_image)
+{
+    // 遅延切り替えでは、割り込まれたタスクがFPUを使っていた時だけ保存する。
+    // 割り込みハンドラがSSEのレジスタを壊しているので、#NMで後から保存することはできない。
+    // 複数のCPUが動いている時は、prevが次に別のCPUで動くかもしれないので、使っていれば必ず保存する（復帰は遅延のまま）。
+    smp::PerCPU *cpu = smp::CurrentCPU();
+    uint8_t *&fpu_owner_area = cpu->fpu_owner_area;
+    bool save = !fpu_lazy || 
+        (fpu_owner_area == prev_area && (interrupted_image || smp::NumCPUs() > 1));
+    if (save) {
+        SaveFPU(prev_area);
+        if (interrupted_image) {
+            NormalizeFPUArea(prev_area);
+            memcpy(prev_area, interrupted_image, kLegacyAreaSize);
+        }
+        if (fpu_lazy) {
+            fpu_owner_area = nullptr; // レジスタの内容はもう誰のものでもない
+        }
+    }
+    cpu->fpu_current_area = next_area;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/* 
+ * FPU・SIMDレジスタ（x87、SSE、AVX）の状態をタスクごとに保存・復帰する仕組み
+ * 
+ * kFxsave:   切り替えのたびにFXSAVE/FXRSTORで保存・復帰する。x87とSSEのみでAVXの上位は保存されない。
+ * kXsave:    XSAVE/XRSTORで、XCR0で有効にした全ての状態（AVXを含む）を保存・復帰する。
+ * kXsaveopt: XSAVEOPTで、前回の復帰から変更されていない部分や初期状態の部分の書き込みを省く。
+ * kLazy:     切り替え時には保存も復帰もせずCR0.TSを立てておき、タスクが最初にFPUを使った時（#NM）に入れ替える。
+ *            FPUを使わないタスクの間で切り替える時は何もしない。保存にはXSAVEOPT（使えなければFXSAVE）を使う。
+ *            TSが立っている時に割り込まれたら、割り込みの入口で持ち主の状態を保存領域へ追い出してTSを下ろし、
+ *            出口で立て直す（割り込みでは#NMを起こさず、割り込まれたタスクの状態も読み込まない）。
+ *            FPUTrapCount()はタスクがFPUを使ったことによる#NMだけを数える。
+ * 
+ * 保存領域の大きさはCPUID（EAX=0Dh）で調べ、タスクごとに確保する。
+ * 復帰はSwitchContext/RestoreContextが最後に行う（カーネルのコードもSSEを使うので、それより前には行えない）。
+ * 
+ * FPUレジスタはCPUごとにあるので、実行中のタスクとレジスタの持ち主はsmp::PerCPUに記録する。
+ */
+enum class FPUMode {
+    kFxsave,
+    kXsave,
+    kXsaveopt,
+    kLazy,
+};
+
+// CPUIDで機能を調べ、XSAVEが使えればCR4.OSXSAVEとXCR0を設定して、使える中で最も速いモードにする。
+// InitializeTask()より前に呼ぶこと。
+void InitializeFPU();
+// AP上で呼び、BSPと同じようにCR4.OSXSAVEとXCR0を設定する
+void InitializeFPUOnAP();
+
+size_t FPUAreaSize(); // １タスク分の保存領域の大きさ（領域は６４バイト境界に置くこと）
+void InitFPUArea(uint8_t *area); // 保存領域にFPUの初期状態を書き込む
+void SetInitialFPUArea(uint8_t *area); // 最初のタスク（今FPUを使っているもの）の保存領域を登録する
+// 終了するタスクの保存領域を、このCPUのレジスタの持ち主から外す（レジスタの内容は捨てる）。割り込みを禁止して呼ぶこと。
+void DropFPUArea(uint8_t *area);
+
+bool FPUModeSupported(FPUMode mode);
+bool SetFPUMode(FPUMode mode); // サポートされていなければfalseを返す。タスクから呼ぶこと。全てのCPUに適用する。
+FPUMode GetFPUMode();
+const char *FPUModeName(FPUMode mode);
+uint64_t FPUTrapCount(); // kLazyで#NMによって入れ替えた回数
+
+// prev_areaのタスクからnext_areaのタスクへ切り替える前に呼ぶ。必要ならprevの状態を保存する。
+// 割り込みハンドラの中で切り替える時は、割り込まれた時点のFXSAVEイメージ（TaskContext::fxsave_area）を
+// interrupted_imageに渡す。ハンドラがSSEのレジスタを使っているので、その部分はイメージの方が正しい。
+void SwitchFPUState(uint8_t *prev_area, uint8_t *next_area, const uint8_t *interrupted_image);
@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include "futex.hpp"
+#include "paging.hpp"
+#include "run_application.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+namespace futex
+{
+    namespace {
+        const int kBucketBits = 6;
+
+        // 物理アドレスごとの待ち行列。待っているタスクがいる間だけ作っておく。
+        struct Key {
+            uint64_t phys;
+            int users; // Wait()の中にいるタスクの数
+            WaitQueue queue;
+        };
+
+        struct Bucket {
+            SpinLock lock; // keysと各Keyのusersを守る
+            std::vector<Key *> keys;
+        };
+
+        std::array<Bucket, 1 << kBucketBits> buckets;
+
+        Bucket &BucketOf(uint64_t phys)
+        {
+            return buckets[((phys >> 2) * 0x9e37'79b9'7f4a'7c15ull) >> (64 - kBucketBits)];
+        }
+
+        Key *Find(Bucket &bucket, uint64_t phys)
+        {
+            for (Key *key : bucket.keys) {
+                if (key->phys == phys) {
+                    return key;
+                }
+            }
+            return nullptr;
+        }
+
+        bool IsValidAddress(uint64_t addr)
+        {
+            return IsUserRange(addr, sizeof(uint32_t), sizeof(uint32_t));
+        }
+    }
+
+    int64_t Wait(uint64_t addr, uint32_t expected, uint64_t timeout_ns)
+    {
+        if (!IsValidAddress(addr)) {
+            return kErrorInvalid;
+        }
+        volatile uint32_t *value = reinterpret_cast<volatile uint32_t *>(addr);
+        // ここで一度読んでおけば、まだマップされていないページもページフォルトでマップされる
+        // （ロックの中で読む時にはページフォルトが起きない）
+        if (*value != expected) {
+            return kErrorAgain;
+        }
+        uint64_t phys = Translate4LevelPaging(addr);
+        if (phys == 0) {
+            return kErrorInvalid;
+        }
+
+        Bucket &bucket = BucketOf(phys);
+        Key *key;
+        {
+            IRQSaveLockGuard<SpinLock> guard{bucket.lock};
+            key = Find(bucket, phys);
+            if (key == nullptr) {
+                key = new Key{phys, 0, {}};
+                bucket.keys.push_back(key);
+            }
+            key->users++;
+        }
+
+        int res = key->queue.WaitIf([value, expected]() { return *value == expected; }, timeout_ns);
+
+        {
+            IRQSaveLockGuard<SpinLock> guard{bucket.lock};
+            if (--key->users == 0) {
+                bucket.keys.erase(std::find(bucket.keys.begin(), bucket.keys.end(), key));
+                delete key;
+            }
+        }
+        if (res == 0) {
+            return kErrorAgain;
+        }
+        return res > 0 ? 0 : kErrorTimedOut;
+    }
+
+    int64_t Wake(uint64_t addr, uint32_t n)
+    {
+        if (!IsValidAddress(addr)) {
+            return kErrorInvalid;
+        }
+        uint64_t phys = Translate4LevelPaging(addr);
+        if (phys == 0) { // マップされていないページで待っているタスクはいない
+            return 0;
+        }
+
+        Bucket &bucket = BucketOf(phys);
+        // Keyを消されないよう、起こし終わるまでバケットのロックを持っておく
+        IRQSaveLockGuard<SpinLock> guard{bucket.lock};
+        Key *key = Find(bucket, phys);
+        if (key == nullptr) {
+            return 0;
+        }
+        int64_t num_woken = 0;
+        while (num_woken < n && key->queue.WakeOne()) {
+            num_woken++;
+        }
+        return num_woken;
+    }
+}
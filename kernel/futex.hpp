@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * アプリの同期のためのfutex（fast userspace mutex）
+ *
+ * ロックなどの状態はアプリのメモリの32bitの値に置き、取り合いにならない時はアプリの中だけで済ませる。
+ * 取り合いになった時だけWait()で眠り、値を変えた側がWake()で起こす。
+ *
+ * 待ち合わせは値の物理アドレスをキーにしたハッシュ表のWaitQueueで行うので、
+ * 同じ物理ページを共有していれば、違うアドレス空間からでも待ち合わせられる。
+ * Wait()は値がexpectedと等しいことをキューのロックの中で確かめてからキューに入るので、
+ * 値を変えてからWake()する側との間で起こされるのを取りこぼさない。
+ *
+ * application/sys/syscall.hppに同じ返り値の定義があるので、変える時は両方を変えること。
+ */
+namespace futex
+{
+    const int64_t kErrorInvalid = -1; // アドレスがアプリの領域でないか、４バイト境界に揃っていない
+    const int64_t kErrorAgain = -2; // 値がexpectedと違ったので眠らなかった
+    const int64_t kErrorTimedOut = -3; // timeout_nsナノ秒経っても起こされなかった
+
+    // *addrがexpectedと等しければ、Wake()で起こされるかtimeout_nsナノ秒経つまで眠る（０なら無期限）。
+    // 起こされたら０を返す。
+    int64_t Wait(uint64_t addr, uint32_t expected, uint64_t timeout_ns);
+    // addrで眠っているタスクを最大n個起こし、起こした数を返す。
+    int64_t Wake(uint64_t addr, uint32_t n);
+}
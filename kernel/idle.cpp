@@ -0,0 +1,190 @@
+#include <array>
+
+#include "idle.hpp"
+#include "asmfunc.h"
+#include "logging.hpp"
+#include "smp.hpp"
+#include "timer.hpp"
+
+extern TimerManager *timer_manager;
+extern logging::Logger *logger;
+
+namespace idle
+{
+    namespace {
+        // Cステートごとの目安の滞在時間。実際の値はモデルごとに違うので、intel_idleの表よりやや保守的にしておく。
+        const CState kMwaitStates[] = {
+            {"C1", 0x00, 2000},
+            {"C2", 0x10, 20000},
+            {"C3", 0x20, 100000},
+            {"C4", 0x30, 200000},
+            {"C5", 0x40, 400000},
+            {"C6", 0x50, 600000},
+            {"C7", 0x60, 800000},
+        };
+        const CState kHltState{"HLT", 0, 0};
+
+        // CPUごとの状態。他のCPUがKick()で読むwaitingと統計を、CPUごとに別のキャッシュラインに置く。
+        struct alignas(64) CPUState {
+            volatile bool waiting; // MONITORを仕掛けてからMWAITを抜けるまでtrue
+            uint64_t wait_start_tsc; // 休み始めた時のTSC（休んでいない間は０）
+            uint64_t wake_tsc; // 休んでいる間に割り込みが来た時のTSC
+            Stats stats;
+        };
+
+        std::array<CPUState, smp::kMaxCPUs> cpus{};
+        std::array<CState, kMaxStates> mwait_states{};
+        int num_mwait_states = 0;
+        bool mwait_supported = false;
+        bool interrupt_break = false; // 割り込みを禁止したままMWAITから割り込みで戻れる（CPUID.05H:ECX[1]）
+        volatile Mode mode = Mode::kHlt;
+
+        void Monitor(const volatile void *addr)
+        {
+            __asm__ volatile("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+        }
+
+        void Mwait(uint32_t hint, uint32_t extensions)
+        {
+            __asm__ volatile("mwait" : : "a"(hint), "c"(extensions) : "memory");
+        }
+
+        // 予想されるアイドル時間に対して、目安の滞在時間が収まる中で一番深いCステートを選ぶ
+        int SelectState(uint64_t expected_ns)
+        {
+            int state = 0;
+            for (int i = 1; i < num_mwait_states; i++) {
+                if (mwait_states[i].target_residency_ns <= expected_ns) {
+                    state = i;
+                }
+            }
+            return state;
+        }
+    }
+
+    void Initialize()
+    {
+        uint32_t regs[4]; // eax, ebx, ecx, edx
+        CPUID(0, 0, regs);
+        uint32_t max_leaf = regs[0];
+        CPUID(1, 0, regs);
+        if ((regs[2] & (1u << 3)) && max_leaf >= 5) { // MONITOR/MWAIT
+            CPUID(5, 0, regs);
+            interrupt_break = (regs[2] & 1) && (regs[2] & 2);
+            // EDXには、C0〜C7のそれぞれでMWAITに使えるサブステートの数が４bitずつ並んでいる。
+            // C1はサブステートが報告されていなくてもヒント０で使える。
+            for (int c = 1; c <= 7; c++) {
+                uint32_t substates = (regs[3] >> (c * 4)) & 0xf;
+                if (c == 1 || substates > 0) {
+                    mwait_states[num_mwait_states++] = kMwaitStates[c - 1];
+                }
+            }
+            mwait_supported = true;
+            mode = Mode::kMwait;
+        }
+        ResetStats();
+        logger->info("[+] Idle: %s, %d C-states, interrupt break %d\n",
+            mwait_supported ? "mwait" : "hlt", NumStates(), interrupt_break);
+    }
+
+    Mode CurrentMode()
+    {
+        return mode;
+    }
+
+    bool SetMode(Mode new_mode)
+    {
+        if (new_mode == Mode::kMwait && !mwait_supported) {
+            return false;
+        }
+        mode = new_mode;
+        ResetStats(); // Cステートの並びが変わるので数え直す
+        return true;
+    }
+
+    int NumStates()
+    {
+        return mode == Mode::kMwait ? num_mwait_states : 1;
+    }
+
+    const CState &State(int index)
+    {
+        return mode == Mode::kMwait ? mwait_states[index] : kHltState;
+    }
+
+    void Wait(volatile bool *work_pending)
+    {
+        CPUState &cpu = cpus[smp::CPUIndex()]; // アイドルタスクは他のCPUに移らない
+        Mode current_mode = mode;
+        uint64_t expected_ns = timer_manager->NanosecondsUntilNextTick();
+        int state = current_mode == Mode::kMwait ? SelectState(expected_ns) : 0;
+
+        // フラグを確かめてから休むまでの間に割り込みで起こされたのを見逃さないよう、割り込みを禁止しておく
+        __asm__ volatile("cli" : : : "memory");
+        uint64_t start = ReadTSC();
+        cpu.wake_tsc = 0;
+        cpu.wait_start_tsc = start;
+        bool waited = false;
+        if (current_mode == Mode::kMwait) {
+            cpu.waiting = true;
+            // Kick()はフラグを書いてからwaitingを読むので、こちらはwaitingを書いてからフラグを読む
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            Monitor(work_pending);
+            if (!*work_pending) { // MONITORの後に書かれていれば、MWAITはすぐに戻る
+                if (interrupt_break) { // 割り込みは禁止したまま戻るので、戻った時刻を割り込みの処理より先に取れる
+                    Mwait(mwait_states[state].hint, 1);
+                } else { // stiの直後の１命令の間は割り込みが入らないので、MWAITに入る前に割り込みを処理してしまうことはない
+                    __asm__ volatile("sti\n\tmwait" : : "a"(mwait_states[state].hint), "c"(0) : "memory");
+                }
+                waited = true;
+            }
+            cpu.waiting = false;
+        } else if (!*work_pending) {
+            __asm__ volatile("sti\n\thlt" : : : "memory");
+            waited = true;
+        }
+        // hltやsti; mwaitから割り込みで戻った時は、戻ったところで割り込みを処理し、そのまま他のタスクに
+        // 切り替えていたかもしれない。割り込みの入口で記録した時刻までを休んでいた時間とする。
+        uint64_t end = cpu.wake_tsc ? cpu.wake_tsc : ReadTSC();
+        cpu.wait_start_tsc = 0;
+        __asm__ volatile("sti" : : : "memory");
+
+        if (waited) {
+            cpu.stats.entries[state]++;
+            cpu.stats.residency_tsc[state] += end - start;
+        }
+    }
+
+    bool Kick(int index)
+    {
+        CPUState &cpu = cpus[index];
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!cpu.waiting) {
+            return false;
+        }
+        __atomic_fetch_add(&cpu.stats.kicks, 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    void OnInterrupt(int index)
+    {
+        CPUState &cpu = cpus[index];
+        if (cpu.wait_start_tsc != 0 && cpu.wake_tsc == 0) {
+            cpu.wake_tsc = ReadTSC();
+        }
+    }
+
+    Stats GetStats(int index)
+    {
+        return cpus[index].stats;
+    }
+
+    void ResetStats()
+    {
+        uint64_t now = ReadTSC();
+        for (CPUState &cpu : cpus) {
+            cpu.stats = Stats{};
+            cpu.stats.since_tsc = now;
+        }
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * アイドル時のCPUの休ませ方（アイドルドライバ）
+ *
+ * MONITOR/MWAITが使えれば、実行可能キューの「切り替えが必要」フラグ（RunQueue::need_resched）の
+ * キャッシュラインをMONITORで見張ってからMWAITで休む。他のCPUがタスクを起こしてフラグを書くと、
+ * 割り込み（IPI）を待たずにその書き込みでMWAITから戻り、すぐに切り替えられる。
+ * その間、起こす側はIPIを送らずに済む（Kick()）。
+ *
+ * MWAITに渡すCステートのヒントは、次のタイマー割り込みまでの時間（予想されるアイドル時間）で選ぶ。
+ * 深いCステートほど戻るのに時間がかかるので、目安の滞在時間（target_residency）より
+ * 予想が短ければ浅いCステートにする。
+ * MWAITが使えなければ、これまで通りhltで休む。
+ *
+ * CPUごとに、Cステートごとの回数と滞在時間（アイドル滞在率）を記録し、idleコマンドで表示する。
+ */
+namespace idle
+{
+    enum class Mode {
+        kHlt,
+        kMwait,
+    };
+
+    const int kMaxStates = 8; // C1〜C7とhlt
+
+    struct CState {
+        const char *name;
+        uint32_t hint; // MWAITのEAX（bit7:4がCステート−１、bit3:0がサブステート）
+        uint64_t target_residency_ns; // これより短いアイドルには使わない
+    };
+
+    struct Stats {
+        uint64_t since_tsc; // 記録を始めた時のTSC
+        uint64_t entries[kMaxStates]; // Cステートごとに休んだ回数
+        uint64_t residency_tsc[kMaxStates]; // Cステートごとに休んでいた時間の合計
+        uint64_t kicks; // MWAIT中に実行可能キューへの書き込みで起こされた回数（送らずに済んだIPIの数）
+    };
+
+    // CPUIDでMONITOR/MWAITとCステートを調べる。BSPでタスクの初期化より前に呼ぶ。
+    void Initialize();
+
+    Mode CurrentMode();
+    // MWAITが使えない時にkMwaitを指定するとfalseを返す
+    bool SetMode(Mode mode);
+    // 現在のモードで使うCステート。hltの時は"HLT"の１つだけ。
+    int NumStates();
+    const CState &State(int index);
+
+    // アイドルタスクから割り込みを許可した状態で呼ぶ。*work_pendingが立つか割り込みが来るまでCPUを休ませる。
+    // 戻った時には割り込みは許可されていて、割り込みの出口ですでにタスクを切り替えて戻ってきたかもしれない。
+    void Wait(volatile bool *work_pending);
+    // cpuの*work_pendingを立てた後に呼ぶ。そのCPUがMWAITで見張っていて、書き込みで起きるならtrueを返す
+    // （falseならIPIを送って起こすこと）。
+    bool Kick(int cpu);
+    // アイドルタスクの実行中に割り込みハンドラの入口で呼ぶ。休んでいた時間の終わりを記録する。
+    void OnInterrupt(int cpu);
+
+    Stats GetStats(int cpu);
+    void ResetStats();
+}
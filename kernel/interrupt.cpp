@@ -6,6 +6,8 @@
 #include "message.hpp"
 #include "memory_manager.hpp"
 #include "usb/xhci/xhci.hpp"
+#include "irq.hpp"
+#include "smp.hpp"
 
 extern logging::Logger *logger;
 extern TimerManager *timer_manager;
@@ -138,6 +140,9 @@ void NotifyEndOfInterrupt() {
 __attribute__((interrupt)) 
 void PageFaultHandler(InterruptFrame *frame, uint64_t error_code_)
 {
+    if (frame->cs & 3) { // アプリから入ってきた時はGSベースを書き戻す（smp.hpp）
+        smp::RestoreGSBase();
+    }
     // CR2にフォルトしたリニアアドレスが渡される
     PageFaultErrorCode error_code;
     error_code.data = error_code_;
@@ -161,19 +166,29 @@ void PageFaultHandler(InterruptFrame *frame, uint64_t error_code_)
 }
 
 
-// XHCIの割り込みハンドラ
-__attribute__((interrupt)) 
-void IntHandlerXHCI(InterruptFrame *frame) 
+// XHCIの割り込みハンドラ（IntHandlerXHCIから呼ばれる）
+// イベントの処理はirq::Register()で登録したサービスタスクが行う。
+extern "C" void XHCIOnInterrupt(const TaskContext *ctx_stack)
 {
-    // printk("[!-- INTERRUPT --!] xHCI\n");
-    task_manager->SendMessage(1, Message{Message::Type::kInterruptXHCI});
+    irq::Dispatch(InterruptVector::kXHCI, ctx_stack);
+}
+
+// 他のCPUがこのCPUの実行可能キューにタスクを入れ、切り替えを求めてきた時の割り込みハンドラ（IntHandlerRescheduleから呼ばれる）
+// 送る側が切り替えの必要を記録しているので、出口で切り替えるだけ。
+extern "C" void RescheduleOnInterrupt(const TaskContext *ctx_stack)
+{
+    task_manager->EnterInterrupt(InterruptVector::kReschedule);
     NotifyEndOfInterrupt();
+    task_manager->ExitInterrupt(ctx_stack);
 }
 
 // レガシー割り込みハンドラ
 __attribute__((interrupt)) 
 void IntHandlerLegacyInterrupt(InterruptFrame *frame) 
 {
+    if (frame->cs & 3) {
+        smp::RestoreGSBase();
+    }
     printk("[!-- INTERRUPT --!] REGACY INTERRUPT!\n");
     NotifyEndOfInterrupt();
 }
@@ -182,6 +197,7 @@ void IntHandlerLegacyInterrupt(InterruptFrame *frame)
 #define FaultHandlerWithError(fault_name) \
     __attribute__((interrupt)) \
     void IntHandler ## fault_name (InterruptFrame* frame, uint64_t error_code) { \
+        if (frame->cs & 3) smp::RestoreGSBase(); \
         printk("[!-- EXCEPTION --!] #"); printk(#fault_name); printk("\n"); \
         printk("ERROR CODE: "); PrintNumber(error_code); printk("\n"); \
         printk("RIP: "); PrintNumber(frame->rip); printk("\n"); \
@@ -193,6 +209,7 @@ void IntHandlerLegacyInterrupt(InterruptFrame *frame)
 #define FaultHandlerNoError(fault_name) \
     __attribute__((interrupt)) \
     void IntHandler ## fault_name (InterruptFrame* frame) { \
+        if (frame->cs & 3) smp::RestoreGSBase(); \
         printk("[!-- EXCEPTION --!] #"); printk(#fault_name); printk("\n"); \
         printk("RIP: "); PrintNumber(frame->rip); printk("\n"); \
         printk("RSP: "); PrintNumber(frame->rsp); printk("\n"); \
@@ -205,7 +222,7 @@ FaultHandlerNoError(BP)
 FaultHandlerNoError(OF)
 FaultHandlerNoError(BR)
 FaultHandlerNoError(UD)
-FaultHandlerNoError(NM)
+// #NMはFPUの遅延切り替えに使うので、asmfunc.asmのIntHandlerNMで処理する
 FaultHandlerWithError(DF)
 FaultHandlerWithError(TS)
 FaultHandlerWithError(NP)
@@ -240,6 +257,12 @@ void SetupInterruptDescriptorTable()
     logger->info("Setting IDT[%02xh] kLegacyInterruptFromIOAPIC\n", InterruptVector::kLegacyInterruptFromIOAPIC);
     SetIDTEntry(InterruptVector::kLegacyInterruptFromIOAPIC, reinterpret_cast<uintptr_t>(IntHandlerLegacyInterrupt), cs, 14);
 
+    logger->info("Setting IDT[%02xh] kReschedule\n", InterruptVector::kReschedule);
+    SetIDTEntry(InterruptVector::kReschedule, reinterpret_cast<uintptr_t>(IntHandlerReschedule), cs, 14, kISTForTimer);
+
+    logger->info("Setting IDT[%02xh] kStopCPU\n", InterruptVector::kStopCPU);
+    SetIDTEntry(InterruptVector::kStopCPU, reinterpret_cast<uintptr_t>(IntHandlerStopCPU), cs, 14);
+
     auto set_idt_entry = [](int vector_number, auto handler) {
         idt[vector_number].SetOffset(reinterpret_cast<uintptr_t>(handler));
         idt[vector_number].segment_selector = kKernelCS;
@@ -268,7 +291,12 @@ void SetupInterruptDescriptorTable()
     set_idt_entry(20, IntHandlerVE);
 
     // idtrレジスタを新しいテーブルのアドレスに書き換える。
-    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+    LoadInterruptDescriptorTable();
     // RFLAGSの割り込み許可フラグをセットし割り込みを受け付ける。
     __asm__("sti");
 }
+
+void LoadInterruptDescriptorTable()
+{
+    LoadIDT(sizeof(idt) - 1, reinterpret_cast<uintptr_t>(&idt[0]));
+}
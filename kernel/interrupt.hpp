@@ -20,6 +20,8 @@ enum InterruptVector
     kXHCI = 0x40, 
     kLAPICTimer = 0x41,
     kLegacyInterruptFromIOAPIC = 0x42,
+    kReschedule = 0x43, // CPU間割り込み：起こしたタスクを実行させるため、タスクの切り替えを求める
+    kStopCPU = 0x44, // CPU間割り込み：smp::StopOtherCPUs()
 };
 
 // 各割り込みが用いるISTの値を定義
@@ -92,3 +94,6 @@ void NotifyEndOfInterrupt();
 
 // idtへの設定をここで行う。
 void SetupInterruptDescriptorTable();
+
+// 設定済みのidtをこのCPUのIDTRにロードする（APの起動時に使う）
+void LoadInterruptDescriptorTable();
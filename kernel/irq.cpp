@@ -0,0 +1,105 @@
+#include <array>
+#include <algorithm>
+
+#include "irq.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logging.hpp"
+
+extern TaskManager* task_manager;
+extern logging::Logger *logger;
+
+namespace irq
+{
+    namespace {
+        struct Line {
+            TopHalf *top;
+            ThreadFunc *thread;
+            void *arg;
+            Task *task; // サービスタスク
+            bool pending; // 上半分が終わり、下半分の処理を待っている間true
+            Stats stats;
+        };
+
+        std::array<Line *, 256> lines{};
+
+        // サービスタスク。上半分に起こされたら下半分を実行し、また眠る。
+        void ServiceTask(uint64_t id, int64_t data)
+        {
+            Line *line = reinterpret_cast<Line *>(data);
+            while (1) {
+                // 下ろしてから処理するので、処理中に来た割り込みの分はもう一度回って拾う
+                if (!__atomic_exchange_n(&line->pending, false, __ATOMIC_ACQ_REL)) {
+                    line->task->Sleep(); // 眠る前に起こされていればすぐに戻る
+                    continue;
+                }
+                uint64_t start = ReadTSC();
+                line->thread(line->arg);
+                uint64_t elapsed = ReadTSC() - start;
+
+                line->stats.thread_runs++;
+                line->stats.thread_tsc += elapsed;
+                line->stats.thread_max_tsc = std::max(line->stats.thread_max_tsc, elapsed);
+            }
+        }
+    }
+
+    void Register(uint8_t vector, const char *name, TopHalf *top, ThreadFunc *thread, void *arg, int cpu)
+    {
+        Line *line = new Line{top, thread, arg, nullptr, false, Stats{}};
+        line->stats.name = name;
+        line->task = task_manager->NewTask()
+            ->InitContext(ServiceTask, reinterpret_cast<int64_t>(line))
+            ->SetLevel(kThreadLevel)
+            ->SetAffinity(cpu);
+        line->stats.task_id = line->task->ID();
+        lines[vector] = line;
+        line->task->Wakeup(); // 最初はpendingが立っていないのですぐに眠る
+        logger->info("[irq] vector 0x%02x (%s): service task %lu\n", vector, name, line->task->ID());
+    }
+
+    void Dispatch(uint8_t vector, const TaskContext *ctx)
+    {
+        task_manager->EnterInterrupt(vector);
+        Line *line = lines[vector];
+        if (line) {
+            uint64_t start = ReadTSC();
+            bool handled = line->top(line->arg);
+            uint64_t elapsed = ReadTSC() - start;
+
+            line->stats.count++;
+            line->stats.top_tsc += elapsed;
+            line->stats.top_max_tsc = std::max(line->stats.top_max_tsc, elapsed);
+            if (handled) {
+                __atomic_store_n(&line->pending, true, __ATOMIC_RELEASE);
+                line->task->Wakeup(); // 割り込みハンドラの中なので、切り替えは出口で行う
+            }
+        }
+        NotifyEndOfInterrupt();
+        task_manager->ExitInterrupt(ctx);
+    }
+
+    bool GetStats(uint8_t vector, Stats &stats)
+    {
+        Line *line = lines[vector];
+        if (!line) {
+            return false;
+        }
+        InterruptGuard guard; // 上半分の統計が途中で書き換わらないように（同じCPUの割り込みに対して）
+        stats = line->stats;
+        return true;
+    }
+
+    void ResetStats()
+    {
+        InterruptGuard guard;
+        for (Line *line : lines) {
+            if (line) {
+                Stats stats{};
+                stats.name = line->stats.name;
+                stats.task_id = line->stats.task_id;
+                line->stats = stats;
+            }
+        }
+    }
+}
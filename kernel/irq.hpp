@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+
+#include "task.hpp"
+
+/*
+ * スレッド化した割り込みハンドラ
+ *
+ * デバイスの割り込みは２つに分けて処理する。
+ *   上半分（TopHalf）：割り込みハンドラの中で呼ぶ。割り込みの受付をデバイスに伝える（割り込み要因のクリア）だけにする。
+ *   下半分（ThreadFunc）：ベクタごとに作る専用のカーネルタスク（サービスタスク）で呼ぶ。溜まったイベントをまとめて処理する。
+ * 上半分が終わるとサービスタスクを起こすだけなので、あるデバイスの処理が遅くても、
+ * 他のデバイスの割り込みやメインタスクのメッセージ処理は待たされない。
+ * サービスタスクは優先度レベルkThreadLevelで実行される。
+ *
+ * 割り込みの回数と上半分・下半分の処理時間はベクタごとに記録し、irqコマンドで表示する。
+ */
+namespace irq
+{
+    // 上半分。自分のデバイスの割り込みでなければfalseを返す（サービスタスクは起こさない）。
+    using TopHalf = bool (void *arg);
+    // 下半分。溜まっているイベントを全て処理する。
+    using ThreadFunc = void (void *arg);
+
+    const int kThreadLevel = TaskManager::kMaxLevel;
+
+    struct Stats {
+        const char *name;
+        uint64_t count; // 割り込みの回数
+        uint64_t top_tsc; // 上半分の処理時間の合計（TSCのカウント数）
+        uint64_t top_max_tsc;
+        uint64_t thread_runs; // サービスタスクが起きて処理した回数（割り込みがまとまると割り込みの回数より少なくなる）
+        uint64_t thread_tsc; // 下半分の処理時間の合計
+        uint64_t thread_max_tsc;
+        uint64_t task_id; // サービスタスクのid
+    };
+
+    // vectorの割り込みを登録し、サービスタスクを作る。cpu >= 0ならサービスタスクをそのCPUに固定する。
+    // IDTのエントリはSetupInterruptDescriptorTable()で設定しておき、そのハンドラからDispatch()を呼ぶこと。
+    // デバイスの割り込みを有効にする前に呼ぶ。
+    void Register(uint8_t vector, const char *name, TopHalf *top, ThreadFunc *thread, void *arg, int cpu = -1);
+    // 割り込みハンドラから呼ぶ。上半分を実行してサービスタスクを起こし、EOIを送る。
+    // 出口でサービスタスク（や他の起こされたタスク）に切り替えることがある。
+    void Dispatch(uint8_t vector, const TaskContext *ctx);
+
+    // vectorが登録されていればstatsに統計を写してtrueを返す
+    bool GetStats(uint8_t vector, Stats &stats);
+    void ResetStats();
+}
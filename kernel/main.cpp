@@ -17,6 +17,8 @@
 #include "timer.hpp"
 #include "message.hpp" 
 #include "task.hpp"
+#include "fpu.hpp"
+#include "idle.hpp"
 #include "run_application.hpp"
 #include "syscall.hpp"
 #include "pci.hpp"
@@ -27,12 +29,16 @@
 #include "acpi.hpp"
 #include "screen.hpp"
 #include "terminal.hpp"
+#include "serial.hpp"
+#include "smp.hpp"
+#include "coro.hpp"
 
 void Halt(void);
 int printk(const char *format, ...);
 
 extern PixelWriter *pixel_writer;
 extern Console *console;
+extern Terminal *terminal;
 extern BitmapMemoryManager* memory_manager;
 TaskManager* task_manager;
 TimerManager *timer_manager; // LAPICタイマーの管理をするもの。
@@ -61,11 +67,13 @@ extern "C" void KernelMainNewStack(
     logger->set_level(logging::kERROR); // ログレベルの変更・設定
 
     console->Deactivate(); // コンソール出力を抑制する
+    serial::Initialize(); // トレースの書き出しなどに使う
 
     SetupSegments(); // UEFIの設定を更新し直す
     SetupIdentityPageTable(); // ページングの設定
     InitializeMemoryManager(memory_map); // メモリ管理の開始
     InitializeTSS(); // TSSをGDTに設定
+    smp::InitializeBSP(); // CPUごとのデータをGSベースに設定
 
     SetupInterruptDescriptorTable(); // 割り込み・例外ハンドラの設定
 
@@ -77,9 +85,12 @@ extern "C" void KernelMainNewStack(
 
     ioapic::Initialize();
 
+    InitializeFPU(); // FPU・SIMDの状態の保存方法を決める
+    idle::Initialize(); // アイドル時にMWAITとhltのどちらで休むかを決める
     InitializeTask(); // マルチタスクの開始
     Task *main_task = task_manager->CurrentTask();
     InitializeSyscall(); // システムコールを使用可能にする
+    smp::StartAPs(); // 他のCPUを起動し、タスクを並列に実行させる
 
     logger->set_level(logging::kERROR); // 出力減らす
     InitializePCI();
@@ -91,6 +102,7 @@ extern "C" void KernelMainNewStack(
 
     // Halt();
 
+    coro::Initialize(); // ドライバが使うコルーチンのエグゼキュータ
     usb::xhci::Initialize(); // xHCの初期化 
 
     RunTerminal(&frame_buffer_config);
@@ -104,24 +116,26 @@ extern "C" void KernelMainNewStack(
         ->Wakeup(); */
 
     while (1) {
-        // main_queueの処理中は割り込みを受け付けないようにする
-        __asm__("cli");
+        // 取り出してから眠るまでの間にメッセージが来ても、起こされたのが残るのでSleep()はすぐに戻る。
+        // そのため割り込みを禁止しておく必要はない。
         Message msg = main_task->ReceiveMessage();
         if (msg.type == Message::Type::kNullMessage) { // メインキューにメッセージが入っていない時
             main_task->Sleep();
-            __asm__("sti");
             continue;
         }
-        __asm__("sti");
 
         // msgの処理
         switch (msg.type) {
             case Message::Type::kTimerTimeout:
+                if (msg.arg.timer.value == Terminal::kTopTimerValue) {
+                    terminal->OnTopTimer();
+                    break;
+                }
                 logger->debug("Type: kTimerTimeout, Arg.timeout: %lx, Arg.value: %d\n", 
                     msg.arg.timer.timeout, msg.arg.timer.value);
                 break;
-            case Message::Type::kInterruptXHCI:
-                usb::xhci::ProcessEvents();
+            case Message::Type::kKeyStroke:
+                terminal->OnKeyStroke(msg.arg.keyboard.keys);
                 break;
             default:
                 break;
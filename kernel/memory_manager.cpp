@@ -21,14 +21,14 @@ void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames)
     /* logger->debug("[Mark 0x%x frames from %p (ID: %lx)]\n", 
        num_frames, start_frame.Frame(), start_frame.ID()); */
 
-    for (size_t i = 0; i < num_frames; i++) {
-        SetBit(FrameID{start_frame.ID() + i}, true);
-    }
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    SetBits(start_frame, num_frames, true);
 }
 
 
 FrameID BitmapMemoryManager::Allocate(size_t num_frames)
 {
+    IRQSaveLockGuard<SpinLock> guard{lock_};
     size_t start_frame_id = range_begin_.ID();
     while (true) {
         size_t i = 0;
@@ -42,7 +42,7 @@ FrameID BitmapMemoryManager::Allocate(size_t num_frames)
         }
         // 連続してnum_frames個の空きフレームが見つかった！
         if (i == num_frames) {
-            MarkAllocated(FrameID{start_frame_id}, num_frames);
+            SetBits(FrameID{start_frame_id}, num_frames, true);
             return FrameID{start_frame_id};
         }
         start_frame_id += i + 1;
@@ -50,11 +50,17 @@ FrameID BitmapMemoryManager::Allocate(size_t num_frames)
 }
 
 int BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames)
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    SetBits(start_frame, num_frames, false);
+    return 0;
+}
+
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated)
 {
     for (size_t i = 0; i < num_frames; i++) {
-        SetBit(FrameID{start_frame.ID() + i}, false);
+        SetBit(FrameID{start_frame.ID() + i}, allocated);
     }
-    return 0;
 }
 
 bool BitmapMemoryManager::GetBit(FrameID frame) const
@@ -112,6 +118,9 @@ void InitializeMemoryManager(MemoryMap& memory_map)
     }
     // logger->info("Memory allocate map is at %p\n", memory_manager->BitMapAddress());
 
+    // 1MiB未満はAPの起動用コード（smp.cpp）を置くのに使うので、確保されないようにしておく
+    memory_manager->MarkAllocated(FrameID{0}, 1_MiB / kBytesPerFrame);
+
     if (InitializeHeap(memory_manager)) { // カーネルで使用するmalloc用のヒープ領域の初期化。
         logger->error("Failed to allocate heap memory...\n");
         Halt();
@@ -149,6 +158,10 @@ int HandlePageFault(PageFaultErrorCode error_code, uint64_t addr)
         if (SetupPageMapForApp(linear_addr, 1)) {
             return 0;
         }
+    } else if (error_code.bits.w_r) { // テンプレートと共有しているページへの書き込みなら
+        if (CopyOnWriteForApp(linear_addr)) {
+            return 0;
+        }
     }
     return -1;
 }
@@ -6,6 +6,7 @@
 
 #include "memory_map.hpp"
 #include "run_application.hpp"
+#include "spinlock.hpp"
 
 namespace
 {
@@ -82,8 +83,11 @@ private:
     FrameID range_begin_;   // 管理するメモリの開始地点
     FrameID range_end_;     // 管理するメモリの終了地点（最終フレームの次のフレーム）
 
+    SpinLock lock_; // 複数のCPUから同時に確保・解放されるので、ビットマップの操作はこれで守る
+
     bool GetBit(FrameID frame) const;           // ビットマップ上のフレームに立っているビット
     void SetBit(FrameID frame, bool allocated); // フレームをallocated状態にする。
+    void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
 
 };
 
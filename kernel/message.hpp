@@ -8,7 +8,7 @@ struct Message
     enum class Type {
         kNullMessage, 
         kTimerTimeout,
-        kInterruptXHCI,
+        kKeyStroke, // USBキーボードの入力（メインタスクがターミナルに渡す）
     } type;
 
     union {
@@ -17,8 +17,8 @@ struct Message
             int value;
         } timer;
         struct {
-            bool success; // 成功した場合
-        } xhc_port_init;
+            uint8_t keys[8]; // HIDキーボードのレポート（先頭が修飾キー、keys[2]〜keys[7]がキーコード）
+        } keyboard;
     } arg;
 };
 
@@ -27,4 +27,52 @@ int getpid(void) {
 int kill(int pid, int sig) {
     errno = EINVAL;
     return -1;
-}
\ No newline at end of file
+}
+
+/*
+ * mallocのロック（newlibのmallocが呼ぶ）
+ * 複数のCPUから同時にmallocを呼んでもヒープが壊れないようにする。
+ * realloc()の中からmalloc()を呼ぶなど同じCPUで入れ子になることがあるので、再帰的に取れるようにしている。
+ * 割り込みハンドラの中でもメモリを確保するので、ロックを持っている間は割り込みを禁止する。
+ * 持ち主の判定にはCPUごとのデータ（smp.hpp）のアドレスを使う。GSベースを設定する前はBSPしか動いていない。
+ */
+struct _reent;
+
+static volatile int malloc_lock;
+static void *malloc_lock_owner;
+static int malloc_lock_depth;
+static int malloc_lock_irq_enabled; // ロックを取る前に割り込みが許可されていたか
+
+static void *CurrentCPUData(void) {
+    void *cpu;
+    __asm__ volatile("mov %%gs:0x00, %0" : "=r"(cpu));
+    return cpu;
+}
+
+void __malloc_lock(struct _reent *reent) {
+    unsigned long rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    void *cpu = CurrentCPUData();
+    if (malloc_lock && malloc_lock_owner == cpu) { // このCPUがすでに持っている（割り込みも禁止済み）
+        malloc_lock_depth++;
+        return;
+    }
+    while (__atomic_exchange_n(&malloc_lock, 1, __ATOMIC_ACQUIRE)) {
+        __builtin_ia32_pause();
+    }
+    malloc_lock_owner = cpu;
+    malloc_lock_depth = 1;
+    malloc_lock_irq_enabled = (rflags & 0x200) != 0;
+}
+
+void __malloc_unlock(struct _reent *reent) {
+    if (--malloc_lock_depth > 0) {
+        return;
+    }
+    int irq_enabled = malloc_lock_irq_enabled;
+    malloc_lock_owner = 0;
+    __atomic_store_n(&malloc_lock, 0, __ATOMIC_RELEASE);
+    if (irq_enabled) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
@@ -47,10 +47,17 @@ void SetupIdentityPageTable()
     logger->debug("before set %p to cr3\n", &pml4_table[0]);
     SetCR3(reinterpret_cast<uint64_t>(&pml4_table[0]));
     logger->debug("after set cr3\n");
+    // カーネルからもアプリの読み取り専用のページ（テンプレートと共有しているページなど）に書き込めないようにする（CR0.WP）
+    SetCR0(GetCR0() | (1 << 16));
 
     // logger->info("[+] Identity paging structure mapped!!\n");
 }
 
+uint64_t KernelCR3()
+{
+    return reinterpret_cast<uint64_t>(&pml4_table[0]);
+}
+
 int SetIDMapEntry(LinearAddress4Level linear_address)
 {
     PageMapEntry *pml4 = reinterpret_cast<PageMapEntry *>(GetCR3());
@@ -123,29 +130,35 @@ uintptr_t Translate4LevelPaging(uintptr_t linear_address)
     // CR3レジスタからPML4の先頭アドレスを取得する。
     uint64_t cr3 = GetCR3();
     PageMapEntry *pml4 = reinterpret_cast<PageMapEntry *>(cr3 & ~static_cast<uint64_t>(0xfff));
+    if (!pml4[linear.bits.pml4].bits.present) {
+        return 0;
+    }
 
     // PML4のエントリがページを指し示すことはないので、
     // すぐにPDPTの先頭アドレスを計算。
     PageMapEntry *pdpt = reinterpret_cast<PageMapEntry *>(pml4[linear.bits.pml4].Pointer());
+    if (!pdpt[linear.bits.pdpt].bits.present) {
+        return 0;
+    }
     if (pdpt[linear.bits.pdpt].isPage()) {  // 1GiBのページの時（Huge Page）
-        logger->debug("1GiB page!\n");
         return reinterpret_cast<uintptr_t>(pdpt[linear.bits.pdpt].Pointer()) + linear.Offset1GiB();
     }
 
     // PDPTエントリから指されるページディレクトリ
     // Page Directory
     PageMapEntry *pd = reinterpret_cast<PageMapEntry *>(pdpt[linear.bits.pdpt].Pointer());
+    if (!pd[linear.bits.directory].bits.present) {
+        return 0;
+    }
     if (pd[linear.bits.directory].isPage()) { // 2MiBのページの時
-        logger->debug("2MiB page!\n");
         return reinterpret_cast<uintptr_t>(pd[linear.bits.directory].Pointer()) + linear.Offset2MiB();
     }
 
     // Page Table
+    // （アプリ用のページテーブルのエントリはpage_sizeを立てているが、４KiBのページなので見ない）
     PageMapEntry *pt = reinterpret_cast<PageMapEntry *>(pd[linear.bits.directory].Pointer());
-    if (pt[linear.bits.table].isPage()) { // 4KiBのページの時
-        logger->debug("4KiB page!\n");
-        return reinterpret_cast<uintptr_t>(pt[linear.bits.table].Pointer()) + linear.Offset4KiB();
+    if (!pt[linear.bits.table].bits.present) {
+        return 0;
     }
-
-    return 0;
+    return reinterpret_cast<uintptr_t>(pt[linear.bits.table].Pointer()) + linear.Offset4KiB();
 }
@@ -36,7 +36,8 @@ union PageMapEntry
         uint64_t dirty : 1;     // OSがこの領域に書き込んだか？
         uint64_t page_size : 1; // アドレスがページを指しているか？（0の時はPDテーブルを指す）
         uint64_t global : 1;    // TODO: 理解してない
-        uint64_t : 2;
+        uint64_t shared : 1;    // OSが自由に使えるビット。他の持ち主（カーネルなど）のページをアプリにマップしている印。
+        uint64_t cow : 1;       // OSが自由に使えるビット。テンプレートのページを読み取り専用で共有していて、書き込まれたら複製する印。
         uint64_t r : 1;         // HLAT pagingのときのみ1をセットする（基本0）
         uint64_t addr : 40;     // 次のテーブルへのアドレスorページへのアドレス
         uint64_t : 11;
@@ -63,6 +64,8 @@ const size_t kPageDirectoryCount = 300; */
 
 // 恒等変換のページングを行う。
 void SetupIdentityPageTable();
+// SetupIdentityPageTable()で作ったカーネルのPML4のアドレス（カーネルのタスクのCR3の値）
+uint64_t KernelCR3();
 
 // 指定したメモリ領域をIDマップのエントリに追加する
 int SetIDMapEntry(LinearAddress4Level linear_address);
@@ -70,5 +73,5 @@ int SetIDMapEntry(LinearAddress4Level linear_address);
 // リニアアドレスから物理アドレスを算出する関数
 // 4level paging方式であることを前提にする。
 // CR3->pml4->pdpt->pd->ptの順で参照する。
-// 内部でページの大きさを出力する（デバッグレベル）。
+// マップされていなければ０を返す。
 uintptr_t Translate4LevelPaging(uintptr_t linear);
@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <cstring>
+
+#include "process.hpp"
+#include "logging.hpp"
+#include "paging.hpp"
+#include "shm.hpp"
+
+extern BitmapMemoryManager* memory_manager;
+extern logging::Logger *logger;
+
+namespace
+{
+    const size_t kEntriesPerTable = 512;
+    const size_t kUserPML4Index = 256; // PML4のこのエントリ以降がアプリの領域（0xffff800000000000〜）
+
+    FrameID FrameOf(const PageMapEntry &entry)
+    {
+        return FrameID{reinterpret_cast<uint64_t>(entry.Pointer()) / kBytesPerFrame};
+    }
+
+    // levelが３ならPDPT、２ならPD、１ならPTとして、tableから辿れるページとページング構造を解放する。
+    // owns_cowがfalseなら、cowのページはテンプレートの物なので解放しない。
+    void FreeTable(PageMapEntry *table, int level, bool owns_cow)
+    {
+        for (size_t i = 0; i < kEntriesPerTable; i++) {
+            PageMapEntry entry = table[i];
+            if (!entry.bits.present) {
+                continue;
+            }
+            if (level > 1) {
+                FreeTable(reinterpret_cast<PageMapEntry *>(entry.Pointer()), level - 1, owns_cow);
+            } else if (entry.bits.shared || (entry.bits.cow && !owns_cow)) { // 持ち主が別にいるページ
+                continue;
+            }
+            memory_manager->Free(FrameOf(entry), 1);
+        }
+    }
+
+    // tableから辿れるページを全て読み取り専用にし、cowの印を付ける（共有しているページはそのまま）
+    void FreezeTable(PageMapEntry *table, int level)
+    {
+        for (size_t i = 0; i < kEntriesPerTable; i++) {
+            PageMapEntry &entry = table[i];
+            if (!entry.bits.present) {
+                continue;
+            }
+            if (level > 1) {
+                FreezeTable(reinterpret_cast<PageMapEntry *>(entry.Pointer()), level - 1);
+            } else if (!entry.bits.shared) {
+                entry.bits.writable = 0;
+                entry.bits.cow = 1;
+            }
+        }
+    }
+
+    // tableから辿れるcowのページをコピーして書き込めるようにする
+    bool UnshareTable(PageMapEntry *table, int level)
+    {
+        for (size_t i = 0; i < kEntriesPerTable; i++) {
+            PageMapEntry &entry = table[i];
+            if (!entry.bits.present) {
+                continue;
+            }
+            if (level > 1) {
+                if (!UnshareTable(reinterpret_cast<PageMapEntry *>(entry.Pointer()), level - 1)) {
+                    return false;
+                }
+            } else if (entry.bits.cow) {
+                FrameID frame = memory_manager->Allocate(1);
+                if (frame.ID() == kNullFrame.ID()) {
+                    return false;
+                }
+                memcpy(frame.Frame(), entry.Pointer(), kBytesPerFrame);
+                entry.SetPointer(frame.Frame());
+                entry.bits.cow = 0;
+                entry.bits.writable = 1;
+            }
+        }
+        return true;
+    }
+
+    // テンプレートのページング構造srcをコピーしてdstに繋ぐ。ページそのものはコピーしない。
+    // 途中で失敗しても、そこまでにコピーした分はdstに繋がっているので、呼び出し元のFreeUserHalf()で解放できる。
+    bool CopyTable(const PageMapEntry &src, PageMapEntry &dst, int level)
+    {
+        if (level == 0) { // ページ（テンプレートで読み取り専用になっている）
+            dst = src;
+            return true;
+        }
+        FrameID frame = memory_manager->Allocate(1);
+        if (frame.ID() == kNullFrame.ID()) {
+            return false;
+        }
+        memset(frame.Frame(), 0, kBytesPerFrame);
+        dst = src;
+        dst.SetPointer(frame.Frame());
+
+        const PageMapEntry *src_table = reinterpret_cast<const PageMapEntry *>(src.Pointer());
+        PageMapEntry *dst_table = reinterpret_cast<PageMapEntry *>(frame.Frame());
+        for (size_t i = 0; i < kEntriesPerTable; i++) {
+            if (src_table[i].bits.present && !CopyTable(src_table[i], dst_table[i], level - 1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+Process *Process::Create()
+{
+    FrameID frame = memory_manager->Allocate(1);
+    if (frame.ID() == kNullFrame.ID()) {
+        return nullptr;
+    }
+    PageMapEntry *pml4 = reinterpret_cast<PageMapEntry *>(frame.Frame());
+    PageMapEntry *kernel_pml4 = reinterpret_cast<PageMapEntry *>(KernelCR3());
+    memcpy(pml4, kernel_pml4, sizeof(PageMapEntry) * kUserPML4Index); // 前半はカーネルと同じ
+    memset(&pml4[kUserPML4Index], 0, sizeof(PageMapEntry) * (kEntriesPerTable - kUserPML4Index));
+    logger->info("[+] Setup PML4 for application at %p\n", pml4);
+    return new Process(frame);
+}
+
+Process *Process::Get()
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    refs_++;
+    return this;
+}
+
+void Process::Put()
+{
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        if (--refs_ > 0) {
+            return;
+        }
+    }
+    FreeUserHalf();
+    memory_manager->Free(pml4_, 1);
+    if (template_) {
+        template_->Put();
+    }
+    for (const SharedMapping &mapping : shared_memory_) {
+        mapping.shm->Put();
+    }
+    for (const AdoptedFrames &adopted : adopted_) { // マップしていたページング構造はもうない
+        memory_manager->Free(adopted.frames, adopted.num_frames);
+    }
+    delete this;
+}
+
+bool Process::UnshareTemplatePages()
+{
+    IRQSaveLockGuard<SpinLock> guard{page_table_lock_};
+    if (unshared_ || template_ == nullptr) {
+        return true;
+    }
+    PageMapEntry *pml4 = reinterpret_cast<PageMapEntry *>(pml4_.Frame());
+    for (size_t i = kUserPML4Index; i < kEntriesPerTable; i++) {
+        // 途中で失敗しても、コピーできた分はこのプロセスのページになっているだけなので、次の呼び出しで続きから行える
+        if (pml4[i].bits.present && !UnshareTable(reinterpret_cast<PageMapEntry *>(pml4[i].Pointer()), 3)) {
+            return false;
+        }
+    }
+    unshared_ = true;
+    return true;
+}
+
+uint64_t Process::Sbrk(int64_t increment)
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    uint64_t prev = brk_;
+    uint64_t next = prev + increment;
+    if (increment > 0 ? next - kHeapBegin > kMaxHeapBytes : next < kHeapBegin) {
+        return 0;
+    }
+    brk_ = next;
+    return prev;
+}
+
+uint64_t Process::AttachSharedMemory(SharedMemory *shm)
+{
+    uint64_t addr = 0;
+    bool attached = false;
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        for (const SharedMapping &mapping : shared_memory_) {
+            if (mapping.shm == shm) {
+                addr = mapping.addr;
+                break;
+            }
+        }
+        uint64_t bytes = shm->NumPages() * kBytesPerFrame;
+        if (addr == 0 && shared_memory_end_ + bytes - kSharedMemoryBegin <= kSharedMemoryBytes) {
+            addr = shared_memory_end_;
+            shared_memory_end_ += bytes;
+            shared_memory_.push_back({shm, addr});
+            attached = true;
+        }
+    }
+    if (!attached) {
+        shm->Put();
+    }
+    return addr;
+}
+
+int Process::AllocateThreadStack()
+{
+    static_assert(kMaxThreads <= 64);
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    for (int slot = 0; slot < kMaxThreads; slot++) {
+        if (!(thread_stacks_ & (1ul << slot))) {
+            thread_stacks_ |= 1ul << slot;
+            return slot;
+        }
+    }
+    return -1;
+}
+
+void Process::FreeThreadStack(int slot)
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    thread_stacks_ &= ~(1ul << slot);
+}
+
+void Process::AddThread(uint64_t task_id)
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    threads_.push_back(task_id);
+}
+
+bool Process::RemoveThread(uint64_t task_id)
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    auto it = std::find(threads_.begin(), threads_.end(), task_id);
+    if (it == threads_.end()) {
+        return false;
+    }
+    threads_.erase(it);
+    return true;
+}
+
+std::vector<uint64_t> Process::TakeThreadsOnMainExit()
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    main_exited_ = true;
+    std::vector<uint64_t> threads;
+    threads.swap(threads_);
+    return threads;
+}
+
+bool Process::DetachOnExit(uint64_t task_id)
+{
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        if (!main_exited_) {
+            return false;
+        }
+    }
+    return RemoveThread(task_id);
+}
+
+void Process::AddAppTask()
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    app_tasks_++;
+}
+
+bool Process::RemoveAppTask()
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    return --app_tasks_ == 0;
+}
+
+void Process::AdoptFrames(FrameID frames, size_t num_frames)
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    adopted_.push_back({frames, num_frames});
+}
+
+void Process::Freeze()
+{
+    PageMapEntry *pml4 = reinterpret_cast<PageMapEntry *>(pml4_.Frame());
+    for (size_t i = kUserPML4Index; i < kEntriesPerTable; i++) {
+        if (pml4[i].bits.present) {
+            FreezeTable(reinterpret_cast<PageMapEntry *>(pml4[i].Pointer()), 3);
+        }
+    }
+    frozen_ = true;
+}
+
+Process *Process::Clone()
+{
+    Process *child = Create();
+    if (child == nullptr) {
+        return nullptr;
+    }
+    child->template_ = Get();
+    PageMapEntry *pml4 = reinterpret_cast<PageMapEntry *>(pml4_.Frame());
+    PageMapEntry *child_pml4 = reinterpret_cast<PageMapEntry *>(child->pml4_.Frame());
+    for (size_t i = kUserPML4Index; i < kEntriesPerTable; i++) {
+        if (pml4[i].bits.present && !CopyTable(pml4[i], child_pml4[i], 3)) {
+            child->Put();
+            return nullptr;
+        }
+    }
+    return child;
+}
+
+void Process::FreeUserHalf()
+{
+    PageMapEntry *pml4 = reinterpret_cast<PageMapEntry *>(pml4_.Frame());
+    for (size_t i = kUserPML4Index; i < kEntriesPerTable; i++) {
+        if (!pml4[i].bits.present) {
+            continue;
+        }
+        FreeTable(reinterpret_cast<PageMapEntry *>(pml4[i].Pointer()), 3, frozen_);
+        memory_manager->Free(FrameOf(pml4[i]), 1);
+        pml4[i].data = 0;
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+
+class SharedMemory;
+
+/*
+ * アプリのプロセス（アドレス空間）
+ *
+ * プロセスごとにPML4を持ち、前半（カーネルの恒等写像）にはカーネルのPML4と同じエントリを、
+ * 後半（0xffff800000000000以降のアプリの領域）にはプロセスごとのページング構造を入れる。
+ * 同時に実行している複数のアプリは、同じアドレス（コードやスタックなど）に別々のページを持つ。
+ *
+ * PML4のアドレスはプロセスのタスクのコンテキストのcr3に入れておき（Task::SetProcess()）、
+ * タスクを切り替える時にCR3へ読み込まれる。
+ *
+ * 参照カウントを持ち、最後の参照が外れた時に後半のページング構造と、
+ * プロセスのために割り当てたページ（ページフォルトでマップしたものなど）を解放する。
+ * カーネルのページを共有している所（MapPageForApp()でマップしたもの）は解放しない。
+ *
+ * アプリを読み込んだアドレス空間をFreeze()するとテンプレートになり、Clone()で同じ内容のプロセスを作れる
+ * （zygoteのようなもの）。テンプレートのページは全て読み取り専用（cowの印付き）にして複製先と共有し、
+ * 複製先で書き込まれた時に初めてそのページだけをコピーする（CopyOnWriteForApp()、run_application.hpp）。
+ * 複製はページング構造をコピーするだけなので、ELFファイルの読み込みやBSSの初期化をやり直さずに済む。
+ * テンプレート自身は実行しない。複製先はテンプレートの参照を持つ。
+ *
+ * プロセスは複数のタスク（スレッド）から使える。最初のタスク（RunApplication()）の他に、
+ * ThreadCreateシステムコールで作ったタスクが同じPML4を使い、それぞれプロセスの参照を持つ。
+ * スレッドのスタックはkMaxThreads個の番号で割り当て、番号ごとにアドレスを分けて置く（run_application.cpp）。
+ * 他のCPUのTLBに残った読み取り専用の変換を消す手段（TLBシュートダウン）がないので、
+ * 最初のスレッドを作る前にテンプレートと共有しているページを全てコピーしておく（UnshareTemplatePages()）。
+ * 以降はページを外したり書き込めなくしたりすることはなく、ページフォルトでマップを増やすだけになる。
+ *
+ * アプリのヒープ（newlibのmalloc()が使う）はkHeapBeginから始まり、終わり（プログラムブレーク）を
+ * Sbrkシステムコールで動かす。ページはアクセスした時にページフォルトでマップする。
+ * 共有メモリ（shm.hpp）はkSharedMemoryBegin以降に開いた順に並べてマップし、プロセスが消える時に参照を外す。
+ * 投入・完了リング（uring.hpp）のようにアプリにマップしたカーネルのページは、AdoptFrames()でプロセスに預け、
+ * アドレス空間を解放した後で解放する（どのスレッドからも触れなくなるまで残す）。
+ */
+class Process
+{
+public:
+    // 後半が空のアドレス空間を作る（参照カウントは１）。作れなければnullptr。
+    static Process *Create();
+
+    uint64_t CR3() const { return reinterpret_cast<uint64_t>(pml4_.Frame()); }
+    Process *Get(); // 参照を増やす
+    // 参照を減らし、０になったら解放する。このプロセスのCR3を読み込んでいないタスクから呼ぶこと。
+    void Put();
+
+    // テンプレートにする。以降、このアドレス空間には書き込まないこと。
+    void Freeze();
+    // テンプレートの後半のページング構造をコピーし、ページを共有したプロセスを作る。作れなければnullptr。
+    Process *Clone();
+
+    // テンプレートと共有しているページ（cowの印付き）を全てコピーして書き込めるようにする。
+    // このプロセスを使っているタスクが呼び出し元だけの時に呼び、後でCR3を読み直してTLBを消すこと。
+    bool UnshareTemplatePages();
+    // ページング構造を変える時に持つロック（同じプロセスのスレッドが別々のCPUで同時にページフォルトを起こすことがある）
+    SpinLock &PageTableLock() { return page_table_lock_; }
+
+    static const int kMaxThreads = 64; // 同時に動かせるスレッドの数（最初のタスクを除く）
+    // スレッドのスタックの番号を割り当てる。空きがなければ−１。
+    int AllocateThreadStack();
+    void FreeThreadStack(int slot);
+    // Join()を待っているスレッドのタスクのidを覚えておく。RemoveThread()はidがなければfalseを返す。
+    void AddThread(uint64_t task_id);
+    bool RemoveThread(uint64_t task_id);
+    // 最初のタスクが終わった時に呼び、まだJoinされていないスレッドのidを外して返す。
+    // これ以降に終わるスレッドは、DetachOnExit()でJoinを待たずに回収するものにする。
+    std::vector<uint64_t> TakeThreadsOnMainExit();
+    // スレッドが終わる時に呼ぶ。最初のタスクが終わった後で、まだJoinされていなければidを外してtrueを返す。
+    bool DetachOnExit(uint64_t task_id);
+    // アプリのコードを実行するタスク（最初のタスクとスレッド）の数を数える。
+    // RemoveAppTask()は最後のタスクが抜けた時にtrueを返す（プロセスのリングを閉じるのに使う）。
+    void AddAppTask();
+    bool RemoveAppTask();
+    // アプリにマップしたカーネルのページを預け、プロセスが消える時（アドレス空間を解放した後）に解放する。
+    void AdoptFrames(FrameID frames, size_t num_frames);
+
+    static const uint64_t kHeapBegin = 0xffff'a000'0000'0000; // ヒープの先頭（アプリのイメージとスタックの間）
+    static const uint64_t kMaxHeapBytes = 1ul << 30;
+    // ヒープの終わりをincrementバイト動かし、動かす前の終わりを返す。ヒープの範囲を外れるなら０。
+    // 縮めてもページは解放せず、また伸ばした時にそのまま使う。
+    uint64_t Sbrk(int64_t increment);
+
+    static const uint64_t kSharedMemoryBegin = 0xffff'e000'0000'0000; // 共有メモリをマップする領域の先頭
+    static const uint64_t kSharedMemoryBytes = 1ul << 32;
+    // 共有メモリshmをマップするアドレスを決め、shmの参照を預かる（プロセスが消える時に外す）。
+    // 既にマップしていれば同じアドレスを返し、増えた参照は外す。領域が足りなければ参照を外して０を返す。
+    uint64_t AttachSharedMemory(SharedMemory *shm);
+
+private:
+    Process(FrameID pml4) : pml4_{pml4} {}
+    void FreeUserHalf();
+
+    FrameID pml4_;
+    SpinLock lock_; // refs_、thread_stacks_、threads_、main_exited_、app_tasks_、brk_、shared_memory_、adopted_を守る
+    int refs_{1};
+    uint64_t thread_stacks_{0}; // 使用中のスタックの番号のビットマップ
+    std::vector<uint64_t> threads_;
+    bool main_exited_{false};
+    int app_tasks_{0};
+    uint64_t brk_{kHeapBegin}; // ヒープの終わり
+    struct SharedMapping {
+        SharedMemory *shm;
+        uint64_t addr;
+    };
+    std::vector<SharedMapping> shared_memory_;
+    uint64_t shared_memory_end_{kSharedMemoryBegin}; // 次の共有メモリをマップするアドレス
+    struct AdoptedFrames {
+        FrameID frames;
+        size_t num_frames;
+    };
+    std::vector<AdoptedFrames> adopted_;
+    SpinLock page_table_lock_;
+    bool frozen_{false}; // テンプレートである（cowのページの持ち主）
+    bool unshared_{false}; // UnshareTemplatePages()が済んだ
+    Process *template_{nullptr}; // 複製元のテンプレート（cowのページの持ち主）
+};
@@ -9,13 +9,78 @@
 #include "segment.hpp"
 #include "elf.hpp"
 
+// アプリの領域の先頭（app_base_addrと同じ）。これより下はカーネルの恒等写像。
+const uint64_t kUserHalfBegin = 0xffff'8000'0000'0000;
+
+/*
+ * システムコールでアプリから渡されたアドレスaddrからbytesバイトが、アプリの領域に収まっているか確かめる。
+ * alignを指定すると、addrがその倍数に揃っていることも確かめる。
+ * ページがマップされているかまでは見ない（アプリの領域ならページフォルトでマップされる）。
+ * カーネルはCPL0で読み書きするので、アプリからのポインタは使う前に必ずこれを通すこと。
+ */
+inline bool IsUserRange(uint64_t addr, uint64_t bytes, uint64_t align = 1)
+{
+    return addr >= kUserHalfBegin && addr + bytes >= addr && addr % align == 0;
+}
+
+/*
+ * アプリの実行ファイル（カーネルに埋め込んだELFファイル）。名前で探して実行する。
+ * 増やす時はapp_images.asmとrun_application.cppのkAppImagesに足す。
+ */
+struct AppImage {
+    const char *name;
+    const uint8_t *start;
+    const uint8_t *end;
+
+    size_t Size() const { return end - start; }
+};
+size_t NumAppImages();
+const AppImage &GetAppImage(size_t index);
+const AppImage *FindAppImage(const char *name); // なければnullptr
+
 /* 
- * 独自のPML4ページング構造体を実装し、0xffff800000000000アドレス以降を利用して
+ * 独自のPML4ページング構造体（Process）を作り、0xffff800000000000アドレス以降を利用して
  * アプリケーションを特権レベル３で実行する関数。
- * タスクの１つとして実行されることを念頭に置いている。
+ * タスクの１つとして実行されることを念頭に置いている。bには実行するアプリのAppImage *を渡す。
+ * アプリごとにアドレス空間が分かれるので、複数のタスクで同時に実行できる。
+ *
+ * アプリは初めて実行する時に一度だけテンプレートのアドレス空間に読み込んで凍結し（process.hpp）、
+ * 以降はそれをコピーオンライトで複製してe_entryから実行するので、ELFファイルの読み込みをやり直さない。
  */
 void RunApplication(uint64_t a, int64_t b);
 
+/*
+ * アプリのスレッド（ThreadCreate・ThreadExit・ThreadJoinシステムコール）
+ * スレッドは実行中のアプリと同じアドレス空間（Process）を使うタスクで、TaskManagerが他のタスクと同じように
+ * 独立してスケジューリングするので、別々のCPUで同時に動ける。スタックはスレッドごとに別のアドレスに置き、
+ * FSベース（スレッドローカル記憶域）もタスクごとに持つ。
+ * スレッドはThreadExitかExitで終わり、同じプロセスの他のスレッドがJoinAppThread()で返り値を受け取る。
+ * Exitはプロセス全体ではなく、呼び出したタスクだけを終わらせる（スレッドから呼べばThreadExitと同じ）。
+ * 最初のタスクがExitで終わっても他のスレッドは止めずに動かし続け、アドレス空間も全てのスレッドが終わるまで残る。
+ * その時点でJoinされていないスレッドは切り離し（TaskManager::Detach()）、終わった時にJoinを待たずに回収する。
+ * 最初のタスクが終わるまでは、Joinされなかったスレッドのタスクは回収されないので、作ったスレッドはJoinすること。
+ */
+// アプリのアドレスstartからstart(arg0, arg1)を実行するスレッドを作り、そのタスクのidを返す（失敗したら−１）。
+// tlsはスレッドのFSベースにする（先頭に自分のアドレスを置いておくこと）。
+// ０ならスタックの底に自分のアドレスだけを持つブロックを作ってFSベースにする（最初のタスクも同じ）ので、
+// どのスレッドでも%fs:0がスレッドごとに異なる値になる。
+int64_t CreateAppThread(uint64_t start, uint64_t arg0, uint64_t arg1, uint64_t tls);
+// 同じプロセスのスレッドidが終わるまで待ち、返り値をstatusに入れて０を返す。待てないスレッドなら−１。
+int64_t JoinAppThread(uint64_t id, int64_t *status);
+
+/*
+ * アプリの起動のベンチマーク結果
+ * すぐに終わるアプリを、毎回ELFファイルを読み込む場合とテンプレートを複製する場合で、それぞれ起動して終了を待つことを繰り返す。
+ */
+struct LaunchBenchmarkResult {
+    uint64_t launches; // それぞれの方法で起動した回数
+    uint64_t loader_tsc; // 毎回読み込んだ時にかかった時間（TSCのカウント数）
+    uint64_t template_tsc; // テンプレートを複製した時にかかった時間
+};
+
+// imageをnum_launches回ずつ起動して終了させる。タスクから呼ぶこと。
+void BenchmarkLaunch(const AppImage &image, uint64_t num_launches, LaunchBenchmarkResult &result);
+
 /*
  * 指定したリニアアドレスが含まれるページに物理アドレスをマップする。
  * この関数はアプリケーション用のメモリ領域にのみ適応される。
@@ -25,3 +90,19 @@ void RunApplication(uint64_t a, int64_t b);
  * 成功時１、失敗時０を返す
  */
 int SetupPageMapForApp(LinearAddress4Level linear_address, bool writable);
+
+/*
+ * テンプレートと共有している読み取り専用のページ（cowの印付き）に書き込まれた時、ページフォルトハンドラから呼ぶ。
+ * ページをコピーして書き込めるようにし、成功時１、cowのページでなければ０を返す。
+ */
+int CopyOnWriteForApp(LinearAddress4Level linear_address);
+
+/*
+ * 指定したリニアアドレスが含まれるページに、既にあるカーネルのページ（frameから始まる4KiB、ページの境界に揃っていること）をマップする。
+ * アプリとカーネルで同じページを共有する時に使う。条件と返り値はSetupPageMapForAppと同じ。
+ */
+int MapPageForApp(LinearAddress4Level linear_address, void *frame, bool writable);
+
+// 時刻のページ（TimePage、timer.hpp）をアプリに読み取り専用でマップするアドレス
+// application/sys/time.hppのkTimePageAddressと同じ値にすること。
+const uint64_t kTimePageAddress = 0xffff'ffff'ffff'f000;
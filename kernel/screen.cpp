@@ -1,5 +1,6 @@
 #include "screen.hpp"
 #include <stdlib.h>
+#include <algorithm>
 
 extern const uint8_t _binary_hankaku_bin_start;
 extern const uint8_t _binary_hankaku_bin_end;
@@ -46,6 +47,19 @@ void Frame::WriteChar(uint32_t p_x, uint32_t p_y, const CharData &c_data)
 {
     const uint8_t *kFont = GetFont(c_data.val);
     if (kFont == NULL) return;
+    if (IsInFrame(p_x + 7, p_y + 15)) {
+        // 文字全体がフレームに収まる時は、ピクセルごとの範囲の確認を省いて１行ずつ書き込む
+        for (int dy = 0; dy < 16; dy++) {
+            uint8_t *p = reinterpret_cast<uint8_t *>(PixelAt(p_x, p_y + dy));
+            for (int dx = 0; dx < 8; dx++, p += BYTES_PER_PIXEL) {
+                const PixelColor &color = ((kFont[dy] << dx) & 0x80u) ? c_data.fg_color : c_data.bg_color;
+                p[0] = color.r;
+                p[1] = color.g;
+                p[2] = color.b;
+            }
+        }
+        return;
+    }
     for (int dx = 0; dx < 8; dx++) {
         for (int dy = 0; dy < 16; dy++) {
             if ((kFont[dy] << dx) & 0x80u) {
@@ -198,6 +212,10 @@ uint32_t ScreenManager::PutChar(const CharData &c_data)
         CopyChar(cursor_col_, cursor_row_);
         cursor_col_ = 0;
         cursor_row_++;
+        if (cursor_row_ + 1 >= long_frame_rows_) {
+            ReclaimLongFrame();
+            MoveFrameToCursor();
+        }
     } else {
         WriteCharToLongFrame(cursor_col_, cursor_row_, c_data);
         CopyChar(cursor_col_, cursor_row_);
@@ -247,6 +265,47 @@ uint32_t ScreenManager::PutString(const char *s)
     return PutString(s, default_fg_color_, default_bg_color_);
 }
 
+uint32_t ScreenManager::Write(const char *s, size_t len)
+{
+    CopyChar(cursor_col_, cursor_row_); // カーソルを消しておく
+    uint32_t first_row = cursor_row_;
+    CharData c_data;
+    c_data.fg_color = default_fg_color_;
+    c_data.bg_color = default_bg_color_;
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '\n') {
+            cursor_col_ = 0;
+            cursor_row_++;
+            if (cursor_row_ + 1 >= long_frame_rows_) {
+                uint32_t shift = ReclaimLongFrame();
+                first_row = first_row > shift ? first_row - shift : 0;
+            }
+            // 文字を書く前に背景を塗っておく（CopyAll()で後から塗られると文字が消える）
+            while (long_frame_end_ <= cursor_row_) {
+                FillLine(long_frame_end_, default_bg_color_);
+                long_frame_end_++;
+            }
+            continue;
+        }
+        c_data.val = s[i];
+        WriteCharToLongFrame(cursor_col_, cursor_row_, c_data);
+        if (cursor_col_ + 1 < long_frame_cols_) {
+            cursor_col_++;
+        }
+    }
+
+    // ここまでフレームには触っていないので、まとめて反映する
+    if (!IsCursorInFrame()) {
+        MoveFrameToCursor(); // 全体をコピーしてカーソルを表示する
+    } else {
+        for (uint32_t row = std::max(first_row, base_); row <= cursor_row_; row++) {
+            CopyLine(row);
+        }
+        CursorShow();
+    }
+    return cursor_col_;
+}
+
 void ScreenManager::UpdateRightFromCursor(const char *s)
 {
     uint32_t c_x = cursor_col_;
@@ -282,6 +341,25 @@ bool ScreenManager::IsCursorInFrame()
            (cursor_row_ - base_ < frame_rows_);
 }
 
+uint32_t ScreenManager::ReclaimLongFrame()
+{
+    // 画面の半分の数だけ残して、それより古い行を捨てる
+    uint32_t keep = long_frame_rows_ / 2;
+    if (cursor_row_ + 1 < keep) {
+        return 0;
+    }
+    uint32_t shift = cursor_row_ + 1 - keep;
+    size_t bytes_per_row = BYTES_PER_PIXEL * long_frame_->Config()->pixels_per_scan_line * 16;
+    uint8_t *buf = reinterpret_cast<uint8_t *>(long_frame_->Buffer());
+    memmove(buf, buf + bytes_per_row * shift, bytes_per_row * (long_frame_end_ - shift));
+
+    cursor_row_ -= shift;
+    base_ = base_ > shift ? base_ - shift : 0;
+    long_frame_begin_ = 0;
+    long_frame_end_ = long_frame_end_ > shift ? long_frame_end_ - shift : 0;
+    return shift;
+}
+
 void ScreenManager::WriteCharToLongFrame(uint32_t c_x, uint32_t c_y, const CharData &c_data)
 {
     /* 
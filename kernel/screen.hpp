@@ -89,6 +89,9 @@ public:
     uint32_t PutString(const char *s, PixelColor &fg_color, PixelColor &bg_color);
     uint32_t PutString(const char *s, PixelColor &fg_color);
     uint32_t PutString(const char *s); // 色はデフォルトのものを使う
+    // lenバイトの文字列をまとめて出力する（NULL文字で止まらない）。色はデフォルトのものを使う。
+    // ロングフレームに全ての文字を書いてから、変化した行のフレームへのコピーとカーソルの表示を最後に１回だけ行う。
+    uint32_t Write(const char *s, size_t len);
 
     // カーソルから右を新しい文字列に変更する。
     void UpdateRightFromCursor(const char *s);
@@ -116,6 +119,8 @@ private:
 
     // 現在のカーソルがフレーム内にいればtrueを返す
     bool IsCursorInFrame();
+    // カーソルがロングフレームの下端に近づいたら、古い行を捨てて残りを先頭に詰める。詰めた行数を返す。
+    uint32_t ReclaimLongFrame();
 
     /* ロングフレーム自体に書き込む便利関数 */
     // ロングフレームの(c_x, c_y)に文字を書き込む。(c_x, c_y)はピクセルではなく文字の行と列である。
@@ -6,8 +6,7 @@ extern BitmapMemoryManager* memory_manager;
 extern logging::Logger *logger;
 
 namespace {
-    std::array<SegmentDescriptor, 7> gdt;
-    TaskStateSegment tss;
+    CPUSegments bsp_segments; // BSPのGDTとTSS（APの分はNewCPUSegments()で確保する）
 }
 
 
@@ -56,63 +55,98 @@ void SetSystemSegment(SegmentDescriptor *desc,
     desc->bits.long_mode = 0;
 }
 
+namespace {
+    // カーネルとアプリのセグメントを設定する。TSSのディスクリプタはLoadTSS()で設定する。
+    void BuildGDT(std::array<SegmentDescriptor, 7> &gdt)
+    {
+        gdt[0].data = 0;
+        SetCodeSegment(&gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
+        SetDataSegment(&gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
+        SetCodeSegment(&gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff); // アプリ用
+        SetDataSegment(&gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff); // アプリ用
+    }
+
+    void LoadSegments(std::array<SegmentDescriptor, 7> &gdt)
+    {
+        LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+        SetDSAll(kKernelDS);
+        SetCSSS(kKernelCS, kKernelSS); 
+    }
+
+    // TSSに各特権レベルと割り込みで使うスタック領域を確保して設定する
+    void AllocateTSSStacks(TaskStateSegment &tss)
+    {
+        const int kRing0Frames = 8;  // ring0のスタック領域のサイズ（フレーム）
+        uint64_t ring0_stack_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kRing0Frames).Frame());
+        uint64_t ring0_stack_end = ring0_stack_begin + kRing0Frames * kBytesPerFrame;
+        logger->debug("Ring0 stack: 0x%lx ~ 0x%lx\n", ring0_stack_begin, ring0_stack_end);
+        
+        const int kISTFrames = 8; 
+        // 通常の割り込み時
+        uint64_t ist1_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
+        uint64_t ist1_end = ist1_begin + kISTFrames * kBytesPerFrame;
+        logger->debug("IST1 : 0x%lx ~ 0x%lx\n", ist1_begin, ist1_end);
+
+        // ＃GP用スタック領域
+        uint64_t ist2_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
+        uint64_t ist2_end = ist2_begin + kISTFrames * kBytesPerFrame;
+        logger->debug("IST2 : 0x%lx ~ 0x%lx\n", ist2_begin, ist2_end);
+
+        // ＃GP用スタック領域
+        uint64_t ist3_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
+        uint64_t ist3_end = ist3_begin + kISTFrames * kBytesPerFrame;
+        logger->debug("IST3 : 0x%lx ~ 0x%lx\n", ist3_begin, ist3_end);
+
+        // xHCI用
+        uint64_t ist4_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
+        uint64_t ist4_end = ist4_begin + kISTFrames * kBytesPerFrame;
+        logger->debug("IST4 : 0x%lx ~ 0x%lx\n", ist4_begin, ist4_end);
+
+        // TSSに値を指定する。
+        tss.rsp0 = ring0_stack_end;
+        tss.ist1 = ist1_end;
+        tss.ist2 = ist2_end;
+        tss.ist3 = ist3_end;
+        tss.ist4 = ist4_end;
+    }
+
+    // GDTにTSSのディスクリプタを設定し、TRにロードする
+    void LoadTSS(CPUSegments &segs)
+    {
+        uint64_t tss_addr = reinterpret_cast<uint64_t>(&segs.tss);
+        SetSystemSegment(&segs.gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0, 
+            tss_addr & 0xffffffff, sizeof(segs.tss) - 1);
+        segs.gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+
+        LoadTR(kTSS);
+    }
+}
+
 void SetupSegments() {
     logger->info("[+] Setup Segments\n");
-    logger->debug("gdt: %p\n", &gdt);
-    gdt[0].data = 0;
-    SetCodeSegment(&gdt[1], DescriptorType::kExecuteRead, 0, 0, 0xfffff);
-    SetDataSegment(&gdt[2], DescriptorType::kReadWrite, 0, 0, 0xfffff);
-    SetCodeSegment(&gdt[4], DescriptorType::kExecuteRead, 3, 0, 0xfffff); // アプリ用
-    SetDataSegment(&gdt[3], DescriptorType::kReadWrite, 3, 0, 0xfffff); // アプリ用
-    LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
-
-    SetDSAll(kKernelDS);
-    SetCSSS(kKernelCS, kKernelSS); 
+    logger->debug("gdt: %p\n", &bsp_segments.gdt);
+    BuildGDT(bsp_segments.gdt);
+    LoadSegments(bsp_segments.gdt);
 }
 
 
 void InitializeTSS()
 {
     logger->info("[+] Initialize TSS\n");
+    AllocateTSSStacks(bsp_segments.tss);
+    LoadTSS(bsp_segments);
+}
 
-    const int kRing0Frames = 8;  // ring0のスタック領域のサイズ（フレーム）
-    uint64_t ring0_stack_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kRing0Frames).Frame());
-    uint64_t ring0_stack_end = ring0_stack_begin + kRing0Frames * kBytesPerFrame;
-    logger->debug("Ring0 stack: 0x%lx ~ 0x%lx\n", ring0_stack_begin, ring0_stack_end);
-    
-    const int kISTFrames = 8; 
-    // 通常の割り込み時
-    uint64_t ist1_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
-    uint64_t ist1_end = ist1_begin + kISTFrames * kBytesPerFrame;
-    logger->debug("IST1 : 0x%lx ~ 0x%lx\n", ist1_begin, ist1_end);
-
-    // ＃GP用スタック領域
-    uint64_t ist2_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
-    uint64_t ist2_end = ist2_begin + kISTFrames * kBytesPerFrame;
-    logger->debug("IST2 : 0x%lx ~ 0x%lx\n", ist2_begin, ist2_end);
-
-    // ＃GP用スタック領域
-    uint64_t ist3_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
-    uint64_t ist3_end = ist3_begin + kISTFrames * kBytesPerFrame;
-    logger->debug("IST3 : 0x%lx ~ 0x%lx\n", ist3_begin, ist3_end);
-
-    // xHCI用
-    uint64_t ist4_begin = reinterpret_cast<uint64_t>(memory_manager->Allocate(kISTFrames).Frame());
-    uint64_t ist4_end = ist4_begin + kISTFrames * kBytesPerFrame;
-    logger->debug("IST4 : 0x%lx ~ 0x%lx\n", ist4_begin, ist4_end);
-
-    // TSSに値を指定する。
-    tss.rsp0 = ring0_stack_end;
-    tss.ist1 = ist1_end;
-    tss.ist2 = ist2_end;
-    tss.ist3 = ist3_end;
-    tss.ist4 = ist4_end;
-    
-    // GDTへの設定
-    uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss);
-    SetSystemSegment(&gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0, 
-        tss_addr & 0xffffffff, sizeof(tss) - 1);
-    gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+CPUSegments *NewCPUSegments()
+{
+    CPUSegments *segs = new CPUSegments{};
+    BuildGDT(segs->gdt);
+    AllocateTSSStacks(segs->tss);
+    return segs;
+}
 
-    LoadTR(kTSS);
+void LoadCPUSegments(CPUSegments *segs)
+{
+    LoadSegments(segs->gdt);
+    LoadTSS(*segs);
 }
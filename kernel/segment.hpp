@@ -74,6 +74,25 @@ const uint16_t kUserSS = 3 << 3; // ユーザーはカーネルと逆順！！
 const uint16_t kTSS = 5 << 3;
 const uint16_t kKernelDS = 0;
 
+/* 
+ * CPUごとに持つGDTとTSS
+ * TSSのディスクリプタは一度ロードすると使用中（busy）になり、他のCPUからはロードできないので、
+ * GDTごとCPUの数だけ用意する。
+ */
+struct CPUSegments
+{
+    std::array<SegmentDescriptor, 7> gdt;
+    TaskStateSegment tss;
+};
+
+// BSPのGDTを設定してロードする
 void SetupSegments();
 
+// BSPのTSSのスタック領域を確保し、GDTに設定する
 void InitializeTSS();
+
+// APのGDTとTSSを作る（TSSのスタック領域も確保する）。APを起動する前にBSPで呼ぶ。
+CPUSegments *NewCPUSegments();
+
+// AP上で呼び、NewCPUSegments()で作ったGDTとTSSをロードする
+void LoadCPUSegments(CPUSegments *segs);
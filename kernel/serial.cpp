@@ -0,0 +1,57 @@
+#include <cstdint>
+
+#include "serial.hpp"
+#include "asmfunc.h"
+#include "spinlock.hpp"
+
+namespace serial
+{
+    namespace {
+        const uint16_t kCOM1 = 0x3f8;
+        // 各レジスタのkCOM1からのオフセット
+        const uint16_t kData = 0; // 送信データ（DLABが１の時は分周比の下位）
+        const uint16_t kInterruptEnable = 1; // 割り込みの有効化（DLABが１の時は分周比の上位）
+        const uint16_t kFIFOControl = 2;
+        const uint16_t kLineControl = 3;
+        const uint16_t kModemControl = 4;
+        const uint16_t kLineStatus = 5;
+
+        const uint8_t kLineControlDLAB = 0x80;
+        const uint8_t kLineStatusTHRE = 0x20; // 送信バッファが空
+
+        SpinLock lock;
+        bool initialized = false;
+
+        void PutByte(uint8_t c)
+        {
+            while (!(ReadIOAddressSpace8(kCOM1 + kLineStatus) & kLineStatusTHRE)) {
+                __builtin_ia32_pause();
+            }
+            WriteIOAddressSpace8(kCOM1 + kData, c);
+        }
+    }
+
+    void Initialize()
+    {
+        WriteIOAddressSpace8(kCOM1 + kInterruptEnable, 0x00); // 割り込みは使わない
+        WriteIOAddressSpace8(kCOM1 + kLineControl, kLineControlDLAB);
+        WriteIOAddressSpace8(kCOM1 + kData, 0x01); // 分周比１：115200bps
+        WriteIOAddressSpace8(kCOM1 + kInterruptEnable, 0x00);
+        WriteIOAddressSpace8(kCOM1 + kLineControl, 0x03); // 8bit、パリティなし、ストップビット１
+        WriteIOAddressSpace8(kCOM1 + kFIFOControl, 0xc7); // FIFOを有効にしてクリア
+        WriteIOAddressSpace8(kCOM1 + kModemControl, 0x03); // DTR、RTS
+        initialized = true;
+    }
+
+    void Write(const void *buf, size_t size)
+    {
+        if (!initialized) {
+            return;
+        }
+        const uint8_t *p = reinterpret_cast<const uint8_t *>(buf);
+        IRQSaveLockGuard<SpinLock> guard{lock};
+        for (size_t i = 0; i < size; i++) {
+            PutByte(p[i]);
+        }
+    }
+}
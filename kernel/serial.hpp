@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+ * シリアルポート（COM1）への出力
+ * 115200bps、8bit、パリティなし、ストップビット１で設定する。受信と割り込みは使わない。
+ * QEMUでは-serial file:<ファイル名>などでホスト側に取り出せる。
+ */
+namespace serial
+{
+    void Initialize();
+    // bufのsizeバイトをそのまま送る（複数のCPUから呼んでも１回のWrite()の中のデータは混ざらない）。
+    // 送り終わるまで割り込みを禁止するので、大きなデータは小分けにして呼ぶこと。
+    void Write(const void *buf, size_t size);
+}
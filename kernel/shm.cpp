@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "shm.hpp"
+#include "logging.hpp"
+#include "paging.hpp"
+#include "process.hpp"
+#include "run_application.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
+
+extern BitmapMemoryManager* memory_manager;
+extern TaskManager* task_manager;
+extern logging::Logger *logger;
+
+namespace
+{
+    SpinLock objects_lock; // objectsと各SharedMemoryのrefs_を守る
+    std::array<SharedMemory *, SharedMemory::kMaxObjects> objects{};
+}
+
+SharedMemory *SharedMemory::GetLocked(const char *name, uint64_t bytes, bool &found)
+{
+    for (SharedMemory *shm : objects) {
+        if (shm && strcmp(shm->name_, name) == 0) {
+            found = true;
+            if (bytes > shm->num_pages_ * kBytesPerFrame) {
+                return nullptr;
+            }
+            shm->refs_++;
+            return shm;
+        }
+    }
+    found = false;
+    return nullptr;
+}
+
+SharedMemory *SharedMemory::Open(const char *name, uint64_t bytes)
+{
+    bool found;
+    {
+        IRQSaveLockGuard<SpinLock> guard{objects_lock};
+        SharedMemory *shm = GetLocked(name, bytes, found);
+        if (found) {
+            return shm;
+        }
+    }
+    if (bytes == 0 || bytes > kMaxBytes) {
+        return nullptr;
+    }
+
+    // ページを０で埋めるのに時間がかかるので、ロックを外してから作る
+    size_t num_pages = (bytes + kBytesPerFrame - 1) / kBytesPerFrame;
+    FrameID frames = memory_manager->Allocate(num_pages);
+    if (frames.ID() == kNullFrame.ID()) {
+        return nullptr;
+    }
+    memset(frames.Frame(), 0, num_pages * kBytesPerFrame);
+    SharedMemory *shm = new SharedMemory(frames, num_pages);
+    strncpy(shm->name_, name, kMaxNameLength);
+
+    SharedMemory *other;
+    bool inserted = false;
+    {
+        IRQSaveLockGuard<SpinLock> guard{objects_lock};
+        // 作っている間に同じ名前で作られていたら、そちらを使う
+        other = GetLocked(name, bytes, found);
+        if (!found) {
+            auto slot = std::find(objects.begin(), objects.end(), nullptr);
+            if (slot != objects.end()) {
+                *slot = shm;
+                inserted = true;
+            }
+        }
+    }
+    if (inserted) {
+        logger->debug("[shm] %s: %lu pages at %p\n", name, num_pages, frames.Frame());
+        return shm;
+    }
+    memory_manager->Free(frames, num_pages);
+    delete shm;
+    return other;
+}
+
+void SharedMemory::Put()
+{
+    {
+        IRQSaveLockGuard<SpinLock> guard{objects_lock};
+        if (--refs_ > 0) {
+            return;
+        }
+        *std::find(objects.begin(), objects.end(), this) = nullptr;
+    }
+    logger->debug("[shm] %s: freed\n", name_);
+    memory_manager->Free(frames_, num_pages_);
+    delete this;
+}
+
+namespace shm
+{
+    uint64_t Map(uint64_t name, uint64_t bytes)
+    {
+        Process *process = task_manager->CurrentTask()->GetProcess();
+        if (process == nullptr || !IsUserRange(name, SharedMemory::kMaxNameLength + 1)) {
+            return 0;
+        }
+        char kname[SharedMemory::kMaxNameLength + 1] = {};
+        strncpy(kname, reinterpret_cast<const char *>(name), sizeof(kname));
+        if (kname[0] == '\0' || kname[sizeof(kname) - 1] != '\0') { // 空か長すぎる
+            return 0;
+        }
+
+        SharedMemory *shm = SharedMemory::Open(kname, bytes);
+        if (shm == nullptr) {
+            return 0;
+        }
+        uint64_t addr = process->AttachSharedMemory(shm);
+        if (addr == 0) {
+            return 0;
+        }
+        // ２回目に開いた時も同じページを同じアドレスにマップし直すだけなので、そのまま行う
+        uint8_t *pages = reinterpret_cast<uint8_t *>(shm->Pages());
+        for (size_t i = 0; i < shm->NumPages(); i++) {
+            LinearAddress4Level linear;
+            linear.data = addr + i * kBytesPerFrame;
+            if (!MapPageForApp(linear, pages + i * kBytesPerFrame, true)) {
+                // マップできた分はプロセスが終わるまで残る（参照はプロセスが持っている）
+                return 0;
+            }
+        }
+        return addr;
+    }
+}
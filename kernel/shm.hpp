@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "memory_manager.hpp"
+
+/*
+ * 名前付きの共有メモリ
+ *
+ * アプリはShmMapシステムコールで名前を指定して共有メモリを開き、自分のアドレス空間にマップしてもらう。
+ * 同じ名前を開いたプロセスは、BitmapMemoryManagerから確保した同じ物理ページをそれぞれのアドレスに持つので、
+ * カーネルを通さずに（コピーせずに）データを受け渡せる。
+ * 待ち合わせには共有ページの上のfutexを使う（futexは物理アドレスで待ち合わせるので、プロセスをまたいで使える）。
+ *
+ * 共有メモリは最初に開いたプロセスが大きさを決めて作り、ページは０で埋めておく。
+ * マップしたプロセスがそれぞれ参照を持ち（Process::AttachSharedMemory()）、
+ * 最後のプロセスが終わった時にページを解放して名前も消える。
+ * マップを外す手段はない（TLBシュートダウンがないので、プロセスが終わるまでマップしたままにする）。
+ */
+class SharedMemory
+{
+public:
+    static const size_t kMaxObjects = 16; // 同時に存在できる共有メモリの数
+    static const size_t kMaxNameLength = 31;
+    static const uint64_t kMaxBytes = 16 * 1024 * 1024;
+
+    // 名前nameの共有メモリを探して参照を増やす。なければbytesバイト（ページ単位に切り上げる）で作る。
+    // 既にあるものがbytesより小さい時や、作れない時はnullptr。
+    static SharedMemory *Open(const char *name, uint64_t bytes);
+    void Put(); // 参照を減らし、０になったらページを解放する
+
+    const char *Name() const { return name_; }
+    void *Pages() const { return frames_.Frame(); } // 恒等写像のアドレス（そのまま物理アドレス）
+    size_t NumPages() const { return num_pages_; }
+
+private:
+    SharedMemory(FrameID frames, size_t num_pages) : frames_{frames}, num_pages_{num_pages} {}
+    // nameの共有メモリを探し、foundをtrueにして参照を増やして返す（bytesより小さければnullptr）。
+    // objects_lockを持った状態で呼ぶ。
+    static SharedMemory *GetLocked(const char *name, uint64_t bytes, bool &found);
+
+    char name_[kMaxNameLength + 1]{};
+    FrameID frames_;
+    size_t num_pages_;
+    int refs_{1}; // objects_lock（shm.cpp）で守る
+};
+
+namespace shm
+{
+    // 実行中のアプリのタスクのアドレス空間に、名前nameの共有メモリ（なければbytesバイトで作る）をマップし、
+    // そのアドレスを返す（失敗したら０）。同じプロセスで２回開いた時は同じアドレスを返す。
+    uint64_t Map(uint64_t name, uint64_t bytes);
+}
@@ -0,0 +1,238 @@
+#include <array>
+#include <string.h>
+
+#include "smp.hpp"
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "logging.hpp"
+#include "memory_manager.hpp"
+#include "spinlock.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+extern BitmapMemoryManager* memory_manager;
+extern TaskManager* task_manager;
+extern TimerManager *timer_manager;
+extern logging::Logger *logger;
+
+// IntHandlerStopCPU（asmfunc.asm）と共有する
+extern "C" {
+    volatile uint64_t smp_stop_request = 0; // ０以外の間、止められたCPUは割り込みハンドラの中で待つ
+    volatile uint64_t smp_stopped_count = 0; // 止まったCPUの数
+}
+
+namespace smp
+{
+    static_assert(offsetof(PerCPU, self) == 0x00);
+    static_assert(offsetof(PerCPU, fpu_current_area) == 0x08);
+    static_assert(offsetof(PerCPU, fpu_owner_area) == 0x10);
+    static_assert(offsetof(PerCPU, index) == 0x18);
+    static_assert(offsetof(PerCPU, fs_base) == 0x28);
+    static_assert(offsetof(PerCPU, syscall_stack) == 0x38);
+    static_assert(offsetof(PerCPU, user_rsp) == 0x40);
+    static_assert(offsetof(PerCPU, switch_stack) + kSwitchStackBytes == 0x90);
+
+    namespace {
+        std::array<PerCPU, kMaxCPUs> cpus;
+        volatile int num_cpus = 0;
+
+        const uint32_t kIA32GSBase = 0xc0000101;
+        const uint32_t kIA32KernelGSBase = 0xc0000102; // swapgsは使わないので、GSベースの写しとして使う
+        const int kAPStackFrames = 8; // APの起動処理（アイドルタスクになる）のスタック
+
+        // Local APICのレジスタ
+        volatile uint32_t *kLAPICID = reinterpret_cast<uint32_t *>(0xfee00020ul);
+        volatile uint32_t *kSpuriousInterruptVector = reinterpret_cast<uint32_t *>(0xfee000f0ul);
+        volatile uint32_t *kInterruptCommandLow = reinterpret_cast<uint32_t *>(0xfee00300ul);
+        volatile uint32_t *kInterruptCommandHigh = reinterpret_cast<uint32_t *>(0xfee00310ul);
+
+        const uint32_t kICRDeliveryStatus = 1 << 12; // １：送信中
+        const uint32_t kICRAssert = 1 << 14;
+        const uint32_t kICRInit = 0x5 << 8;
+        const uint32_t kICRStartup = 0x6 << 8;
+
+        // asmfunc.asmのAPTrampolineParamsと同じ並び
+        struct TrampolineParams {
+            uint64_t cr3;
+            uint64_t stack;
+            uint64_t entry;
+            uint64_t arg;
+        };
+
+        SpinLock stop_lock; // StopOtherCPUs()を同時に呼べるのは１つのCPUだけ
+
+        void SetGSBase(PerCPU *cpu)
+        {
+            WriteMSR(kIA32GSBase, reinterpret_cast<uint64_t>(cpu));
+            WriteMSR(kIA32KernelGSBase, reinterpret_cast<uint64_t>(cpu));
+        }
+
+        void WaitICRIdle()
+        {
+            while (*kInterruptCommandLow & kICRDeliveryStatus) {
+                __builtin_ia32_pause();
+            }
+        }
+
+        // apic_idのLocal APICにプロセッサ間割り込みを送る
+        void WriteICR(uint8_t apic_id, uint32_t command)
+        {
+            *kInterruptCommandHigh = static_cast<uint32_t>(apic_id) << 24;
+            *kInterruptCommandLow = command; // 下位を書いた時に送られる
+            WaitICRIdle();
+        }
+
+        void WaitMicroseconds(uint64_t usec)
+        {
+            uint64_t end = ReadTSC() + timer_manager->TSCPerMillisecond() * usec / 1000;
+            while (ReadTSC() < end) {
+                __builtin_ia32_pause();
+            }
+        }
+
+        // APがトランポリンから最初に呼ぶ関数。ここから戻ることはない。
+        void APMain(PerCPU *cpu)
+        {
+            LoadCPUSegments(cpu->segments);
+            SetGSBase(cpu);
+            LoadInterruptDescriptorTable();
+            InitializeFPUOnAP();
+            InitializeSyscallOnAP();
+            *kSpuriousInterruptVector = 0x1ff; // Local APICを有効にする
+
+            // この処理をアイドルタスクとしてスケジューラに加え、タイマー割り込みを受け始める
+            task_manager->AddCPU();
+            timer_manager->StartOnAP();
+
+            cpu->online = true;
+            __atomic_add_fetch(&num_cpus, 1, __ATOMIC_SEQ_CST);
+            task_manager->Idle();
+        }
+
+        // index番のAPを起動し、APMain()まで来るのを待つ
+        bool StartAP(int index, uint8_t apic_id)
+        {
+            PerCPU *cpu = &cpus[index];
+            cpu->self = cpu;
+            cpu->index = index;
+            cpu->apic_id = apic_id;
+            cpu->segments = NewCPUSegments();
+            cpu->online = false;
+
+            uint64_t stack = reinterpret_cast<uint64_t>(memory_manager->Allocate(kAPStackFrames).Frame());
+            TrampolineParams params{
+                GetCR3(),
+                stack + kAPStackFrames * kBytesPerFrame, // １６バイト境界。トランポリンのcallで８ずれて、APMain()の入口で揃う
+                reinterpret_cast<uint64_t>(APMain),
+                reinterpret_cast<uint64_t>(cpu),
+            };
+            size_t trampoline_size = APTrampolineEnd - APTrampoline;
+            uint8_t *trampoline = reinterpret_cast<uint8_t *>(kTrampolineAddress);
+            memcpy(trampoline, APTrampoline, trampoline_size);
+            memcpy(trampoline + (APTrampolineParams - APTrampoline), &params, sizeof(params));
+
+            // INIT-SIPI-SIPI（SIPIのベクタはトランポリンの置き場所のページ番号）
+            uint32_t vector = kTrampolineAddress >> 12;
+            WriteICR(apic_id, kICRInit | kICRAssert);
+            acpi::WaitMilliseconds(10);
+            for (int i = 0; i < 2 && !cpu->online; i++) {
+                WriteICR(apic_id, kICRStartup | kICRAssert | vector);
+                WaitMicroseconds(200);
+            }
+
+            for (int ms = 0; ms < 100 && !cpu->online; ms++) {
+                acpi::WaitMilliseconds(1);
+            }
+            return cpu->online;
+        }
+    }
+
+    int NumCPUs()
+    {
+        return num_cpus;
+    }
+
+    PerCPU *CPU(int index)
+    {
+        return &cpus[index];
+    }
+
+    void InitializeBSP()
+    {
+        PerCPU *cpu = &cpus[0];
+        cpu->self = cpu;
+        cpu->index = 0;
+        cpu->apic_id = *kLAPICID >> 24;
+        cpu->online = true;
+        SetGSBase(cpu);
+        num_cpus = 1;
+        irqoff::StartTracking();
+    }
+
+    void StartAPs()
+    {
+        logger->info("[+] Start APs\n");
+        if (acpi::apic_reader == nullptr) {
+            return;
+        }
+
+        int index = 1;
+        for (uint8_t apic_id : acpi::apic_reader->LocalAPICIDs()) {
+            if (apic_id == cpus[0].apic_id) {
+                continue;
+            }
+            if (index >= kMaxCPUs) {
+                logger->warning("[smp] too many CPUs. APIC ID %d is not started\n", apic_id);
+                break;
+            }
+            // APは１つずつ起動する（トランポリンと引数の領域を使い回すので）
+            if (StartAP(index, apic_id)) {
+                logger->debug("[smp] CPU %d (APIC ID %d) is online\n", index, apic_id);
+                index++;
+            } else {
+                logger->warning("[smp] failed to start APIC ID %d\n", apic_id);
+            }
+        }
+        logger->info("[smp] %d CPUs\n", NumCPUs());
+    }
+
+    void SendIPI(int index, uint8_t vector)
+    {
+        InterruptGuard guard; // ICRの上位と下位を書く間に、割り込みハンドラが別のIPIを送らないように
+        WriteICR(cpus[index].apic_id, kICRAssert | vector);
+    }
+
+    bool StopOtherCPUs()
+    {
+        // 他のCPUが先に止めようとしていたら、こちらも止められるように割り込みを許可したまま待つ
+        while (!stop_lock.TryLock()) {
+            __builtin_ia32_pause();
+        }
+        bool interrupts_enabled = DisableInterrupts();
+
+        smp_stopped_count = 0;
+        smp_stop_request = 1;
+        int self = CPUIndex();
+        int num_others = 0;
+        for (int i = 0; i < NumCPUs(); i++) {
+            if (i != self && cpus[i].online) {
+                SendIPI(i, InterruptVector::kStopCPU);
+                num_others++;
+            }
+        }
+        while (smp_stopped_count < static_cast<uint64_t>(num_others)) {
+            __builtin_ia32_pause();
+        }
+        return interrupts_enabled;
+    }
+
+    void ResumeOtherCPUs(bool interrupts_enabled)
+    {
+        smp_stop_request = 0;
+        stop_lock.Unlock();
+        RestoreInterrupts(interrupts_enabled);
+    }
+}
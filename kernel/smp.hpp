@@ -0,0 +1,94 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "segment.hpp"
+
+/*
+ * マルチプロセッサ（SMP）の起動とCPUごとのデータ
+ *
+ * BSP（最初から動いているCPU）がMADTに載っているAPをINIT-SIPI-SIPIで起こす。
+ * APはリアルモードで1MiB未満に置いたコード（asmfunc.asmのAPTrampoline）から始まり、
+ * ロングモードに入ってAPMain()に来る。APMain()ではCPUごとのGDT・TSS・LAPICタイマーなどを設定し、
+ * アイドルタスクとしてスケジューラに加わる。
+ *
+ * CPUごとのデータ（PerCPU）はGSベースに置いておき、gs:0x00などで参照する。
+ * アプリにもGSベースはカーネルのものをそのまま見せる（swapgsはしない）。
+ * ただしアプリは mov gs, セレクタ でGSベースを書き換えられるので、IA32_KERNEL_GS_BASEに同じアドレスの写しを置き、
+ * CPL3から入ってきたシステムコール・割り込み・例外の入口でそこからIA32_GS_BASEを書き戻す（RestoreGSBase()）。
+ */
+namespace smp
+{
+    const int kMaxCPUs = 16;
+    const uint64_t kTrampolineAddress = 0x8000; // APが起動するアドレス（SIPIのベクタは0x08）
+    const size_t kSwitchStackBytes = 64;
+
+    // CPUごとのデータ。先頭の５つとfs_baseなどはasmfunc.asmからgs:のオフセットで参照するので並びを変えないこと。
+    struct PerCPU {
+        PerCPU *self; // 0x00：gs:0から自分自身のアドレスを得るため
+        uint8_t *fpu_current_area; // 0x08：実行中のタスクのFPU状態の保存領域（fpu.hpp）
+        uint8_t *fpu_owner_area; // 0x10：遅延切り替えで、いまこのCPUのFPUレジスタに載っている状態の持ち主
+        uint32_t index; // 0x18：CPUの番号（BSPが０で、起動した順に振る）
+        uint32_t apic_id; // 0x1c
+        CPUSegments *segments; // 0x20
+        uint64_t fs_base; // 0x28：実行中（これから実行する）タスクのFSベース（アプリのスレッドローカル記憶域）
+        uint64_t fs_base_loaded; // 0x30：このCPUのIA32_FS_BASEに書き込んである値
+        uint64_t syscall_stack; // 0x38：実行中のタスクがシステムコールで使うカーネルスタックの底（Task::os_stack_pointer_）
+        uint64_t user_rsp; // 0x40：SyscallEntryがカーネルスタックに移るまでアプリのRSPを置いておく
+        // 0x50：SwitchContextが前のタスクのスタックを手放した後、iretのフレームを積むのに使う
+        alignas(16) uint8_t switch_stack[kSwitchStackBytes];
+        volatile bool online;
+
+        // 割り込みを禁止していた時間の計測（spinlock.hppのirqoff）
+        uint64_t irq_off_start; // 割り込みを禁止した時のTSC
+        uint64_t irq_off_max; // 禁止していた時間の最大値（TSCのカウント数）
+        const char *irq_off_max_site;
+        uint64_t irq_off_count;
+    };
+
+    // このCPUのデータ。割り込みを禁止しておかないと、読んだ後に別のCPUへ移っているかもしれない。
+    inline PerCPU *CurrentCPU()
+    {
+        PerCPU *cpu;
+        __asm__ volatile("mov %%gs:0x00, %0" : "=r"(cpu));
+        return cpu;
+    }
+
+    inline int CPUIndex()
+    {
+        uint32_t index;
+        __asm__ volatile("movl %%gs:0x18, %0" : "=r"(index));
+        return index;
+    }
+
+    // IA32_KERNEL_GS_BASEの写しからGSベースを書き戻す（asmfunc.asmのRestoreGSBaseと同じ）。
+    // C++で書いた割り込み・例外ハンドラの最初で、CPL3から入ってきた時（フレームのCSの下位２ビットが３）に呼ぶ。
+    inline void RestoreGSBase()
+    {
+        __asm__ volatile(
+            "movl $0xc0000102, %%ecx\n\t" // IA32_KERNEL_GS_BASE
+            "rdmsr\n\t"
+            "movl $0xc0000101, %%ecx\n\t" // IA32_GS_BASE
+            "wrmsr"
+            ::: "rax", "rcx", "rdx", "memory");
+    }
+
+    int NumCPUs(); // 起動済みのCPUの数
+    PerCPU *CPU(int index);
+
+    // BSPのCPUごとのデータをGSベースに設定する。InitializeTSS()の後、FPUやタスクの初期化より前に呼ぶこと。
+    void InitializeBSP();
+    // MADTに載っているAPを起動する。タスク管理とシステムコールの初期化が済んだ後に呼ぶこと。
+    void StartAPs();
+
+    // index番のCPUに割り込みvectorを送る
+    void SendIPI(int index, uint8_t vector);
+
+    // 他のCPUを割り込みハンドラの中で待たせる（FPUのモードの変更など、全てのCPUの状態を揃える必要がある時に使う）。
+    // 止めている間、他のCPUのFPUレジスタは実行中のタスクのものになっている。
+    // 割り込みを許可した状態のタスクから呼ぶこと。StopOtherCPUs()は割り込みを禁止し、禁止する前の状態を返すので、
+    // それをResumeOtherCPUs()に渡す。
+    bool StopOtherCPUs();
+    void ResumeOtherCPUs(bool interrupts_enabled);
+}
@@ -0,0 +1,55 @@
+#include "spinlock.hpp"
+#include "asmfunc.h"
+#include "smp.hpp"
+
+namespace irqoff
+{
+    namespace {
+        bool tracking = false;
+    }
+
+    void StartTracking()
+    {
+        tracking = true;
+    }
+
+    void Begin()
+    {
+        if (!tracking) {
+            return;
+        }
+        smp::CurrentCPU()->irq_off_start = ReadTSC();
+    }
+
+    void End(const char *site)
+    {
+        if (!tracking) {
+            return;
+        }
+        smp::PerCPU *cpu = smp::CurrentCPU();
+        uint64_t elapsed = ReadTSC() - cpu->irq_off_start;
+        cpu->irq_off_count++;
+        if (elapsed > cpu->irq_off_max) {
+            cpu->irq_off_max = elapsed;
+            cpu->irq_off_max_site = site;
+        }
+    }
+
+    Stats Get(int cpu_index)
+    {
+        InterruptGuard guard;
+        smp::PerCPU *cpu = smp::CPU(cpu_index);
+        return Stats{cpu->irq_off_max, cpu->irq_off_max_site, cpu->irq_off_count};
+    }
+
+    void Reset()
+    {
+        InterruptGuard guard;
+        for (int i = 0; i < smp::NumCPUs(); i++) {
+            smp::PerCPU *cpu = smp::CPU(i);
+            cpu->irq_off_max = 0;
+            cpu->irq_off_max_site = nullptr;
+            cpu->irq_off_count = 0;
+        }
+    }
+}
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * 割り込みの禁止・復帰とスピンロック
+ *
+ * 複数のCPUから触られるデータはスピンロックで守る。
+ * ロックを持ったまま割り込みハンドラで同じロックを取ろうとすると抜け出せなくなるので、
+ * タスクから取る時はIRQSaveLockGuardを使い、割り込みを禁止してからロックを取ること。
+ * 割り込みハンドラの中（すでに割り込みが禁止されている）ではLockGuardでよい。
+ *
+ * InterruptGuardは割り込み許可フラグ（RFLAGS.IF）を保存してから割り込みを禁止し、スコープを抜ける時に元に戻す。
+ * もともと禁止されていた場所で使っても、抜けた時に勝手に許可してしまうことはない。
+ */
+
+// 割り込みを禁止し、禁止する前に割り込みが許可されていたかを返す
+inline bool DisableInterrupts()
+{
+    uint64_t rflags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rflags) : : "memory");
+    return rflags & 0x200; // IF
+}
+
+// DisableInterrupts()の返り値を渡して割り込み許可フラグを元に戻す
+inline void RestoreInterrupts(bool enabled)
+{
+    if (enabled) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
+
+/*
+ * 割り込みを禁止していた時間の計測
+ * InterruptGuard（とIRQSaveLockGuard）で許可から禁止に変わった区間の長さをCPUごとに測り、最大値とその場所を記録する。
+ * 割り込みハンドラの中やアセンブリでの禁止は数えない。
+ */
+namespace irqoff
+{
+    struct Stats {
+        uint64_t max_tsc; // 最も長く割り込みを禁止していた時間（TSCのカウント数）
+        const char *max_site; // その区間で割り込みを禁止した関数
+        uint64_t count; // 計測した区間の数
+    };
+
+    // CPUごとのデータ（smp::PerCPU）が使えるようになってから呼ぶ。それまでは計測しない。
+    void StartTracking();
+    void Begin(); // 割り込みを禁止した直後に呼ぶ
+    void End(const char *site); // 割り込みを許可する直前に呼ぶ
+    Stats Get(int cpu);
+    void Reset(); // 全てのCPUの記録を消す
+}
+
+
+class InterruptGuard
+{
+public:
+    explicit InterruptGuard(const char *site = __builtin_FUNCTION()) : site_{site}
+    {
+        enabled_ = DisableInterrupts();
+        if (enabled_) {
+            irqoff::Begin();
+        }
+    }
+
+    ~InterruptGuard()
+    {
+        if (enabled_) {
+            irqoff::End(site_);
+            RestoreInterrupts(true);
+        }
+    }
+
+    InterruptGuard(const InterruptGuard &) = delete;
+    InterruptGuard &operator=(const InterruptGuard &) = delete;
+
+private:
+    const char *site_;
+    bool enabled_;
+};
+
+
+// test-and-setのスピンロック。取り合いが少ない所で使う（待っているCPUの順番は保証しない）。
+class SpinLock
+{
+public:
+    void Lock()
+    {
+        while (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&locked_, __ATOMIC_RELAXED)) { // 解放されるまでは読むだけにしてバスを占有しない
+                __builtin_ia32_pause();
+            }
+        }
+    }
+
+    bool TryLock()
+    {
+        return !__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE);
+    }
+
+    void Unlock()
+    {
+        __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE);
+    }
+
+    bool IsLocked() const { return __atomic_load_n(&locked_, __ATOMIC_RELAXED); }
+
+private:
+    uint32_t locked_{0};
+};
+
+
+// チケットロック。取りに来た順にロックを渡すので、取り合いが多くても特定のCPUが待たされ続けることがない。
+class TicketSpinLock
+{
+public:
+    void Lock()
+    {
+        uint32_t ticket = __atomic_fetch_add(&next_, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&owner_, __ATOMIC_ACQUIRE) != ticket) {
+            __builtin_ia32_pause();
+        }
+    }
+
+    bool TryLock()
+    {
+        uint32_t owner = __atomic_load_n(&owner_, __ATOMIC_RELAXED);
+        uint32_t expected = owner;
+        // 誰も待っていない（次のチケットが今の持ち主の番号）時だけ取る
+        return __atomic_compare_exchange_n(&next_, &expected, owner + 1, false,
+            __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+    }
+
+    void Unlock()
+    {
+        // 持ち主しか書き換えないので、読んでから書いてよい
+        __atomic_store_n(&owner_, owner_ + 1, __ATOMIC_RELEASE);
+    }
+
+    bool IsLocked() const
+    {
+        return __atomic_load_n(&next_, __ATOMIC_RELAXED) != __atomic_load_n(&owner_, __ATOMIC_RELAXED);
+    }
+
+private:
+    uint32_t next_{0}; // 次に配るチケット
+    uint32_t owner_{0}; // ロックを持っているチケット
+};
+
+
+// スコープの間ロックを持つ。割り込みは操作しないので、割り込みハンドラの中や、すでに禁止している所で使う。
+template <class L>
+class LockGuard
+{
+public:
+    explicit LockGuard(L &lock) : lock_{lock} { lock_.Lock(); }
+    ~LockGuard() { lock_.Unlock(); }
+
+    LockGuard(const LockGuard &) = delete;
+    LockGuard &operator=(const LockGuard &) = delete;
+
+private:
+    L &lock_;
+};
+
+
+// 割り込みを禁止してからロックを取り、スコープを抜ける時にロックを外して割り込み許可フラグを元に戻す
+template <class L>
+class IRQSaveLockGuard
+{
+public:
+    explicit IRQSaveLockGuard(L &lock, const char *site = __builtin_FUNCTION()) :
+        interrupt_guard_{site}, lock_guard_{lock} {}
+
+private:
+    InterruptGuard interrupt_guard_; // メンバは宣言の逆順に破棄されるので、ロックを外してから割り込みを戻す
+    LockGuard<L> lock_guard_;
+};
@@ -1,10 +1,22 @@
 #include "syscall.hpp"
 #include "task.hpp"
+#include "timer.hpp"
+#include "terminal.hpp"
+#include "uring.hpp"
+#include "futex.hpp"
+#include "process.hpp"
+#include "shm.hpp"
+#include "run_application.hpp"
 #include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <utility>
 
 int printk(const char *format, ...);
 extern logging::Logger *logger;
 extern TaskManager* task_manager;
+extern TimerManager *timer_manager;
+extern Terminal *terminal;
 
 
 #define IA32_EFER_ADDRESS 0xc000'0080u
@@ -12,6 +24,13 @@ extern TaskManager* task_manager;
 #define IA32_LSTAR_ADDRESS 0xc000'0082u
 #define IA32_FMASK_ADDRESS 0xc000'0084u
 
+/* 
+ * rax: 返り値
+ * rdi, rsi, rdx, rcx, r8, r9が引数
+ */
+using SyscallFuncType = int64_t (uint64_t, uint64_t, uint64_t,
+                                 uint64_t, uint64_t, uint64_t);
+
 namespace syscall
 {
     #define SYSCALL(name) \
@@ -23,30 +42,270 @@ namespace syscall
         return static_cast<int64_t>(arg1); // exit(0)のように呼ばれたら、0を返す
     }
 
-    SYSCALL(SyscallLogString) { // 文字列の出力（syscall number 1）
-        printk(reinterpret_cast<char *>(arg1));
+    SYSCALL(LogString) { // 文字列の出力（syscall number 1）
+        // 書式として解釈しないよう、コピーしてから%sで出力する
+        char s[256] = {};
+        if (!IsUserRange(arg1, sizeof(s) - 1)) {
+            return -1;
+        }
+        strncpy(s, reinterpret_cast<const char *>(arg1), sizeof(s) - 1);
+        printk("%s", s);
+        return 0;
+    }
+
+    SYSCALL(Nanosleep) { // arg1ナノ秒だけスリープする（syscall number 2）
+        Task *task = task_manager->CurrentTask();
+        task->SleepFor(arg1);
+        return 0;
+    }
+
+    SYSCALL(ClockNanosleep) { // 起動してからの時刻arg1（ナノ秒）までスリープする（syscall number 3）
+        Task *task = task_manager->CurrentTask();
+        task->SleepUntil(arg1);
+        return 0;
+    }
+
+    // GetTaskUsageでアプリに返す構造体（application/sys/syscall.hppのTaskUsageと同じ並び）
+    struct TaskUsageInfo {
+        uint64_t run_ns;
+        uint64_t wait_ns;
+        uint64_t wakeups;
+        uint64_t voluntary_switches;
+        uint64_t involuntary_switches;
+    };
+
+    SYSCALL(GetTaskUsage) { // 呼び出したタスクのCPU使用量をarg1の指す構造体に書き込む（syscall number 4）
+        if (!IsUserRange(arg1, sizeof(TaskUsageInfo), alignof(TaskUsageInfo))) {
+            return -1;
+        }
+        TaskUsage usage = task_manager->Usage(task_manager->CurrentTask());
+        TaskUsageInfo *info = reinterpret_cast<TaskUsageInfo *>(arg1);
+        info->run_ns = timer_manager->TSCToNanoseconds(usage.run_tsc);
+        info->wait_ns = timer_manager->TSCToNanoseconds(usage.wait_tsc);
+        info->wakeups = usage.wakeups;
+        info->voluntary_switches = usage.voluntary_switches;
+        info->involuntary_switches = usage.involuntary_switches;
+        return 0;
+    }
+
+    SYSCALL(CreateGroup) { // 名前arg1のタスクのグループを作り、そのidを返す（syscall number 5）
+        char name[16] = {};
+        if (arg1 != 0) {
+            if (!IsUserRange(arg1, sizeof(name) - 1)) {
+                return -1;
+            }
+            strncpy(name, reinterpret_cast<const char *>(arg1), sizeof(name) - 1);
+        }
+        return task_manager->NewGroup(name);
+    }
+
+    SYSCALL(SetGroupQuota) { // グループarg1のクォータをarg3 msごとにarg2 msにする。arg2が０なら制限を外す（syscall number 6）
+        return task_manager->SetGroupQuota(static_cast<int>(arg1), arg2, arg3);
+    }
+
+    SYSCALL(MoveToGroup) { // タスクarg1（０なら自分）をグループarg2に移す（syscall number 7）
+        // 移せるのは自分と同じプロセスのタスクだけ（ターミナルなどカーネルのタスクを絞られないように）
+        Task *task = task_manager->CurrentTask();
+        if (task->GetProcess() == nullptr) {
+            return -1;
+        }
+        uint64_t task_id = arg1 != 0 ? arg1 : task->ID();
+        return task_manager->MoveToGroup(task_id, static_cast<int>(arg2), task->GetProcess());
+    }
+
+    const size_t kMaxWriteBytes = 4096; // １回のwriteで書き込む最大のバイト数（超えた分は書かずに返る）
+
+    int64_t WriteUserBuffer(uint64_t fd, uint64_t buf, uint64_t len)
+    {
+        if (fd != 1 && fd != 2) { // 今は標準出力と標準エラー出力（どちらもターミナル）だけ
+            return -1;
+        }
+        if (len == 0) {
+            return 0;
+        }
+        len = std::min<uint64_t>(len, kMaxWriteBytes);
+        if (!IsUserRange(buf, len)) {
+            return -1;
+        }
+        if (terminal == NULL) {
+            return -1;
+        }
+
+        // 書き込んでいる間にアプリの他のスレッドに書き換えられても困らないよう、一度だけコピーしてから渡す
+        char *kbuf = reinterpret_cast<char *>(malloc(len));
+        if (kbuf == NULL) {
+            return -1;
+        }
+        memcpy(kbuf, reinterpret_cast<const char *>(buf), len);
+        terminal->Write(kbuf, len);
+        free(kbuf);
+        return static_cast<int64_t>(len);
+    }
+
+    SYSCALL(Write) { // fd arg1にarg2からarg3バイト書き込み、書き込んだバイト数を返す（syscall number 8）
+        return WriteUserBuffer(arg1, arg2, arg3);
+    }
+
+    SYSCALL(RingSetup) { // 投入・完了リングを作ってマップし、そのアドレスを返す。arg1はflags（syscall number 9）
+        uint64_t addr = uring::Setup(static_cast<uint32_t>(arg1));
+        return addr ? static_cast<int64_t>(addr) : -1;
+    }
+
+    SYSCALL(RingEnter) { // arg1個まで投入を処理し、arg2個の完了を待つ。arg3はflags（syscall number 10）
+        return uring::Enter(static_cast<uint32_t>(arg1), static_cast<uint32_t>(arg2), static_cast<uint32_t>(arg3));
+    }
+
+    SYSCALL(FutexWait) { // *arg1がarg2ならFutexWakeされるかarg3ナノ秒経つまで眠る（syscall number 11）
+        return futex::Wait(arg1, static_cast<uint32_t>(arg2), arg3);
+    }
+
+    SYSCALL(FutexWake) { // arg1で眠っているタスクを最大arg2個起こす（syscall number 12）
+        return futex::Wake(arg1, static_cast<uint32_t>(arg2));
+    }
+
+    SYSCALL(ThreadCreate) { // arg1(arg2, arg3)を実行するスレッドを作り、idを返す。arg4はFSベース（syscall number 13）
+        return CreateAppThread(arg1, arg2, arg3, arg4);
+    }
+
+    SYSCALL(ThreadExit) { // 呼び出したスレッドだけを終わらせる。Exitと同じく、返り値はSyscallEntryがCallAppの呼び出し元に返す（syscall number 14）
+        return static_cast<int64_t>(arg1);
+    }
+
+    SYSCALL(ThreadJoin) { // スレッドarg1の終了を待ち、返り値をarg2の指す場所に書き込む（syscall number 15）
+        if (arg2 != 0 && !IsUserRange(arg2, sizeof(int64_t), alignof(int64_t))) {
+            return -1;
+        }
+        int64_t status;
+        if (JoinAppThread(arg1, &status) < 0) {
+            return -1;
+        }
+        if (arg2 != 0) {
+            *reinterpret_cast<int64_t *>(arg2) = status;
+        }
         return 0;
     }
 
+    SYSCALL(Sbrk) { // ヒープの終わりをarg1バイト動かし、動かす前の終わりを返す（syscall number 16）
+        Process *process = task_manager->CurrentTask()->GetProcess();
+        if (process == nullptr) {
+            return -1;
+        }
+        uint64_t prev = process->Sbrk(static_cast<int64_t>(arg1));
+        return prev ? static_cast<int64_t>(prev) : -1;
+    }
+
+    SYSCALL(ShmMap) { // 名前arg1の共有メモリ（なければarg2バイトで作る）をマップし、そのアドレスを返す（syscall number 17）
+        uint64_t addr = shm::Map(arg1, arg2);
+        return addr ? static_cast<int64_t>(addr) : -1;
+    }
+
     #undef SYSCALL
 
-}
+    namespace {
+        // 番号順のシステムコールの関数（syscall_list.incから作る）
+        constexpr std::array<SyscallFuncType*, kNumSyscalls> kHandlers{
+        #define SYSCALL_ENTRY(number, name, num_args, args, params) name,
+        #include "syscall_list.inc"
+        #undef SYSCALL_ENTRY
+        };
 
-/* 
- * rax: 返り値
- * rdi, rsi, rdx, rcx, r8, r9が引数
- */
-using SyscallFuncType = int64_t (uint64_t, uint64_t, uint64_t,
-                                 uint64_t, uint64_t, uint64_t);
+        constexpr std::array<Info, kNumSyscalls> kInfos{{
+        #define SYSCALL_ENTRY(number, name, num_args, args, params) {#name, num_args, args},
+        #include "syscall_list.inc"
+        #undef SYSCALL_ENTRY
+        }};
+
+        constexpr bool NumbersAreDense()
+        {
+            size_t index = 0;
+        #define SYSCALL_ENTRY(number, name, num_args, args, params) if (number != index++) return false;
+        #include "syscall_list.inc"
+        #undef SYSCALL_ENTRY
+            return true;
+        }
+        static_assert(NumbersAreDense(), "syscall_list.incの番号は０から順に並べること");
+
+        // 呼び出しの回数と時間の統計。全てのCPUから足し込むのでアトミックに更新する。
+        std::array<Stats, kNumSyscalls> stats{};
+        bool stats_enabled = false;
+
+        void Record(size_t number, uint64_t tsc)
+        {
+            Stats &s = stats[number];
+            __atomic_fetch_add(&s.calls, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&s.total_tsc, tsc, __ATOMIC_RELAXED);
+            uint64_t max = __atomic_load_n(&s.max_tsc, __ATOMIC_RELAXED);
+            while (tsc > max && 
+                   !__atomic_compare_exchange_n(&s.max_tsc, &max, tsc, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            }
+            int bucket = std::min(63 - __builtin_clzll(tsc | 1), kHistogramBuckets - 1);
+            __atomic_fetch_add(&s.histogram[bucket], 1, __ATOMIC_RELAXED);
+        }
+
+        // 番号Nのシステムコールを呼び、かかった時間を記録する。統計を取る間だけsyscall_tableに入れる。
+        template <size_t N>
+        int64_t Instrumented(uint64_t arg1, uint64_t arg2, uint64_t arg3,
+                             uint64_t arg4, uint64_t arg5, uint64_t arg6)
+        {
+            uint64_t start = ReadTSC();
+            int64_t ret = kHandlers[N](arg1, arg2, arg3, arg4, arg5, arg6);
+            Record(N, ReadTSC() - start);
+            return ret;
+        }
+
+        template <size_t... N>
+        constexpr std::array<SyscallFuncType*, kNumSyscalls> MakeInstrumented(std::index_sequence<N...>)
+        {
+            return {Instrumented<N>...};
+        }
+
+        constexpr std::array<SyscallFuncType*, kNumSyscalls> kInstrumented = 
+            MakeInstrumented(std::make_index_sequence<kNumSyscalls>{});
+    }
+}
 
 /* 
  * syscallが呼ばれた時に実行される関数を管理
- * syscall_table[rax]が呼び出される関数
+ * syscall_table[rax]が呼び出される関数（raxがnum_syscalls以上ならSyscallEntryで−１を返す）
+ * 統計を取る間は、計測するための関数に入れ替える。
  */
-extern "C" std::array<SyscallFuncType*, 2> syscall_table{
-    syscall::Exit,
-    syscall::SyscallLogString, 
-};
+extern "C" std::array<SyscallFuncType*, syscall::kNumSyscalls> syscall_table = syscall::kHandlers;
+extern "C" const uint64_t num_syscalls = syscall::kNumSyscalls;
+
+namespace syscall
+{
+    const Info &GetInfo(size_t number)
+    {
+        return kInfos[number];
+    }
+
+    void EnableStats(bool enable)
+    {
+        // 各要素の書き換えは８バイトの１回の書き込みなので、他のCPUは古いか新しい関数のどちらかを呼ぶ
+        const std::array<SyscallFuncType*, kNumSyscalls> &table = enable ? kInstrumented : kHandlers;
+        for (size_t i = 0; i < kNumSyscalls; i++) {
+            syscall_table[i] = table[i];
+        }
+        stats_enabled = enable;
+    }
+
+    bool StatsEnabled()
+    {
+        return stats_enabled;
+    }
+
+    Stats GetStats(size_t number)
+    {
+        return stats[number];
+    }
+
+    void ResetStats()
+    {
+        for (Stats &s : stats) {
+            s = Stats{};
+        }
+    }
+}
 
 
 /* 
@@ -56,18 +315,19 @@ extern "C" std::array<SyscallFuncType*, 2> syscall_table{
 // 現在実行中のアプリケーションを呼び出したときのOSスタックの値を返す。
 extern "C" uint64_t GetOSStackInExitSyscall()
 {
-    __asm__("cli");
-    Task *task = task_manager->CurrentTask();
-    __asm__("sti");
-    return task->GetOSStackPointer();
+    return task_manager->CurrentTask()->GetOSStackPointer();
 }
 
 
 void InitializeSyscall()
 {
-    /* MSRの値を設定してゆく、、、 */
     logger->info("[+] Set syscall enable\n");
+    InitializeSyscallOnAP();
+}
 
+void InitializeSyscallOnAP()
+{
+    /* MSRの値を設定してゆく、、、 */
     IA32_EFER efer;
     efer.bits.ia32e_mode_active = 1;
     efer.bits.ia32e_mode_enable = 1;
@@ -87,7 +347,7 @@ void InitializeSyscall()
     WriteMSR(IA32_LSTAR_ADDRESS, lstar.data);
 
     IA32_FMASK fmask;
-    fmask.syscall_rflags = 0;
+    fmask.syscall_rflags = 1 << 9; // IF。SyscallEntryがGSベースを書き戻すまで割り込みを禁止する
     logger->debug("IA32_FMASK: 0x%lx\n", fmask.data);
     WriteMSR(IA32_FMASK_ADDRESS, fmask.data);
 }
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
+
 #include "asmfunc.h"
 #include "logging.hpp"
 #include "msr.hpp"
@@ -12,4 +15,48 @@
  * 設定はMSRということになっている。
  */
 void InitializeSyscall();
+// MSRはCPUごとにあるので、APでも同じ設定を行う
+void InitializeSyscallOnAP();
+
+/* 
+ * システムコールの一覧はsyscall_list.incに１行ずつ
+ *   SYSCALL_ENTRY(番号, 名前, 引数の数, "引数の名前", (アプリから見た引数の型と名前))
+ * の形で書き、カーネルのsyscall_table・名前などの情報と、アプリの呼び出し用の関数
+ * （application/sys/syscall.asmのSyscall<名前>）とその宣言（application/sys/syscall.hpp）を
+ * そこから作る。アプリから見た返り値はどれもカーネルと同じ64ビット（long）になる。
+ * 番号は０から順に並べること。カーネルの関数はsyscall::<名前>として定義する。
+ */
+namespace syscall
+{
+    constexpr size_t kNumSyscalls = 0
+    #define SYSCALL_ENTRY(number, name, num_args, args, params) + 1
+    #include "syscall_list.inc"
+    #undef SYSCALL_ENTRY
+        ;
+
+    struct Info {
+        const char *name;
+        int num_args;
+        const char *args; // 引数の名前（"fd, buf, len"のように並べたもの）
+    };
+    const Info &GetInfo(size_t number);
+
+    // システムコールごとの呼び出しの統計（TSCのカウント数）
+    // histogram[i]は、かかった時間が[2^i, 2^(i+1))だった回数（最後はそれ以上の全て）。
+    const int kHistogramBuckets = 32;
+    struct Stats {
+        uint64_t calls;
+        uint64_t total_tsc;
+        uint64_t max_tsc;
+        uint64_t histogram[kHistogramBuckets];
+    };
+    // 統計を取るかどうか。取らない間はsyscall_tableに計測しない関数が入っているので、何も足されない。
+    void EnableStats(bool enable);
+    bool StatsEnabled();
+    Stats GetStats(size_t number);
+    void ResetStats();
 
+    // write()システムコールの本体。アプリのbufからlenバイト（最大4096）をfdに書き込み、書き込んだバイト数を返す。
+    // 呼ぶタスクのアドレス空間にbufがマップされていること（投入リングのポーリングタスクからも使う）。
+    int64_t WriteUserBuffer(uint64_t fd, uint64_t buf, uint64_t len);
+}
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <algorithm>
+#include <new>
 
 #include "task.hpp"
 #include "asmfunc.h"
@@ -7,6 +8,12 @@
 #include "timer.hpp"
 #include "logging.hpp"
 #include "memory_manager.hpp"
+#include "paging.hpp"
+#include "process.hpp"
+#include "fpu.hpp"
+#include "interrupt.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 extern BitmapMemoryManager* memory_manager;
 extern TaskManager* task_manager;
 extern TimerManager *timer_manager;
@@ -16,7 +23,7 @@ namespace {
     // アイドルタスク（ずっと何もせずCPUを休ませてくれるタスク）
     void IdleTask(uint64_t id, int64_t data)
     {
-        while (1) __asm__("hlt");
+        task_manager->Idle();
     }
 
     // 第一引数で指定したdequeから要素valueを消去する関数（必ずしもdequeである必要はない）
@@ -25,9 +32,49 @@ namespace {
         auto it = std::remove(c.begin(), c.end(), value);
         c.erase(it, c.end());
     }
+
+    // nice値に対応する重み（Linuxのsched_prio_to_weightと同じ値）。nice値が１違うと約１．２５倍の差になる。
+    const int kMinNice = -20;
+    const int kMaxNice = 19;
+    const uint32_t kNiceToWeight[kMaxNice - kMinNice + 1] = {
+        88761, 71755, 56483, 46273, 36291, // -20
+        29154, 23254, 18705, 14949, 11916, // -15
+         9548,  7620,  6100,  4904,  3906, // -10
+         3121,  2501,  1991,  1586,  1277, //  -5
+         1024,   820,   655,   526,   423, //   0
+          335,   272,   215,   172,   137, //   5
+          110,    87,    70,    56,    45, //  10
+           36,    29,    23,    18,    15, //  15
+    };
+    const uint32_t kNice0Weight = 1024;
+
+    // vruntimeの比較。周回しても大小関係が崩れないように差の符号で比べる。
+    bool VruntimeLess(uint64_t a, uint64_t b)
+    {
+        return static_cast<int64_t>(a - b) < 0;
+    }
+}
+
+Task::Task(uint64_t id) : Task(id, {}, {})
+{
+}
+
+Task::Task(uint64_t id, std::vector<uint64_t> &&stack, std::vector<uint8_t> &&fpu_buf) : 
+    id_{id}, stack_{std::move(stack)}, fpu_buf_{std::move(fpu_buf)}
+{
+    fpu_buf_.resize(FPUAreaSize() + 63);
+    fpu_area_ = reinterpret_cast<uint8_t *>((reinterpret_cast<uintptr_t>(fpu_buf_.data()) + 63) & ~uintptr_t{63});
+    InitFPUArea(fpu_area_);
 }
 
-Task::Task(uint64_t id) : id_{id} {}
+void Task::Recycle(uint64_t id)
+{
+    // スタックとFPUの保存領域だけを残し、他のメンバは全て作り直す
+    std::vector<uint64_t> stack = std::move(stack_);
+    std::vector<uint8_t> fpu_buf = std::move(fpu_buf_);
+    this->~Task();
+    new (this) Task(id, std::move(stack), std::move(fpu_buf));
+}
 
 Task *Task::InitContext(TaskFunc *f, int64_t data)
 {
@@ -36,7 +83,8 @@ Task *Task::InitContext(TaskFunc *f, int64_t data)
     uint64_t stack_end = reinterpret_cast<uint64_t>(&stack_[stack_size]);
 
     memset(&context_, 0, sizeof(context_)); // コンテキストを０で初期化
-    context_.cr3 = GetCR3(); // カーネルと同じページテーブルを使用する
+    // カーネルと同じページテーブルを使用する（アプリのタスクから作られても、そのアドレス空間は引き継がない）
+    context_.cr3 = process_ ? process_->CR3() : KernelCR3();
     context_.rflags = 0x202; // 割り込みを許可する設定
     context_.cs = kKernelCS;
     context_.ss = kKernelSS;
@@ -48,9 +96,14 @@ Task *Task::InitContext(TaskFunc *f, int64_t data)
     context_.rdi = id_;
     context_.rsi = data;
 
-      // MXCSR のすべての例外をマスクする
-      // TODO: ここよく分からんが後で、、
-    *reinterpret_cast<uint32_t*>(&context_.fxsave_area[24]) = 0x1f80;
+    InitFPUArea(fpu_area_); // MXCSR のすべての例外をマスクするなど、FPUを初期状態にする
+    return this;
+}
+
+Task *Task::SetProcess(Process *process)
+{
+    process_ = process;
+    context_.cr3 = process ? process->CR3() : KernelCR3();
     return this;
 }
 
@@ -76,15 +129,30 @@ Task *Task::Wakeup(int level)
     return this;
 }
 
+Task *Task::SleepFor(uint64_t ns)
+{
+    return SleepUntil(timer_manager->MonotonicNanoseconds() + ns);
+}
+
+Task *Task::SleepUntil(uint64_t deadline_ns)
+{
+    task_manager->SleepUntil(this, NanosecondsToTicks(deadline_ns));
+    return this;
+}
+
 void Task::SendMessage(const Message msg)
 {
-    msgs_.push_back(msg);
+    {
+        IRQSaveLockGuard<SpinLock> guard{msgs_lock_};
+        msgs_.push_back(msg);
+    }
     Wakeup();
 }
 
 Message Task::ReceiveMessage()
 {
     Message msg;
+    IRQSaveLockGuard<SpinLock> guard{msgs_lock_};
     if (msgs_.empty()) {
         msg.type = Message::Type::kNullMessage;
     } else {
@@ -95,6 +163,12 @@ Message Task::ReceiveMessage()
     return msg;
 }
 
+int Task::NumMessages()
+{
+    IRQSaveLockGuard<SpinLock> guard{msgs_lock_};
+    return msgs_.size();
+}
+
 Task *Task::SetLevel(int level)
 {
     level_ = level;
@@ -107,165 +181,1501 @@ Task *Task::SetRunning(bool running)
     return this;
 }
 
+Task *Task::SetAffinity(int cpu)
+{
+    affinity_ = cpu;
+    return this;
+}
+
+Task *Task::SetPolicy(SchedPolicy policy)
+{
+    if (policy_ == SchedPolicy::kDeadline && policy != SchedPolicy::kDeadline) {
+        task_manager->ClearDeadline(this);
+    }
+    policy_ = policy;
+    return this;
+}
+
+Task *Task::SetJoinable(bool joinable)
+{
+    joinable_ = joinable;
+    return this;
+}
+
+Task *Task::SetNice(int nice)
+{
+    nice = std::min(std::max(nice, kMinNice), kMaxNice);
+    nice_ = nice;
+    weight_ = kNiceToWeight[nice - kMinNice];
+    return this;
+}
+
 
 TaskManager::TaskManager()
 {
-    // OS用のタスクを最大優先度で現在実行中とする
+    for (int i = 0; i < smp::kMaxCPUs; i++) {
+        run_queues_[i].index = i;
+    }
+    RunQueue &rq = LocalRunQueue(); // BSPのキュー
+
+    // OS用のタスクを最大優先度で現在実行中とする。
+    // レイヤーや端末の処理は割り込みの禁止で排他しているので、BSPから動かさない。
     Task *task = NewTask()
-        ->SetLevel(current_level_)
-        ->SetRunning(true);
-    running_[current_level_].push_back(task);
+        ->SetLevel(kMaxLevel)
+        ->SetRunning(true)
+        ->SetAffinity(0);
+    rq.running[kMaxLevel].push_back(task);
+    rq.current = task;
+    task->run_start_tsc_ = ReadTSC();
+    SetInitialFPUArea(task->FPUArea());
 
     // 何もしないタスクを入れておく
     Task *idle_task = NewTask()
         ->InitContext(IdleTask, 0)
         ->SetLevel(0)
-        ->SetRunning(true);
-    running_[0].push_back(idle_task);
+        ->SetRunning(true)
+        ->SetAffinity(0);
+    rq.running[0].push_back(idle_task);
+    rq.idle = idle_task;
 }
 
 Task *TaskManager::NewTask()
 {
-    latest_id_++;
-    tasks_.push_back(new Task(latest_id_));
-    return tasks_.back();
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    ReapLocked();
+    latest_id_++; // idは使い回さないので、終了したタスクのidで別のタスクが見つかることはない
+    Task *task;
+    if (free_tasks_.empty()) {
+        task = new Task(latest_id_);
+        pool_stats_.allocated++;
+    } else {
+        task = free_tasks_.back();
+        free_tasks_.pop_back();
+        task->Recycle(latest_id_);
+        pool_stats_.recycled++;
+    }
+    tasks_.push_back(task);
+    Task *creator = LocalRunQueue().current; // 作ったタスクのグループを引き継ぐ（起動中はまだない）
+    task->group_ = creator ? creator->group_ : nullptr;
+    return task;
 }
 
-void TaskManager::SwitchTask(const TaskContext *current_ctx)
+void TaskManager::Exit(int64_t status)
 {
-    TaskContext *current_task_ctx = task_manager->CurrentTask()->Context();
-    memcpy(current_task_ctx, current_ctx, sizeof(TaskContext));
+    InterruptGuard guard; // 戻らないので、割り込みの状態は次のタスクのコンテキストで元に戻る
+    lock_.Lock();
+    RunQueue &rq = LocalRunQueue();
+    Task *task = rq.current;
+    task->exit_status_ = status;
+    task->exited_ = true;
+    task->SetRunning(false);
+    task->wakeup_pending_ = false;
+    if (task->policy_ == SchedPolicy::kDeadline) { // 予約を返す（ポリシーはSelectNext()が使うのでそのまま）
+        dl_bandwidth_ -= (task->dl_runtime_ << kBandwidthShift) / task->dl_period_;
+    }
+    // FPUレジスタの持ち主が終了するタスクのままだと、再利用した後に別のタスクの領域へ保存されてしまう
+    DropFPUArea(task->FPUArea());
+    zombies_.push_back(task);
+    for (Task *joiner : task->joiners_) {
+        WakeupLocked(joiner, -1); // この後すぐに切り替えるので、プリエンプションの判定は要らない
+    }
+    ReapLocked(); // 先に終了したタスクがあれば回収しておく（このタスクは切り替わるまで回収されない）
+    trace::Emit(trace::Event::kExit, task->ID(), static_cast<uint64_t>(status));
+    Reschedule(true, true); // 二度と選ばれないので戻ってこない
+    __builtin_unreachable();
+}
 
-    Task *current_task = RotateCurrentRunQueue(false);
-    if (CurrentTask() != current_task) { // 次に実行すべきタスクが変更している場合
-        RestoreContext(CurrentTask()->Context());
+int TaskManager::Join(uint64_t id, int64_t *status)
+{
+    Task *self = CurrentTask();
+    Task *task;
+    {
+        IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+        task = FindTask(id);
+        if (task == nullptr || task == self || !task->joinable_) {
+            return -1;
+        }
+        task->joiners_.push_back(self);
     }
+
+    // Exit()が先に起こしていれば、起こされたのが残っているのでSleep()はすぐに戻る
+    while (!task->exited_) {
+        self->Sleep();
+    }
+
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    if (status) {
+        *status = task->exit_status_;
+    }
+    Erase(task->joiners_, self);
+    task->joined_ = true;
+    ReapLocked();
+    return 0;
 }
 
-Task *TaskManager::RotateCurrentRunQueue(bool current_sleep)
+int TaskManager::Detach(uint64_t id)
 {
-    Task *current_task = running_[current_level_].front();
-    running_[current_level_].pop_front();
-    if (!current_sleep) {
-        running_[current_level_].push_back(current_task);
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    Task *task = FindTask(id);
+    if (task == nullptr || !task->joiners_.empty()) {
+        return -1;
     }
+    task->joinable_ = false;
+    ReapLocked();
+    return 0;
+}
 
-    // 優先度の高い方から順に溜まっているタスクを探し始める。
-    for (uint64_t lv = kMaxLevel; lv >= 0; lv--) {
-        if (!running_[lv].empty()) {
-            current_level_ = lv;
-            break;
+void TaskManager::ReapLocked()
+{
+    for (auto it = zombies_.begin(); it != zombies_.end();) {
+        Task *task = *it;
+        // 切り替えが済むまではスタックとコンテキストがまだ使われている
+        bool switched_out = !task->switching_out_ && task != run_queues_[task->cpu_].current;
+        bool joined = !task->joinable_ || (task->joined_ && task->joiners_.empty());
+        if (!switched_out || !joined) {
+            it++;
+            continue;
+        }
+        it = zombies_.erase(it);
+        Erase(tasks_, task);
+        {
+            LockGuard<SpinLock> msgs_guard{task->msgs_lock_};
+            std::deque<Message>().swap(task->msgs_); // 読まれなかったメッセージごと領域を解放する
+        }
+        if (free_tasks_.size() >= kMaxPooledStacks) {
+            std::vector<uint64_t>().swap(task->stack_);
+        }
+        free_tasks_.push_back(task);
+        pool_stats_.reaped++;
+    }
+}
+
+TaskPoolStats TaskManager::PoolStats()
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    TaskPoolStats stats = pool_stats_;
+    stats.zombies = zombies_.size();
+    stats.pooled = free_tasks_.size();
+    return stats;
+}
+
+void TaskManager::AddCPU()
+{
+    // このAPの起動処理（呼び出し元のコンテキスト）をそのままアイドルタスクにする。
+    // コンテキストは最初に切り替えられた時に保存されるので、InitContext()は呼ばない。
+    Task *idle_task = NewTask()
+        ->SetLevel(0)
+        ->SetRunning(true)
+        ->SetAffinity(smp::CPUIndex());
+
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    RunQueue &rq = LocalRunQueue();
+    idle_task->cpu_ = rq.index;
+    rq.running[0].push_back(idle_task);
+    rq.idle = idle_task;
+    rq.current = idle_task;
+    idle_task->run_start_tsc_ = ReadTSC();
+    SetInitialFPUArea(idle_task->FPUArea());
+    OnSwitchIn(idle_task);
+}
+
+void TaskManager::Idle()
+{
+    RunQueue &rq = LocalRunQueue(); // アイドルタスクは他のCPUに移らない
+    while (1) {
+        idle::Wait(&rq.need_resched);
+        // 割り込みなしで起きた（MWAITが見張っていたneed_reschedが書かれた）ので、ここで切り替える。
+        // 割り込みで起きた時は出口で切り替え済みで、need_reschedは下りている。
+        if (rq.need_resched) {
+            InterruptGuard guard;
+            lock_.Lock();
+            rq.need_resched = false;
+            Reschedule(false, false); // アイドルタスクはレベル０の先頭に残る
+        }
+    }
+}
+
+void TaskManager::SwitchTask(const TaskContext *current_ctx, bool rotate)
+{
+    lock_.Lock();
+    RunQueue &rq = LocalRunQueue();
+    rq.need_resched = false;
+    Task *current_task = rq.current;
+    memcpy(current_task->Context(), current_ctx, sizeof(TaskContext));
+
+    // プリエンプションされた時（rotateがfalse）は、kLevelのタスクは自分のレベルのキューの先頭に残しておく
+    SelectNext(rq, rotate, false);
+
+    Task *next = rq.current;
+    OnSwitchIn(next); // 同じタスクが続けて実行される場合もタイムスライスは張り直す
+    if (next == current_task) {
+        lock_.Unlock();
+        return;
+    }
+    // 次に実行すべきタスクが変更している場合
+    SwitchFPUState(current_task->FPUArea(), next->FPUArea(), current_ctx->fxsave_area.data());
+    lock_.Unlock();
+    WaitSwitchedOut(next);
+    RestoreContext(next->Context());
+}
+
+void TaskManager::Reschedule(bool rotate, bool sleep)
+{
+    RunQueue &rq = LocalRunQueue();
+    Task *current_task = SelectNext(rq, rotate, sleep);
+    Task *next = rq.current;
+    OnSwitchIn(next);
+    if (next == current_task) {
+        lock_.Unlock();
+        return;
+    }
+
+    // ロックを外した後、SwitchContextがコンテキストを保存し終えるまでは他のCPUで再開させない
+    current_task->switching_out_ = true;
+    SwitchFPUState(current_task->FPUArea(), next->FPUArea(), nullptr);
+    lock_.Unlock();
+    WaitSwitchedOut(next);
+    SwitchContext(next->Context(), current_task->Context(), &current_task->switching_out_);
+    // 再開された。割り込みを禁止していた時間は、眠っていた間を除いてここから数え直す（別のCPUかもしれない）。
+    irqoff::Begin();
+}
+
+void TaskManager::WaitSwitchedOut(Task *task)
+{
+    while (task->switching_out_) {
+        __builtin_ia32_pause();
+    }
+}
+
+Task *TaskManager::SelectNext(RunQueue &rq, bool rotate, bool sleep)
+{
+    Task *current_task = rq.current;
+    if (!current_task->Running()) { // 他のCPUからスリープさせられた
+        sleep = true;
+    }
+    // グループのクォータを使い切っていたら、実行可能なままキューには戻さずに補充を待たせる
+    bool park = ChargeGroupLocked(current_task) && !sleep;
+    if (current_task->policy_ == SchedPolicy::kDeadline) {
+        UpdateDeadlineRuntime(current_task, sleep);
+        if (!sleep && !current_task->dl_throttled_) {
+            rq.deadline.push_back(current_task);
+        }
+    } else if (current_task->policy_ == SchedPolicy::kFair) {
+        UpdateFairRuntime(rq, current_task);
+        if (!sleep && !park) {
+            rq.fair.Push(current_task);
         }
+    } else if (rotate || sleep || park) {
+        auto &queue = rq.running[current_task->Level()];
+        queue.pop_front();
+        if (!sleep && !park) {
+            queue.push_back(current_task);
+        }
+    }
+    if (park) {
+        current_task->group_parked_ = true;
+        current_task->group_->parked.push_back(current_task);
     }
 
+    rq.current = PickNext(rq);
+    if (rq.current != current_task) {
+        AccountSwitch(current_task, rq.current, sleep);
+        trace::Emit(trace::Event::kSwitch, current_task->ID(), rq.current->ID(), 0, sleep ? trace::kFlagSleep : 0);
+    }
     return current_task;
 }
 
+void TaskManager::AccountSwitch(Task *prev, Task *next, bool sleep)
+{
+    uint64_t now = ReadTSC();
+    prev->usage_.run_tsc += now - prev->run_start_tsc_;
+    if (sleep) {
+        prev->usage_.voluntary_switches++;
+    } else { // 実行可能なままCPUを明け渡したので、ここから待ち時間を数える
+        prev->usage_.involuntary_switches++;
+        prev->ready_tsc_ = now;
+    }
+    next->usage_.wait_tsc += now - next->ready_tsc_;
+    next->run_start_tsc_ = now;
+}
+
+Task *TaskManager::PickNext(RunQueue &rq)
+{
+    // kDeadlineのタスクが全てのレベルより優先される。その中ではデッドラインが早いものから。
+    if (!rq.deadline.empty()) {
+        auto it = std::min_element(rq.deadline.begin(), rq.deadline.end(), 
+            [](Task *a, Task *b){ return a->dl_abs_deadline_ < b->dl_abs_deadline_; });
+        Task *task = *it;
+        rq.deadline.erase(it);
+        return task;
+    }
+
+    // 優先度の高い方から順に溜まっているタスクを探し始める。
+    // kFairのタスクはレベル１とレベル０（アイドルタスク）の間に入る。
+    for (int lv = kMaxLevel; lv >= 1; lv--) {
+        if (!rq.running[lv].empty()) {
+            return rq.running[lv].front();
+        }
+    }
+    if (!rq.fair.Empty()) {
+        return rq.fair.PopMin();
+    }
+    // このCPUでやることがなければ、他のCPUで待たされているタスクを引き取る
+    if (Task *task = StealTask(rq)) {
+        return task;
+    }
+    // アイドルタスクがいるのでレベル０は空にならない。
+    return rq.running[0].front();
+}
+
+Task *TaskManager::FindStealable(RunQueue &src)
+{
+    // 実行中のものと、CPUが固定されたもの（アイドルタスクを含む）は移せない
+    auto movable = [&src](Task *task) {
+        return task != src.current && task->affinity_ < 0;
+    };
+
+    Task *found = nullptr;
+    for (Task *task : src.deadline) {
+        if (movable(task) && (!found || task->dl_abs_deadline_ < found->dl_abs_deadline_)) {
+            found = task;
+        }
+    }
+    if (found) {
+        return found;
+    }
+    for (int lv = kMaxLevel; lv >= 1; lv--) {
+        for (Task *task : src.running[lv]) {
+            if (movable(task)) {
+                return task;
+            }
+        }
+    }
+    // kFairはヒープを探さず、先頭が移せる時だけにする
+    Task *task = src.fair.Min();
+    if (task && movable(task)) {
+        return task;
+    }
+    return nullptr;
+}
+
+Task *TaskManager::StealTask(RunQueue &rq)
+{
+    for (int i = 0; i < smp::NumCPUs(); i++) {
+        RunQueue &src = run_queues_[i];
+        if (&src == &rq) {
+            continue;
+        }
+        Task *task = FindStealable(src);
+        if (!task) {
+            continue;
+        }
+
+        task->cpu_ = rq.index;
+        if (task->policy_ == SchedPolicy::kDeadline) {
+            Erase(src.deadline, task);
+        } else if (task->policy_ == SchedPolicy::kFair) {
+            src.fair.Remove(task);
+            // vruntimeはキューごとの基準（min_vruntime）からの差として引き継ぐ
+            task->vruntime_ = task->vruntime_ - src.min_vruntime + rq.min_vruntime;
+        } else {
+            Erase(src.running[task->Level()], task);
+            rq.running[task->Level()].push_front(task); // kLevelの実行中のタスクは自分のレベルの先頭にいる
+        }
+        return task;
+    }
+    return nullptr;
+}
+
+bool TaskManager::ShouldPullTask()
+{
+    RunQueue &rq = LocalRunQueue();
+    if (rq.current != rq.idle || smp::NumCPUs() == 1) {
+        return false;
+    }
+    LockGuard<TicketSpinLock> guard{lock_};
+    for (int i = 0; i < smp::NumCPUs(); i++) {
+        if (i != rq.index && FindStealable(run_queues_[i]) != nullptr) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TaskManager::ShouldPreempt(RunQueue &rq, Task *task)
+{
+    Task *current = rq.current;
+    // スケジューリングクラスと優先度レベルを合わせた順位（kFairはレベル０とレベル１の間、kDeadlineは最上位）
+    auto rank = [](Task *t) {
+        switch (t->policy_) {
+            case SchedPolicy::kDeadline:
+                return 2 * kMaxLevel + 2;
+            case SchedPolicy::kFair:
+                return 1;
+            default:
+                return 2 * t->Level();
+        }
+    };
+    if (rank(task) != rank(current)) {
+        return rank(task) > rank(current);
+    }
+    if (task->policy_ == SchedPolicy::kDeadline) { // kDeadline同士はデッドラインが早い方
+        return task->dl_abs_deadline_ < current->dl_abs_deadline_;
+    }
+    if (task->policy_ != SchedPolicy::kFair) { // 同じレベル同士はラウンドロビンの順番を待つ
+        return false;
+    }
+
+    // kFair同士では、起きたタスクのvruntimeが十分に小さい時だけ切り替える（切り替えすぎを防ぐ）
+    UpdateFairRuntime(rq, current);
+    uint64_t granularity = timer_manager->TSCPerMillisecond() * kFairMinGranularity;
+    return VruntimeLess(task->vruntime_ + granularity, current->vruntime_);
+}
+
+bool TaskManager::CheckPreempt(RunQueue &rq, Task *task)
+{
+    if (!preemption_ || !ShouldPreempt(rq, task)) {
+        return false;
+    }
+    if (rq.index != smp::CPUIndex()) { // 他のCPUのタスクより優先されるなら、そのCPUに切り替えてもらう
+        rq.need_resched = true;
+        if (!idle::Kick(rq.index)) { // MWAITで休んでいれば、need_reschedへの書き込みで起きる
+            smp::SendIPI(rq.index, InterruptVector::kReschedule);
+        }
+        return false;
+    }
+    if (rq.interrupt_nesting > 0) { // 割り込みハンドラの中では切り替えられないので出口で行う
+        rq.need_resched = true;
+        return false;
+    }
+    return true;
+}
+
+void TaskManager::UpdateFairRuntime(RunQueue &rq, Task *task)
+{
+    uint64_t now = ReadTSC();
+    uint64_t delta = now - task->exec_start_tsc_;
+    task->exec_start_tsc_ = now;
+    task->vruntime_ += delta * kNice0Weight / task->weight_;
+
+    // min_vruntimeは実行中のタスクとキューの先頭の小さい方に合わせて、単調に進める
+    uint64_t vruntime = task->vruntime_;
+    if (!rq.fair.Empty() && VruntimeLess(rq.fair.Min()->vruntime_, vruntime)) {
+        vruntime = rq.fair.Min()->vruntime_;
+    }
+    if (VruntimeLess(rq.min_vruntime, vruntime)) {
+        rq.min_vruntime = vruntime;
+    }
+}
+
+uint32_t TaskManager::FairTimeSlice(RunQueue &rq, Task *task)
+{
+    // taskはキューから取り出されているので、キューの重みに足して全体の重みとする
+    uint64_t total_weight = rq.fair.TotalWeight() + task->weight_;
+    uint64_t slice = kFairLatency * task->weight_ / total_weight;
+    return std::max<uint64_t>(slice, kFairMinGranularity);
+}
+void TaskManager::UpdateDeadlineRuntime(Task *task, bool sleep)
+{
+    uint64_t now = ReadTSC();
+    task->dl_budget_ -= static_cast<int64_t>(now - task->exec_start_tsc_);
+    task->exec_start_tsc_ = now;
+
+    uint64_t tick = timer_manager->CurrentTick();
+    bool throttle = task->dl_budget_ <= 0;
+    // ジョブが終わる（スリープする）か実行時間を使い切った時点でデッドラインを過ぎていれば、間に合わなかったと数える。
+    // どちらの後も次に実行される前に新しいデッドラインが設定される（EnqueueかReplenishDeadline）ので、１つのジョブを２回数えることはない。
+    // 実行時間が残ったまま横取りされただけなら、ジョブはまだ終わっていないので数えない。
+    if ((sleep || throttle) && tick > task->dl_abs_deadline_) {
+        task->dl_misses_++;
+    }
+    if (throttle) { // 予約した実行時間を使い切ったので、次の周期の始まりまで止める
+        task->dl_throttled_ = true;
+        task->dl_throttles_++;
+        uint64_t replenish_tick = task->dl_abs_deadline_ - task->dl_deadline_ + task->dl_period_;
+        timer_manager->AddReplenishTimer(std::max(replenish_tick, tick + 1), task->ID());
+    }
+}
+
+void TaskManager::ReplenishDeadline(Task *task)
+{
+    task->dl_abs_deadline_ = timer_manager->CurrentTick() + task->dl_deadline_;
+    task->dl_budget_ = task->dl_runtime_ * timer_manager->TSCPerMillisecond();
+}
+
+void TaskManager::OnSwitchIn(Task *task)
+{
+    uint64_t now = ReadTSC();
+    if (task->wakeup_tsc_ != 0) { // 起こされてから初めて実行される
+        uint64_t latency = now - task->wakeup_tsc_;
+        latency_.count++;
+        latency_.total_tsc += latency;
+        latency_.max_tsc = std::max(latency_.max_tsc, latency);
+        task->wakeup_tsc_ = 0;
+    }
+    task->exec_start_tsc_ = now;
+    task->group_charge_tsc_ = now;
+    smp::CurrentCPU()->fs_base = task->fs_base_; // コンテキストを復帰する時にIA32_FS_BASEへ書き込まれる
+    smp::CurrentCPU()->syscall_stack = task->os_stack_pointer_; // SyscallEntryが移るカーネルスタック
+
+    uint64_t slice;
+    if (task->policy_ == SchedPolicy::kDeadline) { // 残りの実行時間を使い切った所で切り替える（切り上げ）
+        uint64_t tsc_per_tick = timer_manager->TSCPerMillisecond();
+        slice = std::max<uint64_t>((task->dl_budget_ + tsc_per_tick - 1) / tsc_per_tick, 1);
+    } else if (task->policy_ == SchedPolicy::kFair) {
+        slice = FairTimeSlice(LocalRunQueue(), task);
+    } else {
+        slice = kTimeSlices[task->Level()];
+    }
+    timer_manager->SetTaskTimer(timer_manager->CurrentTick() + slice);
+}
+
+void TaskManager::ExitInterrupt(const TaskContext *ctx, bool time_slice_expired)
+{
+    RunQueue &rq = LocalRunQueue();
+    rq.interrupt_nesting--;
+    if (rq.interrupt_nesting > 0) { // 割り込みがネストしている時は一番外側の出口まで切り替えを遅らせる
+        if (time_slice_expired) {
+            rq.need_resched = true;
+        }
+        return;
+    }
+
+    if (time_slice_expired) {
+        SwitchTask(ctx, true);
+    } else if (rq.need_resched) {
+        SwitchTask(ctx, false);
+    }
+}
+
 void TaskManager::Sleep(Task *task)
 {
-    if (!task->Running()) { // すでにスリープ状態の時
+    InterruptGuard guard;
+    lock_.Lock();
+    RunQueue &rq = LocalRunQueue();
+    if (task == rq.current) { // タスクが現在実行中なら
+        if (task->wakeup_pending_) { // 眠る前に起こされていたので、眠らずに戻る
+            task->wakeup_pending_ = false;
+            lock_.Unlock();
+        } else {
+            task->SetRunning(false);
+            trace::Emit(trace::Event::kSleep, task->ID());
+            Reschedule(true, true); // ロックは切り替える前に外れる
+        }
         return;
     }
-    task->SetRunning(false); 
 
-    if (task == running_[current_level_].front()) { // タスクが現在実行中なら
-        Task* current_task = RotateCurrentRunQueue(true);
-        SwitchContext(CurrentTask()->Context(), current_task->Context());
+    if (!task->Running()) { // すでにスリープ状態の時
+        lock_.Unlock();
         return;
     }
+    task->SetRunning(false); 
+    task->wakeup_pending_ = false;
+    trace::Emit(trace::Event::kSleep, task->ID());
 
-    Erase(running_[task->Level()], task);
+    RunQueue &task_rq = run_queues_[task->cpu_];
+    if (task == task_rq.current) { // 他のCPUで実行中なら、そのCPUで切り替えてもらう
+        task_rq.need_resched = true;
+        smp::SendIPI(task_rq.index, InterruptVector::kReschedule);
+    } else if (task->group_parked_) { // グループのスロットリングで外されている
+        Erase(task->group_->parked, task);
+        task->group_parked_ = false;
+    } else {
+        Dequeue(task_rq, task);
+    }
+    lock_.Unlock();
 }
 
 int TaskManager::Sleep(uint64_t id)
 {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), 
-        [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task;
+    {
+        IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+        task = FindTask(id);
+    }
+    if (task == nullptr) {
         return -1;
     }
 
-    Sleep(*it);
+    Sleep(task);
     return 0;
 }
 
 void TaskManager::Wakeup(Task *task, int level) 
 {
+    InterruptGuard guard;
+    lock_.Lock();
+    if (WakeupLocked(task, level)) {
+        Reschedule(false, false); // ロックは切り替える前に外れる
+    } else {
+        lock_.Unlock();
+    }
+}
+
+bool TaskManager::WakeupLocked(Task *task, int level)
+{
+    if (task->exited_) { // 終了したタスクは二度と実行しない
+        return false;
+    }
     if (task->Running()) { // タスクがすでに起きているならlevelの変更だけを行う
+        task->wakeup_pending_ = true; // 次にスリープしようとした時に眠らせない
         ChangeLevelRunning(task, level);
-        return;
+        return false;
     }
-    // タスクがスリープ状態の時
-    if (level < 0) { // levelが負の時は値を変えない
-        level = task->Level();
+    if (task == run_queues_[task->cpu_].current) { // 他のCPUからスリープさせられたが、まだ切り替わっていない
+        task->SetRunning(true);
+        ChangeLevelRunning(task, level);
+        return false;
     }
 
-    task->SetLevel(level);
+    // タスクがスリープ状態の時
+    uint64_t now = ReadTSC();
+    task->usage_.wakeups++;
+    task->ready_tsc_ = now;
+    if (task->policy_ == SchedPolicy::kDeadline && task->dl_throttled_) {
+        // 補充されるまではキューに入れない（OnReplenishTimer()で入れる）
+        task->SetRunning(true);
+        trace::Emit(trace::Event::kWakeup, task->ID(), task->cpu_);
+        return false;
+    }
+    if (task->group_ && task->group_->throttled) { // グループのクォータが補充されるまではキューに入れない
+        task->group_parked_ = true;
+        task->group_->parked.push_back(task);
+        ChangeLevelRunning(task, level);
+        task->SetRunning(true);
+        trace::Emit(trace::Event::kWakeup, task->ID(), task->cpu_);
+        return false;
+    }
+    RunQueue &rq = EnqueueRunnable(task, level);
     task->SetRunning(true);
+    task->wakeup_tsc_ = now;
+    trace::Emit(trace::Event::kWakeup, task->ID(), rq.index);
 
-    running_[level].push_back(task); // 新しいレベルのrunningキューにプッシュする
-    return;
+    // 実行中のタスクより優先されるべきなら、タイムスライスの終わりを待たずに切り替える
+    return CheckPreempt(rq, task);
+}
+
+int TaskManager::SelectCPU(Task *task)
+{
+    int num_cpus = smp::NumCPUs();
+    if (task->affinity_ >= 0 && task->affinity_ < num_cpus) {
+        return task->affinity_;
+    }
+
+    // 前に実行したCPUならキャッシュが残っているかもしれないので、空いていればそこを使う
+    auto idle = [this](int cpu) {
+        return run_queues_[cpu].current == run_queues_[cpu].idle;
+    };
+    if (idle(task->cpu_)) {
+        return task->cpu_;
+    }
+    for (int cpu = 0; cpu < num_cpus; cpu++) {
+        if (idle(cpu)) {
+            return cpu;
+        }
+    }
+    return task->cpu_;
+}
+
+TaskManager::RunQueue &TaskManager::EnqueueRunnable(Task *task, int level)
+{
+    RunQueue &rq = run_queues_[SelectCPU(task)];
+    if (task->policy_ == SchedPolicy::kFair && rq.index != task->cpu_) {
+        // vruntimeはキューごとの基準（min_vruntime）からの差として引き継ぐ
+        task->vruntime_ = task->vruntime_ - run_queues_[task->cpu_].min_vruntime + rq.min_vruntime;
+    }
+    task->cpu_ = rq.index;
+    Enqueue(rq, task, level);
+    return rq;
+}
+
+void TaskManager::Dequeue(RunQueue &rq, Task *task)
+{
+    if (task->policy_ == SchedPolicy::kDeadline) {
+        Erase(rq.deadline, task); // 補充待ちの時はもともと入っていない
+    } else if (task->policy_ == SchedPolicy::kFair) {
+        rq.fair.Remove(task);
+    } else {
+        Erase(rq.running[task->Level()], task);
+    }
+}
+
+void TaskManager::Enqueue(RunQueue &rq, Task *task, int level)
+{
+    if (task->policy_ == SchedPolicy::kDeadline) {
+        // 残りの実行時間を今からデッドラインまでに使うと予約した割合を超えてしまうなら、新しい周期を始める（CBS）
+        uint64_t tick = timer_manager->CurrentTick();
+        if (tick >= task->dl_abs_deadline_ || 
+            static_cast<uint64_t>(task->dl_budget_) * task->dl_period_ > 
+                (task->dl_abs_deadline_ - tick) * task->dl_runtime_ * timer_manager->TSCPerMillisecond()) {
+            ReplenishDeadline(task);
+        }
+        rq.deadline.push_back(task);
+    } else if (task->policy_ == SchedPolicy::kFair) {
+        // 長く寝ていたタスクが溜まったvruntimeの差でCPUを独占しないよう、min_vruntimeの少し手前までは進める。
+        // 少し手前にするのは、寝ていたタスク（対話的なタスク）を優先して実行させるため。
+        uint64_t sleeper_credit = timer_manager->TSCPerMillisecond() * kFairLatency / 2;
+        if (VruntimeLess(task->vruntime_, rq.min_vruntime - sleeper_credit)) {
+            task->vruntime_ = rq.min_vruntime - sleeper_credit;
+        }
+        rq.fair.Push(task);
+    } else {
+        if (level < 0) { // levelが負の時は値を変えない
+            level = task->Level();
+        }
+        task->SetLevel(level);
+        rq.running[level].push_back(task); // 新しいレベルのrunningキューにプッシュする
+    }
 }
 
 int TaskManager::Wakeup(uint64_t id, int level) 
 {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), 
-        [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) {
+    Task *task;
+    {
+        IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+        task = FindTask(id);
+    }
+    if (task == nullptr) {
         return -1;
     }
 
-    Wakeup(*it, level);
+    Wakeup(task, level);
     return 0;
 }
 
+void TaskManager::SleepUntil(Task *task, uint64_t deadline_tick)
+{
+    if (deadline_tick <= timer_manager->CurrentTick()) { // すでに時刻を過ぎている
+        return;
+    }
+
+    // タイマーが先に満了しても、起こされたのは残るのでSleep()からすぐに戻る。割り込みを禁止しておく必要はない。
+    task->timer_sleeping_ = true;
+    timer_manager->AddWakeupTimer(deadline_tick, task->ID());
+    // メッセージなどで途中で起こされても、タイマーが満了するまでは眠り直す
+    while (task->timer_sleeping_) {
+        Sleep(task);
+    }
+}
+
+void TaskManager::OnWakeupTimer(uint64_t id)
+{
+    LockGuard<TicketSpinLock> guard{lock_}; // 割り込みハンドラの中
+    Task *task = FindTask(id);
+    if (task == nullptr) {
+        return;
+    }
+
+    bool wakeup = false;
+    if (WaitQueue *queue = task->wait_queue_) { // WaitTimeout()中ならキューから外してタイムアウトを知らせる
+        LockGuard<SpinLock> queue_guard{queue->lock_};
+        if (task->wait_queue_ == queue) { // 他のCPUのWakeOne()で先に外されていなければ
+            queue->Remove(task);
+            task->wait_timed_out_ = true;
+            task->wait_queue_ = nullptr;
+            wakeup = true;
+        }
+    } else if (task->timer_sleeping_) { // SleepUntil()中
+        task->timer_sleeping_ = false;
+        wakeup = true;
+    }
+    // どちらでもなければ、すでに他の理由で起こされた後なので何もしない
+    if (wakeup) {
+        WakeupLocked(task, -1); // 割り込みハンドラの中なので、切り替えは出口で行われる
+    }
+}
+
+bool TaskManager::SetDeadline(Task *task, uint64_t runtime, uint64_t deadline, uint64_t period)
+{
+    if (runtime == 0 || runtime > deadline || deadline > period) {
+        return false;
+    }
+    uint64_t bandwidth = (runtime << kBandwidthShift) / period;
+
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    if (task->group_ != nullptr) { // グループのクォータとは併用しない
+        return false;
+    }
+    uint64_t old_bandwidth = 0;
+    if (task->policy_ == SchedPolicy::kDeadline) { // 予約し直す場合は元の分を除いて数える
+        old_bandwidth = (task->dl_runtime_ << kBandwidthShift) / task->dl_period_;
+    }
+    if (dl_bandwidth_ - old_bandwidth + bandwidth > kMaxDeadlineBandwidth) { // 受け入れ制御
+        return false;
+    }
+    dl_bandwidth_ = dl_bandwidth_ - old_bandwidth + bandwidth;
+
+    task->policy_ = SchedPolicy::kDeadline;
+    task->dl_runtime_ = runtime;
+    task->dl_deadline_ = deadline;
+    task->dl_period_ = period;
+    task->dl_abs_deadline_ = 0; // 起きた時に新しい周期が始まる
+    task->dl_budget_ = 0;
+    task->dl_throttled_ = false;
+    return true;
+}
+
+void TaskManager::ClearDeadline(Task *task)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    dl_bandwidth_ -= (task->dl_runtime_ << kBandwidthShift) / task->dl_period_;
+}
+
+void TaskManager::OnReplenishTimer(uint64_t id)
+{
+    LockGuard<TicketSpinLock> guard{lock_}; // 割り込みハンドラの中
+    Task *task = FindTask(id);
+    if (task == nullptr || task->policy_ != SchedPolicy::kDeadline || !task->dl_throttled_) {
+        return;
+    }
+    task->dl_throttled_ = false;
+    ReplenishDeadline(task);
+    if (task->Running()) { // 止められている間に寝ていなければ、最後に実行したCPUの実行可能キューに戻す
+        RunQueue &rq = run_queues_[task->cpu_];
+        rq.deadline.push_back(task);
+        CheckPreempt(rq, task); // 割り込みハンドラの中なので、このCPUなら出口で切り替える
+    }
+}
+
+int TaskManager::NewGroup(const char *name)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    if (groups_.size() >= kMaxGroups) {
+        return -1;
+    }
+    TaskGroup *group = new TaskGroup{};
+    group->id = groups_.size() + 1;
+    strncpy(group->name, name, sizeof(group->name) - 1);
+    group->period = 100;
+    groups_.push_back(group);
+    return group->id;
+}
+
+TaskGroup *TaskManager::FindGroup(int id)
+{
+    if (id <= 0 || id > static_cast<int>(groups_.size())) {
+        return nullptr;
+    }
+    return groups_[id - 1];
+}
+
+int TaskManager::SetGroupQuota(int id, uint64_t quota, uint64_t period)
+{
+    if (period == 0 || period > kMaxGroupPeriod) {
+        return -1;
+    }
+
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    TaskGroup *group = FindGroup(id);
+    if (group == nullptr) {
+        return -1;
+    }
+    num_quota_groups_ += (quota != 0) - (group->quota != 0);
+    group->quota = quota;
+    group->period = period;
+    // 新しいクォータで周期を始め直す。止めていたタスクはキューに戻す（プリエンプションは次のタイムスライスで）。
+    group->budget = quota * timer_manager->TSCPerMillisecond();
+    group->period_start = timer_manager->CurrentTick();
+    if (group->throttled) {
+        UnthrottleGroupLocked(group);
+    }
+    return 0;
+}
+
+int TaskManager::MoveToGroup(Task *task, int id)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    return MoveToGroupLocked(task, id);
+}
+
+int TaskManager::MoveToGroupLocked(Task *task, int id)
+{
+    TaskGroup *group = FindGroup(id);
+    if ((id != 0 && group == nullptr) || task->policy_ == SchedPolicy::kDeadline || 
+        task == run_queues_[task->cpu_].idle) {
+        return -1;
+    }
+    if (task->group_ == group) {
+        return 0;
+    }
+
+    // 前のグループで止められていたら外しておき、新しいグループの状態に合わせて入れ直す
+    bool parked = task->group_parked_;
+    if (parked) {
+        Erase(task->group_->parked, task);
+        task->group_parked_ = false;
+    }
+    task->group_ = group;
+    task->group_charge_tsc_ = ReadTSC(); // ここまでの実行時間は前のグループに計上しない
+    bool throttled = group && group->throttled;
+    if (parked && throttled) {
+        task->group_parked_ = true;
+        group->parked.push_back(task);
+    } else if (parked) {
+        CheckPreempt(EnqueueRunnable(task, -1), task);
+    } else if (throttled && task->Running() && task != run_queues_[task->cpu_].current) {
+        Dequeue(run_queues_[task->cpu_], task);
+        task->group_parked_ = true;
+        group->parked.push_back(task);
+    }
+    // 実行中なら、そのCPUの次のタイマー割り込みでスロットリングされる
+    return 0;
+}
+
+int TaskManager::MoveToGroup(uint64_t task_id, int id, const Process *process)
+{
+    // ロックを外すと見つけたタスクが回収されて使い回されるかもしれないので、探すのと移すのを同じロックの中で行う
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    Task *task = FindTask(task_id);
+    if (task == nullptr || (process && task->process_ != process)) {
+        return -1;
+    }
+    return MoveToGroupLocked(task, id);
+}
+
+int TaskManager::NumGroups()
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    return groups_.size();
+}
+
+bool TaskManager::GroupStats(int id, TaskGroupStats &stats)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    TaskGroup *group = FindGroup(id);
+    if (group == nullptr) {
+        return false;
+    }
+    stats.id = group->id;
+    memcpy(stats.name, group->name, sizeof(stats.name));
+    stats.quota = group->quota;
+    stats.period = group->period;
+    stats.throttled = group->throttled;
+    stats.num_tasks = std::count_if(tasks_.begin(), tasks_.end(), 
+        [group](Task *task) { return task->group_ == group; });
+    stats.usage_tsc = group->usage_tsc;
+    stats.periods = group->periods;
+    stats.throttles = group->throttles;
+    stats.throttled_tsc = group->throttled_tsc;
+    if (group->throttled) { // スロットリング中の区間も含める
+        stats.throttled_tsc += ReadTSC() - group->throttle_start_tsc;
+    }
+    return true;
+}
+
+bool TaskManager::OnTimerTick()
+{
+    if (num_quota_groups_ == 0) {
+        return false;
+    }
+    LockGuard<TicketSpinLock> guard{lock_}; // 割り込みハンドラの中
+    RunQueue &rq = LocalRunQueue();
+    if (rq.index == 0) {
+        RefreshGroupsLocked();
+    }
+    return ChargeGroupLocked(rq.current);
+}
+
+bool TaskManager::ChargeGroupLocked(Task *task)
+{
+    uint64_t now = ReadTSC();
+    uint64_t delta = now - task->group_charge_tsc_;
+    task->group_charge_tsc_ = now;
+    TaskGroup *group = task->group_;
+    if (group == nullptr) {
+        return false;
+    }
+    group->usage_tsc += delta;
+    if (group->quota == 0) {
+        return false;
+    }
+    group->budget -= static_cast<int64_t>(delta);
+    if (group->budget <= 0 && !group->throttled) {
+        ThrottleGroupLocked(group);
+    }
+    return group->throttled;
+}
+
+void TaskManager::ThrottleGroupLocked(TaskGroup *group)
+{
+    group->throttled = true;
+    group->throttles++;
+    group->throttle_start_tsc = ReadTSC();
+    // キューで待っているタスクはここで外す。
+    // 他のCPUで実行中のタスクは、そのCPUの次のタイマー割り込みか切り替えの時にSelectNext()で外れる。
+    for (Task *task : tasks_) {
+        if (task->group_ == group && task->Running() && !task->group_parked_ && 
+            task != run_queues_[task->cpu_].current) {
+            Dequeue(run_queues_[task->cpu_], task);
+            task->group_parked_ = true;
+            group->parked.push_back(task);
+        }
+    }
+}
+
+void TaskManager::UnthrottleGroupLocked(TaskGroup *group)
+{
+    group->throttled = false;
+    group->throttled_tsc += ReadTSC() - group->throttle_start_tsc;
+    for (Task *task : group->parked) {
+        task->group_parked_ = false;
+        CheckPreempt(EnqueueRunnable(task, -1), task); // 割り込みハンドラの中なら、このCPUは出口で切り替える
+    }
+    group->parked.clear(); // 割り込みハンドラの中で解放しないよう、領域は残しておく
+}
+
+void TaskManager::RefreshGroupsLocked()
+{
+    uint64_t tick = timer_manager->CurrentTick();
+    int64_t tsc_per_ms = timer_manager->TSCPerMillisecond();
+    for (TaskGroup *group : groups_) {
+        if (group->quota == 0 || tick - group->period_start < group->period) {
+            continue;
+        }
+        group->period_start = tick;
+        group->periods++;
+        // 前の周期で超過した分（高々CPUあたり１tick）は差し引く。余った分は持ち越さない。
+        group->budget = std::min<int64_t>(group->budget, 0) + group->quota * tsc_per_ms;
+        if (group->throttled && group->budget > 0) {
+            UnthrottleGroupLocked(group);
+        }
+    }
+}
+
 int TaskManager::SendMessage(uint64_t id, Message msg)
 {
-    auto it = std::find_if(tasks_.begin(), tasks_.end(), 
-        [id](const auto& t){ return t->ID() == id; });
-    if (it == tasks_.end()) { // タスクが存在しない場合
+    Task *task;
+    {
+        IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+        task = FindTask(id);
+    }
+    if (task == nullptr) { // タスクが存在しない場合
         return -1;
     }
 
-    (*it)->SendMessage(msg);
+    task->SendMessage(msg);
     return 0;
 }
 
+Task *TaskManager::FindTask(uint64_t id)
+{
+    auto it = std::find_if(tasks_.begin(), tasks_.end(), 
+        [id](const auto& t){ return t->ID() == id; });
+    return it == tasks_.end() ? nullptr : *it;
+}
+
 Task *TaskManager::CurrentTask()
 {
-    return running_[current_level_].front();
+    // 読んでいる間に別のCPUへ移らないよう、割り込みを禁止しておく
+    InterruptGuard guard;
+    return LocalRunQueue().current;
 }
 
 int TaskManager::NumRunningTasks()
 {
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
     int res = 0;
-    for (int i = 0; i < kMaxLevel + 1; i++) {
-        res += running_[i].size();
+    for (int cpu = 0; cpu < smp::NumCPUs(); cpu++) {
+        RunQueue &rq = run_queues_[cpu];
+        res += rq.fair.Size() + rq.deadline.size();
+        if (rq.current->policy_ != SchedPolicy::kLevel) { // 実行中のkFairやkDeadlineのタスクはキューから出ている
+            res++;
+        }
+        for (int i = 0; i < kMaxLevel + 1; i++) {
+            res += rq.running[i].size();
+        }
     }
     return res;
 }
 
+TaskUsage TaskManager::Usage(Task *task)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    TaskUsage usage = task->usage_;
+    uint64_t now = ReadTSC();
+    if (task == run_queues_[task->cpu_].current) {
+        usage.run_tsc += now - task->run_start_tsc_;
+    } else if (task->Running()) {
+        usage.wait_tsc += now - task->ready_tsc_;
+    }
+    return usage;
+}
+
+bool TaskManager::OnCPU(Task *task)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    return task == run_queues_[task->cpu_].current;
+}
+
 void TaskManager::ChangeLevelRunning(Task *task, int level)
 {
     if (level < 0 || level == task->Level()) { // levelが変わっていない場合や変更しない場合は無視する
         return;
     }
+    // kLevel以外のタスクはレベルを使わないので覚えておくだけ。
+    // グループのスロットリングで外されているタスクは、キューに戻す時に新しいレベルに入る。
+    if (task->policy_ != SchedPolicy::kLevel || task->group_parked_) {
+        task->SetLevel(level);
+        return;
+    }
 
     // level変更有りの時
-    if (task != running_[current_level_].front()) { // 現在実行中ではないならば
-        Erase(running_[task->Level()], task);
-        running_[level].push_back(task);
+    RunQueue &rq = run_queues_[task->cpu_];
+    if (task != rq.current) { // 現在実行中ではないならば
+        Erase(rq.running[task->Level()], task);
+        rq.running[level].push_back(task);
         task->SetLevel(level);
         return;
     }
 
     // 実行状態の場合
-    // このプログラムを実行しているタスクの優先度を変更するので
+    // このタスクは（他のCPUかもしれないが）実行中なので、
     // 変更した先でも実行中でなければならない。
-    running_[current_level_].pop_front();
-    running_[level].push_front(task);
+    rq.running[task->Level()].pop_front();
+    rq.running[level].push_front(task);
     task->SetLevel(level);
-    current_level_ = level;
+}
+
+
+void FairRunQueue::Push(Task *task)
+{
+    heap_.push_back(task);
+    Set(heap_.size() - 1, task);
+    SiftUp(heap_.size() - 1);
+    total_weight_ += task->weight_;
+}
+
+Task *FairRunQueue::PopMin()
+{
+    if (heap_.empty()) {
+        return nullptr;
+    }
+    Task *task = heap_[0];
+    Remove(task);
+    return task;
+}
+
+void FairRunQueue::Remove(Task *task)
+{
+    size_t i = task->heap_index_;
+    Task *last = heap_.back();
+    heap_.pop_back();
+    total_weight_ -= task->weight_;
+    if (i == heap_.size()) { // 末尾の要素だった
+        return;
+    }
+
+    // 末尾の要素を空いた位置に移し、上下どちらかに動かして整える
+    Set(i, last);
+    SiftUp(i);
+    SiftDown(last->heap_index_);
+}
+
+void FairRunQueue::SiftUp(size_t i)
+{
+    Task *task = heap_[i];
+    while (i > 0) {
+        size_t parent = (i - 1) / 2;
+        if (!VruntimeLess(task->vruntime_, heap_[parent]->vruntime_)) {
+            break;
+        }
+        Set(i, heap_[parent]);
+        i = parent;
+    }
+    Set(i, task);
+}
+
+void FairRunQueue::SiftDown(size_t i)
+{
+    Task *task = heap_[i];
+    while (true) {
+        size_t child = 2 * i + 1;
+        if (child >= heap_.size()) {
+            break;
+        }
+        if (child + 1 < heap_.size() && VruntimeLess(heap_[child + 1]->vruntime_, heap_[child]->vruntime_)) {
+            child++;
+        }
+        if (!VruntimeLess(heap_[child]->vruntime_, task->vruntime_)) {
+            break;
+        }
+        Set(i, heap_[child]);
+        i = child;
+    }
+    Set(i, task);
+}
+
+void FairRunQueue::Set(size_t i, Task *task)
+{
+    heap_[i] = task;
+    task->heap_index_ = i;
+}
+
+
+void WaitQueue::Wait()
+{
+    Task *task = PrepareWait();
+    Enqueue(task);
+    Block(task);
+}
+
+bool WaitQueue::WaitTimeout(uint64_t timeout_ns)
+{
+    Task *task = PrepareWait();
+    // タイマーは他のCPU（BSP）ですぐに満了するかもしれないので、先にキューに入っておく
+    Enqueue(task);
+    return BlockTimeout(task, timeout_ns);
+}
+
+int WaitQueue::WakeOne()
+{
+    Task *task;
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        if (waiters_.empty()) {
+            return 0;
+        }
+        task = waiters_.front();
+        waiters_.pop_front();
+        task->wait_queue_ = nullptr;
+    }
+    task->Wakeup();
+    return 1;
+}
+
+int WaitQueue::WakeAll()
+{
+    int num_woken = 0;
+    while (WakeOne()) {
+        num_woken++;
+    }
+    return num_woken;
+}
+
+Task *WaitQueue::PrepareWait()
+{
+    Task *task = task_manager->CurrentTask();
+    task->wait_timed_out_ = false;
+    return task;
+}
+
+void WaitQueue::Enqueue(Task *task)
+{
+    IRQSaveLockGuard<SpinLock> guard{lock_};
+    EnqueueLocked(task);
+}
+
+void WaitQueue::EnqueueLocked(Task *task)
+{
+    waiters_.push_back(task);
+    task->wait_queue_ = this;
+}
+
+void WaitQueue::Block(Task *task)
+{
+    // WakeOne()かタイマーでキューから外されるまで眠り続ける。
+    // 外されてから眠ろうとした場合は、起こされたのが残っているのですぐに戻る。
+    while (task->wait_queue_ == this) {
+        task->Sleep();
+    }
+}
+
+bool WaitQueue::BlockTimeout(Task *task, uint64_t timeout_ns)
+{
+    uint64_t deadline_tick = NanosecondsToTicks(timer_manager->MonotonicNanoseconds() + timeout_ns);
+    TimerHandle timer = timer_manager->AddWakeupTimer(deadline_tick, task->ID());
+    Block(task);
+    timer_manager->CancelTimer(timer); // 起こされた場合はタイマーが残っているので取り消す
+    return !task->wait_timed_out_;
+}
+
+// lock_を持った状態で呼ぶ
+void WaitQueue::Remove(Task *task)
+{
+    Erase(waiters_, task);
+}
+
+
+namespace {
+    // ベンチマーク用のタスクが共有する状態
+    struct SchedBenchmarkState {
+        volatile bool running; // falseになったら各タスクは計測を終えて終了する
+        uint64_t loops[SchedBenchmarkResult::kNumCPUTasks];
+        uint64_t wakeups;
+        uint64_t total_late_ns;
+        uint64_t max_late_ns;
+    } sched_bench;
+
+    // CPUバウンドなタスク。dataは自分の番号。
+    void SchedBenchCPUTask(uint64_t id, int64_t data)
+    {
+        uint64_t loops = 0;
+        while (sched_bench.running) {
+            loops++;
+        }
+        sched_bench.loops[data] = loops;
+        task_manager->Exit(0);
+    }
+
+    // １msごとに起きて、起きた時刻の遅れを記録する対話的なタスク
+    void SchedBenchInteractiveTask(uint64_t id, int64_t data)
+    {
+        while (sched_bench.running) {
+            uint64_t deadline = timer_manager->MonotonicNanoseconds() + 1000000;
+            task_manager->CurrentTask()->SleepUntil(deadline);
+            uint64_t late = timer_manager->MonotonicNanoseconds() - deadline;
+            sched_bench.wakeups++;
+            sched_bench.total_late_ns += late;
+            sched_bench.max_late_ns = std::max(sched_bench.max_late_ns, late);
+        }
+        task_manager->Exit(0);
+    }
+}
+
+void BenchmarkScheduler(SchedPolicy policy, uint64_t duration_ms, SchedBenchmarkResult &result)
+{
+    const int kNumCPUTasks = SchedBenchmarkResult::kNumCPUTasks;
+    const int kLevels[kNumCPUTasks] = {2, 1, 1};
+    const int kNices[kNumCPUTasks] = {0, 0, 5};
+
+    // ベンチマーク用のタスクは計測のたびに作り、終わったらJoin()で回収する。
+    // スケジューリングクラスの比較なので、１つのCPU（BSP）の上で取り合わせる
+    Task *cpu_tasks[kNumCPUTasks];
+    for (int i = 0; i < kNumCPUTasks; i++) {
+        cpu_tasks[i] = task_manager->NewTask()->InitContext(SchedBenchCPUTask, i)->SetAffinity(0)->SetJoinable(true);
+    }
+    Task *interactive_task = task_manager->NewTask()
+        ->InitContext(SchedBenchInteractiveTask, 0)
+        ->SetAffinity(0)
+        ->SetJoinable(true);
+
+    // 起こす前にスケジューリングクラスを設定する
+    for (int i = 0; i < kNumCPUTasks; i++) {
+        cpu_tasks[i]->SetPolicy(policy)->SetLevel(kLevels[i])->SetNice(kNices[i]);
+        result.params[i] = policy == SchedPolicy::kFair ? kNices[i] : kLevels[i];
+    }
+    interactive_task->SetPolicy(policy)->SetLevel(1)->SetNice(0);
+
+    {
+        InterruptGuard guard;
+        sched_bench = SchedBenchmarkState{};
+        sched_bench.running = true;
+    }
+    for (int i = 0; i < kNumCPUTasks; i++) {
+        cpu_tasks[i]->Wakeup();
+    }
+    interactive_task->Wakeup();
+
+    task_manager->CurrentTask()->SleepFor(duration_ms * 1000000);
+    sched_bench.running = false;
+    for (int i = 0; i < kNumCPUTasks; i++) { // 全員が終了するまで待つ
+        task_manager->Join(cpu_tasks[i]->ID(), nullptr);
+    }
+    task_manager->Join(interactive_task->ID(), nullptr);
+
+    for (int i = 0; i < kNumCPUTasks; i++) {
+        result.loops[i] = sched_bench.loops[i];
+    }
+    result.wakeups = sched_bench.wakeups;
+    result.avg_late_ns = sched_bench.wakeups ? sched_bench.total_late_ns / sched_bench.wakeups : 0;
+    result.max_late_ns = sched_bench.max_late_ns;
+}
+
+
+namespace {
+    // コンテキストスイッチのベンチマーク用のタスクが共有する状態
+    struct PingPongState {
+        Task *peers[2];
+        bool use_simd;
+        volatile uint64_t remaining; // 残りの切り替え回数
+        uint64_t total;
+        uint64_t start_tsc;
+        uint64_t end_tsc;
+        volatile bool finished;
+    } ping_pong;
+
+    // 相手のタスクを起こして自分は眠る。dataは自分の番号（０か１）。
+    void PingPongTask(uint64_t id, int64_t data)
+    {
+        Task *self = task_manager->CurrentTask();
+        while (true) {
+            if (ping_pong.remaining > 0) {
+                if (ping_pong.remaining == ping_pong.total) {
+                    ping_pong.start_tsc = ReadTSC();
+                }
+                if (ping_pong.use_simd) {
+                    __asm__ volatile("pxor %%xmm1, %%xmm1" : : : "xmm1");
+                }
+                ping_pong.remaining--;
+                ping_pong.peers[1 - data]->Wakeup();
+            } else if (!ping_pong.finished) {
+                ping_pong.end_tsc = ReadTSC();
+                ping_pong.finished = true;
+            }
+            self->Sleep();
+        }
+    }
+}
+
+void BenchmarkContextSwitch(uint64_t num_switches, bool use_simd, ContextSwitchBenchmarkResult &result)
+{
+    // ベンチマーク用のタスクは最初に一度だけ作って使い回す。
+    // 同じCPUの上での切り替えを測るので、BSPに固定する。
+    if (ping_pong.peers[0] == nullptr) {
+        for (int i = 0; i < 2; i++) {
+            ping_pong.peers[i] = task_manager->NewTask()
+                ->InitContext(PingPongTask, i)
+                ->SetLevel(TaskManager::kMaxLevel)
+                ->SetAffinity(0);
+        }
+    }
+
+    uint64_t fpu_traps;
+    {
+        InterruptGuard guard;
+        ping_pong.use_simd = use_simd;
+        ping_pong.total = num_switches;
+        ping_pong.remaining = num_switches;
+        ping_pong.finished = false;
+        fpu_traps = FPUTrapCount();
+    }
+    ping_pong.peers[0]->Wakeup();
+
+    while (!ping_pong.finished) { // 呼び出したタスクは眠って待つ
+        task_manager->CurrentTask()->SleepFor(1000000);
+    }
+
+    result.switches = num_switches;
+    result.tsc = ping_pong.end_tsc - ping_pong.start_tsc;
+    result.fpu_traps = FPUTrapCount() - fpu_traps;
+}
+
+
+namespace {
+    // すぐに終了するだけのタスク
+    void SpawnBenchTask(uint64_t id, int64_t data)
+    {
+        task_manager->Exit(data);
+    }
+}
+
+void BenchmarkSpawn(uint64_t num_tasks, SpawnBenchmarkResult &result)
+{
+    // 呼び出したタスク（メインタスク）と同じBSP・同じレベルで動かし、Join()で眠った所で切り替わるようにする
+    uint64_t recycled = task_manager->PoolStats().recycled;
+    uint64_t start = ReadTSC();
+    for (uint64_t i = 0; i < num_tasks; i++) {
+        Task *task = task_manager->NewTask()
+            ->InitContext(SpawnBenchTask, i)
+            ->SetLevel(TaskManager::kMaxLevel)
+            ->SetAffinity(0)
+            ->SetJoinable(true)
+            ->Wakeup();
+        task_manager->Join(task->ID(), nullptr);
+    }
+    result.tsc = ReadTSC() - start;
+    result.tasks = num_tasks;
+    result.recycled = task_manager->PoolStats().recycled - recycled;
 }
 
 
@@ -273,8 +1683,6 @@ void InitializeTask()
 {
     task_manager = new TaskManager;
 
-    __asm__("cli");
-    timer_manager->AddTimer(
-        Timer(timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue));
-    __asm__("sti");
+    InterruptGuard guard;
+    timer_manager->SetTaskTimer(timer_manager->CurrentTick() + TaskManager::kTimeSlices[task_manager->CurrentTask()->Level()]);
 }
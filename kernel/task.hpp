@@ -6,11 +6,17 @@
 #include <cstddef>
 #include <deque>
 
+#include "idle.hpp"
 #include "message.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "trace.hpp"
 
 /* 
  * CPUのレジスタを格納する構造体。
  * taskのコンテキストのこと。
+ * fxsave_areaは割り込みの入口で保存したFXSAVEイメージで、タスクのFPUの状態そのものはTask::FPUArea()に保存する。
+ * kLazyでCR0.TSが立っている時に割り込まれた場合は保存しない（FPUのレジスタはこのタスクの物ではないので使われない）。
  */
 struct TaskContext {
     uint64_t cr3, rip, rflags, reserved1; // offset 0x00
@@ -28,6 +34,82 @@ struct TaskContext {
  */
 using TaskFunc = void (uint64_t, int64_t);
 
+class WaitQueue;
+class FairRunQueue;
+class Task;
+class Process;
+
+/* 
+ * タスクのスケジューリングクラス
+ * kLevel:    優先度レベルによる固定優先度スケジューリング。同じレベルの中ではラウンドロビン。
+ * kFair:     仮想実行時間（vruntime）による重み付き公平スケジューリング。重みはnice値で決まる。
+ *            レベル１以上のタスクが全て寝ている時に実行され、アイドルタスク（レベル０）よりは優先される。
+ * kDeadline: EDF（デッドラインの早い順）。周期ごとに予約した実行時間だけ、全てのレベルより優先して実行される。
+ *            予約はTaskManager::SetDeadline()で行い、受け入れ制御を通ったものだけがこのクラスになる。
+ */
+enum class SchedPolicy {
+    kLevel,
+    kFair,
+    kDeadline,
+};
+
+/* 
+ * タスクごとのCPU使用量（TaskManager::Usage()で取得する）
+ * タスクを切り替えるたびにTSCで時刻を取り、実行していた時間と実行可能キューで待たされた時間を積算する。
+ */
+struct TaskUsage {
+    uint64_t run_tsc; // 実行していた時間の合計（TSCのカウント数）
+    uint64_t wait_tsc; // 実行可能状態になってから実行されるまで、キューで待たされた時間の合計
+    uint64_t wakeups; // スリープから起こされた回数
+    uint64_t voluntary_switches; // スリープしてCPUを手放した回数
+    uint64_t involuntary_switches; // タイムスライスの終わりやプリエンプションでCPUを取り上げられた回数
+};
+
+/* 
+ * CPUの使用量に上限（クォータ）を付けるタスクのグループ（cgroupのcpu.maxに相当する）
+ * period tickごとにquota tick分の実行時間を、グループの全てのタスクが全てのCPUで分け合って使う。
+ * 使い切ると、グループのタスクは次の周期が始まるまで実行可能キューから外される（スロットリング）。
+ * 暴走したアプリなどが１つの優先度レベルを占有して、対話的なタスク（ターミナルなど）が動けなくなるのを防ぐ。
+ *
+ * 実行時間はタスクの切り替えと各CPUのタイマー割り込み（TaskManager::OnTimerTick()）で計上するので、
+ * クォータを超えて実行してしまうのはCPUあたり高々１tick。超えた分は次の周期のクォータから差し引く。
+ * kDeadlineのタスクは自分の予約で制限されるので、グループには入れられない。
+ * グループに入っていないタスク（group_ == nullptr）はルートグループとして扱い、制限しない。
+ */
+struct TaskGroup {
+    int id; // １から振る（０はルートグループ）
+    char name[16];
+    uint64_t quota; // 周期ごとに使える実行時間（tick）。０なら制限しない。
+    uint64_t period; // 周期（tick）
+    int64_t budget; // 現在の周期で残っている実行時間（TSCのカウント数）
+    uint64_t period_start; // 現在の周期が始まったtick
+    bool throttled; // クォータを使い切り、補充を待っている間true
+    uint64_t throttle_start_tsc;
+    std::vector<Task *> parked; // スロットリング中に外した実行可能状態のタスク
+
+    uint64_t usage_tsc; // グループのタスクが実行した時間の合計
+    uint64_t periods; // 補充した回数
+    uint64_t throttles; // クォータを使い切った回数
+    uint64_t throttled_tsc; // スロットリングされていた時間の合計
+};
+
+/* 
+ * グループの設定と統計（TaskManager::GroupStats()で取得する）
+ */
+struct TaskGroupStats {
+    int id;
+    char name[16];
+    uint64_t quota; // tick（０なら制限なし）
+    uint64_t period; // tick
+    bool throttled;
+    size_t num_tasks;
+    uint64_t usage_tsc;
+    uint64_t periods;
+    uint64_t throttles;
+    uint64_t throttled_tsc;
+};
+
+
 /* 
  * マルチタスクを実現する上で１つのタスクを表すクラス
  * 実行する関数やスタック領域などを個別に持つ。
@@ -43,68 +125,528 @@ public:
     // コンテキストを０で初期化した後、関数fの実行に必要なレジスタの初期値を与える。
     Task *InitContext(TaskFunc *f, int64_t data);
     TaskContext *Context(); // 現在のコンテキストの構造体へのポインタを返す。
+    uint8_t *FPUArea() { return fpu_area_; } // FPU・SIMDの状態の保存領域（fpu.hpp）
 
     uint64_t ID() const; // タスクのidを返す
     Task *Sleep(); // タスクをスリープする
     Task *Wakeup(int level = -1); // タスクを実行可能状態に遷移させる。優先度をlevelで指定できる。level<0の時、優先度は変えない。
+    // 実行中のタスクをnsナノ秒の間スリープする。途中でWakeupされても時間が来るまで眠り直す。
+    Task *SleepFor(uint64_t ns);
+    // 実行中のタスクを時刻deadline_ns（TimerManager::MonotonicNanoseconds()の値）までスリープする。
+    Task *SleepUntil(uint64_t deadline_ns);
 
     int Level() { return level_; } // このタスクの優先度
     bool Running() { return running_; } // 実行可能常態か？
     Task *SetLevel(int level);
     Task *SetRunning(bool running);
-    uint64_t os_stack_pointer_; // アプリケーション実行後OSの処理に戻ってくる時に用いる
+    // 実行するCPUを固定する。cpu<0なら固定しない（どのCPUでも実行できる）。スリープ中のタスクに対してのみ呼ぶこと。
+    int Affinity() { return affinity_; }
+    Task *SetAffinity(int cpu);
+    int CPU() { return cpu_; } // 実行中・待機中のCPU（スリープ中なら最後に実行したCPU）
+    // スケジューリングクラスの設定。スリープ中（Wakeup前）のタスクに対してのみ呼ぶこと。
+    // kDeadlineにするにはTaskManager::SetDeadline()を使う。
+    SchedPolicy Policy() { return policy_; }
+    Task *SetPolicy(SchedPolicy policy);
+    int Nice() { return nice_; }
+    Task *SetNice(int nice); // kFairのタスクの重みをnice値（-20〜19、小さいほど重い）で設定する
+    // TaskManager::Join()で終了を待てるようにする。joinableなタスクは、終了後にJoin()されるまで回収されない。
+    // スリープ中（Wakeup前）のタスクに対してのみ呼ぶこと。
+    bool Joinable() { return joinable_; }
+    Task *SetJoinable(bool joinable);
+    bool Exited() { return exited_; } // TaskManager::Exit()で終了した（回収を待っている）
+    // 所属するグループのid（ルートグループなら０）。グループの変更はTaskManager::MoveToGroup()で行う。
+    int GroupID() { return group_ ? group_->id : 0; }
+    // kDeadlineの予約（tick）と統計
+    uint64_t DeadlineRuntime() { return dl_runtime_; }
+    uint64_t DeadlinePeriod() { return dl_period_; }
+    uint64_t DeadlineMisses() { return dl_misses_; } // デッドラインまでにジョブが終わらなかった回数
+    uint64_t DeadlineThrottles() { return dl_throttles_; } // 予約した実行時間を使い切って止められた回数
+    // アプリのタスクが属するプロセス（カーネルのタスクならnullptr）。
+    // コンテキストのcr3をプロセスのPML4（nullptrならカーネルのPML4）にする。実行中のタスクに対して呼ぶ時は、
+    // 呼び出し元がSetCR3()でCR3も切り替えること。参照カウントは呼び出し元が管理する。
+    Process *GetProcess() { return process_; }
+    Task *SetProcess(Process *process);
+    // FSベース（アプリのスレッドローカル記憶域の先頭）。次にこのタスクに切り替わった時に設定されるので、
+    // スリープ中（Wakeup前）のタスクに対してのみ呼ぶこと。
+    uint64_t FSBase() { return fs_base_; }
+    Task *SetFSBase(uint64_t fs_base) { fs_base_ = fs_base; return this; }
+    // アプリケーション実行後OSの処理に戻ってくる時に用いる。
+    // アプリを実行している間、システムコールはこの下（タスクのスタック）で動く（smp::PerCPU::syscall_stack）。
+    uint64_t os_stack_pointer_{0};
     uint64_t GetOSStackPointer() { return os_stack_pointer_; }
 
     void SendMessage(const Message msg); // このタスクの持つメッセージキューにプッシュし、実行可能状態へ遷移
     Message ReceiveMessage(); // メッセージキューからポップする。何も入っていない場合、kNullMessageタイプのメッセージを返す。
-    int NumMessages() { return msgs_.size(); }
+    int NumMessages();
     
 private:
+    friend class TaskManager;
+    friend class WaitQueue;
+    friend class FairRunQueue;
+
+    // 回収したタスクのスタックとFPUの保存領域を引き継いで作り直す（TaskManager::NewTask()で使う）
+    Task(uint64_t id, std::vector<uint64_t> &&stack, std::vector<uint8_t> &&fpu_buf);
+    void Recycle(uint64_t id);
+
     uint64_t id_; // タスク固有の値
     std::vector<uint64_t> stack_; // このタスクが使用するスタック領域。
     alignas(16) TaskContext context_; 
+    std::vector<uint8_t> fpu_buf_; // fpu_area_を６４バイト境界に置くための余裕を持たせて確保する
+    uint8_t *fpu_area_;
     std::deque<Message> msgs_;
+    SpinLock msgs_lock_; // msgs_を守る（他のCPUの割り込みハンドラからも送られてくる）
     
     int level_{kDefaultLevel}; // 実行優先度レベル
     bool running_{false}; // 実行状態・実行可能状態の時にtrueになる
+    int cpu_{0}; // どのCPUの実行可能キューにいるか（スリープ中なら最後に実行したCPU）
+    int affinity_{-1};
+    // 実行中に起こされたらtrue。次に自分でスリープしようとした時、眠らずに戻る（起こされたのを取りこぼさないため）。
+    bool wakeup_pending_{false};
+    // タスクから自分で切り替える途中（SwitchContextがコンテキストを保存し終えるまで）true。
+    // その間に他のCPUがこのタスクを選んだ場合は、保存が終わるのを待ってから再開する。
+    volatile bool switching_out_{false};
+
+    bool timer_sleeping_{false}; // SleepUntil()でタイマーを待っている間true
+    WaitQueue *wait_queue_{nullptr}; // WaitQueueで待っている間、そのキューを指す
+    bool wait_timed_out_{false}; // WaitQueueでの待機がタイムアウトで終わった時true
+
+    uint64_t wakeup_tsc_{0}; // 起こされた時のTSC。実行が始まるまでの遅延の計測に使う（計測済みなら０）
+    uint64_t exec_start_tsc_{0}; // 実行を始めた（または最後に実行時間を計上した）時のTSC
+
+    TaskUsage usage_{};
+    uint64_t run_start_tsc_{0}; // CPUに載った時のTSC
+    uint64_t ready_tsc_{0}; // 実行可能キューに入った時のTSC
+
+    SchedPolicy policy_{SchedPolicy::kLevel};
+    int nice_{0};
+    uint32_t weight_{1024}; // nice値から求めた重み（nice０で1024）
+    uint64_t vruntime_{0}; // 重みで割った実行時間（TSCのカウント数）
+    size_t heap_index_{0}; // FairRunQueueのヒープ内での位置
+
+    uint64_t dl_runtime_{0}; // 周期ごとに予約した実行時間（tick）
+    uint64_t dl_deadline_{0}; // 周期の始まりからデッドラインまでの時間（tick）
+    uint64_t dl_period_{0}; // 周期（tick）
+    uint64_t dl_abs_deadline_{0}; // 現在のジョブのデッドライン（tick）
+    int64_t dl_budget_{0}; // 現在の周期で残っている実行時間（TSCのカウント数）
+    bool dl_throttled_{false}; // 実行時間を使い切り、補充を待っている間true
+    uint64_t dl_misses_{0};
+    uint64_t dl_throttles_{0};
+
+    bool joinable_{false};
+    volatile bool exited_{false};
+    int64_t exit_status_{0};
+    bool joined_{false}; // Join()で終了ステータスを受け取った
+    std::vector<Task *> joiners_; // Join()で終了を待っているタスク
+
+    Process *process_{nullptr};
+    uint64_t fs_base_{0};
+    TaskGroup *group_{nullptr}; // 所属するグループ（作ったタスクのグループを引き継ぐ）
+    bool group_parked_{false}; // グループのスロットリングで実行可能キューから外されている間true
+    uint64_t group_charge_tsc_{0}; // 最後にグループへ実行時間を計上した時のTSC
+};
+
+
+/* 
+ * kFairのタスクの実行可能キュー
+ * vruntimeが最小のタスクを取り出す二分ヒープ。各タスクがヒープ内の位置を持つので、途中の要素も削除できる。
+ * 実行中のタスクはキューから取り出しておき、実行を終えた時に戻す。
+ */
+class FairRunQueue
+{
+public:
+    void Push(Task *task);
+    Task *PopMin(); // vruntime最小のタスクを取り出す。空ならnullptr。
+    void Remove(Task *task);
+    Task *Min() const { return heap_.empty() ? nullptr : heap_[0]; }
+    bool Empty() const { return heap_.empty(); }
+    size_t Size() const { return heap_.size(); }
+    uint64_t TotalWeight() const { return total_weight_; } // キューに入っているタスクの重みの合計
+
+private:
+    std::vector<Task *> heap_;
+    uint64_t total_weight_{0};
+
+    void SiftUp(size_t i);
+    void SiftDown(size_t i);
+    void Set(size_t i, Task *task); // heap_[i]にtaskを置き、位置をtaskに記録する
+};
+
+
+/* 
+ * タスクを待たせておくためのキュー
+ * Wait()したタスクはスリープし、WakeOne()かWakeAll()で起こされるまで実行されない。
+ * WaitTimeout()ではタイマーも仕掛けるので、起こされなくても時間が来れば戻ってくる。
+ * 待っている間のタスクは実行可能キューに入らないので、CPUを消費しない。
+ * 
+ * Wait()とWaitTimeout()は実行中のタスクを待たせるものなので、割り込みハンドラからは呼べない。
+ * WakeOne()とWakeAll()は割り込みハンドラや他のCPUからも呼べる。
+ */
+class WaitQueue
+{
+public:
+    void Wait();
+    // 起こされたらtrue、timeout_nsナノ秒経ってタイムアウトしたらfalseを返す。
+    bool WaitTimeout(uint64_t timeout_ns);
+    // cond()がtrueの時だけキューに入って待つ。cond()はキューのロックを持った状態で呼ぶので、
+    // 条件を変えてからWakeOne()する側との間で起こされるのを取りこぼさない（futexのように使う）。
+    // 起こされたら１、cond()がfalseで待たなかったら０、タイムアウトしたら−１を返す。timeout_nsが０なら無期限に待つ。
+    template <class F>
+    int WaitIf(F cond, uint64_t timeout_ns = 0);
+    int WakeOne(); // 先頭のタスクを１つ起こす。起こしたタスクの数を返す。
+    int WakeAll(); // 待っているタスクを全て起こす。起こしたタスクの数を返す。
+    bool Empty() const { return waiters_.empty(); }
+
+private:
+    friend class TaskManager;
+
+    std::deque<Task *> waiters_;
+    SpinLock lock_; // waiters_を守る
+
+    Task *PrepareWait(); // 実行中のタスクを返す（待つ前の状態に戻しておく）
+    void Enqueue(Task *task); // 実行中のタスクをキューに入れる
+    void EnqueueLocked(Task *task); // lock_を持った状態で呼ぶ
+    // Enqueue()したタスクを、起こされるかタイムアウトするまでスリープする。
+    void Block(Task *task);
+    // Block()と同じだが、timeout_nsナノ秒経ったらタイムアウトする。起こされたらtrueを返す。
+    bool BlockTimeout(Task *task, uint64_t timeout_ns);
+    void Remove(Task *task); // lock_を持った状態で呼ぶ
+};
+
+
+template <class F>
+int WaitQueue::WaitIf(F cond, uint64_t timeout_ns)
+{
+    Task *task = PrepareWait();
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        if (!cond()) {
+            return 0;
+        }
+        EnqueueLocked(task);
+    }
+    if (timeout_ns == 0) {
+        Block(task);
+        return 1;
+    }
+    return BlockTimeout(task, timeout_ns) ? 1 : -1;
+}
+
+
+/*
+ * 取り合いになったら眠って待つロック（LockGuard<Mutex>で使う）
+ * 割り込みを禁止せずに持てるので、画面の描画のように時間のかかる処理を守るのに使う。
+ * タスクからだけ取ること（割り込みハンドラやスピンロックを持った所では眠れない）。
+ */
+class Mutex
+{
+public:
+    void Lock()
+    {
+        while (__atomic_exchange_n(&locked_, 1, __ATOMIC_ACQUIRE)) {
+            // 外す側はlocked_を書いてからWakeOne()するので、キューのロックの中で確かめれば取りこぼさない
+            waiters_.WaitIf([this]() { return __atomic_load_n(&locked_, __ATOMIC_RELAXED) != 0; });
+        }
+    }
+
+    void Unlock()
+    {
+        __atomic_store_n(&locked_, 0, __ATOMIC_RELEASE);
+        waiters_.WakeOne();
+    }
+
+private:
+    uint32_t locked_{0};
+    WaitQueue waiters_;
+};
+
+
+/* 
+ * 起こされてから実際に実行が始まるまでの遅延の統計（TSCのカウント数）
+ */
+struct WakeupLatencyStats {
+    uint64_t count; // 計測した回数
+    uint64_t total_tsc; // 遅延の合計
+    uint64_t max_tsc; // 遅延の最大値
+};
+
+
+/* 
+ * 終了したタスクの回収とタスクの再利用の統計
+ */
+struct TaskPoolStats {
+    uint64_t allocated; // newで作ったタスクの数
+    uint64_t recycled; // プールから再利用したタスクの数
+    uint64_t reaped; // 終了して回収したタスクの数
+    size_t zombies; // 終了したが、まだ回収されていないタスクの数
+    size_t pooled; // プールで再利用を待っているタスクの数
 };
 
 
 /* 
  * Taskクラスをまとめて管理するクラス
  * NewTask()で新しくタスクを生成する。
- * SwitchTask()でコンテキストスウィッチを行う。（タイマー割り込み上で呼ばれることを想定）
+ * Exit()で実行中のタスクを終了する。終了したタスクはすぐには片付けず（スタックの上でまだ動いているので）、
+ * 切り替えが済んでから回収する（NewTask()・Exit()・Join()の中で行う）。
+ * 回収したタスクはスタックとFPUの保存領域ごとプールに入れておき、次のNewTask()で使い回す。
+ * Taskオブジェクトそのものは解放しないので、ForEachTask()などで写したポインタが指す先がなくなることはない。
+ * SwitchTask()でコンテキストスウィッチを行う。（割り込みハンドラの出口で呼ばれることを想定）
+ * 
+ * 実行中のタスクより優先度の高いタスクを起こした場合は、次のタイムスライスを待たずにすぐに切り替える（プリエンプション）。
+ * タスクから起こした場合はその場で切り替え、割り込みハンドラから起こした場合はExitInterrupt()で切り替える。
+ * 
+ * 実行可能キューはCPUごとに持つ。起こしたタスクは前に実行したCPUか、空いているCPUのキューに入れ、
+ * 他のCPUのタスクより優先される場合はそのCPUにIPI（kReschedule）を送って切り替えさせる。
+ * アイドルになったCPUは他のCPUのキューで待たされているタスクを引き取る（負荷分散）。
  */
 class TaskManager
 {
 public:
     static const int kMaxLevel = 3; // 実行優先度の幅
+    // 各レベルのタイムスライス（tick）。優先度の高いレベルほど対話的なタスクを想定して短くしている。
+    static constexpr uint32_t kTimeSlices[kMaxLevel + 1] = {20, 20, 10, 5};
+    // kFairのタスクが一巡する目安の時間（tick）。これを重みで按分したものがタイムスライスになる。
+    static const uint32_t kFairLatency = 20;
+    static const uint32_t kFairMinGranularity = 2; // kFairのタイムスライスの最小値（tick）
+    // kDeadlineのタスクに予約できるCPU時間の割合の上限（1 << kBandwidthShiftで100%）。残りは他のタスクのために取っておく。
+    static const int kBandwidthShift = 20;
+    static const uint64_t kMaxDeadlineBandwidth = (95ul << kBandwidthShift) / 100;
+
+    // プールに残しておくスタックの数。これを超えて回収したタスクはスタックを解放する（Taskオブジェクトは残す）。
+    static const size_t kMaxPooledStacks = 64;
+
+    static const int kMaxGroups = 16; // 作れるグループの数
+    static const uint64_t kMaxGroupPeriod = 1000; // グループの周期の最大値（tick）
 
     TaskManager(); // NewTask()を１回だけ実行する。
     Task *NewTask(); // 新しくタスクを追加（コンテキストの設定や実行可能状態への遷移は行わない）
-    void SwitchTask(const TaskContext *current_ctx); // current_ctxを現在のタスクのコンテキストへ格納し、別の処理に制御を移す
-    // 引数にtrueを渡せば現在実行中のタスクをスリープさせる。
-    // 現在のcurrent_level_を必要があれば変更する。返り値は変更前の実行タスク。
-    Task *RotateCurrentRunQueue(bool current_sleep); 
+    // 実行中のタスクを終了する。戻らない。Join()している（これからする）タスクにはstatusを渡す。
+    [[noreturn]] void Exit(int64_t status);
+    // タスクidが終了するまで待ち、終了ステータスをstatusに入れて０を返す。
+    // idのタスクがない（回収済みを含む）か、joinableでない場合は−１を返す。タスクから呼ぶこと。
+    int Join(uint64_t id, int64_t *status);
+    // タスクidをjoinableでなくし、終了したら（終了していればすぐに）回収されるようにする。
+    // idのタスクがないか、Join()で待っているタスクがいる場合は−１を返す。
+    int Detach(uint64_t id);
+    TaskPoolStats PoolStats();
+    // current_ctxを現在のタスクのコンテキストへ格納し、別の処理に制御を移す。
+    // rotateがtrueなら現在のタスクをキューの末尾に回す（タイムスライスを使い切った時）。
+    // falseなら最も優先度の高いタスクに切り替えるだけで、現在のタスクはキューの先頭に残る（プリエンプションされた時）。
+    void SwitchTask(const TaskContext *current_ctx, bool rotate = true);
 
     void Sleep(Task *task);
     int Sleep(uint64_t id); // 成功したら０、失敗したら−１
     void Wakeup(Task *task, int level = -1); // 寝ていたら起こす。levelで実行優先度を変更できる。変更したくない場合はlevel<0とする
     int Wakeup(uint64_t id, int level = -1); // 成功したら０、失敗したら−１
+    // 実行中のタスクtaskを、タイマーのtickがdeadline_tickになるまでスリープする。
+    void SleepUntil(Task *task, uint64_t deadline_tick);
+    // kWakeupタイプのタイマーが満了した時にTimerManagerから呼ばれる（割り込みハンドラ内）。
+    void OnWakeupTimer(uint64_t id);
+
+    // taskをkDeadlineにし、period tickごとにruntime tickの実行時間を、周期の始まりからdeadline tick以内に与える。
+    // runtime <= deadline <= periodでなければならない。
+    // 予約の合計がkMaxDeadlineBandwidthを超える場合は受け入れず、falseを返す。スリープ中のタスクに対して呼ぶこと。
+    bool SetDeadline(Task *task, uint64_t runtime, uint64_t deadline, uint64_t period);
+    void ClearDeadline(Task *task); // SetDeadline()の予約を取り消す。Task::SetPolicy()でkDeadline以外にした時に呼ばれる。
+    uint64_t DeadlineBandwidth() const { return dl_bandwidth_; } // 予約済みの割合（1 << kBandwidthShiftで100%）
+    // kReplenishタイプのタイマーが満了した時にTimerManagerから呼ばれる（割り込みハンドラ内）。
+    void OnReplenishTimer(uint64_t id);
+
+    // タスクのグループを作り、そのidを返す。作れる数（kMaxGroups）を超えたら−１を返す。
+    int NewGroup(const char *name);
+    // グループidのクォータをperiod tickごとにquota tickにする。quotaが０なら制限を外す。成功したら０、失敗したら−１。
+    int SetGroupQuota(int id, uint64_t quota, uint64_t period);
+    // taskをグループidに移す（idが０ならルートグループ）。kDeadlineのタスクとアイドルタスクは移せない。成功したら０、失敗したら−１。
+    int MoveToGroup(Task *task, int id);
+    // idがtask_idのタスクを探して移す。processを渡すと、そのプロセスのタスク（アプリとそのスレッド）しか移さない。
+    int MoveToGroup(uint64_t task_id, int id, const Process *process = nullptr);
+    int NumGroups();
+    bool GroupStats(int id, TaskGroupStats &stats); // グループidがあればstatsに写してtrueを返す
+    // 各CPUのタイマー割り込みで呼ぶ。実行中のタスクのグループに実行時間を計上し、
+    // グループがスロットリングされていればtrueを返す（出口でタスクを切り替える）。BSPでは周期の来たグループのクォータを補充する。
+    bool OnTimerTick();
 
     int SendMessage(uint64_t id, Message msg); // タスクidのメッセージキューにmsgをpushする。成功０、失敗−１
     Task *CurrentTask(); // 現在実行中のTaskオブジェクトへのポインタを返す
     int NumRunningTasks(); // runningのタスクの数を返す
+    // taskのCPU使用量。実行中・待機中の区間は呼んだ時点までを含める。
+    TaskUsage Usage(Task *task);
+    // taskがいずれかのCPUで実行中ならtrue
+    bool OnCPU(Task *task);
+
+    // 割り込みハンドラの入口と出口で呼ぶ。入口ではvectorをトレースに記録する。
+    // 出口では、タイムスライスが切れたか、より優先度の高いタスクが起こされていればctxを保存してタスクを切り替える。
+    void EnterInterrupt(uint8_t vector)
+    {
+        RunQueue &rq = run_queues_[smp::CPUIndex()];
+        rq.interrupt_nesting++;
+        if (rq.current == rq.idle) {
+            idle::OnInterrupt(rq.index);
+        }
+        trace::Emit(trace::Event::kInterrupt, rq.current ? rq.current->ID() : 0, 0, vector);
+    }
+    void ExitInterrupt(const TaskContext *ctx, bool time_slice_expired = false);
+
+    // APのAPMain()から呼ばれ、そのCPUの実行可能キューを用意する。呼び出したコンテキストがそのCPUのアイドルタスクになる。
+    void AddCPU();
+    // アイドルタスクの本体。idle::Wait()で休み、起こされたタスクがあれば切り替える。戻らない。
+    [[noreturn]] void Idle();
+    // 割り込みハンドラの出口でタスクを切り替えるべきか。このCPUがアイドルで、他のCPUに待たされているタスクがある時にtrueを返す。
+    bool ShouldPullTask();
+
+    // 起こしたタスクによるプリエンプションの有効・無効（比較計測用）。無効の時はタイムスライスの終わりまで待つ。
+    void SetPreemption(bool enabled) { preemption_ = enabled; }
+    bool Preemption() const { return preemption_; }
+    const WakeupLatencyStats &LatencyStats() const { return latency_; }
+    void ResetLatencyStats() { latency_ = WakeupLatencyStats{}; }
+
+    // 全てのタスクについてf(Task *)を呼ぶ（呼ぶ前にタスクの一覧を写しておくので、fの中でタスクを作ってもよい）
+    template <class F>
+    void ForEachTask(F f)
+    {
+        std::vector<Task *> tasks;
+        {
+            IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+            tasks = tasks_;
+        }
+        for (Task *task : tasks) {
+            f(task);
+        }
+    }
 
 private:
-    std::vector<Task *> tasks_{}; // 作成したタスクを全て格納するもの
+    // CPUごとの実行可能キュー
+    struct RunQueue {
+        int index{0}; // このキューのCPUの番号
+        // kLevelの実行可能状態タスクの配列。実行中（またはプリエンプションされた）タスクは自分のレベルの先頭にいる。
+        std::array<std::deque<Task *>, kMaxLevel + 1> running{};
+        FairRunQueue fair; // 実行中のものを除くkFairの実行可能状態タスク
+        uint64_t min_vruntime{0}; // kFairのタスクのvruntimeの最小値（単調増加）。起きたタスクのvruntimeの基準にする。
+        // 実行中のものと補充待ちのものを除くkDeadlineの実行可能状態タスク。
+        // 数が少ない前提なので、デッドラインの早いものを線形探索で選ぶ。
+        std::vector<Task *> deadline;
+        Task *current{nullptr}; // このCPUで実行中のタスク
+        Task *idle{nullptr}; // このCPUのアイドルタスク（レベル０にいて、他のCPUに移らない）
+
+        int interrupt_nesting{0}; // 割り込みハンドラの中なら１以上
+        // 割り込みハンドラの出口でタスクを切り替える必要があればtrue。
+        // アイドル中のCPUはこのキャッシュラインをMWAITで見張っているので（idle.hpp）、他の変数と同じラインに置かない。
+        alignas(64) volatile bool need_resched{false};
+    };
+
+    // タスクの一覧と全てのCPUの実行可能キューをまとめて守るロック。
+    // 割り込みハンドラからも取るので、割り込みを禁止してから取ること。
+    TicketSpinLock lock_;
+    std::vector<Task *> tasks_{}; // 作成したタスク（回収済みのものを除く）を全て格納するもの
+    std::vector<Task *> zombies_{}; // 終了して回収を待っているタスク
+    std::vector<Task *> free_tasks_{}; // 回収して再利用を待っているタスク
+    TaskPoolStats pool_stats_{};
     uint64_t latest_id_{0}; // 次に作成するタスクのid
-    std::array<std::deque<Task *>, kMaxLevel + 1> running_{}; // 実行可能状態タスクの配列。先頭のタスクが現在実行中。
-    int current_level_{kMaxLevel}; // running_に入っているタスクの中で最高の優先度を保持する
+    std::array<RunQueue, smp::kMaxCPUs> run_queues_{};
+    uint64_t dl_bandwidth_{0}; // kDeadlineのタスクに予約したCPU時間の割合の合計
+    bool preemption_{true};
+    WakeupLatencyStats latency_{};
+    std::vector<TaskGroup *> groups_{}; // id − １番目にグループidのものが入る（グループは削除しない）
+    volatile int num_quota_groups_{0}; // クォータが設定されているグループの数（０ならタイマー割り込みで何もしない）
 
+    RunQueue &LocalRunQueue() { return run_queues_[smp::CPUIndex()]; }
+    Task *FindTask(uint64_t id); // ロックを持った状態で呼ぶ。見つからなければnullptr。
+    // 終了したタスクのうち、切り替えが済んでいて、Join()を待つ必要もないものを回収してプールに入れる。ロックを持った状態で呼ぶ。
+    void ReapLocked();
     void ChangeLevelRunning(Task *task, int level); // 実行可能状態のtaskの優先度レベルを変更する
+    // 実行中のタスクを実行可能キューに戻し（sleepがtrueなら戻さない）、次に実行するタスクをrq.currentにする。
+    // rotateがfalseの時、kLevelのタスクは自分のレベルの先頭に残る。返り値は変更前の実行タスク。
+    Task *SelectNext(RunQueue &rq, bool rotate, bool sleep);
+    // 次に実行するタスクを選ぶ（kFairのタスクはキューから取り出す）。
+    // アイドルタスクしかいなければ、他のCPUで待たされているタスクを引き取る。
+    Task *PickNext(RunQueue &rq);
+    Task *StealTask(RunQueue &rq); // 他のCPUのキューから移せるタスクを１つ取り出してrqのCPUに移す
+    Task *FindStealable(RunQueue &src); // srcで待たされていて、他のCPUへ移せるタスクを探す。なければnullptr。
+    // タスクから呼び、このCPUで次のタスクに切り替える。ロックを持った状態で呼び、戻る時にはロックは外れている。
+    void Reschedule(bool rotate, bool sleep);
+    // 起こしたtaskをどのCPUで実行するかを決める。固定されていればそのCPU、
+    // そうでなければ前に実行したCPU、それが忙しければアイドルのCPUを選ぶ。
+    int SelectCPU(Task *task);
+    // ロックを持った状態でtaskを起こす。このCPUでその場でタスクを切り替えるべきならtrueを返す。
+    bool WakeupLocked(Task *task, int level);
+    void Enqueue(RunQueue &rq, Task *task, int level); // 起こしたtaskをrqに入れる
+    // 実行可能になったtaskを実行するCPUを選んで、そのキューに入れる。入れたキューを返す。
+    RunQueue &EnqueueRunnable(Task *task, int level);
+    void Dequeue(RunQueue &rq, Task *task); // rqで待っている（実行中でない）taskをキューから外す
+    // 起こしたtaskがrqのCPUで実行中のタスクより優先されるべきなら、そのCPUにタスクの切り替えを求める。
+    // このCPUのタスクから起こしていて、その場で切り替えるべきならtrueを返す。
+    bool CheckPreempt(RunQueue &rq, Task *task);
+    bool ShouldPreempt(RunQueue &rq, Task *task); // 起こしたtaskがrqで実行中のタスクより優先されるべきか
+    void UpdateFairRuntime(RunQueue &rq, Task *task); // kFairのタスクの実行時間をvruntimeに計上する
+    uint32_t FairTimeSlice(RunQueue &rq, Task *task); // kFairのタスクのタイムスライス（tick）
+    // kDeadlineのタスクの実行時間を残りから差し引き、使い切っていれば補充まで止める。
+    // sleepはタスクがスリープする（ジョブが終わる）ならtrue。使い切るかスリープする時にデッドラインを過ぎていれば数える。
+    void UpdateDeadlineRuntime(Task *task, bool sleep);
+    void ReplenishDeadline(Task *task); // 新しいデッドラインを設定し、実行時間を満タンにする
+    // prevからnextへ切り替える時に、prevの実行時間とnextの待ち時間を計上する。sleepはprevがスリープするならtrue。
+    void AccountSwitch(Task *prev, Task *next, bool sleep);
+    // taskの実行を始める直前に呼ぶ。起こされてからの遅延を記録し、タイムスライスのタイマーをセットする。
+    void OnSwitchIn(Task *task);
+    TaskGroup *FindGroup(int id); // ロックを持った状態で呼ぶ。見つからなければnullptr。
+    // taskの前回からの実行時間をグループに計上し、クォータを使い切ったらスロットリングする。
+    // taskのグループがスロットリング中ならtrueを返す。ロックを持った状態で呼ぶ。
+    bool ChargeGroupLocked(Task *task);
+    void ThrottleGroupLocked(TaskGroup *group); // グループの待っているタスクをキューから外す
+    void UnthrottleGroupLocked(TaskGroup *group); // 外していたタスクをキューに戻す
+    void RefreshGroupsLocked(); // 周期の来たグループのクォータを補充する（BSPのタイマー割り込みから）
+    int MoveToGroupLocked(Task *task, int id);
+    // taskがこのCPUで実行中のタスクと入れ替わる前に呼ぶ。
+    // 他のCPUがtaskのコンテキストを保存し終えるまで待つ（ロックを外してから呼ぶこと）。
+    void WaitSwitchedOut(Task *task);
 };
 
 
 // カーネルのmain関数から呼ばれる初期化関数。
 void InitializeTask();
+
+
+/* 
+ * スケジューラの公平性とスループットのベンチマーク結果
+ * CPUバウンドなタスクkNumCPUTasks個と、１msごとに起きる対話的なタスク１個を同時に走らせる。
+ */
+struct SchedBenchmarkResult {
+    static const int kNumCPUTasks = 3;
+    int params[kNumCPUTasks]; // 各CPUバウンドタスクのレベル（kLevel）またはnice値（kFair）
+    uint64_t loops[kNumCPUTasks]; // 各CPUバウンドタスクが回ったループの回数
+    uint64_t wakeups; // 対話的なタスクが起きた回数
+    uint64_t avg_late_ns; // 対話的なタスクが目標の時刻から遅れて起きた時間の平均
+    uint64_t max_late_ns; // 同じく最大値
+};
+
+// policyのスケジューリングクラスでduration_msミリ秒間ベンチマークを行う。タスクから呼ぶこと。
+// kLevelではCPUバウンドタスクをレベル2,1,1、対話的なタスクをレベル１で、
+// kFairではCPUバウンドタスクをnice 0,0,5、対話的なタスクをnice 0で実行する。
+void BenchmarkScheduler(SchedPolicy policy, uint64_t duration_ms, SchedBenchmarkResult &result);
+
+
+/* 
+ * コンテキストスイッチのベンチマーク結果
+ * ２つのタスクが交互に相手を起こして自分は眠ることを繰り返し、１回の切り替えにかかった時間を測る。
+ */
+struct ContextSwitchBenchmarkResult {
+    uint64_t switches; // 切り替えの回数
+    uint64_t tsc; // かかった時間（TSCのカウント数）
+    uint64_t fpu_traps; // 計測中に#NMでFPUの状態を入れ替えた回数（fpu.hppのkLazyの時のみ）
+};
+
+// 現在のFPUモードでnum_switches回の切り替えを測る。use_simdがtrueなら、各タスクが毎回SSEのレジスタを使う。
+// タスクから呼ぶこと。
+void BenchmarkContextSwitch(uint64_t num_switches, bool use_simd, ContextSwitchBenchmarkResult &result);
+
+
+/* 
+ * タスクの生成と終了のベンチマーク結果
+ * すぐにExit()するタスクを作って起こし、Join()で終了を待つことを繰り返す。
+ */
+struct SpawnBenchmarkResult {
+    uint64_t tasks; // 作って終了させたタスクの数
+    uint64_t tsc; // かかった時間（TSCのカウント数）
+    uint64_t recycled; // そのうちプールから再利用したタスクの数
+};
+
+// num_tasks個のタスクを順に作って終了させる。タスクから呼ぶこと。
+void BenchmarkSpawn(uint64_t num_tasks, SpawnBenchmarkResult &result);
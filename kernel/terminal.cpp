@@ -1,6 +1,22 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <algorithm>
 #include "terminal.hpp"
+#include "asmfunc.h"
+#include "timer.hpp"
+#include "task.hpp"
+#include "fpu.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
+#include "trace.hpp"
+#include "irq.hpp"
+#include "idle.hpp"
+#include "syscall.hpp"
+#include "run_application.hpp"
 extern Console *console;
+extern TimerManager *timer_manager;
+extern TaskManager *task_manager;
 Terminal *terminal = NULL;
 
 
@@ -48,6 +64,7 @@ namespace
                       "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00" // 70~79 
                       "\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00";// 80~89 
 
+    #define HID_KC_Q 0x14
     #define HID_KC_ESC 0x29
     #define HID_KC_BACK_SPACE 0x2a
     #define HID_KC_DELETE 0x4c
@@ -56,6 +73,446 @@ namespace
     #define HID_KC_DOWN 0x51
     #define HID_KC_UP 0x52
 
+    // TSCのカウントをナノ秒に直す
+    uint64_t TSCToNanoseconds(uint64_t tsc)
+    {
+        return timer_manager->TSCToNanoseconds(tsc);
+    }
+
+    /* 
+     * ターミナルのコマンド
+     * argv[0]はコマンド名そのもの。
+     */
+    void CommandHelp(Terminal *term, int argc, char **argv);
+
+    // スケジューラのベンチマーク。kLevelとkFairで同じ負荷を与えて比べる。
+    void BenchSched(Terminal *term)
+    {
+        const uint64_t kDurationMs = 1000;
+        const SchedPolicy kPolicies[] = {SchedPolicy::kLevel, SchedPolicy::kFair};
+        for (SchedPolicy policy : kPolicies) {
+            SchedBenchmarkResult result;
+            BenchmarkScheduler(policy, kDurationMs, result);
+
+            bool fair = policy == SchedPolicy::kFair;
+            uint64_t total = 0;
+            for (uint64_t loops : result.loops) {
+                total += loops;
+            }
+            term->Print("[%s] %lu ms\n", fair ? "fair" : "level", kDurationMs);
+            for (int i = 0; i < SchedBenchmarkResult::kNumCPUTasks; i++) {
+                term->Print("  cpu%d (%s %d) %lu loops, %lu%%\n", i, fair ? "nice" : "level", result.params[i], 
+                    result.loops[i], total ? result.loops[i] * 100 / total : 0);
+            }
+            term->Print("  throughput %lu loops/ms\n", total / kDurationMs);
+            term->Print("  interactive: %lu wakeups, late avg %lu us, max %lu us\n", 
+                result.wakeups, result.avg_late_ns / 1000, result.max_late_ns / 1000);
+        }
+    }
+
+    // コンテキストスイッチのベンチマーク。使えるFPUモードを全て試して比べる。
+    void BenchSwitch(Terminal *term)
+    {
+        const uint64_t kNumSwitches = 100000;
+        const FPUMode kModes[] = {FPUMode::kFxsave, FPUMode::kXsave, FPUMode::kXsaveopt, FPUMode::kLazy};
+        FPUMode original_mode = GetFPUMode();
+        for (FPUMode mode : kModes) {
+            if (!SetFPUMode(mode)) {
+                term->Print("%-8s not supported\n", FPUModeName(mode));
+                continue;
+            }
+            for (bool use_simd : {false, true}) {
+                ContextSwitchBenchmarkResult result;
+                BenchmarkContextSwitch(kNumSwitches, use_simd, result);
+                term->Print("%-8s %-7s %lu ns/switch, #NM %lu\n", FPUModeName(mode), use_simd ? "simd" : "no-simd", 
+                    TSCToNanoseconds(result.tsc) / result.switches, result.fpu_traps);
+            }
+        }
+        SetFPUMode(original_mode);
+    }
+
+    // タスクの生成と終了のベンチマーク。回収したタスクがプールから再利用されるかも表示する。
+    void BenchSpawn(Terminal *term)
+    {
+        const uint64_t kNumTasks = 10000;
+        SpawnBenchmarkResult result;
+        BenchmarkSpawn(kNumTasks, result);
+        uint64_t ns = TSCToNanoseconds(result.tsc);
+        term->Print("%lu tasks in %lu us: %lu ns/task, %lu tasks/s\n", result.tasks, ns / 1000, 
+            ns / result.tasks, ns ? result.tasks * 1000000000 / ns : 0);
+        TaskPoolStats stats = task_manager->PoolStats();
+        term->Print("recycled %lu/%lu, pool: allocated %lu, reaped %lu, zombies %lu, pooled %lu\n", 
+            result.recycled, result.tasks, stats.allocated, stats.reaped, stats.zombies, stats.pooled);
+    }
+
+    // アプリの起動のベンチマーク。毎回ELFファイルを読み込む場合と、テンプレートを複製する場合の起動回数/秒を比べる。
+    void BenchLaunch(Terminal *term, const char *name)
+    {
+        const uint64_t kNumLaunches = 1000;
+        const AppImage *image = FindAppImage(name);
+        if (image == nullptr) {
+            term->Print("no such app: %s\n", name);
+            return;
+        }
+        LaunchBenchmarkResult result;
+        BenchmarkLaunch(*image, kNumLaunches, result);
+        const struct {
+            const char *name;
+            uint64_t tsc;
+        } kRows[] = {{"loader", result.loader_tsc}, {"template", result.template_tsc}};
+        for (const auto &row : kRows) {
+            uint64_t ns = TSCToNanoseconds(row.tsc);
+            term->Print("%-8s %lu launches of %s in %lu us: %lu ns/launch, %lu launches/s\n", row.name, 
+                result.launches, image->name, ns / 1000, ns / result.launches, 
+                ns ? result.launches * 1000000000 / ns : 0);
+        }
+    }
+
+    // FPU・SIMDの状態の切り替え方の表示と変更
+    void CommandFPU(Terminal *term, int argc, char **argv)
+    {
+        const FPUMode kModes[] = {FPUMode::kFxsave, FPUMode::kXsave, FPUMode::kXsaveopt, FPUMode::kLazy};
+        if (argc >= 2) {
+            bool found = false;
+            for (FPUMode mode : kModes) {
+                if (strcmp(argv[1], FPUModeName(mode)) == 0) {
+                    found = true;
+                    if (!SetFPUMode(mode)) {
+                        term->Print("%s is not supported\n", argv[1]);
+                    }
+                }
+            }
+            if (!found) {
+                term->Print("usage: fpu [fxsave|xsave|xsaveopt|lazy]\n");
+            }
+        }
+        term->Print("mode: %s, area %lu bytes, #NM %lu\n", FPUModeName(GetFPUMode()), FPUAreaSize(), FPUTrapCount());
+    }
+
+    void CommandBench(Terminal *term, int argc, char **argv)
+    {
+        if (argc >= 2 && strcmp(argv[1], "sched") == 0) {
+            BenchSched(term);
+            return;
+        }
+        if (argc >= 2 && strcmp(argv[1], "switch") == 0) {
+            BenchSwitch(term);
+            return;
+        }
+        if (argc >= 2 && strcmp(argv[1], "spawn") == 0) {
+            BenchSpawn(term);
+            return;
+        }
+        if (argc >= 2 && strcmp(argv[1], "launch") == 0) {
+            BenchLaunch(term, argc >= 3 ? argv[2] : "true");
+            return;
+        }
+        if (argc < 2 || strcmp(argv[1], "timer") != 0) {
+            term->Print("usage: bench timer|sched|switch|spawn|launch [APP]\n");
+            return;
+        }
+        const size_t kNumTimers[] = {10000, 100000};
+        for (size_t num_timers : kNumTimers) {
+            TimerBenchmarkResult result;
+            BenchmarkTimerWheel(num_timers, result);
+            term->Print("[%lu timers] (ns per op)\n", num_timers);
+            term->Print("  wheel add    %lu\n", TSCToNanoseconds(result.wheel_add) / num_timers);
+            term->Print("  wheel cancel %lu\n", TSCToNanoseconds(result.wheel_cancel) / (num_timers / 2));
+            term->Print("  wheel expire %lu (total %lu us)\n", 
+                TSCToNanoseconds(result.wheel_expire) / (num_timers / 2), 
+                TSCToNanoseconds(result.wheel_expire) / 1000);
+            term->Print("  heap push    %lu\n", TSCToNanoseconds(result.heap_push) / num_timers);
+            term->Print("  heap pop     %lu\n", TSCToNanoseconds(result.heap_pop) / num_timers);
+        }
+    }
+
+    // 起こされたタスクが実行されるまでの遅延を表示する。
+    // preempt on/offで起こしたタスクによるプリエンプションを切り替え、前後の遅延を比べられる。
+    void CommandSched(Terminal *term, int argc, char **argv)
+    {
+        WakeupLatencyStats stats;
+        bool preemption;
+        {
+            InterruptGuard guard;
+            if (argc >= 3 && strcmp(argv[1], "preempt") == 0) {
+                task_manager->SetPreemption(strcmp(argv[2], "on") == 0);
+                task_manager->ResetLatencyStats();
+            } else if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+                task_manager->ResetLatencyStats();
+            }
+            stats = task_manager->LatencyStats();
+            preemption = task_manager->Preemption();
+        }
+
+        term->Print("preemption: %s\n", preemption ? "on" : "off");
+        term->Print("time slices (ms):");
+        for (uint32_t slice : TaskManager::kTimeSlices) {
+            term->Print(" %u", slice);
+        }
+        term->Print("\n");
+        term->Print("wakeup latency: %lu wakeups", stats.count);
+        if (stats.count > 0) {
+            term->Print(", avg %lu us, max %lu us", 
+                TSCToNanoseconds(stats.total_tsc / stats.count) / 1000, 
+                TSCToNanoseconds(stats.max_tsc) / 1000);
+        }
+        term->Print("\n");
+
+        term->Print("deadline bandwidth: %lu%%\n", 
+            (task_manager->DeadlineBandwidth() * 100) >> TaskManager::kBandwidthShift);
+        task_manager->ForEachTask([term](Task *task) {
+            if (task->Policy() != SchedPolicy::kDeadline) {
+                return;
+            }
+            term->Print("  task %lu: %lu/%lu ms, misses %lu, throttled %lu\n", task->ID(), 
+                task->DeadlineRuntime(), task->DeadlinePeriod(), task->DeadlineMisses(), task->DeadlineThrottles());
+        });
+    }
+
+    // タスクのグループの作成・クォータの設定・タスクの移動と、グループごとの使用量の表示
+    void CommandGroup(Terminal *term, int argc, char **argv)
+    {
+        if (argc >= 3 && strcmp(argv[1], "new") == 0) {
+            int id = task_manager->NewGroup(argv[2]);
+            if (id < 0) {
+                term->Print("too many groups\n");
+                return;
+            }
+            term->Print("group %d\n", id);
+        } else if (argc >= 4 && strcmp(argv[1], "quota") == 0) {
+            // quotaを省略するか０にすると制限を外す（周期は100ms）
+            uint64_t quota = strtoul(argv[3], nullptr, 0);
+            uint64_t period = argc >= 5 ? strtoul(argv[4], nullptr, 0) : 100;
+            if (task_manager->SetGroupQuota(atoi(argv[2]), quota, period) < 0) {
+                term->Print("invalid group or period (1-%lu ms)\n", TaskManager::kMaxGroupPeriod);
+                return;
+            }
+        } else if (argc >= 4 && strcmp(argv[1], "move") == 0) {
+            if (task_manager->MoveToGroup(strtoul(argv[2], nullptr, 0), atoi(argv[3])) < 0) {
+                term->Print("cannot move task %s to group %s\n", argv[2], argv[3]);
+                return;
+            }
+        } else if (argc >= 2) {
+            term->Print("usage: group [new NAME|quota ID QUOTA_MS [PERIOD_MS]|move TASK ID]\n");
+            return;
+        }
+
+        term->Print("%-3s %-15s %12s %5s %10s %8s %12s %s\n", 
+            "ID", "NAME", "QUOTA/PERIOD", "TASKS", "USAGE(ms)", "THROTTLE", "THROTTLED(ms)", "STATE");
+        int num_groups = task_manager->NumGroups();
+        for (int id = 1; id <= num_groups; id++) {
+            TaskGroupStats stats;
+            if (!task_manager->GroupStats(id, stats)) {
+                continue;
+            }
+            char quota[24];
+            if (stats.quota == 0) {
+                snprintf(quota, sizeof(quota), "max");
+            } else {
+                snprintf(quota, sizeof(quota), "%lu/%lu", stats.quota, stats.period);
+            }
+            term->Print("%-3d %-15s %12s %5lu %10lu %8lu %12lu %s\n", 
+                stats.id, stats.name, quota, stats.num_tasks, 
+                TSCToNanoseconds(stats.usage_tsc) / 1000000, stats.throttles, 
+                TSCToNanoseconds(stats.throttled_tsc) / 1000000, 
+                stats.throttled ? "throttled" : "-");
+        }
+    }
+
+    // CPUごとに、割り込みを禁止していた時間の最大値とその場所を表示する
+    void CommandIRQOff(Terminal *term, int argc, char **argv)
+    {
+        if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+            irqoff::Reset();
+        }
+        for (int i = 0; i < smp::NumCPUs(); i++) {
+            irqoff::Stats stats = irqoff::Get(i);
+            term->Print("cpu %d: max %lu us at %s (%lu sections)\n", i, 
+                TSCToNanoseconds(stats.max_tsc) / 1000, 
+                stats.max_site ? stats.max_site : "-", stats.count);
+        }
+    }
+
+    // 割り込みベクタごとの回数と、上半分（割り込みハンドラ）・下半分（サービスタスク）の処理時間を表示する
+    void CommandIRQ(Terminal *term, int argc, char **argv)
+    {
+        if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+            irq::ResetStats();
+        }
+        term->Print("%-6s %-8s %5s %10s %10s %10s %8s %10s %10s\n", 
+            "VECTOR", "NAME", "TASK", "COUNT", "TOP(ns)", "TOPMAX", "RUNS", "THREAD(ns)", "THREADMAX");
+        for (int vector = 0; vector < 256; vector++) {
+            irq::Stats stats;
+            if (!irq::GetStats(vector, stats)) {
+                continue;
+            }
+            term->Print("0x%02x   %-8s %5lu %10lu %10lu %10lu %8lu %10lu %10lu\n", 
+                vector, stats.name, stats.task_id, stats.count, 
+                stats.count ? TSCToNanoseconds(stats.top_tsc) / stats.count : 0, 
+                TSCToNanoseconds(stats.top_max_tsc), 
+                stats.thread_runs, 
+                stats.thread_runs ? TSCToNanoseconds(stats.thread_tsc) / stats.thread_runs : 0, 
+                TSCToNanoseconds(stats.thread_max_tsc));
+        }
+    }
+
+    // CPUごとのアイドル滞在率とCステートごとの内訳を表示する。hlt/mwaitで休ませ方を切り替えて比べられる。
+    void CommandIdle(Terminal *term, int argc, char **argv)
+    {
+        if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+            idle::ResetStats();
+        } else if (argc >= 2 && strcmp(argv[1], "hlt") == 0) {
+            idle::SetMode(idle::Mode::kHlt);
+        } else if (argc >= 2 && strcmp(argv[1], "mwait") == 0) {
+            if (!idle::SetMode(idle::Mode::kMwait)) {
+                term->Print("mwait is not supported\n");
+            }
+        }
+
+        int num_states = idle::NumStates();
+        term->Print("mode: %s\n", idle::CurrentMode() == idle::Mode::kMwait ? "mwait" : "hlt");
+        uint64_t now = ReadTSC();
+        for (int i = 0; i < smp::NumCPUs(); i++) {
+            idle::Stats stats = idle::GetStats(i);
+            uint64_t elapsed = std::max<uint64_t>(now - stats.since_tsc, 1);
+            uint64_t idle_tsc = 0;
+            for (int s = 0; s < num_states; s++) {
+                idle_tsc += stats.residency_tsc[s];
+            }
+            term->Print("cpu %d: idle %lu.%lu%%, kicks %lu\n", i, 
+                idle_tsc * 100 / elapsed, idle_tsc * 1000 / elapsed % 10, stats.kicks);
+            for (int s = 0; s < num_states; s++) {
+                if (stats.entries[s] == 0) {
+                    continue;
+                }
+                term->Print("  %-4s %8lu entries, %3lu%%, avg %lu us\n", idle::State(s).name, stats.entries[s], 
+                    stats.residency_tsc[s] * 100 / elapsed, 
+                    TSCToNanoseconds(stats.residency_tsc[s] / stats.entries[s]) / 1000);
+            }
+        }
+    }
+
+    // スケジューラのトレースの開始・停止と、シリアルポートへの書き出し
+    void CommandTrace(Terminal *term, int argc, char **argv)
+    {
+        if (argc >= 2 && strcmp(argv[1], "on") == 0) {
+            trace::Start();
+        } else if (argc >= 2 && strcmp(argv[1], "off") == 0) {
+            trace::Stop();
+        } else if (argc >= 2 && strcmp(argv[1], "dump") == 0) {
+            trace::Dump();
+            term->Print("dumped to serial port (tracing stopped)\n");
+        }
+        term->Print("tracing: %s\n", trace::enabled ? "on" : "off");
+        for (int i = 0; i < smp::NumCPUs(); i++) {
+            term->Print("  cpu %d: %lu records\n", i, trace::NumRecords(i));
+        }
+    }
+
+    // システムコールごとの呼び出し回数と処理時間（平均・最大・全体に占める割合）を表示する。
+    // hist NRでそのシステムコールの処理時間のヒストグラムを表示する。
+    void CommandSyscall(Terminal *term, int argc, char **argv)
+    {
+        if (argc >= 2 && strcmp(argv[1], "on") == 0) {
+            syscall::EnableStats(true);
+        } else if (argc >= 2 && strcmp(argv[1], "off") == 0) {
+            syscall::EnableStats(false);
+        } else if (argc >= 2 && strcmp(argv[1], "reset") == 0) {
+            syscall::ResetStats();
+        } else if (argc >= 3 && strcmp(argv[1], "hist") == 0) {
+            size_t number = strtoul(argv[2], nullptr, 0);
+            if (number >= syscall::kNumSyscalls) {
+                term->Print("no such syscall: %s\n", argv[2]);
+                return;
+            }
+            syscall::Stats stats = syscall::GetStats(number);
+            term->Print("%s: %lu calls\n", syscall::GetInfo(number).name, stats.calls);
+            for (int i = 0; i < syscall::kHistogramBuckets; i++) {
+                if (stats.histogram[i] == 0) {
+                    continue;
+                }
+                term->Print("  >= %8lu ns %10lu\n", TSCToNanoseconds(1ul << i), stats.histogram[i]);
+            }
+            return;
+        }
+
+        term->Print("stats: %s\n", syscall::StatsEnabled() ? "on" : "off");
+        uint64_t total_tsc = 0;
+        for (size_t i = 0; i < syscall::kNumSyscalls; i++) {
+            total_tsc += syscall::GetStats(i).total_tsc;
+        }
+        total_tsc = std::max<uint64_t>(total_tsc, 1);
+        term->Print("%-3s %-40s %10s %10s %10s %5s\n", "NR", "NAME", "CALLS", "AVG(ns)", "MAX(ns)", "%TIME");
+        for (size_t i = 0; i < syscall::kNumSyscalls; i++) {
+            const syscall::Info &info = syscall::GetInfo(i);
+            syscall::Stats stats = syscall::GetStats(i);
+            char signature[64];
+            snprintf(signature, sizeof(signature), "%s(%s)", info.name, info.args);
+            term->Print("%-3lu %-40s %10lu %10lu %10lu %4lu%%\n", i, signature, stats.calls, 
+                stats.calls ? TSCToNanoseconds(stats.total_tsc) / stats.calls : 0, 
+                TSCToNanoseconds(stats.max_tsc), 
+                stats.total_tsc * 100 / total_tsc);
+        }
+    }
+
+    // 埋め込まれたアプリを名前で指定して実行する。複数指定すると、それぞれ別のタスク（別のアドレス空間）で同時に動く。
+    void CommandRun(Terminal *term, int argc, char **argv)
+    {
+        if (argc < 2) {
+            term->Print("apps:");
+            for (size_t i = 0; i < NumAppImages(); i++) {
+                const AppImage &image = GetAppImage(i);
+                term->Print(" %s(%lu bytes)", image.name, image.Size());
+            }
+            term->Print("\n");
+            return;
+        }
+        for (int i = 1; i < argc; i++) {
+            const AppImage *image = FindAppImage(argv[i]);
+            if (image == nullptr) {
+                term->Print("no such app: %s\n", argv[i]);
+                continue;
+            }
+            Task *task = task_manager->NewTask()
+                ->InitContext(RunApplication, reinterpret_cast<int64_t>(image));
+            task->Wakeup();
+            term->Print("task %lu: %s\n", task->ID(), image->name);
+        }
+    }
+
+    // タスクごとのCPU使用量を表示し続ける（qかEscで終わる）
+    void CommandTop(Terminal *term, int argc, char **argv)
+    {
+        term->StartTop();
+    }
+
+    struct Command {
+        const char *name;
+        void (*func)(Terminal *term, int argc, char **argv);
+        const char *description;
+    };
+
+    const Command kCommands[] = {
+        {"help", CommandHelp, "show this message"},
+        {"run", CommandRun, "run [NAME...]: run embedded apps concurrently, one task and address space each"},
+        {"bench", CommandBench, "bench timer|sched|switch|spawn|launch [APP]: timer wheel / scheduler / context switch / task spawn / app launch benchmark"},
+        {"fpu", CommandFPU, "fpu [fxsave|xsave|xsaveopt|lazy]: show or set FPU switching mode"},
+        {"sched", CommandSched, "sched [reset|preempt on|off]: wakeup latency stats"},
+        {"group", CommandGroup, "group [new NAME|quota ID QUOTA_MS [PERIOD_MS]|move TASK ID]: CPU quota per task group"},
+        {"top", CommandTop, "top: per-task CPU usage (q or Esc to quit)"},
+        {"trace", CommandTrace, "trace [on|off|dump]: scheduler trace ring (dump writes to serial)"},
+        {"irq", CommandIRQ, "irq [reset]: per-vector interrupt counts and handler time (avg/max)"},
+        {"idle", CommandIdle, "idle [reset|hlt|mwait]: idle residency per CPU and C-state"},
+        {"irqoff", CommandIRQOff, "irqoff [reset]: longest interrupt-disabled section per CPU"},
+        {"syscall", CommandSyscall, "syscall [on|off|reset|hist NR]: per-syscall counts and latency (avg/max/histogram)"},
+    };
+
+    void CommandHelp(Terminal *term, int argc, char **argv)
+    {
+        for (const Command &command : kCommands) {
+            term->Print("%-8s %s\n", command.name, command.description);
+        }
+    }
 }
 
 
@@ -82,6 +539,15 @@ void Terminal::OnKeyStroke(uint8_t *keys)
          */
         return;
     }
+    if (state_ == TerminalState::kTop) {
+        for (int i = 2; i < 8; i++) {
+            if (keys[i] == HID_KC_Q || keys[i] == HID_KC_ESC) {
+                StopTop();
+                return;
+            }
+        }
+        return;
+    }
     
     ModifierKey modifier_key{keys[0]};
     if (modifier_key.bits.left_ctrl || modifier_key.bits.right_ctrl) {
@@ -112,6 +578,7 @@ void Terminal::OnKeyStroke(uint8_t *keys)
                 case HID_KC_RIGHT: // カーソルを右へ動かす
                     if (cursor_pos_ < s_len_) {
                         // 文字の置かれていないところへの移動はできない
+                        LockGuard<Mutex> guard{output_lock_};
                         cursor_pos_ = screen_manager_->MoveCursor(CursorMove::Right);
                     }
                     break;
@@ -119,6 +586,7 @@ void Terminal::OnKeyStroke(uint8_t *keys)
                 case HID_KC_LEFT: // カーソルを左へ動かす
                     if (prompt_len_ < cursor_pos_) {
                         // プロンプトは消さないようにする
+                        LockGuard<Mutex> guard{output_lock_};
                         cursor_pos_ = screen_manager_->MoveCursor(CursorMove::Left);
                     }
                     break;
@@ -133,26 +601,154 @@ void Terminal::OnKeyStroke(uint8_t *keys)
             }
 
             char c = key_code_list[k]; // ASCII文字
+            if (c == '\n') {
+                // ibuf_から文字列を読み込み実行し、プロンプトを再表示する
+                ibuf_[s_len_] = '\x00';
+                {
+                    LockGuard<Mutex> guard{output_lock_};
+                    screen_manager_->PutChar(c);
+                }
+                ExecuteLine(ibuf_ + prompt_len_);
+                if (state_ == TerminalState::kWaitingForInput) { // topなどはコマンドが終わる時に表示する
+                    PutPrompt();
+                }
+                return;
+            }
             if (c) {
                 // 対応するASCII文字があれば出力しておく
                 PutChar(c);
             }
-            if (c == '\n') {
-                /* 
-                 * ibuf_から文字列を読み込み実行する
-                 * ここではとりあえずプロンプトの再表示を行う
-                 */
-                PutPrompt();
-                return;
-            }
         }
     }
 }
 
 
+int Terminal::Print(const char *format, ...)
+{
+    int res;
+    va_list ap;
+    char s[1024];
+
+    va_start(ap, format);
+    res = vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+
+    LockGuard<Mutex> guard{output_lock_};
+    screen_manager_->PutString(s);
+    return res;
+}
+
+size_t Terminal::Write(const char *buf, size_t len)
+{
+    LockGuard<Mutex> guard{output_lock_};
+    screen_manager_->Write(buf, len);
+    return len;
+}
+
+
+void Terminal::StartTop()
+{
+    state_ = TerminalState::kTop;
+    top_lines_ = 0;
+    top_prev_tsc_ = 0;
+    top_prev_run_.clear();
+    DrawTop();
+    top_timer_ = timer_manager->AddTimer(timer_manager->CurrentTick() + kTopInterval, kTopTimerValue);
+}
+
+void Terminal::OnTopTimer()
+{
+    if (state_ != TerminalState::kTop) { // 止めた後に届いたもの
+        return;
+    }
+    DrawTop();
+    top_timer_ = timer_manager->AddTimer(timer_manager->CurrentTick() + kTopInterval, kTopTimerValue);
+}
+
+
 /* 
  * PRIVATE
  */
+void Terminal::StopTop()
+{
+    timer_manager->CancelTimer(top_timer_);
+    top_timer_ = kNullTimerHandle;
+    state_ = TerminalState::kWaitingForInput;
+    PutPrompt();
+}
+
+void Terminal::DrawTop()
+{
+    // 前回の表示の先頭までカーソルを戻して上書きする
+    {
+        LockGuard<Mutex> guard{output_lock_};
+        for (int i = 0; i < top_lines_; i++) {
+            screen_manager_->MoveCursor(CursorMove::Up);
+        }
+    }
+    top_lines_ = 0;
+
+    uint64_t now = ReadTSC();
+    uint64_t interval = top_prev_tsc_ == 0 ? 0 : now - top_prev_tsc_;
+    top_prev_tsc_ = now;
+
+    PutTopLine("top - %d CPUs, %d running tasks, every %lu ms (q: quit)", 
+        smp::NumCPUs(), task_manager->NumRunningTasks(), kTopInterval);
+    PutTopLine("%4s %5s %3s %5s %10s %10s %8s %8s %8s", 
+        "ID", "SCHED", "CPU", "%CPU", "RUN(ms)", "WAIT(ms)", "WAKEUPS", "VOL", "INVOL");
+    task_manager->ForEachTask([this, interval](Task *task) {
+        TaskUsage usage = task_manager->Usage(task);
+        if (top_prev_run_.size() <= task->ID()) {
+            top_prev_run_.resize(task->ID() + 1, 0);
+        }
+        // 前回の表示から今回までに実行していた割合（１回目は起動してからの合計しかないので出さない）
+        uint64_t permille = 0;
+        if (interval > 0) {
+            permille = (usage.run_tsc - top_prev_run_[task->ID()]) * 1000 / interval;
+        }
+        top_prev_run_[task->ID()] = usage.run_tsc;
+
+        char sched[8];
+        switch (task->Policy()) {
+            case SchedPolicy::kFair:
+                sprintf(sched, "F%d", task->Nice());
+                break;
+            case SchedPolicy::kDeadline:
+                sprintf(sched, "DL");
+                break;
+            default:
+                sprintf(sched, "L%d", task->Level());
+                break;
+        }
+        const char *state = task_manager->OnCPU(task) ? "*" : (task->Running() ? "R" : "S");
+        PutTopLine("%4lu %5s %2d%s %3lu.%lu %10lu %10lu %8lu %8lu %8lu", 
+            task->ID(), sched, task->CPU(), state, permille / 10, permille % 10, 
+            TSCToNanoseconds(usage.run_tsc) / 1000000, TSCToNanoseconds(usage.wait_tsc) / 1000000, 
+            usage.wakeups, usage.voluntary_switches, usage.involuntary_switches);
+    });
+    PutTopLine("CPU: *=on CPU, R=waiting, S=sleeping");
+}
+
+void Terminal::PutTopLine(const char *format, ...)
+{
+    char s[256];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(s, sizeof(s), format, ap);
+    va_end(ap);
+
+    int width = std::min<int>(screen_manager_->FrameWidth() - 1, sizeof(s) - 1);
+    len = std::min(std::max(len, 0), width);
+    for (int i = len; i < width; i++) {
+        s[i] = ' ';
+    }
+    s[width] = '\x00';
+    LockGuard<Mutex> guard{output_lock_};
+    screen_manager_->PutString(s);
+    screen_manager_->PutChar('\n');
+    top_lines_++;
+}
+
 void Terminal::PutChar(char c)
 {
     if (s_len_ == ibuf_len_ - 1) {
@@ -160,6 +756,7 @@ void Terminal::PutChar(char c)
         return;
     }
 
+    LockGuard<Mutex> guard{output_lock_};
     if (cursor_pos_ == s_len_) { 
         // カーソルから右に文字がない場合は一文字出力
         ibuf_[cursor_pos_] = c;
@@ -188,6 +785,7 @@ void Terminal::HandleBackSpace()
         return;
     }
     cursor_pos_--;
+    LockGuard<Mutex> guard{output_lock_};
     screen_manager_->MoveCursor(CursorMove::Left);
     for (int idx = cursor_pos_; idx < s_len_ - 1; idx++) {
         ibuf_[idx] = ibuf_[idx + 1];
@@ -208,11 +806,13 @@ void Terminal::HandleDelete()
     }
     s_len_--;
     ibuf_[s_len_] = '\x00';
+    LockGuard<Mutex> guard{output_lock_};
     screen_manager_->UpdateRightFromCursor(ibuf_ + cursor_pos_);
 }
 
 void Terminal::PutPrompt()
 {
+    LockGuard<Mutex> guard{output_lock_};
     screen_manager_->PutString(username_, prompt_color_);
     screen_manager_->PutString("@jinux-2022: ", prompt_color_);
     /* 
@@ -223,6 +823,34 @@ void Terminal::PutPrompt()
     s_len_ = prompt_len_;
 }
 
+void Terminal::ExecuteLine(char *line)
+{
+    const int kMaxArgs = 8;
+    char *argv[kMaxArgs];
+    int argc = 0;
+
+    // 空白で区切って引数に分ける
+    char *p = line;
+    while (*p && argc < kMaxArgs) {
+        while (*p == ' ') *p++ = '\x00';
+        if (*p == '\x00') break;
+        argv[argc++] = p;
+        while (*p && *p != ' ') p++;
+    }
+    *p = '\x00';
+    if (argc == 0) {
+        return;
+    }
+
+    for (const Command &command : kCommands) {
+        if (strcmp(argv[0], command.name) == 0) {
+            command.func(this, argc, argv);
+            return;
+        }
+    }
+    Print("%s: command not found\n", argv[0]);
+}
+
 void Terminal::ProcessKeyStrokeWithCtrl(uint8_t *keys)
 {
 
@@ -232,11 +860,17 @@ void Terminal::ProcessKeyStrokeWithCtrl(uint8_t *keys)
             switch (k) {
                 case HID_KC_UP:
                     // 上スクロール
-                    screen_manager_->Scroll(true);
+                    {
+                        LockGuard<Mutex> guard{output_lock_};
+                        screen_manager_->Scroll(true);
+                    }
                     break;
                 case HID_KC_DOWN:
                     // 下スクロール
-                    screen_manager_->Scroll();
+                    {
+                        LockGuard<Mutex> guard{output_lock_};
+                        screen_manager_->Scroll();
+                    }
                     break;
                 case HID_KC_RIGHT:
                     break;
@@ -2,13 +2,18 @@
 
 #include <array>
 #include <string>
+#include <vector>
 
 #include "screen.hpp"
 #include "console.hpp"
+#include "timer.hpp"
+#include "spinlock.hpp"
+#include "task.hpp"
 
 enum class TerminalState {
     kWaitingForInput,
-    kRunningApplication
+    kRunningApplication,
+    kTop, // topコマンドの表示中（qかEscで終わる）
 };
 
 class Terminal
@@ -20,8 +25,24 @@ public:
     // USBキーボードのキー入力処理から呼ばれる。
     void OnKeyStroke(uint8_t *keys);
 
+    // フォーマット文字列をターミナルに出力する（コマンドの出力に使う）
+    int Print(const char *format, ...);
+    // len バイトをそのままターミナルに出力する（write()システムコールから呼ばれる）。
+    // 画面への反映はまとめて１回だけ行う。書き込んだバイト数を返す。
+    size_t Write(const char *buf, size_t len);
+
+    // topコマンド：タスクごとのCPU使用量を表示し、kTopIntervalミリ秒ごとにその場で書き直す
+    static const int kTopTimerValue = 0x70; // 書き直しのタイマーの値（メインタスクに届く）
+    static const uint64_t kTopInterval = 1000;
+    void StartTop();
+    void OnTopTimer(); // kTopTimerValueのタイマーが満了した時にメインタスクから呼ぶ
+
 private:
     ScreenManager *screen_manager_;
+    // screen_manager_への出力を守る。アプリは他のCPUからもwrite()で書き込んでくるので。
+    // コマンドの実行中（ExecuteLine()）には持たず、画面に触る１回分の処理の間だけ持つ。
+    // 描画（画面全体の描き直しもある）は長くかかるので、割り込みを禁止しない眠るロックにする。
+    Mutex output_lock_;
     TerminalState state_; // この値次第でキー入力の挙動などが変わる
 
     char *ibuf_; // 入力バッファ（スクリーンの横の長さ分の領域をmallocで確保する）
@@ -42,6 +63,17 @@ private:
     void HandleDelete(); // Deleteキーを押されたときに呼ばれる
     // プロンプトを表示。返り値は表示した後のカーソル位置を示す。内部でcursor_pos_やprompt_lenを決める。
     void PutPrompt();
+    // 入力された１行をコマンドとして実行する
+    void ExecuteLine(char *line);
+
+    TimerHandle top_timer_{kNullTimerHandle};
+    int top_lines_{0}; // 前回のtopの表示の行数（書き直す時にその分カーソルを戻す）
+    uint64_t top_prev_tsc_{0}; // 前回のtopの表示の時刻
+    std::vector<uint64_t> top_prev_run_; // 前回の表示の時の各タスクの実行時間（タスクidで引く）
+    void DrawTop();
+    void StopTop();
+    // 画面の幅まで空白で埋めた１行を出力する（書き直した時に前の表示が残らないように）
+    void PutTopLine(const char *format, ...);
 };
 
 
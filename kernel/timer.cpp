@@ -3,6 +3,9 @@
 #include "logging.hpp"
 #include "message.hpp"
 #include "task.hpp"
+#include "asmfunc.h"
+
+#include <algorithm>
 
 extern logging::Logger *logger;
 extern TimerManager *timer_manager;
@@ -18,6 +21,15 @@ namespace
     volatile uint32_t *kInitialCountRegister = reinterpret_cast<uint32_t *>(0xfee00380ul);
     volatile uint32_t *kCurrentCountRegister = reinterpret_cast<uint32_t *>(0xfee00390ul);
     volatile uint32_t *kDivideConfigurationRegister = reinterpret_cast<uint32_t *>(0xfee003e0ul);
+
+    // アプリにマップするので、他のデータと同じページに載らないよう１ページ分を占める
+    alignas(4096) union {
+        TimePage page;
+        uint8_t bytes[4096];
+    } time_page{};
+    static_assert(sizeof(time_page) == 4096);
+
+    const uint32_t kTimePageShift = 32;
 }
 
 void InitializeLocalAPICTimer()
@@ -30,11 +42,16 @@ void InitializeLocalAPICTimer()
     timer_manager = new TimerManager(main_queue);
     timer_manager->Start(0x1000000); 
     uint64_t start = timer_manager->TotalCount();
+    uint64_t tsc_start = ReadTSC();
     // 100ms待つ
     acpi::WaitMilliseconds(100);
     uint64_t end = timer_manager->TotalCount();
+    uint64_t tsc_end = ReadTSC();
     uint64_t counts_per_ms = (end - start) / 100;
     printk("LAPIC Timer Counts %ld Per 1ms.\n", counts_per_ms);
+    // 同じ100msでTSCの周波数も測っておく（ベンチマークなどの時間計測に使う）
+    timer_manager->SetTSCPerMillisecond((tsc_end - tsc_start) / 100);
+    printk("TSC Counts %ld Per 1ms.\n", timer_manager->TSCPerMillisecond());
 
     timer_manager->Stop();
     timer_manager->Start(counts_per_ms); // １チックにかかる時間を１msにする
@@ -43,18 +60,181 @@ void InitializeLocalAPICTimer()
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext *ctx_stack)
 {
-    bool task_timer_timeout = timer_manager->Tick();
-    NotifyEndOfInterrupt();
+    if (task_manager == nullptr) { // タスク管理の初期化前（タイマーの較正中など）
+        timer_manager->Tick();
+        NotifyEndOfInterrupt();
+        return;
+    }
 
-    if (task_timer_timeout) {
-        // タスクの入れ替え処理を行う
-        task_manager->SwitchTask(ctx_stack);
+    task_manager->EnterInterrupt(InterruptVector::kLAPICTimer);
+    if (smp::CPUIndex() == 0) { // 時刻と論理タイマーはBSPだけが進める
+        timer_manager->Tick();
     }
+    bool task_timer_timeout = timer_manager->TaskTimerExpired();
+    bool group_throttled = task_manager->OnTimerTick();
+    NotifyEndOfInterrupt();
+
+    // タイムスライスを使い切った場合や、起こしたタスクの方が優先度が高い場合はタスクの入れ替え処理を行う。
+    // アイドル中のCPUは、他のCPUで待たされているタスクがあれば引き取るために切り替える。
+    // 実行中のタスクのグループがクォータを使い切っていれば、補充されるまで外すために切り替える。
+    task_manager->ExitInterrupt(ctx_stack, task_timer_timeout || group_throttled || task_manager->ShouldPullTask());
 }
 
  
 
-TimerManager::TimerManager(std::deque<Message> *msg_queue) : tick_{0}
+TimerWheel::TimerWheel(uint64_t now) : now_{now}
+{
+    for (auto &level : slots_) {
+        for (auto &slot : level) {
+            slot.prev_ = slot.next_ = &slot;
+        }
+    }
+}
+
+TimerWheel::~TimerWheel()
+{
+    for (Timer *chunk : chunks_) {
+        delete[] chunk;
+    }
+}
+
+TimerHandle TimerWheel::Add(uint64_t timeout, Timer::Type type, int value, uint64_t task_id, uint64_t slack)
+{
+    if (slack) {
+        // [timeout, timeout + slack]の中で下位ビットが最も多く０になる時刻に丸める。
+        // 近い締め切りのタイマーが同じ時刻に揃うので、まとめて満了させられる。
+        uint64_t limit = timeout + slack;
+        uint64_t mask = timeout ^ limit;
+        if (mask) {
+            int bit = 63 - __builtin_clzll(mask);
+            timeout = limit & ~((1ull << bit) - 1);
+        }
+    }
+
+    Timer *timer = AllocNode();
+    timer->type_ = type;
+    timer->timeout_ = timeout;
+    timer->value_ = value;
+    timer->task_id_ = task_id;
+    timer->pending_ = true;
+    Enqueue(timer);
+    num_pending_++;
+    return TimerHandle{timer, timer->generation_};
+}
+
+bool TimerWheel::Cancel(TimerHandle handle)
+{
+    Timer *timer = handle.timer;
+    if (timer == nullptr || timer->generation_ != handle.generation || !timer->pending_) {
+        // すでに満了したか取り消されている
+        return false;
+    }
+    Unlink(timer);
+    timer->pending_ = false;
+    num_pending_--;
+    FreeNode(timer);
+    return true;
+}
+
+Timer *TimerWheel::AllocNode()
+{
+    if (free_list_ == nullptr) {
+        // プールが空の時だけチャンク単位でまとめて確保する
+        Timer *chunk = new Timer[kNodesPerChunk];
+        chunks_.push_back(chunk);
+        for (int i = 0; i < kNodesPerChunk; i++) {
+            chunk[i].next_ = free_list_;
+            free_list_ = &chunk[i];
+        }
+    }
+    Timer *timer = free_list_;
+    free_list_ = timer->next_;
+    return timer;
+}
+
+void TimerWheel::FreeNode(Timer *timer)
+{
+    timer->generation_++; // 以前のハンドルを無効にする
+    timer->prev_ = nullptr;
+    timer->next_ = free_list_;
+    free_list_ = timer;
+}
+
+void TimerWheel::Enqueue(Timer *timer)
+{
+    uint64_t timeout = timer->timeout_;
+    if (timeout < now_) {
+        // すでに過ぎた時刻は次のtickで満了させる
+        timeout = now_;
+    }
+    uint64_t delta = timeout - now_;
+
+    int level = 0;
+    while (level < kLevels - 1 && delta >= (1ull << (kBitsPerLevel * (level + 1)))) {
+        level++;
+    }
+    if (delta >= (1ull << (kBitsPerLevel * kLevels))) {
+        // ホイールに収まらないほど先のタイマーは、最上段の一番遠いスロットに置いておく。
+        // カスケードされるたびに本来の満了時刻で入れ直される。
+        timeout = now_ + (1ull << (kBitsPerLevel * kLevels)) - 1;
+    }
+
+    int index = (timeout >> (kBitsPerLevel * level)) & (kSlotsPerLevel - 1);
+    Timer *slot = &slots_[level][index];
+    timer->prev_ = slot->prev_;
+    timer->next_ = slot;
+    slot->prev_->next_ = timer;
+    slot->prev_ = timer;
+}
+
+void TimerWheel::Unlink(Timer *timer)
+{
+    timer->prev_->next_ = timer->next_;
+    timer->next_->prev_ = timer->prev_;
+    timer->prev_ = timer->next_ = nullptr;
+}
+
+void TimerWheel::Cascade(int level)
+{
+    int index = (now_ >> (kBitsPerLevel * level)) & (kSlotsPerLevel - 1);
+    Timer list;
+    list.prev_ = list.next_ = &list;
+    SpliceSlot(&slots_[level][index], &list);
+
+    Timer *timer = list.next_;
+    while (timer != &list) {
+        Timer *next = timer->next_;
+        Enqueue(timer);
+        timer = next;
+    }
+}
+
+void TimerWheel::SpliceSlot(Timer *slot, Timer *head)
+{
+    if (slot->next_ == slot) {
+        return;
+    }
+    Timer *first = slot->next_;
+    Timer *last = slot->prev_;
+    first->prev_ = head->prev_;
+    head->prev_->next_ = first;
+    last->next_ = head;
+    head->prev_ = last;
+    slot->prev_ = slot->next_ = slot;
+}
+
+
+
+TimerManager::TimerManager(std::deque<Message> *msg_queue) :
+    tick_{0}, timers_{0}
+{
+    task_timer_timeout_.fill(~static_cast<uint64_t>(0));
+    expired_.reserve(64);
+    time_page.page.ns_per_tick = kNanosecondsPerTick;
+    SetupLVT();
+}
+
+void TimerManager::SetupLVT()
 {
     // 一旦APICタイマを止めておく。
     *kInitialCountRegister = 0;
@@ -70,9 +250,6 @@ TimerManager::TimerManager(std::deque<Message> *msg_queue) : tick_{0}
     // 分周比を１に設定
     *kDivideConfigurationRegister = 0b1011;
     logger->debug("Set %08xh to Divide Configuration Register\n", *kDivideConfigurationRegister);
-
-    // 論理タイマーのキューに最大の大きさのタイマーを入れておく
-    timers_.push(Timer(0xffffffffu, -1));
 }
 
 void TimerManager::Start(uint32_t counts_per_loop)
@@ -81,49 +258,231 @@ void TimerManager::Start(uint32_t counts_per_loop)
     *kInitialCountRegister = counts_per_loop_; // 書き込んだ時点からタイマーはカウントを始める。
 }
 
+void TimerManager::StartOnAP()
+{
+    SetupLVT();
+    *kInitialCountRegister = counts_per_loop_;
+}
+
 void TimerManager::Stop()
 {
     *kInitialCountRegister = 0;
 }
 
-void TimerManager::AddTimer(Timer timer)
+TimerHandle TimerManager::AddTimer(uint64_t timeout, int value, uint64_t task_id, uint64_t slack)
 {
-    timers_.push(timer);
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    return timers_.Add(timeout, Timer::Type::kMessage, value, task_id, slack);
 }
 
-bool TimerManager::Tick()
+TimerHandle TimerManager::AddWakeupTimer(uint64_t timeout, uint64_t task_id, uint64_t slack)
 {
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    return timers_.Add(timeout, Timer::Type::kWakeup, 0, task_id, slack);
+}
+
+TimerHandle TimerManager::AddReplenishTimer(uint64_t timeout, uint64_t task_id)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    return timers_.Add(timeout, Timer::Type::kReplenish, 0, task_id);
+}
+
+bool TimerManager::CancelTimer(TimerHandle handle)
+{
+    IRQSaveLockGuard<TicketSpinLock> guard{lock_};
+    return timers_.Cancel(handle);
+}
+
+void TimerManager::Tick()
+{
+    uint64_t tsc = ReadTSC();
+    tick_seq_++;
+    time_page.page.seq++;
+    __asm__ volatile("" : : : "memory");
+    tick_tsc_ = tsc;
     tick_++;
-    bool task_timer_timeout = false;
-    while (1) {
-        Timer timer = timers_.top();
-        if (timer.Timeout() > tick_)
-            break;
-        
-        // タスク切り替えに関するタイマーの場合
-        if (timer.Value() == kTaskTimerValue) {
-            task_timer_timeout = true; // 返り値をtrueにセットする
-            timers_.pop(); // Tick()は割り込み時に行われるメンバ関数なので、他の割り込みを想定しなくて良い。
-            timers_.push(Timer(tick_ + kTaskTimerPeriod, kTaskTimerValue)); // 次のタイマーをセット
+    time_page.page.tick_tsc = tsc;
+    time_page.page.tick = tick_;
+    __asm__ volatile("" : : : "memory");
+    time_page.page.seq++;
+    tick_seq_++;
+
+    // 満了したタイマーはロックを持ったまま写しておき、通知はロックを外してから行う。
+    // 通知先のTaskManagerはスケジューラのロックを取り、その中からAddReplenishTimer()を呼ぶことがあるため。
+    {
+        LockGuard<TicketSpinLock> guard{lock_}; // 割り込みハンドラの中
+        timers_.Advance(tick_, [this](const Timer &timer) {
+            expired_.push_back(timer);
+        });
+    }
+
+    // タイムアウト時刻になったタイマーについてのメッセージをまとめて各タスクに送る。
+    // Tick()は割り込み時に行われるメンバ関数なので、他の割り込みを想定しなくて良い。
+    for (const Timer &timer : expired_) {
+        if (timer.GetType() == Timer::Type::kWakeup) {
+            // スリープ中のタスクを起こすだけ（メッセージは送らない）
+            task_manager->OnWakeupTimer(timer.TaskID());
+            continue;
+        }
+        if (timer.GetType() == Timer::Type::kReplenish) {
+            task_manager->OnReplenishTimer(timer.TaskID());
             continue;
         }
-        // タイムアウト時刻になったタイマーについてのメッセージをキューに挿入する。
         Message msg;
         msg.type = Message::Type::kTimerTimeout;
         msg.arg.timer.timeout = timer.Timeout();
         msg.arg.timer.value = timer.Value();
-        task_manager->SendMessage(1, msg); // メインタスクのタイマーはidが１
-
-        timers_.pop();
+        task_manager->SendMessage(timer.TaskID(), msg);
     }
+    expired_.clear();
+}
 
-    return task_timer_timeout;
+bool TimerManager::TaskTimerExpired()
+{
+    // タスク切り替えの時刻は毎tick比較するだけなので、タイマーとして登録し直す必要はない。
+    // 次の切り替え時刻はTaskManagerが次のタスクのタイムスライスに合わせてセットし直す。
+    uint64_t &timeout = task_timer_timeout_[smp::CPUIndex()];
+    if (tick_ >= timeout) {
+        timeout = ~static_cast<uint64_t>(0);
+        return true;
+    }
+    return false;
 }
 
 uint64_t TimerManager::TotalCount()
 {
     uint32_t current_count = *kCurrentCountRegister;
     return \
-        static_cast<uint64_t>(tick_) * static_cast<uint64_t>(counts_per_loop_) +\
+        tick_ * static_cast<uint64_t>(counts_per_loop_) +\
         static_cast<uint64_t>(counts_per_loop_) - static_cast<uint64_t>(current_count);
 }
+
+uint64_t TimerManager::MonotonicNanoseconds()
+{
+    if (tsc_per_ms_ == 0) { // TSCの較正前
+        return tick_ * kNanosecondsPerTick;
+    }
+
+    uint64_t seq, tick, tsc;
+    do { // 読んでいる間にtickが進んだらやり直す
+        seq = tick_seq_;
+        __asm__ volatile("" : : : "memory");
+        tick = tick_;
+        tsc = tick_tsc_;
+        __asm__ volatile("" : : : "memory");
+    } while ((seq & 1) || seq != tick_seq_);
+
+    // １tick未満の部分。BSPの割り込みが遅れていても次のtickの時刻は越えないようにする。
+    uint64_t elapsed = (ReadTSC() - tsc) * kNanosecondsPerTick / tsc_per_ms_;
+    elapsed = std::min(elapsed, kNanosecondsPerTick - 1);
+    return tick * kNanosecondsPerTick + elapsed;
+}
+
+uint64_t TimerManager::NanosecondsUntilNextTick()
+{
+    if (counts_per_loop_ == 0) { // 開始前
+        return 0;
+    }
+    // カウントはCPUごとのLAPICのものなので、BSPとは位相がずれているAPでも自分の次の割り込みまでの時間になる
+    return static_cast<uint64_t>(*kCurrentCountRegister) * kNanosecondsPerTick / counts_per_loop_;
+}
+
+void TimerManager::SetTSCPerMillisecond(uint64_t tsc_per_ms)
+{
+    tsc_per_ms_ = tsc_per_ms;
+
+    // １tick未満の部分は tsc_per_tick 未満に抑えるので、(tsc_per_tick − 1) * tsc_mult は
+    // kNanosecondsPerTick << kTimePageShift 程度に収まり溢れない
+    TimePage &page = time_page.page;
+    page.seq++;
+    __asm__ volatile("" : : : "memory");
+    page.ns_per_tick = kNanosecondsPerTick;
+    page.tsc_per_tick = tsc_per_ms * kNanosecondsPerTick / 1000000;
+    page.tsc_mult = page.tsc_per_tick ? (kNanosecondsPerTick << kTimePageShift) / page.tsc_per_tick : 0;
+    page.tsc_shift = kTimePageShift;
+    __asm__ volatile("" : : : "memory");
+    page.seq++;
+}
+
+const TimePage *TimerManager::SharedTimePage()
+{
+    return &time_page.page;
+}
+
+uint64_t TimerManager::TSCToNanoseconds(uint64_t tsc)
+{
+    if (tsc_per_ms_ == 0) {
+        return 0;
+    }
+    // 長い時間（タスクの累計の実行時間など）でも溢れないように、ミリ秒の部分と端数を分けて計算する
+    return tsc / tsc_per_ms_ * kNanosecondsPerTick + tsc % tsc_per_ms_ * kNanosecondsPerTick / tsc_per_ms_;
+}
+
+
+namespace
+{
+    // ベンチマーク用の線形合同法による擬似乱数
+    uint64_t NextRandom(uint64_t &state)
+    {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        return state >> 33;
+    }
+}
+
+void BenchmarkTimerWheel(size_t num_timers, TimerBenchmarkResult &result)
+{
+    const uint64_t kMaxTimeout = 100000; // 満了時刻は１〜100000tickの範囲でばらつかせる
+    result.num_timers = num_timers;
+
+    std::vector<uint64_t> timeouts(num_timers);
+    uint64_t seed = 0x2022;
+    for (size_t i = 0; i < num_timers; i++) {
+        timeouts[i] = 1 + NextRandom(seed) % kMaxTimeout;
+    }
+
+    TimerWheel *wheel = new TimerWheel{0};
+    std::vector<TimerHandle> handles(num_timers);
+
+    uint64_t start = ReadTSC();
+    for (size_t i = 0; i < num_timers; i++) {
+        handles[i] = wheel->Add(timeouts[i], Timer::Type::kMessage, i, 0);
+    }
+    result.wheel_add = ReadTSC() - start;
+
+    start = ReadTSC();
+    for (size_t i = 0; i < num_timers; i += 2) {
+        wheel->Cancel(handles[i]);
+    }
+    result.wheel_cancel = ReadTSC() - start;
+
+    size_t num_expired = 0;
+    start = ReadTSC();
+    for (uint64_t tick = 1; tick <= kMaxTimeout; tick++) {
+        num_expired += wheel->Advance(tick, [](const Timer &) {});
+    }
+    result.wheel_expire = ReadTSC() - start;
+    if (num_expired != num_timers / 2 || wheel->NumPending() != 0) {
+        logger->error("[TimerWheel] expired %lu timers (expected %lu)\n", num_expired, num_timers / 2);
+    }
+    delete wheel;
+
+    // 以前の実装（std::priority_queue）との比較
+    struct HeapTimer {
+        uint64_t timeout;
+        int value;
+        bool operator<(const HeapTimer &rhs) const { return timeout > rhs.timeout; }
+    };
+    std::priority_queue<HeapTimer> *heap = new std::priority_queue<HeapTimer>;
+    start = ReadTSC();
+    for (size_t i = 0; i < num_timers; i++) {
+        heap->push(HeapTimer{timeouts[i], static_cast<int>(i)});
+    }
+    result.heap_push = ReadTSC() - start;
+
+    start = ReadTSC();
+    while (!heap->empty()) {
+        heap->pop();
+    }
+    result.heap_pop = ReadTSC() - start;
+    delete heap;
+}
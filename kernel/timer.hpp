@@ -1,10 +1,15 @@
 #pragma once
+#include <array>
+#include <deque>
 #include <queue>
+#include <vector>
 
 #include "interrupt.hpp"
 #include "message.hpp"
 #include "task.hpp"
 #include "acpi.hpp"
+#include "smp.hpp"
+#include "spinlock.hpp"
 
 // lvt timer registerのレイアウト
 // 書き込みは32bitで一気にする必要がある。
@@ -29,29 +34,159 @@ void InitializeLocalAPICTimer();
 
 
 // TimerManagerで管理される論理タイマー
-// 
-// ＜引数の説明＞
-// timeout：　通知を返してほしい時刻を指定する。時刻の単位は、１tick（TimerManagerの）である。
-// value：　通知の時に一緒に伝達される値。タイマーの識別なんかに使う。PIDとか？
+// タイマーホイールのスロットに繋がれる双方向リストのノードでもある。
+// ノードはTimerWheelが内部のプールから貸し出すので、AddTimerのたびにヒープ確保は起きない。
+//
+// ＜メンバの説明＞
+// timeout：　通知を返してほしい時刻。時刻の単位は、１tick（TimerManagerの）である。
+// value：　通知の時に一緒に伝達される値。タイマーの識別なんかに使う。
+// task_id：　タイムアウトの通知を送る先のタスク。
+// type：　タイムアウト時の動作。kMessageならtask_idのタスクにMessageを送り、
+//        kWakeupならtask_idのタスクをスリープ（SleepUntilやWaitTimeout）から起こす。
+//        kReplenishならkDeadlineのtask_idのタスクの実行時間を補充する。
 class Timer
 {
 public:
-    Timer(uint32_t timeout, int value) :
-        timeout_{timeout}, value_{value} {};
-    uint32_t Timeout() const { return timeout_; }
-    int Value() { return value_; }
+    enum class Type {
+        kMessage,
+        kWakeup,
+        kReplenish,
+    };
+
+    Type GetType() const { return type_; }
+    uint64_t Timeout() const { return timeout_; }
+    int Value() const { return value_; }
+    uint64_t TaskID() const { return task_id_; }
+
+private:
+    friend class TimerWheel;
+
+    Type type_{Type::kMessage};
+    uint64_t timeout_{0};
+    int value_{0};
+    uint64_t task_id_{0};
+    uint64_t generation_{0}; // プールに返却されるたびに増える。古いハンドルの検出に使う。
+    Timer *prev_{nullptr};
+    Timer *next_{nullptr};
+    bool pending_{false}; // ホイールに登録されている間true
+};
+
+// AddTimer()が返すタイマーのハンドル。CancelTimer()に渡して取り消すのに使う。
+// タイマーが満了・取り消しされた後のハンドルはgenerationが一致しなくなるので無効になる。
+struct TimerHandle
+{
+    Timer *timer;
+    uint64_t generation;
+
+    bool IsValid() const { return timer != nullptr; }
+};
+
+const TimerHandle kNullTimerHandle{nullptr, 0};
+
+
+// 階層型タイマーホイール
+// １段目は１tick刻みの64スロット、２段目は64tick刻みの64スロット…というように
+// kLevels段のホイールを持つ。追加・取り消しはO(1)で、下の段のホイールが一周するたびに
+// 上の段のスロットを１つだけ下の段へ振り分け直す（カスケード）。
+// 64bitの満了時刻を扱い、2^36tickより先のタイマーは最上段に入れておき、カスケードのたびに入れ直す。
+//
+// ＜メンバ関数の説明＞
+// Add()：　timeoutに満了するタイマーを登録する。slackを指定すると、[timeout, timeout + slack]の
+//        範囲で下位ビットが揃った時刻に丸めるので、近い締め切りのタイマーが同じスロットにまとまる。
+// Cancel()：　タイマーを取り消す。すでに満了・取り消し済みならfalseを返す。
+// Advance()：　nowまで時刻を進め、満了したタイマーをまとめてon_expireに渡す。
+//           on_expireから戻った後、タイマーのノードはプールに返却される。
+class TimerWheel
+{
+public:
+    static const int kBitsPerLevel = 6;
+    static const int kSlotsPerLevel = 1 << kBitsPerLevel;
+    static const int kLevels = 6;
+    static const int kNodesPerChunk = 256; // プールが空になった時にまとめて確保するノード数
+
+    TimerWheel(uint64_t now);
+    ~TimerWheel();
+
+    TimerHandle Add(uint64_t timeout, Timer::Type type, int value, uint64_t task_id, uint64_t slack = 0);
+    bool Cancel(TimerHandle handle);
+
+    template <class F>
+    size_t Advance(uint64_t now, F on_expire);
+
+    uint64_t Now() const { return now_; }
+    size_t NumPending() const { return num_pending_; }
 
 private:
-    uint32_t timeout_;
-    int value_;
+    // スロットは番兵ノードを持つ循環リストにしておく
+    std::array<std::array<Timer, kSlotsPerLevel>, kLevels> slots_;
+    uint64_t now_; // 次に処理するtick
+    size_t num_pending_{0};
+
+    Timer *free_list_{nullptr}; // 未使用ノードのリスト（next_で繋ぐ）
+    std::vector<Timer *> chunks_; // デストラクタで解放するために確保したチャンクを覚えておく
+
+    Timer *AllocNode();
+    void FreeNode(Timer *timer);
+    void Enqueue(Timer *timer); // 満了時刻に応じたスロットへ繋ぐ
+    void Unlink(Timer *timer);
+    void Cascade(int level); // level段目の現在のスロットを下の段へ振り分け直す
+    // 満了したスロットのリストを丸ごと取り出し、headに付け替える
+    void SpliceSlot(Timer *slot, Timer *head);
 };
 
-// タイマー同士での比較演算をできるようにするオペレーター
-inline bool operator<(const Timer& lhs, const Timer& rhs) {
-    return lhs.Timeout() > rhs.Timeout();
+template <class F>
+size_t TimerWheel::Advance(uint64_t now, F on_expire)
+{
+    size_t num_expired = 0;
+    Timer expired; // 満了したタイマーをまとめておくリストの番兵
+    expired.prev_ = expired.next_ = &expired;
+
+    while (now_ <= now) {
+        int index = now_ & (kSlotsPerLevel - 1);
+        // １段目が一周したら上の段から振り分け直す（上の段も一周していればさらに上から）
+        for (int level = 1; index == 0 && level < kLevels; level++) {
+            Cascade(level);
+            index = (now_ >> (kBitsPerLevel * level)) & (kSlotsPerLevel - 1);
+        }
+        SpliceSlot(&slots_[0][now_ & (kSlotsPerLevel - 1)], &expired);
+        now_++;
+    }
+
+    // 満了したタイマーをまとめて処理する
+    Timer *timer = expired.next_;
+    while (timer != &expired) {
+        Timer *next = timer->next_;
+        timer->pending_ = false;
+        num_pending_--;
+        on_expire(*timer);
+        FreeNode(timer);
+        num_expired++;
+        timer = next;
+    }
+    return num_expired;
 }
 
 
+// アプリに読み取り専用でマップする時刻のページ（vDSOのデータページのようなもの）。
+// アプリはこれを読むだけでシステムコールを使わずに時刻（MonotonicNanoseconds()と同じもの）を求められる。
+// application/sys/time.hppのTimePageと同じ並びにすること。
+//
+// 書き込むのはBSPのTick()（とTSCの較正）だけ。書いている間はseqが奇数になるので、読む側は
+// seqが偶数で、読む前後でseqが変わっていなければ読んだ値を使う（seqlock）。
+// 時刻（ns）＝ tick * ns_per_tick + (min(TSC − tick_tsc, tsc_per_tick − 1) * tsc_mult >> tsc_shift)
+// tsc_per_tickが０の間（TSCの較正前）はtickだけで求める。
+struct TimePage
+{
+    volatile uint64_t seq;
+    volatile uint64_t tick; // TimerManager::CurrentTick()
+    volatile uint64_t tick_tsc; // tickが進んだ時のTSC
+    volatile uint64_t ns_per_tick;
+    volatile uint64_t tsc_per_tick;
+    volatile uint64_t tsc_mult; // TSCのカウントをナノ秒に直す時に掛ける数（割り算を避けるため）
+    volatile uint32_t tsc_shift;
+    uint32_t reserved;
+};
+
 // Local APIC Timerを使って複数の論理タイマーを制御するためのクラス。
 // 一つの物理タイマーを連続して何回も回して、その間に論理的なタイマーを可動させる。
 // ＜引数の説明＞
@@ -60,13 +195,19 @@ inline bool operator<(const Timer& lhs, const Timer& rhs) {
 // 
 // ＜メンバ関数の説明＞
 // Start()：　物理タイマーを開始させる。これをしないと時刻の計測はできない。
-// AddTimer()：　論理タイマーの追加。追加しておけば、指定した時刻にmsg_queueに通知が行く。
+// StartOnAP()：　APのLAPICタイマーをBSPと同じ周期で開始させる。
+// AddTimer()：　論理タイマーの追加。追加しておけば、指定した時刻にtask_idのタスクへ通知が行く。
+// CancelTimer()：　AddTimer()で追加したタイマーを取り消す。
 // Tick()：　物理タイマーの割り込み時に実行される関数。物理タイマーのループ数をインクリメントする
 //         だけでなく、論理タイマーがタイムアウトしていないかのチェックもこの中で行う。
 //         割り込みハンドラ内で実行されるので、軽めの実装を心がけるべきである。
+//         時刻はBSPのタイマーだけで進める（APのタイマーはタスクの切り替えにだけ使う）。
+// TaskTimerExpired()：　このCPUのタスク切り替えの時刻が来ていればtrueを返す。各CPUのタイマー割り込みで呼ぶ。
 // CurrentTick()：　現在のループ数を返す。
 // TotalCount()：　物理タイマーが計測を開始してから経過した時間を返す。
 //
+// 論理タイマーは複数のCPUから追加・取り消しされるので、ロックで守っている。
+//
 class TimerManager
 {
 public:
@@ -78,33 +219,96 @@ public:
     // 物理タイマーの開始
     void Start(uint32_t counts_per_loop);
 
+    // APの物理タイマーの開始。Start()で設定したのと同じ周期で割り込みを起こす。
+    void StartOnAP();
+
     // 物理タイマーのストップ
     void Stop();
 
-    // 論理タイマーの追加
-    void AddTimer(Timer timer);
+    // 論理タイマーの追加。task_idを省略した場合はメインタスクに通知する。
+    TimerHandle AddTimer(uint64_t timeout, int value, uint64_t task_id = 1, uint64_t slack = 0);
+
+    // timeoutにtask_idのタスクをスリープから起こすタイマーの追加。
+    TimerHandle AddWakeupTimer(uint64_t timeout, uint64_t task_id, uint64_t slack = 0);
+
+    // timeoutにtask_idのタスク（kDeadline）の実行時間を補充するタイマーの追加。
+    TimerHandle AddReplenishTimer(uint64_t timeout, uint64_t task_id);
+
+    // 論理タイマーの取り消し。取り消せた場合はtrueを返す。
+    bool CancelTimer(TimerHandle handle);
+
+    // このCPUでタスク切り替えを行う時刻を設定する。割り込みを禁止した状態で呼ぶこと。
+    void SetTaskTimer(uint64_t timeout) { task_timer_timeout_[smp::CPUIndex()] = timeout; }
 
     // ループした回数をインクリメント。
-    // タイムアウトしたタイマの通知をmain_queに入れる。
-    // タスク切り替え用のタイマーがタイムアウトしたらtrueを返す。
-    bool Tick();
+    // タイムアウトしたタイマの通知を各タスクへ送る。
+    void Tick();
+
+    // このCPUのタスク切り替え用のタイマーがタイムアウトしていたらtrueを返す。
+    bool TaskTimerExpired();
 
     // 現在のループ回数を返す。
-    uint32_t CurrentTick() { return tick_; }
+    uint64_t CurrentTick() { return tick_; }
 
     // 開始してからの総カウント数を返す。
     uint64_t TotalCount();  
 
+    // タイマーを開始してからの経過時間（ナノ秒）。１tick未満の部分はTSCから補う。
+    uint64_t MonotonicNanoseconds();
+
+    // このCPUのLAPICタイマーが次に割り込みを起こすまでの時間（ナノ秒）。アイドル時間の予想に使う。
+    uint64_t NanosecondsUntilNextTick();
+
+    // TSCの１msあたりのカウント数（InitializeLocalAPICTimer()で計測する）
+    uint64_t TSCPerMillisecond() { return tsc_per_ms_; }
+    void SetTSCPerMillisecond(uint64_t tsc_per_ms);
+    // TSCのカウント数をナノ秒に直す（較正前は０を返す）
+    uint64_t TSCToNanoseconds(uint64_t tsc);
+
+    // アプリにマップする時刻のページ（ページの境界に揃えたカーネルの静的な領域）
+    const TimePage *SharedTimePage();
+
 private:
-    uint32_t tick_; // ループした回数を保持
-    uint32_t counts_per_loop_; // １ループのカウント数
+    volatile uint64_t tick_; // ループした回数を保持
+    uint32_t counts_per_loop_{0}; // １ループのカウント数
+    uint64_t tsc_per_ms_{0};
+    // 最後にtickが進んだ時のTSC。MonotonicNanoseconds()で１tick未満の部分を求めるのに使う。
+    // APのLAPICタイマーはBSPと位相がずれているので、LAPICのカウントではなくTSCで補う。
+    volatile uint64_t tick_tsc_{0};
+    volatile uint64_t tick_seq_{0}; // tick_とtick_tsc_の更新中は奇数になる
+
+    TicketSpinLock lock_; // timers_を守る
+    TimerWheel timers_; // 論理タイマーを保管するタイマーホイール
+    std::vector<Timer> expired_; // Tick()でロックを外してから通知するため、満了したタイマーを写しておく
+    std::array<uint64_t, smp::kMaxCPUs> task_timer_timeout_; // CPUごとの次にタスクを切り替える時刻
+
+    void SetupLVT(); // このCPUのLAPICタイマーの割り込みベクタと分周比を設定する
+};
 
-    std::priority_queue<Timer> timers_; // タイマーを保管する優先度付きキュー
+// １tickの長さ（InitializeLocalAPICTimer()で１tick＝１msに合わせている）
+const uint64_t kNanosecondsPerTick = 1000000;
+
+// ナノ秒をtick数に直す（切り上げ）
+inline uint64_t NanosecondsToTicks(uint64_t ns)
+{
+    return (ns + kNanosecondsPerTick - 1) / kNanosecondsPerTick;
+}
+
+
+// タイマーホイールのベンチマーク結果（単位はTSCのカウント）
+struct TimerBenchmarkResult
+{
+    size_t num_timers;
+    uint64_t wheel_add; // num_timers個のAddの合計
+    uint64_t wheel_cancel; // num_timers / 2個のCancelの合計
+    uint64_t wheel_expire; // 残りが全て満了するまでAdvanceした合計
+    uint64_t heap_push; // 比較用：std::priority_queueへのpushの合計
+    uint64_t heap_pop; // 比較用：std::priority_queueから全てpopした合計
 };
 
-// タスクの切り替えを行うインターバル（チック数）
-const uint32_t kTaskTimerPeriod = 20;
-const int kTaskTimerValue = -11111111; // タスクタイマーを見分ける値（他とかぶらないような値）
+// num_timers個の保留中タイマーに対して追加・取り消し・満了を計測する。
+// 実際のタイマー割り込みとは独立したTimerWheelを使う。
+void BenchmarkTimerWheel(size_t num_timers, TimerBenchmarkResult &result);
 
 
 // タイマーの割り込み時に呼ばれる関数。
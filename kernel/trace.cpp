@@ -0,0 +1,83 @@
+#include <array>
+#include <string.h>
+
+#include "trace.hpp"
+#include "asmfunc.h"
+#include "serial.hpp"
+#include "smp.hpp"
+#include "timer.hpp"
+
+extern TimerManager *timer_manager;
+
+namespace trace
+{
+    bool enabled = false;
+
+    namespace {
+        struct Ring {
+            std::array<Record, kRecordsPerCPU> records;
+            uint64_t head; // これまでに書き込んだレコードの数（次に書く位置はhead % kRecordsPerCPU）
+        };
+        std::array<Ring, smp::kMaxCPUs> rings;
+    }
+
+    void Start()
+    {
+        for (Ring &ring : rings) {
+            ring.head = 0;
+        }
+        __atomic_store_n(&enabled, true, __ATOMIC_RELEASE);
+    }
+
+    void Stop()
+    {
+        __atomic_store_n(&enabled, false, __ATOMIC_RELEASE);
+    }
+
+    size_t NumRecords(int cpu)
+    {
+        uint64_t head = rings[cpu].head;
+        return head < kRecordsPerCPU ? head : kRecordsPerCPU;
+    }
+
+    void Write(Event event, uint64_t task, uint64_t arg, uint8_t vector, uint8_t flags)
+    {
+        int cpu = smp::CPUIndex();
+        Ring &ring = rings[cpu];
+        Record &record = ring.records[ring.head & (kRecordsPerCPU - 1)];
+        record.tsc = ReadTSC();
+        record.task = task;
+        record.arg = arg;
+        record.event = event;
+        record.cpu = cpu;
+        record.vector = vector;
+        record.flags = flags;
+        record.reserved = 0;
+        ring.head++;
+    }
+
+    void Dump()
+    {
+        Stop();
+
+        DumpHeader header;
+        memcpy(header.magic, "JNXTRACE", sizeof(header.magic));
+        header.version = kDumpVersion;
+        header.record_size = sizeof(Record);
+        header.tsc_per_ms = timer_manager->TSCPerMillisecond();
+        header.num_cpus = smp::NumCPUs();
+        header.reserved = 0;
+        serial::Write(&header, sizeof(header));
+
+        for (int cpu = 0; cpu < smp::NumCPUs(); cpu++) {
+            Ring &ring = rings[cpu];
+            CPUHeader cpu_header{static_cast<uint32_t>(cpu), static_cast<uint32_t>(NumRecords(cpu))};
+            serial::Write(&cpu_header, sizeof(cpu_header));
+            // 上書きされていれば次に書く位置が最も古い
+            uint64_t first = ring.head - cpu_header.num_records;
+            for (uint64_t i = first; i < ring.head; i++) {
+                serial::Write(&ring.records[i & (kRecordsPerCPU - 1)], sizeof(Record));
+            }
+        }
+    }
+}
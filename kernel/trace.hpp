@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * スケジューラのトレース
+ * タスクの切り替え・起床・スリープ・終了と割り込みの入口を、CPUごとのリングバッファにバイナリのレコードとして記録する。
+ * リングがいっぱいになったら古いものから上書きする。
+ * 記録は割り込みを禁止した状態（スケジューラのロックの中や割り込みハンドラ）で行うので、
+ * 同じCPUのリングに同時に書き込むことはない。
+ * 止めている間はEmit()がフラグを１つ見るだけになる。
+ *
+ * Dump()はリングの中身をシリアルポートへ次の形式で送る（数値はリトルエンディアン）。
+ * devenv/trace_timeline.pyでタイムラインに直せる。
+ *   DumpHeader
+ *   CPUの数だけ：CPUHeader、Record × num_records（古い順）
+ */
+namespace trace
+{
+    enum class Event : uint8_t {
+        kSwitch = 1, // task：切り替える前のタスク、arg：次のタスク、flags：前のタスクがスリープしたならkFlagSleep
+        kWakeup = 2, // task：起こしたタスク、arg：入れた実行可能キューのCPU
+        kSleep = 3, // task：スリープしたタスク
+        kInterrupt = 4, // task：割り込まれたタスク、vector：割り込みベクタ
+        kExit = 5, // task：終了したタスク、arg：終了ステータス
+    };
+
+    const uint8_t kFlagSleep = 1;
+
+    struct Record {
+        uint64_t tsc;
+        uint64_t task;
+        uint64_t arg;
+        Event event;
+        uint8_t cpu;
+        uint8_t vector;
+        uint8_t flags;
+        uint32_t reserved;
+    };
+    static_assert(sizeof(Record) == 32);
+
+    struct DumpHeader {
+        char magic[8]; // "JNXTRACE"
+        uint32_t version; // kDumpVersion
+        uint32_t record_size; // sizeof(Record)
+        uint64_t tsc_per_ms; // TSCのカウント数を時間に直すのに使う
+        uint32_t num_cpus;
+        uint32_t reserved;
+    };
+
+    struct CPUHeader {
+        uint32_t cpu;
+        uint32_t num_records;
+    };
+
+    const uint32_t kDumpVersion = 1;
+    const size_t kRecordsPerCPU = 1024; // ２のべき乗にすること
+
+    extern bool enabled;
+
+    void Start(); // リングを空にして記録を始める
+    void Stop();
+    size_t NumRecords(int cpu); // cpuのリングに残っているレコードの数
+    void Dump(); // 記録を止めてからリングの中身をシリアルポートへ送る。タスクから呼ぶこと。
+
+    void Write(Event event, uint64_t task, uint64_t arg, uint8_t vector, uint8_t flags);
+
+    // 記録する。割り込みを禁止した状態で呼ぶこと。
+    inline void Emit(Event event, uint64_t task, uint64_t arg = 0, uint8_t vector = 0, uint8_t flags = 0)
+    {
+        if (__builtin_expect(enabled, false)) {
+            Write(event, task, arg, vector, flags);
+        }
+    }
+}
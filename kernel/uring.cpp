@@ -0,0 +1,335 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "uring.hpp"
+#include "asmfunc.h"
+#include "coro.hpp"
+#include "logging.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "process.hpp"
+#include "run_application.hpp"
+#include "spinlock.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+extern BitmapMemoryManager* memory_manager;
+extern TaskManager* task_manager;
+extern TimerManager *timer_manager;
+extern logging::Logger *logger;
+
+namespace uring
+{
+    namespace {
+        const size_t kMaxRings = 16; // 同時にリングを持てるプロセスの数
+        const uint64_t kPollIntervalNs = 1000000; // ポーリングタスクがSQを見に行く間隔
+        const uint64_t kSqIdleNs = 20000000; // これだけ投入がなければポーリングタスクは眠る
+
+        struct Ring {
+            // カーネルから見たアドレス（恒等写像）。アプリからはkRingAddressに見える。
+            RingHeader *header;
+            Submission *sq;
+            Completion *cq;
+            // リングを持つアプリのアドレス空間（ringsを探す鍵。ポーリングタスクがアプリのバッファを読むのにも使う）。
+            // 参照を持つ。
+            Process *process;
+
+            Mutex submit_lock; // SQを読むのを同時に１つのスレッドだけにする（ポーリングタスクがいない時）
+            SpinLock lock; // 以下とcq_tailを守る
+            uint32_t inflight{0}; // 投入したがまだ完了していない操作の数（kTimeout）
+            int refs{1}; // アプリ、ポーリングタスク、処理中のkTimeoutがそれぞれ持つ
+            ::Task *poller{nullptr};
+            volatile bool closing{false}; // アプリの全てのタスクが終わった
+            WaitQueue completions; // Enter()で完了を待っているタスク（同じプロセスのどのスレッドでもよい）
+        };
+
+        SpinLock rings_lock; // ringsを守る
+        std::array<Ring *, kMaxRings> rings{};
+
+        Ring *Find(const Process *process)
+        {
+            for (Ring *ring : rings) {
+                if (ring && ring->process == process) {
+                    return ring;
+                }
+            }
+            return nullptr;
+        }
+
+        void Release(Ring *ring)
+        {
+            {
+                IRQSaveLockGuard<SpinLock> guard{ring->lock};
+                if (--ring->refs > 0) {
+                    return;
+                }
+            }
+            // ページはアプリのスレッドからまだ見えているかもしれないので、プロセスが消える時に解放される
+            ring->process->Put();
+            delete ring;
+        }
+
+        // CQに溜まっている完了の数。ring->lockを持った状態で呼ぶ。
+        uint32_t CqReadyLocked(Ring *ring)
+        {
+            return ring->header->cq_tail - ring->header->cq_head;
+        }
+
+        // 完了をCQの末尾に書く。CQがいっぱいなら捨ててcq_overflowを増やす。
+        // inflight_doneがtrueなら、処理中だった操作（kTimeout）の完了として数える。
+        void Complete(Ring *ring, uint64_t user_data, int64_t result, bool inflight_done = false)
+        {
+            {
+                IRQSaveLockGuard<SpinLock> guard{ring->lock};
+                if (inflight_done) {
+                    ring->inflight--;
+                }
+                RingHeader *header = ring->header;
+                uint32_t tail = header->cq_tail;
+                if (CqReadyLocked(ring) >= kCqEntries) {
+                    header->cq_overflow = header->cq_overflow + 1;
+                } else {
+                    ring->cq[tail & (kCqEntries - 1)] = Completion{user_data, result};
+                    __asm__ volatile("" : : : "memory"); // 中身を書いてからtailを進める
+                    header->cq_tail = tail + 1;
+                }
+            }
+            ring->completions.WakeAll();
+        }
+
+        // kTimeoutの操作。コルーチンのエグゼキュータでticks（タイマーのtick）後に完了を書く。
+        coro::Task<> TimeoutOp(Ring *ring, uint64_t user_data, uint64_t ticks)
+        {
+            co_await coro::SleepFor(ticks);
+            Complete(ring, user_data, 0, true);
+            Release(ring);
+        }
+
+        void Execute(Ring *ring, const Submission &sqe)
+        {
+            switch (sqe.opcode) {
+                case kNop:
+                    Complete(ring, sqe.user_data, 0);
+                    break;
+                case kWrite:
+                    Complete(ring, sqe.user_data, syscall::WriteUserBuffer(sqe.fd, sqe.addr, sqe.len));
+                    break;
+                case kTimeout:
+                    {
+                        IRQSaveLockGuard<SpinLock> guard{ring->lock};
+                        ring->inflight++;
+                        ring->refs++;
+                    }
+                    coro::Spawn(TimeoutOp(ring, sqe.user_data, NanosecondsToTicks(sqe.len)));
+                    break;
+                default: // kSend/kRecvはソケットの層ができるまで失敗させる
+                    Complete(ring, sqe.user_data, -1);
+                    break;
+            }
+        }
+
+        // SQに投入された操作をmax_entries個まで処理し、処理した数を返す。
+        // SQを読むのはポーリングタスクか、submit_lockを持ったアプリのスレッドのどちらか一方だけ。
+        uint32_t Submit(Ring *ring, uint32_t max_entries)
+        {
+            RingHeader *header = ring->header;
+            uint32_t num_submitted = 0;
+            while (num_submitted < max_entries) {
+                uint32_t head = header->sq_head;
+                if (head == header->sq_tail) {
+                    break;
+                }
+                {
+                    // 完了を書く場所が足りなくなる分は投入しない（次のEnter()で処理する）
+                    IRQSaveLockGuard<SpinLock> guard{ring->lock};
+                    if (CqReadyLocked(ring) + ring->inflight >= kCqEntries) {
+                        break;
+                    }
+                }
+                __asm__ volatile("" : : : "memory"); // tailを読んでから中身を読む
+                Submission sqe = ring->sq[head & (kSqEntries - 1)]; // 処理中に書き換えられないよう写しておく
+                header->sq_head = head + 1;
+                Execute(ring, sqe);
+                num_submitted++;
+            }
+            return num_submitted;
+        }
+
+        // kSetupSqPollで作るポーリングタスク。dataはRing *。
+        void PollerTask(uint64_t id, int64_t data)
+        {
+            Ring *ring = reinterpret_cast<Ring *>(data);
+            ::Task *task = task_manager->CurrentTask();
+            // kWriteでアプリのバッファを読めるよう、アプリのページング構造に切り替えておく
+            task->SetProcess(ring->process);
+            SetCR3(ring->process->CR3());
+
+            RingHeader *header = ring->header;
+            uint64_t last_submit = timer_manager->MonotonicNanoseconds();
+            while (!ring->closing) {
+                if (Submit(ring, kSqEntries) > 0) {
+                    last_submit = timer_manager->MonotonicNanoseconds();
+                    continue;
+                }
+                if (timer_manager->MonotonicNanoseconds() - last_submit < kSqIdleNs) {
+                    task->SleepFor(kPollIntervalNs);
+                    continue;
+                }
+                // しばらく投入がないので眠る。アプリはsq_tailを書いてからflagsを読むので、
+                // こちらはflagsを書いてからsq_tailを読み直す（その間に投入されていれば眠らない）。
+                header->flags = header->flags | kRingNeedWakeup;
+                __atomic_thread_fence(__ATOMIC_SEQ_CST);
+                if (header->sq_head == header->sq_tail && !ring->closing) {
+                    task->Sleep();
+                }
+                header->flags = header->flags & ~kRingNeedWakeup;
+                last_submit = timer_manager->MonotonicNanoseconds();
+            }
+            {
+                // Teardown()はこのロックを持ったままpollerを起こすので、外してからは触られない
+                IRQSaveLockGuard<SpinLock> guard{ring->lock};
+                ring->poller = nullptr;
+            }
+            // アプリのアドレス空間を解放できるよう、カーネルのページング構造に戻してから参照を外す
+            task->SetProcess(nullptr);
+            SetCR3(KernelCR3());
+            Release(ring);
+            task_manager->Exit(0);
+        }
+    }
+
+    uint64_t Setup(uint32_t flags)
+    {
+        ::Task *task = task_manager->CurrentTask();
+        Process *process = task->GetProcess();
+        if (process == nullptr) {
+            return 0;
+        }
+        // 先にリングの場所を取っておく（後でページをマップしてから場所がないと分かっても、外せなくなるので）
+        Ring *ring = new Ring;
+        ring->process = process;
+        {
+            IRQSaveLockGuard<SpinLock> guard{rings_lock};
+            auto slot = std::find(rings.begin(), rings.end(), nullptr);
+            if (Find(process) || slot == rings.end()) { // リングはプロセスごとに１つ
+                delete ring;
+                return 0;
+            }
+            *slot = ring;
+        }
+        auto unreserve = [ring]() {
+            IRQSaveLockGuard<SpinLock> guard{rings_lock};
+            *std::find(rings.begin(), rings.end(), ring) = nullptr;
+            delete ring;
+        };
+
+        FrameID frames = memory_manager->Allocate(kRingPages);
+        if (frames.ID() == kNullFrame.ID()) {
+            unreserve();
+            return 0;
+        }
+        // マップしたページはアプリのどのスレッドからも触れ、TLBシュートダウンがないので外すこともできない。
+        // そこでページはプロセスに預け、アドレス空間を解放した後で解放してもらう（マップに失敗した時も同じ）。
+        process->AdoptFrames(frames, kRingPages);
+        uint8_t *base = reinterpret_cast<uint8_t *>(frames.Frame());
+        memset(base, 0, kRingPages * kBytesPerFrame);
+        for (size_t i = 0; i < kRingPages; i++) {
+            LinearAddress4Level linear;
+            linear.data = kRingAddress + i * kBytesPerFrame;
+            if (!MapPageForApp(linear, base + i * kBytesPerFrame, true)) {
+                logger->warning("[uring] task %lu: failed to map ring page %lu\n", task->ID(), i);
+                unreserve();
+                return 0;
+            }
+        }
+
+        ring->header = reinterpret_cast<RingHeader *>(base);
+        ring->sq = reinterpret_cast<Submission *>(base + kBytesPerFrame);
+        ring->cq = reinterpret_cast<Completion *>(base + 2 * kBytesPerFrame);
+        process->Get();
+        ring->header->sq_entries = kSqEntries;
+        ring->header->cq_entries = kCqEntries;
+        ring->header->sq_offset = kBytesPerFrame;
+        ring->header->cq_offset = 2 * kBytesPerFrame;
+
+        if (flags & kSetupSqPoll) {
+            ring->refs++;
+            // アプリと同じグループに入るので、ポーリングに使う時間もアプリのクォータから引かれる
+            ring->poller = task_manager
+                ->NewTask()
+                ->InitContext(PollerTask, reinterpret_cast<int64_t>(ring));
+            ring->poller->Wakeup();
+        }
+        logger->debug("[uring] task %lu: ring at %p (frames %p)%s\n",
+            task->ID(), reinterpret_cast<void *>(kRingAddress), base, ring->poller ? " with poller" : "");
+        return kRingAddress;
+    }
+
+    int64_t Enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags)
+    {
+        Process *process = task_manager->CurrentTask()->GetProcess();
+        Ring *ring;
+        {
+            // 呼び出したスレッドがアプリのタスクとして数えられている間はTeardown()されないので、参照は取らない
+            IRQSaveLockGuard<SpinLock> guard{rings_lock};
+            ring = process ? Find(process) : nullptr;
+        }
+        if (ring == nullptr) {
+            return -1;
+        }
+
+        int64_t num_submitted = 0;
+        if (ring->poller) { // SQはポーリングタスクが読む
+            if (flags & kEnterSqWakeup) {
+                ring->poller->Wakeup();
+            }
+        } else {
+            LockGuard<Mutex> guard{ring->submit_lock};
+            num_submitted = Submit(ring, to_submit);
+        }
+
+        // 待っている完了が来ないことが分かっている時は待たない
+        // （ポーリングタスクがいれば、まだ読んでいない投入の分がこれから来るかもしれない）。
+        // ポーリングタスクがいる時は、残っている操作の数をカーネルが知らないので、min_completeがそれより多いと
+        // 完了がそれ以上来ることはなく、永久に待ち続ける。
+        // （ポーリングタスクがいない時は、処理中の操作がなくなった所で待つのをやめる）
+        min_complete = std::min(min_complete, kCqEntries);
+        auto must_wait = [ring, min_complete]() {
+            IRQSaveLockGuard<SpinLock> guard{ring->lock};
+            return CqReadyLocked(ring) < min_complete && (ring->inflight > 0 || ring->poller);
+        };
+        // 条件はキューのロックを持って確かめるので、Complete()のWakeAll()を取りこぼさない
+        while (ring->completions.WaitIf(must_wait) > 0) {
+        }
+        return num_submitted;
+    }
+
+    void Teardown(Process *process)
+    {
+        Ring *ring = nullptr;
+        {
+            IRQSaveLockGuard<SpinLock> guard{rings_lock};
+            for (Ring *&slot : rings) {
+                if (slot && slot->process == process) {
+                    ring = slot;
+                    slot = nullptr;
+                    break;
+                }
+            }
+        }
+        if (ring == nullptr) {
+            return;
+        }
+        {
+            // ポーリングタスクは終わる前にこのロックを取ってpollerを外すので、起こす前に回収されることはない
+            IRQSaveLockGuard<SpinLock> guard{ring->lock};
+            ring->closing = true;
+            if (ring->poller) {
+                ring->poller->Wakeup();
+            }
+        }
+        Release(ring);
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+class Process;
+
+/*
+ * アプリとカーネルで共有する投入（submission）・完了（completion）リング（io_uringのようなもの）
+ *
+ * アプリはRingSetupシステムコールで、自分のアドレス空間のkRingAddressにリングをマップしてもらう。
+ * リングはプロセスごとに１つで、同じプロセスのどのスレッドからもRingEnterできる。
+ * リングはヘッダのページ、投入キュー（SQ）のページ、完了キュー（CQ）のページの３ページで、
+ * カーネルは同じ物理ページを恒等写像のアドレスから読み書きする。
+ *
+ * アプリはSQの末尾（sq_tail）にSubmissionを書いてsq_tailを進め、RingEnterシステムコールを１回呼ぶと、
+ * カーネルはsq_headからsq_tailまでをまとめて処理し、結果をCQの末尾に書く。
+ * アプリはcq_headからcq_tailまでのCompletionを読み、cq_headを進める。
+ * head/tailはそれぞれ片方だけが書き、キューの要素数（２のべき乗）で割った余りを添字に使う。
+ *
+ * kSetupSqPollを指定すると、カーネルのポーリングタスクがSQを見張って処理するので、
+ * アプリはRingEnterを呼ばずに投入できる。ポーリングタスクはしばらく投入がないと眠り、
+ * ヘッダのflagsにkRingNeedWakeupを立てるので、その時だけkEnterSqWakeupを付けてRingEnterを呼ぶ。
+ *
+ * 操作のうちkTimeoutはタイマーを仕掛けるだけで、完了はコルーチンのエグゼキュータが後から書き込む。
+ * kSend/kRecvはソケットの層がまだないので、今は常に−１で完了する。
+ *
+ * application/sys/uring.hppに同じ定義があるので、変える時は両方を変えること。
+ */
+namespace uring
+{
+    enum Opcode : uint8_t {
+        kNop = 0, // 何もせず０で完了する
+        kWrite = 1, // fdにaddrからlenバイト書き込む（write()システムコールと同じ）
+        kTimeout = 2, // lenナノ秒後に０で完了する
+        kSend = 3, // ソケットfdにaddrからlenバイト送る（未実装）
+        kRecv = 4, // ソケットfdからaddrへ最大lenバイト受け取る（未実装）
+    };
+
+    struct Submission {
+        uint8_t opcode;
+        uint8_t flags;
+        uint16_t reserved;
+        int32_t fd;
+        uint64_t addr;
+        uint64_t len;
+        uint64_t user_data; // 完了の時にそのまま返す
+    };
+    static_assert(sizeof(Submission) == 32);
+
+    struct Completion {
+        uint64_t user_data;
+        int64_t result; // 負なら失敗
+    };
+    static_assert(sizeof(Completion) == 16);
+
+    struct RingHeader {
+        volatile uint32_t sq_head; // カーネルが書く
+        volatile uint32_t sq_tail; // アプリが書く
+        volatile uint32_t cq_head; // アプリが書く
+        volatile uint32_t cq_tail; // カーネルが書く
+        uint32_t sq_entries;
+        uint32_t cq_entries;
+        volatile uint32_t flags; // kRingNeedWakeup
+        volatile uint32_t cq_overflow; // CQが溢れて捨てた完了の数
+        uint64_t sq_offset; // リングの先頭からSQまでのバイト数
+        uint64_t cq_offset; // リングの先頭からCQまでのバイト数
+    };
+
+    const uint32_t kRingNeedWakeup = 1; // ポーリングタスクが眠っている
+
+    const uint32_t kSetupSqPoll = 1; // RingSetupのflags：ポーリングタスクを作る
+    const uint32_t kEnterSqWakeup = 1; // RingEnterのflags：眠っているポーリングタスクを起こす
+
+    const uint32_t kSqEntries = 128; // SQの１ページ分
+    const uint32_t kCqEntries = 256; // CQの１ページ分
+    const size_t kRingPages = 3;
+    const uint64_t kRingAddress = 0xffff'ffff'fff0'0000; // アプリのアドレス空間でリングをマップする場所
+
+    // 実行中のアプリのプロセスにリングを作ってマップし、そのアドレスを返す（失敗したら０）。
+    uint64_t Setup(uint32_t flags);
+    // to_submit個まで投入された操作を処理し、min_complete個の完了がCQに溜まるまで待つ。
+    // kSetupSqPollのリングで、min_completeが残っている操作より多いと永久に戻らない。
+    // 処理した操作の数を返す（リングがなければ−１）。
+    int64_t Enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags);
+    // プロセスのアプリのタスクが全て終わった時に呼ぶ（Process::RemoveAppTask()がtrueを返した時）。
+    // リングがあれば外す（処理中のkTimeoutが終わってから解放される。ページはプロセスが消える時に解放される）。
+    void Teardown(Process *process);
+}
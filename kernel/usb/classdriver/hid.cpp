@@ -5,6 +5,7 @@
 #include "../../timer.hpp"
 extern logging::Logger *logger;
 extern TimerManager *timer_manager;
+extern TaskManager *task_manager;
 extern Terminal *terminal;
 void Halt(); 
 
@@ -81,8 +82,12 @@ namespace
     void PrintKeys(uint8_t *keys) 
     {
         if (terminal) {
-            // ターミナルが起動していれば、ターミナルに文字を送ってあげる。
-            terminal->OnKeyStroke(keys);
+            // ターミナルが起動していれば、メインタスクに送ってターミナルに渡してもらう。
+            // ターミナルはメインタスクだけで動かすので、xHCIのサービスタスクからは直接呼ばない。
+            Message msg;
+            msg.type = Message::Type::kKeyStroke;
+            memcpy(msg.arg.keyboard.keys, keys, sizeof(msg.arg.keyboard.keys));
+            task_manager->SendMessage(1, msg);
             return;
         }
         ModifierKey modifier_key{keys[0]};
@@ -142,7 +147,7 @@ namespace usb
             
             ModifierKey modifier_key{data[0]};
             char key[2] = {0, 0};
-            uint32_t current_tick = timer_manager->CurrentTick(); 
+            uint64_t current_tick = timer_manager->CurrentTick(); 
             if (current_tick < last_tick_ + key_stroke_interval_) {
                 // logger->info("Current Tick: %d, Last Tick: %d\n", current_tick, last_tick_);
                 // 最後に入力検知をしてから十分な時間が立っていなければ出力しない
@@ -43,7 +43,7 @@ namespace usb
         Device *dev_; // このクラスが存在しているUSBデバイスのドライバ
         uint8_t interface_number_; // USBデバイスの中で、このクラスに対応しているInterfaceの番号
 
-        uint32_t last_tick_; // キー入力が最後に検知されたときのタイマーのチック数
+        uint64_t last_tick_; // キー入力が最後に検知されたときのタイマーのチック数
         uint32_t key_stroke_interval_; // キー入力の検知間隔（Ticks）
 
         uint8_t prev_keys_[8]; // 直前のキー入力の値
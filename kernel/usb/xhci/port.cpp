@@ -1,6 +1,8 @@
 #include "port.hpp"
 #include "../../logging.hpp"
+#include "../../task.hpp"
 extern logging::Logger *logger; 
+extern TaskManager* task_manager;
 
 int printk(const char *format, ...);
 
@@ -56,7 +58,10 @@ namespace usb::xhci
             port_reg_set_->PORTSC.data[0] = portsc.data[0];
 
             // printk("[Port::Reset()] Port%02hhd Start Reseting...\n", Number());
-            while (port_reg_set_->PORTSC.bits.port_reset);
+            // リセットには数十msかかるので、その間は１msずつスリープして待つ
+            while (port_reg_set_->PORTSC.bits.port_reset) {
+                task_manager->CurrentTask()->SleepFor(1000000);
+            }
             // printk("[Port::Reset()] Port%02hhd Finish Reseting...\n", Number());
 
             return 0;
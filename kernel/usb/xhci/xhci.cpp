@@ -1,5 +1,8 @@
 #include "xhci.hpp"
 #include <algorithm>
+#include "../../spinlock.hpp"
+#include "../../irq.hpp"
+#include "../../interrupt.hpp"
 int printk(const char *format, ...);
 void Halt();
 extern logging::Logger *logger;
@@ -43,165 +46,128 @@ namespace
 
     Controller *xhc;
     
-    // 初期化中or初期化を待っているポート
-    // 先頭の値が現在初期化中のポートの番号
-    std::deque<uint8_t> initializing_ports{};
-    
-    uint64_t InitUSBDevTaskID;
+    // ポートごとに、初期化のコルーチンが動いている間true
+    std::array<bool, 256> enumerating_ports{};
 
-    
-    // InitUSBDevTaskから呼び出される手続きでタスクをスリープする
-    // このEventが来たら起こしてくれ、というメッセージ機能的なものをつくる
-    // 戻り値にタスクのメッセージをわたしてあげて、どんなEventを受け取ったのかを分かるようにする。
-    // イベントが成功したならtrueを失敗したならfalseを返す
-    bool WaitEvent()
+    // デフォルトアドレス（０）で応答するデバイスが同時に２つ以上にならないよう、
+    // ポートのリセットからアドレスの割り当てまでは１ポートずつ行う
+    coro::Mutex addressing_lock;
+
+    // レジスタの状態が変わるのを待つ間、１msずつスリープしてCPUを他のタスクに譲る。
+    // condが真の間待ち続ける。
+    template <class F>
+    void WaitWhile(F cond)
     {
         Task *current_task = task_manager->CurrentTask();
-        current_task->Sleep();
-        // WakeUpされた時は、タスクのResvMessageに受け取ったイベントの情報を記した
-        // Messageが届いているので、そこからWakeupした理由を得る。
-        // メッセージは戻り値に渡してあげる。
-        Message msg = current_task->ReceiveMessage();
-        if (msg.type != Message::Type::kInterruptXHCI) {
-            if (msg.type == Message::Type::kNullMessage) {
-                printk("Null Message!!!\n");
-            }
-            panic("[usb::xhci::WaitEvent] This Message Is Invalid.\n");
+        while (cond()) {
+            current_task->SleepFor(1000000);
         }
-        return msg.arg.xhc_port_init.success;
     }
 
-    // 初期化が完了したor初期化が失敗した時に後処理する関数
-    void PostProcessing()
+    // ポートをリセットしてスロットを有効にし、デバイスにアドレスを割り当てる。
+    // 割り当てたスロットの番号を返す。失敗した場合は０を返す。
+    coro::Task<uint8_t> AddressPort(uint8_t port_num)
     {
-        initializing_ports.pop_front();
-        if (initializing_ports.empty()) {
-            WaitEvent();
+        Port *port = xhc->PortAt(port_num);
+        if (!co_await xhc->ResetPort(port)) {
+            logger->error("Failed To Reset Port%d.\n", port_num);
+            co_return 0;
         }
-    }
-
-    //
-    // 初期化時に使用される関数
-    // 一つの初期化タスク内でwhileループをつかって実装したほうが見やすくなる。
-    // 初期化タスク内では、キューからpopして各ポートの初期化を行っていく。
-    // 初期化まちポートのキューを作る
-    // （キューを作る意味としては、途中でポートに接続される可能性もある）
-    // ポート接続があるたびにキューに入れて、初期化タスクをWakeupさせる
-    //
-    void InitUSBDevTask(uint64_t id, int64_t _)
-    {
-        while (true) {
-            if (initializing_ports.empty()) { // 初期化するポートがない時
-                WaitEvent();
-                continue;
-            }
-            uint8_t port_num = initializing_ports.front();
-            Port *port = xhc->PortAt(port_num);
-
-            printk("[USB] ");
-            printk("PORT%d WILL BE INITIALIZED.\n", port_num);
-            if (xhc->ResetPort(port)) {
-                logger->error("Error On Resetting Port%d.\n", port_num);
-                PostProcessing();
-                continue;
-            }
-
-            if (!WaitEvent()) {
-                logger->error("Failed To Reset Port%d.\n", port_num);
-                PostProcessing();
-                continue;
-            }
-
-            printk("[USB] ");
-            printk("PORT%d RESET COMPLETED.\n", port_num);
-            if (xhc->EnableSlot(port)) {
-                PostProcessing();
-                continue;
-            }
 
-            if (!WaitEvent()) {
-                logger->error("Failed To Enable Slot For Port%d.\n", port_num);
-                PostProcessing();
-                continue;
-            }
+        printk("[USB] ");
+        printk("PORT%d RESET COMPLETED.\n", port_num);
+        uint8_t slot_num = co_await xhc->EnableSlot(port);
+        if (slot_num == 0) {
+            logger->error("Failed To Enable Slot For Port%d.\n", port_num);
+            co_return 0;
+        }
 
-            uint8_t slot_num = port->Slot();
-            printk("[USB] ");
-            printk("SLOT%d ENABLED FOR PORT%d\n", slot_num, port_num);
-            xhc->slot_to_port_[slot_num] = port_num;
-            if (xhc->AddressDevice(port_num, slot_num)) {
-                PostProcessing();
-                continue;
-            }
+        printk("[USB] ");
+        printk("SLOT%d ENABLED FOR PORT%d\n", slot_num, port_num);
+        xhc->slot_to_port_[slot_num] = port_num;
+        if (!co_await xhc->AddressDevice(port_num, slot_num)) {
+            logger->error("Failed To Address Device For Port%d (Slot%d).\n", port_num, slot_num);
+            co_return 0;
+        }
 
-            if (!WaitEvent()) {
-                logger->error("Failed To Address Device For Port%d (Slot%d).\n", port_num, slot_num);
-                PostProcessing();
-                continue;
-            }
+        printk("[USB] ");
+        printk("ADDRESS DEVICE ON PORT%d\n", port_num);
+        co_return slot_num;
+    }
 
-            printk("[USB] ");
-            printk("ADDRESS DEVICE ON PORT%d\n", port_num);
-            Device *dev = xhc->devmgr_.FindBySlot(slot_num);
-            if (dev->BeforeInitialize()) {
-                PostProcessing();
-                continue;
-            }
-            
-            if (!WaitEvent()) {
-                logger->error("Failed To Get Device Descriptor Top.\n");
-                PostProcessing();
-                continue;
-            }
+    // アドレスを割り当てたデバイスのディスクリプタを読み、エンドポイントを設定してConfigured状態にする
+    coro::Task<> ConfigureDevice(uint8_t port_num, uint8_t slot_num)
+    {
+        Device *dev = xhc->devmgr_.FindBySlot(slot_num);
 
-            printk("[USB] ");
-            printk("MAX PACKET SIZE IS %d.\n", dev->MaxPacketSize());
-            if (xhc->ReConfigureDefaultControlPipe(dev)) {
-                PostProcessing();
-                continue;
-            }
+        coro::Completion<bool> descriptor_top;
+        xhc->SetTransferWaiter(slot_num, &descriptor_top);
+        if (dev->BeforeInitialize()) {
+            xhc->SetTransferWaiter(slot_num, nullptr);
+            co_return;
+        }
+        if (!co_await descriptor_top) {
+            logger->error("Failed To Get Device Descriptor Top.\n");
+            co_return;
+        }
 
-            if (!WaitEvent()) {
-                logger->error("Failed To Re Configure Default Control Pipe.\n");
-                PostProcessing();
-                continue;
-            }
+        printk("[USB] ");
+        printk("MAX PACKET SIZE IS %d.\n", dev->MaxPacketSize());
+        if (!co_await xhc->ReConfigureDefaultControlPipe(dev)) {
+            logger->error("Failed To Re Configure Default Control Pipe.\n");
+            co_return;
+        }
 
-            printk("[USB] ");
-            printk("RECONFIGURE EP0.\n");
-            if (dev->StartInitialize()) {
-                PostProcessing();
-                continue;
-            }
+        printk("[USB] ");
+        printk("RECONFIGURE EP0.\n");
+        coro::Completion<bool> initialized;
+        xhc->SetTransferWaiter(slot_num, &initialized);
+        if (dev->StartInitialize()) {
+            xhc->SetTransferWaiter(slot_num, nullptr);
+            co_return;
+        }
+        if (!co_await initialized) {
+            logger->error("Failed To Initialize Device Attached To Port%d.\n", port_num);
+            co_return;
+        }
 
-            printk("[USB] ");
-            if (!WaitEvent()) {
-                logger->error("Failed To Initialize Device Attached To Port%d.\n", port_num);
-                PostProcessing();
-                continue;
-            }
+        printk("[USB] ");
+        printk("DEVICE CONFIGURED!!\n");
+        if (!co_await xhc->ConfigureEndpoints(dev)) {
+            logger->error("Failed To Configure Endpoints For Port%d (Slot%d).\n", port_num, slot_num);
+            co_return;
+        }
 
-            printk("[USB] ");
-            printk("DEVICE CONFIGURED!!\n");
-            if (xhc->ConfigureEndpoints(dev)) {
-                PostProcessing();
-                continue;
-            }
+        printk("[USB] ");
+        dev->OnEndpointsConfigured();
+        printk("PORT%d (SLOT%d) REACHED TO CONFIGURED STATE.\n", port_num, slot_num);
+        printk("\n");
+    }
 
-            if (!WaitEvent()) {
-                logger->error("Failed To Configure Endpoints For Port%d (Slot%d).\n", port_num, slot_num);
-                PostProcessing();
-                continue;
-            } 
+    // １つのポートにつながったデバイスを初期化するコルーチン。
+    // コマンドや転送の完了はco_awaitで待つので、待っている間はタスクのスタックを持たない。
+    // 複数のポートの初期化は、アドレスの割り当てまでを除いて並行に進む。
+    coro::Task<> EnumeratePort(uint8_t port_num)
+    {
+        printk("[USB] ");
+        printk("PORT%d WILL BE INITIALIZED.\n", port_num);
 
-            printk("[USB] ");
-            dev->OnEndpointsConfigured();
-            printk("PORT%d (SLOT%d) REACHED TO CONFIGURED STATE.\n", port_num, slot_num);
-            printk("\n");
+        co_await addressing_lock.Lock();
+        uint8_t slot_num = co_await AddressPort(port_num);
+        addressing_lock.Unlock();
 
-            PostProcessing();
+        if (slot_num != 0) {
+            co_await ConfigureDevice(port_num, slot_num);
         }
+        __atomic_store_n(&enumerating_ports[port_num], false, __ATOMIC_RELEASE);
+    }
 
+    // port_numの初期化を始める。既に初期化中なら何もしない。
+    void StartEnumeration(uint8_t port_num)
+    {
+        if (!__atomic_exchange_n(&enumerating_ports[port_num], true, __ATOMIC_ACQ_REL)) {
+            coro::Spawn(EnumeratePort(port_num));
+        }
     }
     
     //  ポートスピードからMaxPacketSizeの値を定める関数
@@ -255,12 +221,12 @@ namespace usb::xhci
         }
 
         // リセットが完了するまで待つ
-        while (!opt_->USBSTS.bits.host_controller_halted);
+        WaitWhile([this]() { return !opt_->USBSTS.bits.host_controller_halted; });
 
         // リセットの開始
         opt_->USBCMD.bits.host_controller_reset = 1;
-        while (opt_->USBCMD.bits.host_controller_reset); // リセットが完了するまで待つ
-        while (opt_->USBSTS.bits.controller_not_ready); // レジスタへの書き込みが可能になるまで待つ
+        WaitWhile([this]() { return opt_->USBCMD.bits.host_controller_reset; }); // リセットが完了するまで待つ
+        WaitWhile([this]() { return opt_->USBSTS.bits.controller_not_ready; }); // レジスタへの書き込みが可能になるまで待つ
 
         logger->info("[xHC Init] MaxPorts        %d\n", cap_->HCSPARAMS1.bits.max_ports);
         logger->info("[xHC Init] MaxDeviceSlots  %d\n", cap_->HCSPARAMS1.bits.max_device_slots);
@@ -305,7 +271,7 @@ namespace usb::xhci
     void Controller::Run()
     {
         opt_->USBCMD.bits.run_stop = true;
-        while (opt_->USBSTS.bits.host_controller_halted);
+        WaitWhile([this]() { return opt_->USBSTS.bits.host_controller_halted; });
 
         logger->info("xHC power on!!\n");
     }
@@ -313,7 +279,7 @@ namespace usb::xhci
     void Controller::AllPortsInit()
     {
         for (uint8_t port_num = MaxPorts(); port_num > 0; port_num--) {
-            // デバイスが接続されているポートをinitializing_portsにpushしていく
+            // デバイスが接続されているポートごとに初期化のコルーチンを始める
             Port *port = PortAt(port_num);
 
             if (port->IsConnectStatusChanged()) 
@@ -322,14 +288,9 @@ namespace usb::xhci
                 port->ClearPortResetChange();
 
             if (port->IsConnected()) {
-                __asm__("cli");
-                if (std::find(initializing_ports.begin(), initializing_ports.end(), port->Number()) == initializing_ports.end()) { 
-                    initializing_ports.push_back(port->Number());
-                }
-                __asm__("sti");
+                StartEnumeration(port->Number());
             }
         }
-        task_manager->Wakeup(InitUSBDevTaskID);
     }
 
     Ring *Controller::CommandRing()
@@ -347,6 +308,21 @@ namespace usb::xhci
         return &run_->IR[0];
     }
 
+    void Controller::AcknowledgeInterrupt()
+    {
+        // どちらもRW1Cなので、クリアしたいビットだけ１にして書く（他のRW1Cのビットを消さないように）
+        InterrupterRegisterSet *ir = PrimaryInterruptRegs();
+        IMAN_Bitmap iman;
+        iman.data[0] = ir->IMAN.data[0];
+        iman.bits.interrupt_pending = true;
+        ir->IMAN.data[0] = iman.data[0];
+
+        USBSTS_Bitmap usbsts;
+        usbsts.data[0] = 0;
+        usbsts.bits.event_interrupt = true;
+        opt_->USBSTS.data[0] = usbsts.data[0];
+    }
+
     uint8_t Controller::MaxPorts() const { 
         return static_cast<uint8_t>(cap_->HCSPARAMS1.bits.max_ports); 
     }
@@ -359,10 +335,15 @@ namespace usb::xhci
     void Controller::SendNoOpCommand()
     {
         NoOpCommandTRB trb = NoOpCommandTRB();
-        cr_.Push(&trb);
-        doorbell_[0].Ring(0, 0);
+        PushCommand(reinterpret_cast<TRB *>(&trb));
     }   
 
+    void Controller::SetTransferWaiter(uint8_t slot_id, coro::Completion<bool> *done)
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        transfer_waiters_[slot_id] = done;
+    }
+
     int Controller::ProcessEvent()
     {
         int ret;
@@ -391,7 +372,7 @@ namespace usb::xhci
         return ret;
     }
 
-    int Controller::ConfigureEndpoints(Device *dev)
+    coro::Task<bool> Controller::ConfigureEndpoints(Device *dev)
     {
         // USBデバイスの初期化が終わり、Configuration Descriptorの情報などがDeviceオブジェクトに保存されている状態を前提とする。
         EndpointConfig *configs = dev->EndpointConfigs();
@@ -415,7 +396,7 @@ namespace usb::xhci
         const int port_speed = PortAt(port_id)->Speed();
         if (port_speed == 0 || port_speed > PortSpeed::kSuperSpeed) {
             logger->error("[ConfigEndpoint] Port Speed Unsupported\n");
-            return -1;
+            co_return false;
         }
         // logger->debug("    | PortSpeed: %d\n", port_speed);
 
@@ -451,7 +432,7 @@ namespace usb::xhci
                     return -1; */
                 } else {
                     logger->error("This Pair Of Type And Port Speed Is Not Implemented..\n");
-                    return -1;
+                    co_return false;
                 }
             } else {
                 ep_ctx->bits.interval = configs[i].interval - 1; // デバイスへのリクエスト間隔（125μs * interval）
@@ -467,12 +448,11 @@ namespace usb::xhci
         }
 
         ConfigureEndpointCommandTRB cmd{dev->InputContextPtr(), dev->SlotID()};
-        CommandRing()->Push(&cmd);
-        RingCommandRing();
-        return 0;
+        CommandResult result = co_await IssueCommand(&cmd);
+        co_return result.completion_code == TRBCompletionCode::kSuccess;
     }
 
-    int Controller::ReConfigureDefaultControlPipe(Device *dev)
+    coro::Task<bool> Controller::ReConfigureDefaultControlPipe(Device *dev)
     {
         // EP0を再設定する
         memset(&dev->InputContextPtr()->input_control_context, 0, sizeof(InputControlContext));
@@ -483,9 +463,8 @@ namespace usb::xhci
         ep0_ctx->bits.max_packet_size = dev->MaxPacketSize();
         
         EvaluateContextCommandTRB cmd{dev->InputContextPtr(), dev->SlotID()};
-        CommandRing()->Push(&cmd);
-        RingCommandRing();
-        return 0;
+        CommandResult result = co_await IssueCommand(&cmd);
+        co_return result.completion_code == TRBCompletionCode::kSuccess;
     }
 
 // Controller(private)
@@ -493,14 +472,31 @@ namespace usb::xhci
         doorbell_[0].Ring(0, 0);
     }
 
+    coro::Task<CommandResult> Controller::IssueCommand_(TRB *trb)
+    {
+        coro::Completion<CommandResult> done;
+        {
+            // 完了イベントはすぐに来るかもしれないので、待ち合わせを登録してからドアベルを鳴らす
+            IRQSaveLockGuard<SpinLock> guard{lock_};
+            TRB *issued = cr_.Push(trb);
+            command_waiters_.push_back({issued, &done});
+            RingCommandRing();
+        }
+        co_return co_await done;
+    }
+
+    void Controller::PushCommand(TRB *trb)
+    {
+        IRQSaveLockGuard<SpinLock> guard{lock_};
+        cr_.Push(trb);
+        RingCommandRing();
+    }
+
     int Controller::OnEvent(CommandCompletionEventTRB *trb)
     {
-        uint8_t port_id;
         uint32_t slot_id = trb->bits.slot_id;
         TRB *issuer_trb = trb->Pointer(); // このイベントを発行したTRBへのポインタ
         uint32_t issuer_type = issuer_trb->bits.trb_type;
-        Message msg;
-        msg.type = Message::Type::kInterruptXHCI;
 
         /* logging::LoggingLevel current_level = logger->current_level();
         logger->set_level(logging::kDEBUG);
@@ -510,28 +506,6 @@ namespace usb::xhci
         logger->debug("    | CompletionCode: %s\n", kTRBCompletionCodeToName[trb->bits.completion_code]);
         logger->set_level(current_level); */
         
-        if (issuer_type == EnableSlotCommandTRB::Type) {
-            if (initializing_ports.empty()) {
-                panic("[OnEvent] Enable Slot But There Are No Initializing Port.\n");
-            }
-            port_id = initializing_ports.front();
-            PortAt(port_id)->SetSlot(slot_id);
-            msg.arg.xhc_port_init.success = (trb->bits.completion_code == TRBCompletionCode::kSuccess);
-            task_manager->SendMessage(InitUSBDevTaskID, msg);
-            task_manager->Wakeup(InitUSBDevTaskID);
-            return 0;
-        }
-        if (issuer_type == AddressDeviceCommandTRB::Type) {
-            // このコマンドが正常に完了した場合、インプットスロットの内容は、
-            // 全てアウトプットスロットの内容にコピーされているはずである。
-            // また、EP０の内容もコピーされているはずである。
-            if (initializing_ports.empty()) {
-                panic("[OnEvent] Address Device But There Are No Initializing Port.\n");
-            }
-            msg.arg.xhc_port_init.success = (trb->bits.completion_code == TRBCompletionCode::kSuccess);
-            task_manager->SendMessage(InitUSBDevTaskID, msg);
-            task_manager->Wakeup(InitUSBDevTaskID);
-        }
         if (issuer_type == DisableSlotCommandTRB::Type) {
             if (trb->bits.completion_code == 1) {
                 logger->info("[+] Slot%02d Disabled.\n", slot_id);
@@ -539,28 +513,23 @@ namespace usb::xhci
                 devmgr_.DisableSlot(slot_id); // デバイス用に確保したメモリ領域を確保などする
             }
         }
-        if (issuer_type == ConfigureEndpointCommandTRB::Type) {
-            Device *dev = devmgr_.FindBySlot(slot_id);
-            if (dev == nullptr) {
-                panic("[OnEvent::ConfigureEndpointCommand]\n");
-            }
-            if (initializing_ports.empty()) {
-                panic("[OnEvent] Configure Endpoints But There Are No Initializing Port.\n");
+
+        // IssueCommand()で発行したコマンドなら、完了を待っているコルーチンに結果を渡す。
+        // AddressDeviceが成功した場合、インプットスロットの内容は、
+        // 全てアウトプットスロットの内容にコピーされているはずである。
+        coro::Completion<CommandResult> *done = nullptr;
+        {
+            IRQSaveLockGuard<SpinLock> guard{lock_};
+            for (auto it = command_waiters_.begin(); it != command_waiters_.end(); it++) {
+                if (it->first == issuer_trb) {
+                    done = it->second;
+                    command_waiters_.erase(it);
+                    break;
+                }
             }
-            msg.arg.xhc_port_init.success = (trb->bits.completion_code == TRBCompletionCode::kSuccess);
-            task_manager->SendMessage(InitUSBDevTaskID, msg);
-            task_manager->Wakeup(InitUSBDevTaskID);
-            return -1;
         }
-        if (issuer_type == EvaluateContextCommandTRB::Type) {
-            if (initializing_ports.empty()) {
-                panic("[OnEvent] Evaluate Context But There Are No Initializing Port.\n");
-            }
-            port_id = initializing_ports.front();
-            msg.arg.xhc_port_init.success = (trb->bits.completion_code == TRBCompletionCode::kSuccess);
-            task_manager->SendMessage(InitUSBDevTaskID, msg);
-            task_manager->Wakeup(InitUSBDevTaskID);
-            return 0;
+        if (done) {
+            done->Complete(CommandResult{static_cast<uint8_t>(trb->bits.completion_code), static_cast<uint8_t>(slot_id)});
         }
         return 0;
     }
@@ -574,7 +543,6 @@ namespace usb::xhci
          * ・Enable（ポートがリセットによって有効化された）
          */
         int res = -1;
-        Message msg;
         uint8_t port_id = static_cast<uint8_t>(trb->bits.port_id);
         Port *port = PortAt(port_id);
 
@@ -587,19 +555,29 @@ namespace usb::xhci
         
         if (port->IsConnectStatusChanged()) { // ポート接続の変化
             if (port->IsConnected()) {
-                // TODO: ここが立て続けに２回呼ばれた時、意図しない動作が起こる可能性があるので注意したい
                 printk("\n[+] USB DEVICE ATTACHED TO PORT%02hhd\n", port->Number());
-                if (std::find(initializing_ports.begin(), initializing_ports.end(), port->Number()) == initializing_ports.end()) { // 配列に含まれていない場合
-                    initializing_ports.push_back(port->Number());
-                }
-                if (initializing_ports.size() == 1) { // 他のポートが初期化していない場合
-                    msg.type = Message::Type::kInterruptXHCI;
-                    msg.arg.xhc_port_init.success = true;
-                    task_manager->SendMessage(InitUSBDevTaskID, msg);
-                    task_manager->Wakeup(InitUSBDevTaskID);
-                }
+                StartEnumeration(port->Number()); // 立て続けに呼ばれても、初期化中なら何もしない
             } else {
                 printk("\n[+] USB DEVICE ATTACHED TO PORT%02hhd\n", port->Number());
+                // 初期化の途中で切断された場合は、待っているコルーチンを失敗で終わらせる
+                coro::Completion<bool> *reset_done;
+                coro::Completion<bool> *transfer_done = nullptr;
+                {
+                    IRQSaveLockGuard<SpinLock> guard{lock_};
+                    reset_done = std::exchange(reset_waiters_[port_id], nullptr);
+                    for (int i = 1; i <= device_size_; i++) {
+                        if (slot_to_port_[i] == port->Number()) {
+                            transfer_done = std::exchange(transfer_waiters_[i], nullptr);
+                            break;
+                        }
+                    }
+                }
+                if (reset_done) {
+                    reset_done->Complete(false);
+                }
+                if (transfer_done) {
+                    transfer_done->Complete(false);
+                }
                 // ポートにスロットが割り当てられていれば、そのスロットを無効にする
                 for (int i = 1; i <= device_size_; i++) {
                     if (slot_to_port_[i] == port->Number()) {
@@ -614,10 +592,14 @@ namespace usb::xhci
         if (port->IsPortResetChanged()) { // リセット処理が終わった場合
             // printk("PORT RESETTED !!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n");
             port->ClearPortResetChange();
-            msg.type = Message::Type::kInterruptXHCI;
-            msg.arg.xhc_port_init.success = true;
-            task_manager->SendMessage(InitUSBDevTaskID, msg);
-            task_manager->Wakeup(InitUSBDevTaskID);
+            coro::Completion<bool> *done;
+            {
+                IRQSaveLockGuard<SpinLock> guard{lock_};
+                done = std::exchange(reset_waiters_[port_id], nullptr);
+            }
+            if (done) {
+                done->Complete(true);
+            }
             return -1;
         }
 
@@ -643,75 +625,71 @@ namespace usb::xhci
             return -1;
         }
         dev->OnTransferEventReceived(trb);
-        
-        uint8_t port_id = dev->DeviceContextPtr()->slot_context.bits.root_hub_port_num;
-
-        if (port_id == initializing_ports.front()) { // 初期化中の時
-            Message msg;
-            msg.type = Message::Type::kInterruptXHCI;
-            if (trb->bits.completion_code != TRBCompletionCode::kSuccess &&
-                trb->bits.completion_code != TRBCompletionCode::kShortPacket) {
-                    msg.arg.xhc_port_init.success = false;
-                    task_manager->SendMessage(InitUSBDevTaskID, msg);
-                    task_manager->Wakeup(InitUSBDevTaskID); // SendMessage内でWakeupしているので実は必要ない！？
-                    return -1;
-            }
-            if (dev->IsInitialized() || dev->InitializePhase() == 0) {
-                msg.arg.xhc_port_init.success = true;
-                task_manager->SendMessage(InitUSBDevTaskID, msg);
-                task_manager->Wakeup(InitUSBDevTaskID);  // SendMessage内でWakeupしているので実は必要ない！？
-                return 0;
-            }
+
+        // 初期化中のデバイスなら、ディスクリプタの先頭を読み終えた時（フェーズ０）と
+        // 初期化が終わった時、失敗した時に待っているコルーチンを再開させる
+        bool failed = trb->bits.completion_code != TRBCompletionCode::kSuccess &&
+                      trb->bits.completion_code != TRBCompletionCode::kShortPacket;
+        if (!failed && !dev->IsInitialized() && dev->InitializePhase() != 0) {
+            return -1;
+        }
+        coro::Completion<bool> *done;
+        {
+            IRQSaveLockGuard<SpinLock> guard{lock_};
+            done = std::exchange(transfer_waiters_[slot_id], nullptr);
         }
-        return -1;
+        if (done == nullptr) {
+            return -1;
+        }
+        done->Complete(!failed);
+        return failed ? -1 : 0;
     }
 
-    int Controller::ResetPort(Port *port)
+    coro::Task<bool> Controller::ResetPort(Port *port)
     {
         if (!port->IsConnected()) { // 指定したポートにUSBデバイスが接続されていない場合は、エラーを返す。
-            return -1;
+            co_return false;
+        }
+        coro::Completion<bool> done;
+        {
+            IRQSaveLockGuard<SpinLock> guard{lock_};
+            reset_waiters_[port->Number()] = &done;
         }
         port->Reset();
-        return 0;
+        co_return co_await done;
     }
 
-    int Controller::EnableSlot(Port *port)
+    coro::Task<uint8_t> Controller::EnableSlot(Port *port)
     {
         /*  ポートが有効かつリセット処理が無事終わった場合のみ処理が行われる。
             これらの条件を満たしていない場合は、エラーを吐く。 */
-        if (!port->IsEnabled()) return -1; // ポートが有効か？
-        // if (!port->IsPortResetChanged()) return -1; // リセット処理が完了しているか？
-        if (initializing_ports.front() != port->Number()) {
-            logger->error("This Port Is Not Addressing Port\n");
-            return -1;
-        }
+        if (!port->IsEnabled()) co_return 0; // ポートが有効か？
         // logger->info("[+] ENABLE SLOT FOR PORT%02hhd\n", port->Number());
 
-        // port->ClearPortResetChange();
-
         EnableSlotCommandTRB command_trb = EnableSlotCommandTRB{};
-        cr_.Push(&command_trb);
-        RingCommandRing();
-        return 0;
+        CommandResult result = co_await IssueCommand(&command_trb);
+        if (result.completion_code != TRBCompletionCode::kSuccess) {
+            co_return 0;
+        }
+        port->SetSlot(result.slot_id);
+        co_return result.slot_id;
     }
 
     int Controller::DisableSlot(uint8_t slot_id)
     {
         // logger->info("[+] DISABLE SLOT%02hhd\n", slot_id);
         DisableSlotCommandTRB command_trb(slot_id);
-        
-        cr_.Push(&command_trb);
-        RingCommandRing();
+        PushCommand(reinterpret_cast<TRB *>(&command_trb));
         return 0;
     }
 
-    int Controller::AddressDevice(uint8_t port_id, uint8_t slot_id)
+    coro::Task<bool> Controller::AddressDevice(uint8_t port_id, uint8_t slot_id)
     {
         // logger->debug("[+] ADRESS DEVICE (PORT%02hhd, SLOT%02hhd)\n", port_id, slot_id);
 
         if (devmgr_.AllocDevice(slot_id, &doorbell_[slot_id])) {
             printk("[DEBUG CTRer::AddressDev] FAILED!! AllocDevice\n");
-            return -1;
+            co_return false;
         }
 
         Device *device = devmgr_.FindBySlot(slot_id);
@@ -721,7 +699,7 @@ namespace usb::xhci
         EndpointContext *ep0_ctx = device->InputContextPtr()->EnableEndpoint(DeviceContextIndex{1});
 
         //  3. InputSlotContextを初期化。
-        Port *port = PortAt(initializing_ports.front());
+        Port *port = PortAt(port_id);
         slot_ctx->bits.root_hub_port_num = port->Number();
         slot_ctx->bits.route_string = 0;
         slot_ctx->bits.context_entries = 1;
@@ -748,10 +726,8 @@ namespace usb::xhci
 
         //  8.  AddressDeviceCommandTRBの発行。
         AddressDeviceCommandTRB addr_dev_cmd(device->InputContextPtr(), slot_id);
-        cr_.Push(&addr_dev_cmd);
-        RingCommandRing();
-
-        return 0;
+        CommandResult result = co_await IssueCommand(&addr_dev_cmd);
+        co_return result.completion_code == TRBCompletionCode::kSuccess;
     }
     
 
@@ -783,12 +759,15 @@ namespace usb::xhci
         xhc = new Controller(mmio_base);
         xhc->Initializer();
 
-        // デバイスの初期化タスクを起動しておく
-        InitUSBDevTaskID = task_manager
-            ->NewTask()
-            ->InitContext(InitUSBDevTask, 0)
-            ->Wakeup(3) // カーネルの特権レベルで実行
-            ->ID(); 
+        // イベントリングの処理はxHCIのサービスタスクで行う。
+        // デバイスの初期化はコルーチン（coro.hpp）で行い、コマンドや転送の完了はサービスタスクから知らせる。
+        irq::Register(InterruptVector::kXHCI, "xhci", 
+            [](void *arg) {
+                reinterpret_cast<Controller *>(arg)->AcknowledgeInterrupt();
+                return true; // MSIなので他のデバイスと共有していない
+            }, 
+            [](void *arg) { ProcessEvents(); }, 
+            xhc, 0);
 
         xhc->Run();
         xhc->SendNoOpCommand();
@@ -9,11 +9,19 @@
 #include "../../logging.hpp"
 #include "../../task.hpp"
 #include "../../memory_manager.hpp"
+#include "../../spinlock.hpp"
+#include "../../coro.hpp"
 
 
 
 namespace usb::xhci
 {
+    // コマンド完了イベントの中身
+    struct CommandResult {
+        uint8_t completion_code;
+        uint8_t slot_id;
+    };
+
     class Controller
     {
     public:
@@ -31,6 +39,9 @@ namespace usb::xhci
 
         InterrupterRegisterSet *PrimaryInterruptRegs();
 
+        // 割り込みの受付をコントローラに伝える（IMAN.IPとUSBSTS.EINTをクリアする）。割り込みハンドラから呼ぶ。
+        void AcknowledgeInterrupt();
+
         uint8_t MaxPorts() const; // コントローラーの持つルートポートの数
 
         Port *PortAt(uint8_t port_num); // １ ≦ port_num ≦ MaxPorts()
@@ -45,10 +56,22 @@ namespace usb::xhci
         //  デバイスの初期化処理が完了した後に呼び出される。
         //  デバイスのオブジェクトには、このOSで使用可能なインターフェースの
         //  使用するエンドポイントが列挙されている。
-        int ConfigureEndpoints(Device *dev);
+        //  Configure Endpoint Commandが成功するまで待ち、成功したらtrueを返す。
+        coro::Task<bool> ConfigureEndpoints(Device *dev);
         
-        // デバイスディスクリプタの値を読み、MaxPacketSizeを正しいものに設定し直す
-        int ReConfigureDefaultControlPipe(Device *dev);
+        // デバイスディスクリプタの値を読み、MaxPacketSizeを正しいものに設定し直す。
+        // Evaluate Context Commandが成功するまで待ち、成功したらtrueを返す。
+        coro::Task<bool> ReConfigureDefaultControlPipe(Device *dev);
+
+        // コマンドをコマンドリングに積んでドアベルを鳴らし、完了イベントが来るまで待つ
+        template <class TRBType>
+        coro::Task<CommandResult> IssueCommand(TRBType *trb) {
+            return IssueCommand_(reinterpret_cast<TRB *>(trb));
+        }
+
+        // slot_idのデバイスの初期化中の転送が一段落したら（またはエラーで終わったら）doneを完了させる。
+        // 完了は１回だけで、転送を始める前に設定しておくこと。nullptrで取り消す。
+        void SetTransferWaiter(uint8_t slot_id, coro::Completion<bool> *done);
     
     // private:
         uint8_t device_size_; // デバイススロットの有効化数 
@@ -65,6 +88,12 @@ namespace usb::xhci
         Ring cr_; // コマンドリング
         EventRing er_; // イベントリング
 
+        // コルーチン（エグゼキュータ）とイベントを処理するサービスタスクの間で、cr_と以下の待ち合わせを守る
+        SpinLock lock_;
+        std::vector<std::pair<TRB *, coro::Completion<CommandResult> *>> command_waiters_; // 発行したコマンドのTRBと、その完了を待つもの
+        std::array<coro::Completion<bool> *, 256> reset_waiters_{}; // ポートごとのリセットの完了を待つもの
+        std::array<coro::Completion<bool> *, 256> transfer_waiters_{}; // スロットごとの初期化中の転送を待つもの
+
                 
         void RingCommandRing(); // CommandRingのドアベルを鳴らす
 
@@ -72,13 +101,17 @@ namespace usb::xhci
         int OnEvent(PortStatusChangeEventTRB *trb);
         int OnEvent(TransferEventTRB *trb);
 
-        int ResetPort(Port *port); // port initialize fase 1
+        coro::Task<CommandResult> IssueCommand_(TRB *trb);
+        void PushCommand(TRB *trb); // 完了を待たないコマンド（DisableSlotなど）を発行する
+
+        // ポートをリセットし、リセットが終わるまで待つ。
+        // デバイスが接続されていない場合や、途中で切断された場合はfalseを返す。
+        coro::Task<bool> ResetPort(Port *port); // port initialize fase 1
 
         //  ポートをリセットした後に呼び出される関数。
         //  EnableSlotCommandを発行して、スロットを有効にする。
-        //  ポートがEnable状態ではない場合またはリセット処理が完了していない場合は−１を返す。
-        //  コマンドを無事に送れれば０を返す。コマンド完了イベントの処理は別の関数が行う。
-        int EnableSlot(Port *port);  // port initialize fase 1
+        //  有効にしたスロットの番号を返す。ポートがEnable状態ではない場合やコマンドが失敗した場合は０を返す。
+        coro::Task<uint8_t> EnableSlot(Port *port);  // port initialize fase 1
         
         //  デバイスがデタッチされた時に、使用されていたスロットを
         //  Disableにする関数。
@@ -89,11 +122,10 @@ namespace usb::xhci
         //  具体的には、デバイスを使用可能なスロットにつなげて初期化を行う。
         //  デバイス固有のデバイスコンテキストとインプットコンテキストを初期化し、
         //  エンドポイント０を初期化し、Transfer Ringを用意する。
-        //  最後に「Address Device Command」を発行し、終了する。
-        //  無事終了すれば、０を返す。
-        //  失敗した場合は、−１を返す。
-        //  コマンド完了イベントの処理は、他の関数に任せている。
-        int AddressDevice(uint8_t port_id, uint8_t slot_id);
+        //  最後に「Address Device Command」を発行し、完了するまで待つ。
+        //  無事終了すれば、trueを返す。
+        //  失敗した場合は、falseを返す。
+        coro::Task<bool> AddressDevice(uint8_t port_id, uint8_t slot_id);
 
         int CompleteConfiguration(uint8_t port_id, uint8_t slot_id);
     }; 